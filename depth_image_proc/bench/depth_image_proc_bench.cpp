@@ -0,0 +1,121 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <depth_image_proc/depth_conversions.h>
+#include <depth_image_proc/depth_registration.h>
+#include <image_proc/benchmark.h>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+using namespace depth_image_proc;
+using image_proc::Benchmark;
+namespace enc = sensor_msgs::image_encodings;
+
+namespace {
+
+sensor_msgs::ImagePtr depthMessage(Benchmark& bench, const cv::Size& size, int type)
+{
+  return cv_bridge::CvImage(std_msgs::Header(), type == CV_16UC1 ? enc::TYPE_16UC1 : enc::TYPE_32FC1,
+                            bench.depth(size, type)).toImageMsg();
+}
+
+template<typename T>
+void convertCloud(const sensor_msgs::ImageConstPtr& depth_msg, PointCloud::Ptr& cloud_msg, const DepthRays& rays)
+{
+  convert<T>(depth_msg, cloud_msg, rays);
+}
+
+void benchConvert(Benchmark& bench, const cv::Size& size)
+{
+  image_geometry::PinholeCameraModel model;
+  model.fromCameraInfo(Benchmark::cameraInfo(size));
+  DepthRays rays;
+  rays.update(model, size.width, size.height);
+
+  PointCloud::Ptr cloud = boost::make_shared<PointCloud>();
+  cloud->height = size.height;
+  cloud->width = size.width;
+  sensor_msgs::PointCloud2Modifier pcd_modifier(*cloud);
+  pcd_modifier.setPointCloud2FieldsByString(1, "xyz");
+
+  sensor_msgs::ImageConstPtr depth16 = depthMessage(bench, size, CV_16UC1);
+  sensor_msgs::ImageConstPtr depth32 = depthMessage(bench, size, CV_32FC1);
+  bench.run("convert/16uc1", size,
+            boost::bind(&convertCloud<uint16_t>, depth16, boost::ref(cloud), boost::cref(rays)));
+  bench.run("convert/32fc1", size,
+            boost::bind(&convertCloud<float>, depth32, boost::ref(cloud), boost::cref(rays)));
+}
+
+void benchRegister(Benchmark& bench, const cv::Size& size)
+{
+  image_geometry::PinholeCameraModel depth_model, rgb_model;
+  depth_model.fromCameraInfo(Benchmark::cameraInfo(size));
+  rgb_model.fromCameraInfo(Benchmark::cameraInfo(size));
+  // Typical RGB-D extrinsics: RGB camera 2.5cm beside the depth camera
+  Eigen::Affine3d depth_to_rgb(Eigen::Translation3d(-0.025, 0.0, 0.0));
+
+  DepthRegistration registration;
+  registration.setTransform(depth_model, rgb_model, depth_to_rgb);
+
+  sensor_msgs::Image registered;
+  registered.width = size.width;
+  registered.height = size.height;
+  sensor_msgs::ImageConstPtr depth16 = depthMessage(bench, size, CV_16UC1);
+  sensor_msgs::ImageConstPtr depth32 = depthMessage(bench, size, CV_32FC1);
+  boost::function<void ()> register16 =
+    boost::bind(&DepthRegistration::convert<uint16_t>, &registration, boost::cref(*depth16), boost::ref(registered));
+  boost::function<void ()> register32 =
+    boost::bind(&DepthRegistration::convert<float>, &registration, boost::cref(*depth32), boost::ref(registered));
+
+  bench.run("register/splat_16uc1", size, register16);
+  bench.run("register/splat_32fc1", size, register32);
+  registration.setRasterize(true);
+  bench.run("register/rasterize_16uc1", size, register16);
+  bench.run("register/rasterize_32fc1", size, register32);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Benchmark bench(argc, argv);
+  std::vector<cv::Size> sizes = Benchmark::resolutions();
+  for (size_t i = 0; i < sizes.size(); ++i)
+  {
+    benchConvert(bench, sizes[i]);
+    benchRegister(bench, sizes[i]);
+  }
+  return 0;
+}
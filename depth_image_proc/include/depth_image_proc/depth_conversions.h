@@ -35,67 +35,277 @@
 #define DEPTH_IMAGE_PROC_DEPTH_CONVERSIONS
 
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <image_geometry/pinhole_camera_model.h>
 #include <depth_image_proc/depth_traits.h>
 
+#include <cstring>
 #include <limits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace depth_image_proc {
 
 typedef sensor_msgs::PointCloud2 PointCloud;
 
-// Handles float or uint16 depths
+/**
+ * Per-column and per-row back-projection rays of a camera model, so the point
+ * for pixel (u,v) at depth Z (meters) is simply (x_u * Z, y_v * Z, Z). Columns
+ * are stored as packed (x_u, 0, 1, 0) quadruples that, added to the row's
+ * (0, y_v, 0, 0) and scaled by Z, give a whole point in one vector operation.
+ */
+struct DepthRays
+{
+  std::vector<float> columns; // 4 floats per column
+  std::vector<float> rows;    // 1 float per row
+
+  DepthRays() : fx_(0.0), fy_(0.0), cx_(0.0), cy_(0.0) {}
+
+  /// Rebuild the tables if model or resolution changed. Returns true if rebuilt.
+  bool update(const image_geometry::PinholeCameraModel& model, int width, int height)
+  {
+    if ((int)rows.size() == height && (int)columns.size() == 4 * width &&
+        model.fx() == fx_ && model.fy() == fy_ && model.cx() == cx_ && model.cy() == cy_)
+      return false;
+
+    fx_ = model.fx();
+    fy_ = model.fy();
+    cx_ = model.cx();
+    cy_ = model.cy();
+    columns.resize(4 * width);
+    for (int u = 0; u < width; ++u)
+    {
+      columns[4*u + 0] = (u - cx_) / fx_;
+      columns[4*u + 1] = 0.0f;
+      columns[4*u + 2] = 1.0f;
+      columns[4*u + 3] = 0.0f;
+    }
+    rows.resize(height);
+    for (int v = 0; v < height; ++v)
+      rows[v] = (v - cy_) / fy_;
+    return true;
+  }
+
+private:
+  double fx_, fy_, cx_, cy_;
+};
+
+namespace detail {
+
+// Metric depth of a raw sample, invalid samples mapping to invalid_z
+template<typename T>
+inline float depthMeters(T depth, float invalid_z)
+{
+  return DepthTraits<T>::valid(depth) ? DepthTraits<T>::toMeters(depth) : invalid_z;
+}
+
+#if defined(__SSE2__)
+// Four metric depths at once; invalid lanes (0 or non-finite) become invalid_z
+inline __m128 depthMeters4(const uint16_t* depth, __m128 invalid_z)
+{
+  __m128i raw = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(depth)),
+                                   _mm_setzero_si128());
+  __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(raw), _mm_set1_ps(DepthTraits<uint16_t>::toMeters(1)));
+  __m128 valid = _mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(raw, _mm_setzero_si128()),
+                                                _mm_set1_epi32(-1)));
+  return _mm_or_ps(_mm_and_ps(valid, z), _mm_andnot_ps(valid, invalid_z));
+}
+
+inline __m128 depthMeters4(const float* depth, __m128 invalid_z)
+{
+  __m128 z = _mm_loadu_ps(depth);
+  // z - z is 0 for finite values and NaN for NaN or infinity
+  __m128 valid = _mm_cmpeq_ps(_mm_sub_ps(z, z), _mm_setzero_ps());
+  return _mm_or_ps(_mm_and_ps(valid, z), _mm_andnot_ps(valid, invalid_z));
+}
+#endif
+
+} // namespace detail
+
+/**
+ * Back-project one row of depths, writing x, y, z as the first three floats of
+ * each point_step-spaced point in out. Invalid depths produce NaN points, or
+ * points at range_max if it is nonzero. The fourth float of each point may be
+ * overwritten as well, so fields at byte offset 12 have to be filled afterwards.
+ */
+template<typename T>
+inline void convertRow(const T* depth_row, int v, int width, const DepthRays& rays,
+                       uint8_t* out, int point_step, double range_max = 0.0)
+{
+  // Invalid depths are replaced by the quantized range_max, as if it had been measured
+  float invalid_z = (range_max != 0.0) ? DepthTraits<T>::toMeters(DepthTraits<T>::fromMeters(range_max))
+                                       : std::numeric_limits<float>::quiet_NaN();
+  const float* ray = &rays.columns[0];
+  float ray_y = rays.rows[v];
+  int u = 0;
+#if defined(__SSE2__)
+  __m128 row_ray = _mm_setr_ps(0.0f, ray_y, 0.0f, 0.0f);
+  __m128 invalid = _mm_set1_ps(invalid_z);
+  for (; u + 4 <= width; u += 4, ray += 16, out += 4 * point_step)
+  {
+    __m128 z = detail::depthMeters4(depth_row + u, invalid);
+    _mm_storeu_ps(reinterpret_cast<float*>(out),
+                  _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(ray), row_ray), _mm_shuffle_ps(z, z, _MM_SHUFFLE(0,0,0,0))));
+    _mm_storeu_ps(reinterpret_cast<float*>(out + point_step),
+                  _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(ray + 4), row_ray), _mm_shuffle_ps(z, z, _MM_SHUFFLE(1,1,1,1))));
+    _mm_storeu_ps(reinterpret_cast<float*>(out + 2 * point_step),
+                  _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(ray + 8), row_ray), _mm_shuffle_ps(z, z, _MM_SHUFFLE(2,2,2,2))));
+    _mm_storeu_ps(reinterpret_cast<float*>(out + 3 * point_step),
+                  _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(ray + 12), row_ray), _mm_shuffle_ps(z, z, _MM_SHUFFLE(3,3,3,3))));
+  }
+#endif
+  for (; u < width; ++u, ray += 4, out += point_step)
+  {
+    // NaN depth propagates to all three coordinates, no branch needed
+    float z = detail::depthMeters(depth_row[u], invalid_z);
+    float* point = reinterpret_cast<float*>(out);
+    point[0] = ray[0] * z;
+    point[1] = ray_y * z;
+    point[2] = z;
+  }
+}
+
+/// Byte offset of the named field within each point, or -1 if absent
+inline int fieldOffset(const PointCloud& cloud, const std::string& name)
+{
+  for (size_t i = 0; i < cloud.fields.size(); ++i)
+  {
+    if (cloud.fields[i].name == name)
+      return cloud.fields[i].offset;
+  }
+  return -1;
+}
+
+/**
+ * Byte offsets of red, green and blue within a pixel of the given encoding,
+ * and the pixel size. Returns false if the encoding has to be converted first.
+ */
+inline bool colorLayout(const sensor_msgs::Image& image, int& red_offset, int& green_offset,
+                        int& blue_offset, int& color_step)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  const std::string& encoding = image.encoding;
+  if (encoding == enc::RGB8 || encoding == enc::RGBA8)
+  {
+    red_offset   = 0;
+    green_offset = 1;
+    blue_offset  = 2;
+    color_step   = (encoding == enc::RGB8) ? 3 : 4;
+  }
+  else if (encoding == enc::BGR8 || encoding == enc::BGRA8)
+  {
+    red_offset   = 2;
+    green_offset = 1;
+    blue_offset  = 0;
+    color_step   = (encoding == enc::BGR8) ? 3 : 4;
+  }
+  else if (encoding == enc::MONO8)
+  {
+    red_offset   = 0;
+    green_offset = 0;
+    blue_offset  = 0;
+    color_step   = 1;
+  }
+  else if (encoding == enc::MONO16)
+  {
+    // The most significant byte, as the 16 to 8-bit conversion would keep
+    red_offset = green_offset = blue_offset = image.is_bigendian ? 0 : 1;
+    color_step   = 2;
+  }
+  else
+    return false;
+  return true;
+}
+
+/**
+ * Pack one row of color pixels, laid out as colorLayout() describes, into the
+ * point_step-spaced "rgb" fields starting at out (a little endian float: b, g,
+ * r, a).
+ */
+inline void packColorRow(const uint8_t* rgb, int width, int red_offset, int green_offset, int blue_offset,
+                         int color_step, uint8_t* out, int point_step)
+{
+  for (int u = 0; u < width; ++u, rgb += color_step, out += point_step)
+  {
+    out[0] = rgb[blue_offset];
+    out[1] = rgb[green_offset];
+    out[2] = rgb[red_offset];
+    out[3] = 255;
+  }
+}
+
+/**
+ * Back-project a whole depth image into the x, y, z fields of cloud_msg, which
+ * must be laid out with x, y, z as consecutive floats at offset 0 (as set by
+ * PointCloud2Modifier) and have the depth image's dimensions.
+ */
 template<typename T>
 void convert(
     const sensor_msgs::ImageConstPtr& depth_msg,
     PointCloud::Ptr& cloud_msg,
-    const image_geometry::PinholeCameraModel& model,
+    const DepthRays& rays,
     double range_max = 0.0)
 {
-  // Use correct principal point from calibration
-  float center_x = model.cx();
-  float center_y = model.cy();
-
-  // Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
-  float constant_x = unit_scaling / model.fx();
-  float constant_y = unit_scaling / model.fy();
-  float bad_point = std::numeric_limits<float>::quiet_NaN();
-
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  for (int v = 0; v < (int)cloud_msg->height; ++v, depth_row += row_step)
+  const uint8_t* depth_row = &depth_msg->data[0];
+  uint8_t* cloud_row = &cloud_msg->data[0];
+  for (int v = 0; v < (int)cloud_msg->height; ++v, depth_row += depth_msg->step, cloud_row += cloud_msg->row_step)
   {
-    for (int u = 0; u < (int)cloud_msg->width; ++u, ++iter_x, ++iter_y, ++iter_z)
-    {
-      T depth = depth_row[u];
-
-      // Missing points denoted by NaNs
-      if (!DepthTraits<T>::valid(depth))
-      {
-        if (range_max != 0.0)
-        {
-          depth = DepthTraits<T>::fromMeters(range_max);
-        }
-        else
-        {
-          *iter_x = *iter_y = *iter_z = bad_point;
-          continue;
-        }
-      }
-
-      // Fill in XYZ
-      *iter_x = (u - center_x) * depth * constant_x;
-      *iter_y = (v - center_y) * depth * constant_y;
-      *iter_z = DepthTraits<T>::toMeters(depth);
-    }
+    convertRow(reinterpret_cast<const T*>(depth_row), v, cloud_msg->width, rays,
+               cloud_row, cloud_msg->point_step, range_max);
   }
 }
 
+/**
+ * Drop the NaN points of an organized cloud in place, leaving a dense 1 x N
+ * cloud (z at byte offset 8 decides validity). If indices is non-NULL it
+ * receives the pixel index v * width + u of each point kept.
+ */
+inline void compact(PointCloud& cloud, std::vector<int32_t>* indices = NULL)
+{
+  size_t point_step = cloud.point_step;
+  size_t count = (size_t)cloud.height * cloud.width;
+  if (indices)
+    indices->clear();
+
+  uint8_t* data = cloud.data.empty() ? NULL : &cloud.data[0];
+  uint8_t* out = data;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const uint8_t* point = data + i * point_step;
+    float z;
+    memcpy(&z, point + 8, sizeof(float));
+    if (z != z) // NaN
+      continue;
+    if (out != point)
+      memcpy(out, point, point_step);
+    out += point_step;
+    if (indices)
+      indices->push_back((int32_t)i);
+  }
+
+  cloud.height = 1;
+  cloud.width = (out - data) / point_step;
+  cloud.row_step = cloud.width * point_step;
+  cloud.data.resize(cloud.row_step); // shrinking keeps the capacity for the next frame
+  cloud.is_dense = true;
+}
+
+// Handles float or uint16 depths
+template<typename T>
+void convert(
+    const sensor_msgs::ImageConstPtr& depth_msg,
+    PointCloud::Ptr& cloud_msg,
+    const image_geometry::PinholeCameraModel& model,
+    double range_max = 0.0)
+{
+  DepthRays rays;
+  rays.update(model, cloud_msg->width, cloud_msg->height);
+  convert<T>(depth_msg, cloud_msg, rays, range_max);
+}
+
 } // namespace depth_image_proc
 
 #endif
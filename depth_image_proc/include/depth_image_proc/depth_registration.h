@@ -0,0 +1,426 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef DEPTH_IMAGE_PROC_DEPTH_REGISTRATION
+#define DEPTH_IMAGE_PROC_DEPTH_REGISTRATION
+
+#include <sensor_msgs/Image.h>
+#include <image_geometry/pinhole_camera_model.h>
+#include <depth_image_proc/depth_conversions.h>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace depth_image_proc {
+
+/**
+ * Registers depth images to another camera, typically the RGB camera of an
+ * RGB-D sensor.
+ *
+ * Unprojecting depth pixel (u,v) at depth Z, transforming the point to the
+ * target frame and projecting it again is a single linear map of (uZ, vZ, Z, 1),
+ * so it is folded into one 3x4 matrix M: M * (uZ, vZ, Z, 1) = (u'Z', v'Z', Z').
+ * Depth rows are split into stripes that are splatted in parallel, each into
+ * its own z-buffer; the z-buffers are then merged by taking the nearest depth.
+ *
+ * Splatting maps each depth pixel to a single target pixel, which leaves holes
+ * when the target has the higher resolution. In rasterizing mode each quad of
+ * neighboring depth pixels is instead drawn as two triangles, interpolating
+ * 1/Z' (which is affine in the target image) across them, so the output is
+ * dense at target resolution. Triangles spanning a depth discontinuity are
+ * skipped so foreground and background are not bridged.
+ */
+class DepthRegistration
+{
+public:
+  DepthRegistration()
+    : rasterize_(false), max_discontinuity_(0.1f)
+  {
+    std::fill(&m_[0][0], &m_[0][0] + 12, 0.0f);
+  }
+
+  /// Rasterize depth triangles instead of splatting points. Triangles whose
+  /// depths differ by more than max_discontinuity (meters) are skipped.
+  void setRasterize(bool rasterize, float max_discontinuity = 0.1f)
+  {
+    rasterize_ = rasterize;
+    max_discontinuity_ = max_discontinuity;
+  }
+
+  /// Set up the combined matrix for the current camera models and extrinsics
+  void setTransform(const image_geometry::PinholeCameraModel& depth_model,
+                    const image_geometry::PinholeCameraModel& target_model,
+                    const Eigen::Affine3d& depth_to_target)
+  {
+    // (uZ, vZ, Z, 1) -> (X, Y, Z, 1) in the depth frame
+    Eigen::Matrix4d unproject = Eigen::Matrix4d::Identity();
+    unproject(0,0) = 1.0 / depth_model.fx();
+    unproject(0,2) = -depth_model.cx() / depth_model.fx();
+    unproject(0,3) = -depth_model.Tx() / depth_model.fx();
+    unproject(1,1) = 1.0 / depth_model.fy();
+    unproject(1,2) = -depth_model.cy() / depth_model.fy();
+    unproject(1,3) = -depth_model.Ty() / depth_model.fy();
+
+    // (X, Y, Z, 1) in the target frame -> (u'Z', v'Z', Z')
+    Eigen::Matrix<double, 3, 4> project = Eigen::Matrix<double, 3, 4>::Zero();
+    project(0,0) = target_model.fx();
+    project(0,2) = target_model.cx();
+    project(0,3) = target_model.Tx();
+    project(1,1) = target_model.fy();
+    project(1,2) = target_model.cy();
+    project(1,3) = target_model.Ty();
+    project(2,2) = 1.0;
+
+    Eigen::Matrix<double, 3, 4> m = project * depth_to_target.matrix() * unproject;
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 4; ++c)
+        m_[r][c] = m(r,c);
+  }
+
+  /**
+   * Register depth_msg into registered_msg, whose width and height must already
+   * be set to the target resolution. Sets step and data; pixels no depth lands
+   * on are invalid (0 or NaN).
+   */
+  template<typename T>
+  void convert(const sensor_msgs::Image& depth_msg, sensor_msgs::Image& registered_msg);
+
+  /**
+   * Register depth_msg straight into the x, y, z fields of cloud_msg, laid out
+   * as for depth_image_proc::convert() with the target resolution: the points
+   * the registered depth image would back-project to through the target rays,
+   * without quantizing to or going through that image. Points no depth lands
+   * on are NaN.
+   */
+  template<typename T>
+  void convert(const sensor_msgs::Image& depth_msg, const DepthRays& target_rays, PointCloud& cloud_msg);
+
+private:
+  template<typename T> class SplatBody;
+  template<typename T> class MergeBody;
+  class CloudMergeBody;
+
+  // Fill zbuffers_ with the nearest registered depths of a width x height target
+  template<typename T>
+  void splat(const sensor_msgs::Image& depth_msg, int width, int height);
+
+  float m_[3][4];
+  bool rasterize_;
+  float max_discontinuity_;
+  std::vector<cv::Mat> zbuffers_; // one per stripe, CV_32FC1 target depth in meters
+};
+
+// Splats (or rasterizes) the rows of one stripe per index into zbuffers[index]
+template<typename T>
+class DepthRegistration::SplatBody : public cv::ParallelLoopBody
+{
+public:
+  SplatBody(const sensor_msgs::Image& depth_msg, const float (&m)[3][4],
+            bool rasterize, float max_discontinuity, std::vector<cv::Mat>& zbuffers)
+    : depth_msg_(depth_msg), m_(m), rasterize_(rasterize),
+      max_discontinuity_(max_discontinuity), zbuffers_(zbuffers)
+  {
+  }
+
+  virtual void operator()(const cv::Range& stripes) const
+  {
+    const int rows = depth_msg_.height, width = depth_msg_.width, nstripes = zbuffers_.size();
+    // Target (x, y, Z') of each pixel in the current and the next depth row
+    std::vector<float> current(3 * width), next(3 * width);
+    for (int s = stripes.start; s < stripes.end; ++s)
+    {
+      cv::Mat& zbuffer = zbuffers_[s];
+      zbuffer.setTo(std::numeric_limits<float>::infinity());
+      int start = rows * s / nstripes, end = rows * (s + 1) / nstripes;
+      if (start < end)
+        projectRow(start, &current[0]);
+      for (int v = start; v < end; ++v)
+      {
+        // Points are splatted in both modes, so isolated points survive rasterizing
+        for (int u = 0; u < width; ++u)
+          splat(&current[3*u], zbuffer);
+
+        if (rasterize_ && v + 1 < rows)
+        {
+          // Quads reaching into the next stripe's first row are drawn here
+          projectRow(v + 1, &next[0]);
+          for (int u = 0; u + 1 < width; ++u)
+          {
+            const float* p00 = &current[3*u];
+            const float* p10 = p00 + 3;
+            const float* p01 = &next[3*u];
+            const float* p11 = p01 + 3;
+            rasterizeTriangle(p00, p10, p01, zbuffer);
+            rasterizeTriangle(p10, p11, p01, zbuffer);
+          }
+        }
+        else if (v + 1 < end)
+        {
+          projectRow(v + 1, &next[0]);
+        }
+        current.swap(next);
+      }
+    }
+  }
+
+private:
+  // Triangles larger than this in the target image come from degenerate projections
+  static const int MAX_TRIANGLE_EXTENT = 64;
+
+  static inline bool inFront(const float* p)
+  {
+    return p[2] > 0.0f; // false for invalid (NaN) depth and points behind the camera
+  }
+
+  // Keep the nearest depth at the pixel (rounded as the cast + 0.5 always did)
+  static inline void splat(const float* p, cv::Mat& zbuffer)
+  {
+    if (!inFront(p))
+      return;
+    int u = p[0] + 0.5f;
+    int v = p[1] + 0.5f;
+    if (u < 0 || u >= zbuffer.cols || v < 0 || v >= zbuffer.rows)
+      return;
+    float& z_old = zbuffer.at<float>(v, u);
+    if (p[2] < z_old)
+      z_old = p[2];
+  }
+
+  // Fill the target pixels whose centers lie inside triangle abc
+  void rasterizeTriangle(const float* a, const float* b, const float* c, cv::Mat& zbuffer) const
+  {
+    if (!inFront(a) || !inFront(b) || !inFront(c))
+      return;
+    float z_min = std::min(a[2], std::min(b[2], c[2]));
+    float z_max = std::max(a[2], std::max(b[2], c[2]));
+    if (z_max - z_min > max_discontinuity_)
+      return;
+
+    float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    if (std::fabs(area) < 1e-6f)
+      return;
+
+    int x0 = std::max(0, (int)std::ceil(std::min(a[0], std::min(b[0], c[0]))));
+    int x1 = std::min(zbuffer.cols - 1, (int)std::floor(std::max(a[0], std::max(b[0], c[0]))));
+    int y0 = std::max(0, (int)std::ceil(std::min(a[1], std::min(b[1], c[1]))));
+    int y1 = std::min(zbuffer.rows - 1, (int)std::floor(std::max(a[1], std::max(b[1], c[1]))));
+    if (x1 - x0 > MAX_TRIANGLE_EXTENT || y1 - y0 > MAX_TRIANGLE_EXTENT)
+      return;
+
+    // Barycentric weights are edge functions over the signed area; 1/Z' is
+    // interpolated linearly, which is perspective correct
+    const float inv_area = 1.0f / area;
+    const float iza = 1.0f / a[2], izb = 1.0f / b[2], izc = 1.0f / c[2];
+    const float eps = -1e-5f; // keep pixels exactly on shared edges
+    for (int y = y0; y <= y1; ++y)
+    {
+      float* z_row = zbuffer.ptr<float>(y);
+      for (int x = x0; x <= x1; ++x)
+      {
+        float wa = ((b[0] - x) * (c[1] - y) - (b[1] - y) * (c[0] - x)) * inv_area;
+        float wb = ((c[0] - x) * (a[1] - y) - (c[1] - y) * (a[0] - x)) * inv_area;
+        float wc = 1.0f - wa - wb;
+        if (wa < eps || wb < eps || wc < eps)
+          continue;
+        float z = 1.0f / (wa * iza + wb * izb + wc * izc);
+        if (z < z_row[x])
+          z_row[x] = z;
+      }
+    }
+  }
+
+  // Transform depth row v to target (x, y, Z') triples
+  void projectRow(int v, float* out) const
+  {
+    const T* depth_row = reinterpret_cast<const T*>(&depth_msg_.data[v * depth_msg_.step]);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const int width = depth_msg_.width;
+    // The parts of M * (uZ, vZ, Z, 1) that are constant along the row
+    const float row_a = m_[0][1] * v + m_[0][2];
+    const float row_b = m_[1][1] * v + m_[1][2];
+    const float row_c = m_[2][1] * v + m_[2][2];
+    int u = 0;
+#if defined(__SSE2__)
+    const __m128 m00 = _mm_set1_ps(m_[0][0]), m03 = _mm_set1_ps(m_[0][3]), ra = _mm_set1_ps(row_a);
+    const __m128 m10 = _mm_set1_ps(m_[1][0]), m13 = _mm_set1_ps(m_[1][3]), rb = _mm_set1_ps(row_b);
+    const __m128 m20 = _mm_set1_ps(m_[2][0]), m23 = _mm_set1_ps(m_[2][3]), rc = _mm_set1_ps(row_c);
+    const __m128 invalid = _mm_set1_ps(nan);
+    __m128 uu = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128 four = _mm_set1_ps(4.0f);
+    for (; u + 4 <= width; u += 4, uu = _mm_add_ps(uu, four))
+    {
+      __m128 z = detail::depthMeters4(depth_row + u, invalid);
+      __m128 a = _mm_add_ps(_mm_mul_ps(z, _mm_add_ps(_mm_mul_ps(m00, uu), ra)), m03);
+      __m128 b = _mm_add_ps(_mm_mul_ps(z, _mm_add_ps(_mm_mul_ps(m10, uu), rb)), m13);
+      __m128 c = _mm_add_ps(_mm_mul_ps(z, _mm_add_ps(_mm_mul_ps(m20, uu), rc)), m23);
+      float xt[4], yt[4], zt[4];
+      _mm_storeu_ps(xt, _mm_div_ps(a, c));
+      _mm_storeu_ps(yt, _mm_div_ps(b, c));
+      _mm_storeu_ps(zt, c);
+      for (int k = 0; k < 4; ++k)
+      {
+        out[3*(u+k) + 0] = xt[k];
+        out[3*(u+k) + 1] = yt[k];
+        out[3*(u+k) + 2] = zt[k];
+      }
+    }
+#endif
+    for (; u < width; ++u)
+    {
+      float z = detail::depthMeters(depth_row[u], nan);
+      float a = z * (m_[0][0] * u + row_a) + m_[0][3];
+      float b = z * (m_[1][0] * u + row_b) + m_[1][3];
+      float c = z * (m_[2][0] * u + row_c) + m_[2][3];
+      out[3*u + 0] = a / c;
+      out[3*u + 1] = b / c;
+      out[3*u + 2] = c;
+    }
+  }
+
+  const sensor_msgs::Image& depth_msg_;
+  const float (&m_)[3][4];
+  bool rasterize_;
+  float max_discontinuity_;
+  std::vector<cv::Mat>& zbuffers_;
+};
+
+// Takes the nearest depth over all z-buffers for each output row
+template<typename T>
+class DepthRegistration::MergeBody : public cv::ParallelLoopBody
+{
+public:
+  MergeBody(const std::vector<cv::Mat>& zbuffers, sensor_msgs::Image& registered_msg)
+    : zbuffers_(zbuffers), registered_msg_(registered_msg)
+  {
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    const int width = registered_msg_.width;
+    // quiet_NaN() is 0 for integer types, the invalid value of uint16 depth
+    const T invalid = std::numeric_limits<T>::quiet_NaN();
+    for (int y = rows.start; y < rows.end; ++y)
+    {
+      T* out = reinterpret_cast<T*>(&registered_msg_.data[y * registered_msg_.step]);
+      const float* first = zbuffers_[0].ptr<float>(y);
+      for (int x = 0; x < width; ++x)
+      {
+        float z = first[x];
+        for (size_t s = 1; s < zbuffers_.size(); ++s)
+          z = std::min(z, zbuffers_[s].ptr<float>(y)[x]);
+        out[x] = (z != std::numeric_limits<float>::infinity()) ? DepthTraits<T>::fromMeters(z) : invalid;
+      }
+    }
+  }
+
+private:
+  const std::vector<cv::Mat>& zbuffers_;
+  sensor_msgs::Image& registered_msg_;
+};
+
+// Back-projects the nearest depth over all z-buffers through the target rays
+class DepthRegistration::CloudMergeBody : public cv::ParallelLoopBody
+{
+public:
+  CloudMergeBody(const std::vector<cv::Mat>& zbuffers, const DepthRays& rays, PointCloud& cloud_msg)
+    : zbuffers_(zbuffers), rays_(rays), cloud_msg_(cloud_msg)
+  {
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    const int width = cloud_msg_.width, point_step = cloud_msg_.point_step;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for (int y = rows.start; y < rows.end; ++y)
+    {
+      uint8_t* point = &cloud_msg_.data[y * cloud_msg_.row_step];
+      const float* first = zbuffers_[0].ptr<float>(y);
+      const float ray_y = rays_.rows[y];
+      for (int x = 0; x < width; ++x, point += point_step)
+      {
+        float z = first[x];
+        for (size_t s = 1; s < zbuffers_.size(); ++s)
+          z = std::min(z, zbuffers_[s].ptr<float>(y)[x]);
+        if (z == std::numeric_limits<float>::infinity())
+          z = nan;
+        float* xyz = reinterpret_cast<float*>(point);
+        xyz[0] = rays_.columns[4*x] * z;
+        xyz[1] = ray_y * z;
+        xyz[2] = z;
+      }
+    }
+  }
+
+private:
+  const std::vector<cv::Mat>& zbuffers_;
+  const DepthRays& rays_;
+  PointCloud& cloud_msg_;
+};
+
+template<typename T>
+void DepthRegistration::splat(const sensor_msgs::Image& depth_msg, int width, int height)
+{
+  // One stripe per thread, bounded to keep the z-buffer memory reasonable
+  int nstripes = std::max(1, std::min(std::min(cv::getNumThreads(), 8), (int)depth_msg.height));
+  zbuffers_.resize(nstripes);
+  for (int s = 0; s < nstripes; ++s)
+    zbuffers_[s].create(height, width, CV_32FC1);
+
+  cv::parallel_for_(cv::Range(0, nstripes), SplatBody<T>(depth_msg, m_, rasterize_, max_discontinuity_, zbuffers_));
+}
+
+template<typename T>
+void DepthRegistration::convert(const sensor_msgs::Image& depth_msg, sensor_msgs::Image& registered_msg)
+{
+  registered_msg.step = registered_msg.width * sizeof(T);
+  registered_msg.data.resize(registered_msg.height * registered_msg.step);
+
+  splat<T>(depth_msg, registered_msg.width, registered_msg.height);
+  cv::parallel_for_(cv::Range(0, registered_msg.height), MergeBody<T>(zbuffers_, registered_msg));
+}
+
+template<typename T>
+void DepthRegistration::convert(const sensor_msgs::Image& depth_msg, const DepthRays& target_rays,
+                                PointCloud& cloud_msg)
+{
+  splat<T>(depth_msg, cloud_msg.width, cloud_msg.height);
+  cv::parallel_for_(cv::Range(0, cloud_msg.height), CloudMergeBody(zbuffers_, target_rays, cloud_msg));
+}
+
+} // namespace depth_image_proc
+
+#endif
@@ -0,0 +1,242 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef DEPTH_IMAGE_PROC_IMAGE_CONVERSIONS
+#define DEPTH_IMAGE_PROC_IMAGE_CONVERSIONS
+
+#include <sensor_msgs/Image.h>
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace depth_image_proc {
+
+/**
+ * Pixel-wise depth image conversions. Each kernel converts one row of n
+ * pixels without branching on the values (invalid pixels are masked), and
+ * convertRows() runs a kernel over all rows of an image in parallel.
+ */
+
+/// uint16 millimeters to float meters; 0 becomes NaN
+struct MillimetersToMeters
+{
+  void operator()(const uint16_t* src, float* dst, int n) const
+  {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(0.001f);
+    const __m128 nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+      __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero));
+      __m128 lo_invalid = _mm_cmpeq_ps(lo, _mm_setzero_ps());
+      __m128 hi_invalid = _mm_cmpeq_ps(hi, _mm_setzero_ps());
+      lo = _mm_or_ps(_mm_and_ps(lo_invalid, nan), _mm_andnot_ps(lo_invalid, _mm_mul_ps(lo, scale)));
+      hi = _mm_or_ps(_mm_and_ps(hi_invalid, nan), _mm_andnot_ps(hi_invalid, _mm_mul_ps(hi, scale)));
+      _mm_storeu_ps(dst + i, lo);
+      _mm_storeu_ps(dst + i + 4, hi);
+    }
+#endif
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    for (; i < n; ++i)
+      dst[i] = (src[i] == 0) ? bad_point : (float)src[i] * 0.001f;
+  }
+};
+
+/// float meters to uint16 millimeters, rounded; NaN, infinite, non-positive
+/// and out of range depths become 0
+struct MetersToMillimeters
+{
+  void operator()(const float* src, uint16_t* dst, int n) const
+  {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(1000.0f), half = _mm_set1_ps(0.5f);
+    const __m128 max_mm = _mm_set1_ps(65536.0f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16(-32768);
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128 lo = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), half);
+      __m128 hi = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale), half);
+      // Comparisons with NaN are false, so NaN is masked out with the rest
+      __m128 lo_valid = _mm_and_ps(_mm_cmpge_ps(lo, _mm_set1_ps(1.0f)), _mm_cmplt_ps(lo, max_mm));
+      __m128 hi_valid = _mm_and_ps(_mm_cmpge_ps(hi, _mm_set1_ps(1.0f)), _mm_cmplt_ps(hi, max_mm));
+      __m128i lo_mm = _mm_and_si128(_mm_cvttps_epi32(lo), _mm_castps_si128(lo_valid));
+      __m128i hi_mm = _mm_and_si128(_mm_cvttps_epi32(hi), _mm_castps_si128(hi_valid));
+      // SSE2 can only pack with signed saturation, so shift into int16 range and back
+      __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo_mm, bias), _mm_sub_epi32(hi_mm, bias));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(packed, bias16));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+      float mm = src[i] * 1000.0f + 0.5f;
+      dst[i] = (mm >= 1.0f && mm < 65536.0f) ? (uint16_t)mm : 0;
+    }
+  }
+};
+
+/// Depth to disparity d = constant / Z, stored as float or as 16-bit fixed
+/// point d / delta_d (rounded, saturated); invalid (zero or non-finite) depths
+/// become 0
+template<typename T, typename D>
+struct DepthToDisparity
+{
+  DepthToDisparity(float constant, float inv_delta_d)
+    : constant_(constant), inv_delta_d_(inv_delta_d) {}
+
+  void operator()(const T* src, D* dst, int n) const
+  {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 constant = _mm_set1_ps(constant_);
+    const __m128 max_depth = _mm_set1_ps(std::numeric_limits<float>::max());
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128 z[2];
+      load8(src + i, z);
+      for (int k = 0; k < 2; ++k)
+      {
+        // Also false for NaN; infinite depths give disparity 0 anyway
+        __m128 valid = _mm_and_ps(_mm_cmpgt_ps(z[k], _mm_setzero_ps()), _mm_cmple_ps(z[k], max_depth));
+        z[k] = _mm_and_ps(valid, _mm_div_ps(constant, z[k]));
+      }
+      store8(z, dst + i);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+      float depth = src[i];
+      float d = (depth > 0.0f && depth <= std::numeric_limits<float>::max()) ? constant_ / depth : 0.0f;
+      store(d, dst[i]);
+    }
+  }
+
+private:
+  void store(float d, float& out) const { out = d; }
+
+  void store(float d, int16_t& out) const
+  {
+    float value = std::min(d * inv_delta_d_ + 0.5f, (float)std::numeric_limits<int16_t>::max());
+    out = static_cast<int16_t>(std::max(value, 0.0f));
+  }
+
+#if defined(__SSE2__)
+  static void load8(const float* src, __m128* z)
+  {
+    z[0] = _mm_loadu_ps(src);
+    z[1] = _mm_loadu_ps(src + 4);
+  }
+
+  static void load8(const uint16_t* src, __m128* z)
+  {
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    z[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, _mm_setzero_si128()));
+    z[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, _mm_setzero_si128()));
+  }
+
+  void store8(const __m128* d, float* dst) const
+  {
+    _mm_storeu_ps(dst, d[0]);
+    _mm_storeu_ps(dst + 4, d[1]);
+  }
+
+  void store8(const __m128* d, int16_t* dst) const
+  {
+    // Disparities are non-negative, and packing saturates at the int16 maximum
+    const __m128 scale = _mm_set1_ps(inv_delta_d_), half = _mm_set1_ps(0.5f);
+    const __m128 max_value = _mm_set1_ps((float)std::numeric_limits<int16_t>::max());
+    __m128i lo = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(d[0], scale), half), max_value));
+    __m128i hi = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(d[1], scale), half), max_value));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(lo, hi));
+  }
+#endif
+
+  float constant_;
+  float inv_delta_d_;
+};
+
+namespace detail {
+
+template<typename S, typename D, typename Kernel>
+class ConvertRowsBody : public cv::ParallelLoopBody
+{
+public:
+  ConvertRowsBody(const sensor_msgs::Image& src, sensor_msgs::Image& dst, const Kernel& kernel)
+    : src_(src), dst_(dst), kernel_(kernel) {}
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    for (int v = rows.start; v < rows.end; ++v)
+    {
+      const S* src_row = reinterpret_cast<const S*>(&src_.data[v * src_.step]);
+      D* dst_row = reinterpret_cast<D*>(&dst_.data[v * dst_.step]);
+      kernel_(src_row, dst_row, src_.width);
+    }
+  }
+
+private:
+  const sensor_msgs::Image& src_;
+  sensor_msgs::Image& dst_;
+  const Kernel& kernel_;
+};
+
+} // namespace detail
+
+/// Rows handed to a thread at a time; smaller images run on the calling thread
+static const int CONVERT_ROWS_GRAIN = 32;
+
+/**
+ * Run kernel over every row of src, writing the same pixels of dst. dst must
+ * already have src's width and height and its data allocated; rows are split
+ * across threads.
+ */
+template<typename S, typename D, typename Kernel>
+void convertRows(const sensor_msgs::Image& src, sensor_msgs::Image& dst, const Kernel& kernel)
+{
+  cv::parallel_for_(cv::Range(0, src.height), detail::ConvertRowsBody<S, D, Kernel>(src, dst, kernel),
+                    std::max(1, (int)src.height / CONVERT_ROWS_GRAIN));
+}
+
+} // namespace depth_image_proc
+
+#endif
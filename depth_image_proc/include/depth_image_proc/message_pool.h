@@ -0,0 +1,174 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef DEPTH_IMAGE_PROC_MESSAGE_POOL
+#define DEPTH_IMAGE_PROC_MESSAGE_POOL
+
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <stereo_msgs/DisparityImage.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <vector>
+
+namespace depth_image_proc {
+
+// The bulk storage of each pooled message type
+inline std::vector<uint8_t>& messageBuffer(sensor_msgs::Image& msg) { return msg.data; }
+inline std::vector<uint8_t>& messageBuffer(sensor_msgs::PointCloud2& msg) { return msg.data; }
+inline std::vector<uint8_t>& messageBuffer(stereo_msgs::DisparityImage& msg) { return msg.image.data; }
+
+/**
+ * Recycles outgoing messages for high-rate publishers. allocate() hands out a
+ * message whose shared_ptr deleter returns it, storage intact, to the pool once
+ * the last subscriber drops it. Recycled messages keep their stale contents:
+ * callers must set every field and overwrite every byte they publish, in
+ * exchange for skipping the allocation, page faults and zero-fill on every
+ * frame after the first.
+ */
+template <class M>
+class MessagePool
+{
+public:
+  typedef boost::shared_ptr<M> Ptr;
+
+  /// Pool shared by every nodelet in the process
+  static MessagePool& instance()
+  {
+    static MessagePool pool;
+    return pool;
+  }
+
+  explicit MessagePool(size_t max_idle = 32)
+    : impl_(new Impl(max_idle))
+  {
+  }
+
+  /// Get the most recently recycled message as is, for callers that size the
+  /// buffer themselves (e.g. through PointCloud2Modifier)
+  Ptr allocate()
+  {
+    M* msg = NULL;
+    {
+      boost::lock_guard<boost::mutex> lock(impl_->mutex);
+      if (!impl_->idle.empty())
+      {
+        msg = impl_->idle.back();
+        impl_->idle.pop_back();
+      }
+    }
+    if (!msg)
+      msg = new M;
+    return Ptr(msg, Recycler(impl_));
+  }
+
+  /// Get a message whose buffer holds exactly size bytes of unspecified content
+  Ptr allocate(size_t size)
+  {
+    M* msg = NULL;
+    {
+      boost::lock_guard<boost::mutex> lock(impl_->mutex);
+      // Prefer an exact size match, which makes the resize below free
+      typename std::vector<M*>::iterator best = impl_->idle.end();
+      for (typename std::vector<M*>::iterator it = impl_->idle.begin(); it != impl_->idle.end(); ++it)
+      {
+        const std::vector<uint8_t>& buffer = messageBuffer(**it);
+        if (buffer.size() == size)
+        {
+          best = it;
+          break;
+        }
+        if (buffer.capacity() >= size && best == impl_->idle.end())
+          best = it;
+      }
+      if (best != impl_->idle.end())
+      {
+        msg = *best;
+        impl_->idle.erase(best);
+      }
+    }
+    if (!msg)
+      msg = new M;
+    messageBuffer(*msg).resize(size);
+    return Ptr(msg, Recycler(impl_));
+  }
+
+private:
+  struct Impl
+  {
+    explicit Impl(size_t max_idle) : max_idle(max_idle) {}
+    ~Impl()
+    {
+      for (size_t i = 0; i < idle.size(); ++i)
+        delete idle[i];
+    }
+
+    boost::mutex mutex;
+    std::vector<M*> idle;
+    size_t max_idle;
+  };
+
+  // Deleter that returns messages to the pool, or frees them if the pool is gone or full
+  struct Recycler
+  {
+    explicit Recycler(const boost::shared_ptr<Impl>& impl) : impl(impl) {}
+
+    void operator()(M* msg) const
+    {
+      boost::shared_ptr<Impl> pool = impl.lock();
+      if (pool)
+      {
+        boost::lock_guard<boost::mutex> lock(pool->mutex);
+        if (pool->idle.size() < pool->max_idle)
+        {
+          pool->idle.push_back(msg);
+          return;
+        }
+      }
+      delete msg;
+    }
+
+    boost::weak_ptr<Impl> impl;
+  };
+
+  boost::shared_ptr<Impl> impl_;
+};
+
+} // namespace depth_image_proc
+
+#endif
@@ -0,0 +1,165 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef DEPTH_IMAGE_PROC_RADIAL_RAYS
+#define DEPTH_IMAGE_PROC_RADIAL_RAYS
+
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <depth_image_proc/depth_conversions.h>
+#include <opencv2/core/core.hpp>
+#include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace depth_image_proc {
+
+/**
+ * Unit-length viewing ray of every pixel of a radially measuring (e.g.
+ * time-of-flight) camera, undistorted through K and D, so the point at range
+ * r along pixel (u,v) is r * (x, y, z)(u,v). The components are stored as
+ * separate row-major float planes, which lets a row be scaled four pixels at
+ * a time.
+ *
+ * Undistorting every pixel is expensive, so tables are shared: get() returns
+ * the table of any live camera with the same K, D and resolution, building it
+ * only the first time.
+ */
+class RadialRays
+{
+public:
+  typedef boost::shared_ptr<const RadialRays> ConstPtr;
+
+  /// Table for the calibration and resolution of info, shared process-wide
+  static ConstPtr get(const sensor_msgs::CameraInfo& info);
+
+  /// Whether this table was built for the calibration and resolution of info
+  bool matches(const sensor_msgs::CameraInfo& info) const
+  {
+    return (int)info.width == width && (int)info.height == height && info.K == K_ && info.D == D_;
+  }
+
+  int width, height;
+  std::vector<float> x, y, z; // width * height each, pixel (u,v) at v * width + u
+
+private:
+  RadialRays(const sensor_msgs::CameraInfo& info);
+
+  boost::array<double, 9> K_;
+  std::vector<double> D_;
+};
+
+namespace detail {
+
+// Scales the rays of whole rows by the measured ranges
+template<typename T>
+class RadialConvertBody : public cv::ParallelLoopBody
+{
+public:
+  RadialConvertBody(const sensor_msgs::Image& depth_msg, sensor_msgs::PointCloud2& cloud_msg, const RadialRays& rays)
+    : depth_msg_(depth_msg), cloud_msg_(cloud_msg), rays_(rays)
+  {
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    const int width = rays_.width, point_step = cloud_msg_.point_step;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for (int v = rows.start; v < rows.end; ++v)
+    {
+      const T* depth_row = reinterpret_cast<const T*>(&depth_msg_.data[v * depth_msg_.step]);
+      uint8_t* out = &cloud_msg_.data[v * cloud_msg_.row_step];
+      const float* ray_x = &rays_.x[v * width];
+      const float* ray_y = &rays_.y[v * width];
+      const float* ray_z = &rays_.z[v * width];
+      int u = 0;
+#if defined(__SSE2__)
+      const __m128 invalid = _mm_set1_ps(nan);
+      for (; u + 4 <= width; u += 4, out += 4 * point_step)
+      {
+        // Invalid ranges are NaN, which carries over to all three coordinates
+        __m128 r = depthMeters4(depth_row + u, invalid);
+        __m128 px = _mm_mul_ps(_mm_loadu_ps(ray_x + u), r);
+        __m128 py = _mm_mul_ps(_mm_loadu_ps(ray_y + u), r);
+        __m128 pz = _mm_mul_ps(_mm_loadu_ps(ray_z + u), r);
+        __m128 pw = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(px, py, pz, pw);
+        _mm_storeu_ps(reinterpret_cast<float*>(out), px);
+        _mm_storeu_ps(reinterpret_cast<float*>(out + point_step), py);
+        _mm_storeu_ps(reinterpret_cast<float*>(out + 2 * point_step), pz);
+        _mm_storeu_ps(reinterpret_cast<float*>(out + 3 * point_step), pw);
+      }
+#endif
+      for (; u < width; ++u, out += point_step)
+      {
+        float r = depthMeters(depth_row[u], nan);
+        float* point = reinterpret_cast<float*>(out);
+        point[0] = ray_x[u] * r;
+        point[1] = ray_y[u] * r;
+        point[2] = ray_z[u] * r;
+      }
+    }
+  }
+
+private:
+  const sensor_msgs::Image& depth_msg_;
+  sensor_msgs::PointCloud2& cloud_msg_;
+  const RadialRays& rays_;
+};
+
+} // namespace detail
+
+/**
+ * Back-project radial depths into the x, y, z fields of cloud_msg, which must
+ * have x, y, z as consecutive floats at offset 0, a point_step of at least 16
+ * bytes and the resolution of rays. As with convertRow(), the float at byte
+ * offset 12 may be overwritten, so fields there have to be filled afterwards.
+ * Rows are converted in parallel.
+ */
+template<typename T>
+void convertRadial(const sensor_msgs::Image& depth_msg, sensor_msgs::PointCloud2& cloud_msg, const RadialRays& rays)
+{
+  cv::parallel_for_(cv::Range(0, rays.height), detail::RadialConvertBody<T>(depth_msg, cloud_msg, rays),
+                    std::max(1, rays.height / 32));
+}
+
+} // namespace depth_image_proc
+
+#endif
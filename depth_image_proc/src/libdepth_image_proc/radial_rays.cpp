@@ -0,0 +1,113 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "depth_image_proc/radial_rays.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <cmath>
+
+namespace depth_image_proc {
+
+namespace {
+
+// Tables of the cameras currently in use. Entries hold weak references so a
+// table is freed with its last user; expired entries are dropped on lookup.
+boost::mutex cache_mutex;
+std::vector<boost::weak_ptr<const RadialRays> > cache;
+
+} // namespace
+
+RadialRays::ConstPtr RadialRays::get(const sensor_msgs::CameraInfo& info)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(cache_mutex);
+    for (size_t i = 0; i < cache.size(); )
+    {
+      ConstPtr rays = cache[i].lock();
+      if (!rays)
+      {
+        cache[i] = cache.back();
+        cache.pop_back();
+        continue;
+      }
+      if (rays->matches(info))
+        return rays;
+      ++i;
+    }
+  }
+
+  // Built outside the lock, as it takes a while at high resolution. Two
+  // nodelets starting together may both build the table; one copy survives.
+  ConstPtr rays(new RadialRays(info));
+  boost::lock_guard<boost::mutex> lock(cache_mutex);
+  for (size_t i = 0; i < cache.size(); ++i)
+  {
+    ConstPtr existing = cache[i].lock();
+    if (existing && existing->matches(info))
+      return existing;
+  }
+  cache.push_back(rays);
+  return rays;
+}
+
+RadialRays::RadialRays(const sensor_msgs::CameraInfo& info)
+  : width(info.width), height(info.height), K_(info.K), D_(info.D)
+{
+  int total = width * height;
+  cv::Mat_<cv::Vec2f> pixels(1, total);
+  for (int v = 0; v < height; ++v)
+    for (int u = 0; u < width; ++u)
+      pixels(0, v * width + u) = cv::Vec2f(u, v);
+
+  cv::Mat_<cv::Vec2f> undistorted;
+  cv::undistortPoints(pixels, undistorted, cv::Mat_<double>(3, 3, &K_[0]), cv::Mat(D_));
+
+  x.resize(total);
+  y.resize(total);
+  z.resize(total);
+  for (int i = 0; i < total; ++i)
+  {
+    const cv::Vec2f& p = undistorted(0, i);
+    float inv_norm = 1.0f / std::sqrt(p[0] * p[0] + p[1] * p[1] + 1.0f);
+    x[i] = p[0] * inv_norm;
+    y[i] = p[1] * inv_norm;
+    z[i] = inv_norm;
+  }
+}
+
+} // namespace depth_image_proc
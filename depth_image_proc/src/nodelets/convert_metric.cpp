@@ -36,6 +36,8 @@
 #include <image_transport/image_transport.h>
 #include <sensor_msgs/image_encodings.h>
 #include <boost/thread.hpp>
+#include <depth_image_proc/message_pool.h>
+#include <depth_image_proc/image_conversions.h>
 
 namespace depth_image_proc {
 
@@ -87,32 +89,31 @@ void ConvertMetricNodelet::connectCb()
 
 void ConvertMetricNodelet::depthCb(const sensor_msgs::ImageConstPtr& raw_msg)
 {
-  if (raw_msg->encoding != enc::TYPE_16UC1)
+  // Convert uint16 mm to float m, or float m back to uint16 mm
+  bool to_meters = (raw_msg->encoding == enc::TYPE_16UC1);
+  if (!to_meters && raw_msg->encoding != enc::TYPE_32FC1)
   {
-    NODELET_ERROR_THROTTLE(2, "Expected data of type [%s], got [%s]", enc::TYPE_16UC1.c_str(),
-                           raw_msg->encoding.c_str());
+    NODELET_ERROR_THROTTLE(2, "Expected data of type [%s] or [%s], got [%s]", enc::TYPE_16UC1.c_str(),
+                           enc::TYPE_32FC1.c_str(), raw_msg->encoding.c_str());
     return;
   }
 
-  // Allocate new Image message
-  sensor_msgs::ImagePtr depth_msg( new sensor_msgs::Image );
+  // Allocate Image message, reusing a buffer released by an earlier callback
+  size_t pixel_size = to_meters ? sizeof(float) : sizeof(uint16_t);
+  sensor_msgs::ImagePtr depth_msg =
+    MessagePool<sensor_msgs::Image>::instance().allocate(raw_msg->height * raw_msg->width * pixel_size);
   depth_msg->header   = raw_msg->header;
-  depth_msg->encoding = enc::TYPE_32FC1;
+  depth_msg->encoding = to_meters ? enc::TYPE_32FC1 : enc::TYPE_16UC1;
   depth_msg->height   = raw_msg->height;
   depth_msg->width    = raw_msg->width;
-  depth_msg->step     = raw_msg->width * sizeof (float);
-  depth_msg->data.resize( depth_msg->height * depth_msg->step);
-
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-
-  // Fill in the depth image data, converting mm to m
-  const uint16_t* raw_data = reinterpret_cast<const uint16_t*>(&raw_msg->data[0]);
-  float* depth_data = reinterpret_cast<float*>(&depth_msg->data[0]);
-  for (unsigned index = 0; index < depth_msg->height * depth_msg->width; ++index)
-  {
-    uint16_t raw = raw_data[index];
-    depth_data[index] = (raw == 0) ? bad_point : (float)raw * 0.001f;
-  }
+  depth_msg->is_bigendian = false;
+  depth_msg->step     = raw_msg->width * pixel_size;
+
+  // Fill in the depth image data; invalid points are NaN in meters and 0 in mm
+  if (to_meters)
+    convertRows<uint16_t, float>(*raw_msg, *depth_msg, MillimetersToMeters());
+  else
+    convertRows<float, uint16_t>(*raw_msg, *depth_msg, MetersToMillimeters());
 
   pub_depth_.publish(depth_msg);
 }
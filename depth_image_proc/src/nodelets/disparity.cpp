@@ -45,6 +45,10 @@
 #include <sensor_msgs/image_encodings.h>
 #include <stereo_msgs/DisparityImage.h>
 #include <depth_image_proc/depth_traits.h>
+#include <depth_image_proc/message_pool.h>
+#include <depth_image_proc/image_conversions.h>
+#include <image_proc/instrumentation.h>
+#include <limits>
 
 namespace depth_image_proc {
 
@@ -64,6 +68,8 @@ class DisparityNodelet : public nodelet::Nodelet
   double min_range_;
   double max_range_;
   double delta_d_;
+  bool fixed_point_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
 
   virtual void onInit();
 
@@ -72,7 +78,7 @@ class DisparityNodelet : public nodelet::Nodelet
   void depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
                const sensor_msgs::CameraInfoConstPtr& info_msg);
 
-  template<typename T>
+  template<typename T, typename D>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg,
                stereo_msgs::DisparityImagePtr& disp_msg);
 };
@@ -91,10 +97,15 @@ void DisparityNodelet::onInit()
   private_nh.param("min_range", min_range_, 0.0);
   private_nh.param("max_range", max_range_, std::numeric_limits<double>::infinity());
   private_nh.param("delta_d", delta_d_, 0.125);
+  // Publish 16SC1 disparity in units of delta_d instead of 32FC1
+  private_nh.param("fixed_point", fixed_point_, false);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "disparity");
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Sync(sub_depth_image_, sub_info_, queue_size) );
   sync_->registerCallback(boost::bind(&DisparityNodelet::depthCb, this, _1, _2));
+  if (stats_)
+    sync_->registerDropCallback(boost::bind(&image_proc::StageStats::drop, stats_.get()));
 
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&DisparityNodelet::connectCb, this);
@@ -123,15 +134,21 @@ void DisparityNodelet::connectCb()
 void DisparityNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
                                const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
-  // Allocate new DisparityImage message
-  stereo_msgs::DisparityImagePtr disp_msg( new stereo_msgs::DisparityImage );
+  image_proc::StageTimer timer(stats_.get(), depth_msg->header.stamp);
+
+  // Allocate DisparityImage message; recycled buffers are not cleared, so every
+  // field is set here and convert() writes every pixel
+  size_t pixel_size = fixed_point_ ? sizeof(int16_t) : sizeof(float);
+  stereo_msgs::DisparityImagePtr disp_msg =
+    MessagePool<stereo_msgs::DisparityImage>::instance().allocate(depth_msg->height * depth_msg->width * pixel_size);
   disp_msg->header         = depth_msg->header;
   disp_msg->image.header   = disp_msg->header;
-  disp_msg->image.encoding = enc::TYPE_32FC1;
+  disp_msg->image.encoding = fixed_point_ ? enc::TYPE_16SC1 : enc::TYPE_32FC1;
   disp_msg->image.height   = depth_msg->height;
   disp_msg->image.width    = depth_msg->width;
-  disp_msg->image.step     = disp_msg->image.width * sizeof (float);
-  disp_msg->image.data.resize( disp_msg->image.height * disp_msg->image.step, 0.0f );
+  disp_msg->image.is_bigendian = false;
+  disp_msg->image.step     = disp_msg->image.width * pixel_size;
+  disp_msg->valid_window = sensor_msgs::RegionOfInterest();
   double fx = info_msg->P[0];
   disp_msg->T = -info_msg->P[3] / fx;
   disp_msg->f = fx;
@@ -142,11 +159,17 @@ void DisparityNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
 
   if (depth_msg->encoding == enc::TYPE_16UC1)
   {
-    convert<uint16_t>(depth_msg, disp_msg);
+    if (fixed_point_)
+      convert<uint16_t, int16_t>(depth_msg, disp_msg);
+    else
+      convert<uint16_t, float>(depth_msg, disp_msg);
   }
   else if (depth_msg->encoding == enc::TYPE_32FC1)
   {
-    convert<float>(depth_msg, disp_msg);
+    if (fixed_point_)
+      convert<float, int16_t>(depth_msg, disp_msg);
+    else
+      convert<float, float>(depth_msg, disp_msg);
   }
   else
   {
@@ -154,32 +177,20 @@ void DisparityNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
     return;
   }
 
+  timer.setBytes(disp_msg->image.data.size());
   pub_disparity_.publish(disp_msg);
 }
 
-template<typename T>
+template<typename T, typename D>
 void DisparityNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg,
                                stereo_msgs::DisparityImagePtr& disp_msg)
 {
   // For each depth Z, disparity d = fT / Z
   float unit_scaling = DepthTraits<T>::toMeters( T(1) );
   float constant = disp_msg->f * disp_msg->T / unit_scaling;
+  float inv_delta_d = 1.0f / disp_msg->delta_d;
 
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  float* disp_data = reinterpret_cast<float*>(&disp_msg->image.data[0]);
-  for (int v = 0; v < (int)depth_msg->height; ++v)
-  {
-    for (int u = 0; u < (int)depth_msg->width; ++u)
-    {
-      T depth = depth_row[u];
-      if (DepthTraits<T>::valid(depth))
-        *disp_data = constant / depth;
-      ++disp_data;
-    }
-
-    depth_row += row_step;
-  }
+  convertRows<T, D>(*depth_msg, disp_msg->image, DepthToDisparity<T, D>(constant, inv_delta_d));
 }
 
 } // namespace depth_image_proc
@@ -38,6 +38,9 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <boost/thread.hpp>
 #include <depth_image_proc/depth_conversions.h>
+#include <depth_image_proc/message_pool.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/point_cloud_quantization.h>
 
 #include <sensor_msgs/point_cloud2_iterator.h>
 
@@ -51,13 +54,19 @@ class PointCloudXyzNodelet : public nodelet::Nodelet
   boost::shared_ptr<image_transport::ImageTransport> it_;
   image_transport::CameraSubscriber sub_depth_;
   int queue_size_;
+  bool compact_;
+  bool quantize_points_;
 
   // Publications
   boost::mutex connect_mutex_;
   typedef sensor_msgs::PointCloud2 PointCloud;
   ros::Publisher pub_point_cloud_;
+  ros::Publisher pub_indices_;
 
   image_geometry::PinholeCameraModel model_;
+  DepthRays rays_;
+  std::vector<int32_t> indices_; // scratch buffer for compacted point indices
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
 
   virtual void onInit();
 
@@ -75,19 +84,28 @@ void PointCloudXyzNodelet::onInit()
 
   // Read parameters
   private_nh.param("queue_size", queue_size_, 5);
+  // Publish only the valid points, as a dense unorganized cloud
+  private_nh.param("compact", compact_, false);
+  // Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+  // see image_proc::QuantizedPoints
+  private_nh.param("quantize_points", quantize_points_, false);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "point_cloud_xyz");
 
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&PointCloudXyzNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_point_cloud_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_point_cloud_ = nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+  // Pixel index v * width + u of each compacted point, as a 1 x N 32SC1 image
+  if (compact_)
+    pub_indices_ = nh.advertise<sensor_msgs::Image>("points_indices", 1, connect_cb, connect_cb);
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloudXyzNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_point_cloud_.getNumSubscribers() == 0)
+  if (pub_point_cloud_.getNumSubscribers() == 0 && pub_indices_.getNumSubscribers() == 0)
   {
     sub_depth_.shutdown();
   }
@@ -101,7 +119,9 @@ void PointCloudXyzNodelet::connectCb()
 void PointCloudXyzNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
                                    const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
-  PointCloud::Ptr cloud_msg(new PointCloud);
+  image_proc::StageTimer timer(stats_.get(), depth_msg->header.stamp);
+
+  PointCloud::Ptr cloud_msg = MessagePool<PointCloud>::instance().allocate();
   cloud_msg->header = depth_msg->header;
   cloud_msg->height = depth_msg->height;
   cloud_msg->width  = depth_msg->width;
@@ -111,16 +131,17 @@ void PointCloudXyzNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
   sensor_msgs::PointCloud2Modifier pcd_modifier(*cloud_msg);
   pcd_modifier.setPointCloud2FieldsByString(1, "xyz");
 
-  // Update camera model
+  // Update camera model and back-projection tables
   model_.fromCameraInfo(info_msg);
+  rays_.update(model_, depth_msg->width, depth_msg->height);
 
   if (depth_msg->encoding == enc::TYPE_16UC1)
   {
-    convert<uint16_t>(depth_msg, cloud_msg, model_);
+    convert<uint16_t>(depth_msg, cloud_msg, rays_);
   }
   else if (depth_msg->encoding == enc::TYPE_32FC1)
   {
-    convert<float>(depth_msg, cloud_msg, model_);
+    convert<float>(depth_msg, cloud_msg, rays_);
   }
   else
   {
@@ -128,6 +149,30 @@ void PointCloudXyzNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
     return;
   }
 
+  if (compact_)
+  {
+    bool want_indices = pub_indices_.getNumSubscribers() > 0;
+    compact(*cloud_msg, want_indices ? &indices_ : NULL);
+    if (want_indices)
+    {
+      sensor_msgs::ImagePtr indices_msg =
+        MessagePool<sensor_msgs::Image>::instance().allocate(indices_.size() * sizeof(int32_t));
+      indices_msg->header = cloud_msg->header;
+      indices_msg->encoding = enc::TYPE_32SC1;
+      indices_msg->height = 1;
+      indices_msg->width = indices_.size();
+      indices_msg->is_bigendian = false;
+      indices_msg->step = indices_msg->width * sizeof(int32_t);
+      if (!indices_.empty())
+        memcpy(&indices_msg->data[0], &indices_[0], indices_msg->data.size());
+      pub_indices_.publish(indices_msg);
+    }
+  }
+
+  if (quantize_points_)
+    image_proc::quantizePoints(*cloud_msg);
+
+  timer.setBytes(cloud_msg->data.size());
   pub_point_cloud_.publish (cloud_msg);
 }
 
@@ -38,6 +38,10 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <boost/thread.hpp>
 #include <depth_image_proc/depth_traits.h>
+#include <depth_image_proc/message_pool.h>
+#include <depth_image_proc/radial_rays.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/point_cloud_quantization.h>
 
 #include <sensor_msgs/point_cloud2_iterator.h>
 
@@ -58,13 +62,10 @@ namespace depth_image_proc {
 	ros::Publisher pub_point_cloud_;
 
 	
-	std::vector<double> D_;
-	boost::array<double, 9> K_;
-  
-	int width_;
-	int height_;
-
-	cv::Mat binned;
+	// Ray table of the current calibration, shared with other nodelets
+	RadialRays::ConstPtr rays_;
+	image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+	bool quantize_points_;
   
 	virtual void onInit();
 
@@ -72,54 +73,8 @@ namespace depth_image_proc {
 
 	void depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
 		     const sensor_msgs::CameraInfoConstPtr& info_msg);
-
-	// Handles float or uint16 depths
-	template<typename T>
-	void convert(const sensor_msgs::ImageConstPtr& depth_msg, PointCloud::Ptr& cloud_msg);
     };
 
-    cv::Mat initMatrix(cv::Mat cameraMatrix, cv::Mat distCoeffs, int width, int height, bool radial)
-    {
-	int i,j;
-	int totalsize = width*height;
-	cv::Mat pixelVectors(1,totalsize,CV_32FC3);
-	cv::Mat dst(1,totalsize,CV_32FC3);
-
-	cv::Mat sensorPoints(cv::Size(height,width), CV_32FC2);
-	cv::Mat undistortedSensorPoints(1,totalsize, CV_32FC2);
-
-	std::vector<cv::Mat> ch;
-	for(j = 0; j < height; j++)
-	{
-	    for(i = 0; i < width; i++)
-	    {
-		cv::Vec2f &p = sensorPoints.at<cv::Vec2f>(i,j);
-		p[0] = i;
-		p[1] = j;
-	    }
-	}
-
-	sensorPoints = sensorPoints.reshape(2,1);
-
-	cv::undistortPoints(sensorPoints, undistortedSensorPoints, cameraMatrix, distCoeffs);
-
-	ch.push_back(undistortedSensorPoints);
-	ch.push_back(cv::Mat::ones(1,totalsize,CV_32FC1));
-	cv::merge(ch,pixelVectors);
-
-	if(radial)
-	{
-	    for(i = 0; i < totalsize; i++)
-	    {
-		normalize(pixelVectors.at<cv::Vec3f>(i),
-			  dst.at<cv::Vec3f>(i));
-	    }
-	    pixelVectors = dst;
-	}
-	return pixelVectors.reshape(3,width);
-    }
-  
-
     void PointCloudXyzRadialNodelet::onInit()
     {
 	ros::NodeHandle& nh         = getNodeHandle();
@@ -128,6 +83,10 @@ namespace depth_image_proc {
 
 	// Read parameters
 	private_nh.param("queue_size", queue_size_, 5);
+	// Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+	// see image_proc::QuantizedPoints
+	private_nh.param("quantize_points", quantize_points_, false);
+	stats_ = image_proc::Instrumentation::stage(private_nh, "point_cloud_xyz_radial");
 
 	// Monitor whether anyone is subscribed to the output
 	ros::SubscriberStatusCallback connect_cb = 
@@ -158,7 +117,9 @@ namespace depth_image_proc {
     void PointCloudXyzRadialNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
 					     const sensor_msgs::CameraInfoConstPtr& info_msg)
     {
-	PointCloud::Ptr cloud_msg(new PointCloud);
+	image_proc::StageTimer timer(stats_.get(), depth_msg->header.stamp);
+
+	PointCloud::Ptr cloud_msg = MessagePool<PointCloud>::instance().allocate();
 	cloud_msg->header = depth_msg->header;
 	cloud_msg->height = depth_msg->height;
 	cloud_msg->width  = depth_msg->width;
@@ -168,23 +129,22 @@ namespace depth_image_proc {
 	sensor_msgs::PointCloud2Modifier pcd_modifier(*cloud_msg);
 	pcd_modifier.setPointCloud2FieldsByString(1, "xyz");
 
-	if(info_msg->D != D_ || info_msg->K != K_ || width_ != info_msg->width ||
-	   height_ != info_msg->height)
+	if (!rays_ || !rays_->matches(*info_msg))
+	    rays_ = RadialRays::get(*info_msg);
+	if (rays_->width != (int)depth_msg->width || rays_->height != (int)depth_msg->height)
 	{
-	    D_ = info_msg->D;
-	    K_ = info_msg->K;
-	    width_ = info_msg->width;
-	    height_ = info_msg->height;
-	    binned = initMatrix(cv::Mat_<double>(3, 3, &K_[0]),cv::Mat(D_),width_,height_,true);
+	    NODELET_ERROR_THROTTLE(5, "Depth image resolution %dx%d does not match camera info %dx%d",
+				   (int)depth_msg->width, (int)depth_msg->height, rays_->width, rays_->height);
+	    return;
 	}
 
 	if (depth_msg->encoding == enc::TYPE_16UC1)
 	{
-	    convert<uint16_t>(depth_msg, cloud_msg);
+	    convertRadial<uint16_t>(*depth_msg, *cloud_msg, *rays_);
 	}
 	else if (depth_msg->encoding == enc::TYPE_32FC1)
 	{
-	    convert<float>(depth_msg, cloud_msg);
+	    convertRadial<float>(*depth_msg, *cloud_msg, *rays_);
 	}
 	else
 	{
@@ -192,40 +152,11 @@ namespace depth_image_proc {
 	    return;
 	}
 
-	pub_point_cloud_.publish (cloud_msg);
-    }
+	if (quantize_points_)
+		image_proc::quantizePoints(*cloud_msg);
 
-    template<typename T>
-    void PointCloudXyzRadialNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg, PointCloud::Ptr& cloud_msg)
-    {
-	// Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-	double unit_scaling = DepthTraits<T>::toMeters( T(1) );
-	float bad_point = std::numeric_limits<float>::quiet_NaN();
-
-	sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-	sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-	sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-	const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-	int row_step = depth_msg->step / sizeof(T);
-	for (int v = 0; v < (int)cloud_msg->height; ++v, depth_row += row_step)
-	{
-	    for (int u = 0; u < (int)cloud_msg->width; ++u, ++iter_x, ++iter_y, ++iter_z)
-	    {
-		T depth = depth_row[u];
-
-		// Missing points denoted by NaNs
-		if (!DepthTraits<T>::valid(depth))
-		{
-		    *iter_x = *iter_y = *iter_z = bad_point;
-		    continue;
-		}
-		const cv::Vec3f &cvPoint = binned.at<cv::Vec3f>(u,v) * DepthTraits<T>::toMeters(depth);
-		// Fill in XYZ
-		*iter_x = cvPoint(0);
-		*iter_y = cvPoint(1);
-		*iter_z = cvPoint(2);
-	    }
-	}
+	timer.setBytes(cloud_msg->data.size());
+	pub_point_cloud_.publish (cloud_msg);
     }
 
 } // namespace depth_image_proc
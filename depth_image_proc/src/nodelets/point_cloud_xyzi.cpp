@@ -47,7 +47,10 @@
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <image_geometry/pinhole_camera_model.h>
-#include <depth_image_proc/depth_traits.h>
+#include <depth_image_proc/depth_conversions.h>
+#include <depth_image_proc/message_pool.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/point_cloud_quantization.h>
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -74,6 +77,9 @@ class PointCloudXyziNodelet : public nodelet::Nodelet
   ros::Publisher pub_point_cloud_;
 
   image_geometry::PinholeCameraModel model_;
+  DepthRays rays_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  bool quantize_points_;
 
   virtual void onInit();
 
@@ -101,6 +107,10 @@ void PointCloudXyziNodelet::onInit()
   // Read parameters
   int queue_size;
   private_nh.param("queue_size", queue_size, 5);
+  // Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+  // see image_proc::QuantizedPoints
+  private_nh.param("quantize_points", quantize_points_, false);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "point_cloud_xyzi");
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_, sub_intensity_, sub_info_) );
@@ -144,6 +154,8 @@ void PointCloudXyziNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
                                       const sensor_msgs::ImageConstPtr& intensity_msg_in,
                                       const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
+  image_proc::StageTimer timer(stats_.get(), depth_msg->header.stamp);
+
   // Check for bad inputs
   if (depth_msg->header.frame_id != intensity_msg_in->header.frame_id)
   {
@@ -213,7 +225,7 @@ void PointCloudXyziNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
   }
 
   // Allocate new point cloud message
-  PointCloud::Ptr cloud_msg (new PointCloud);
+  PointCloud::Ptr cloud_msg = MessagePool<PointCloud>::instance().allocate();
   cloud_msg->header = depth_msg->header; // Use depth image time stamp
   cloud_msg->height = depth_msg->height;
   cloud_msg->width  = depth_msg->width;
@@ -255,6 +267,10 @@ void PointCloudXyziNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
     return;
   }
 
+  if (quantize_points_)
+    image_proc::quantizePoints(*cloud_msg);
+
+  timer.setBytes(cloud_msg->data.size());
   pub_point_cloud_.publish (cloud_msg);
 }
 
@@ -263,49 +279,24 @@ void PointCloudXyziNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg,
                                       const sensor_msgs::ImageConstPtr& intensity_msg,
                                       const PointCloud::Ptr& cloud_msg)
 {
-  // Use correct principal point from calibration
-  float center_x = model_.cx();
-  float center_y = model_.cy();
-
-  // Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
-  float constant_x = unit_scaling / model_.fx();
-  float constant_y = unit_scaling / model_.fy();
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-
-  const T2* inten_row = reinterpret_cast<const T2*>(&intensity_msg->data[0]);
-  int inten_row_step  = intensity_msg->step / sizeof(T2);
+  rays_.update(model_, depth_msg->width, depth_msg->height);
 
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-  sensor_msgs::PointCloud2Iterator<float> iter_i(*cloud_msg, "intensity");
+  const uint8_t* depth_row = &depth_msg->data[0];
+  const uint8_t* inten_row = &intensity_msg->data[0];
+  uint8_t* cloud_row = &cloud_msg->data[0];
+  int point_step = cloud_msg->point_step;
+  int inten_offset = fieldOffset(*cloud_msg, "intensity");
 
-  for (int v = 0; v < int(cloud_msg->height); ++v, depth_row += row_step, inten_row += inten_row_step)
+  for (int v = 0; v < int(cloud_msg->height); ++v, depth_row += depth_msg->step, inten_row += intensity_msg->step,
+                                                cloud_row += cloud_msg->row_step)
   {
-    for (int u = 0; u < int(cloud_msg->width); ++u, ++iter_x, ++iter_y, ++iter_z, ++iter_i)
-    {
-      T depth = depth_row[u];
-      T2 inten = inten_row[u];
-      // Check for invalid measurements
-      if (!DepthTraits<T>::valid(depth))
-      {
-        *iter_x = *iter_y = *iter_z = bad_point;
-      }
-      else
-      {
-        // Fill in XYZ
-        *iter_x = (u - center_x) * depth * constant_x;
-        *iter_y = (v - center_y) * depth * constant_y;
-        *iter_z = DepthTraits<T>::toMeters(depth);
-      }
-
-      // Fill in intensity
-      *iter_i = inten;
-    }
+    // Fill in XYZ, then intensity, which shares the 16 byte store of convertRow()
+    convertRow(reinterpret_cast<const T*>(depth_row), v, cloud_msg->width, rays_, cloud_row, point_step);
+
+    const T2* inten = reinterpret_cast<const T2*>(inten_row);
+    uint8_t* point = cloud_row + inten_offset;
+    for (int u = 0; u < int(cloud_msg->width); ++u, point += point_step)
+      *reinterpret_cast<float*>(point) = inten[u];
   }
 }
 
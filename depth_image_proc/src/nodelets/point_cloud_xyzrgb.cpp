@@ -47,7 +47,12 @@
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <image_geometry/pinhole_camera_model.h>
-#include <depth_image_proc/depth_traits.h>
+#include <depth_image_proc/depth_conversions.h>
+#include <depth_image_proc/message_pool.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/latest_dispatcher.h>
+#include <image_proc/shm_ring.h>
+#include <image_proc/point_cloud_quantization.h>
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -72,24 +77,65 @@ class PointCloudXyzrgbNodelet : public nodelet::Nodelet
   boost::mutex connect_mutex_;
   typedef sensor_msgs::PointCloud2 PointCloud;
   ros::Publisher pub_point_cloud_;
+  image_proc::ShmPublisher<PointCloud> pub_point_cloud_shm_; // points/shm, for other processes
 
   image_geometry::PinholeCameraModel model_;
+  DepthRays rays_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  bool quantize_points_;
+
+  // How RGB of a different resolution is matched to the depth pixels
+  enum RgbSampling { RESIZE, NEAREST, BILINEAR };
+  RgbSampling rgb_sampling_;
+
+  // Source of each cloud column (or row) when sampling RGB directly: byte
+  // offsets of the two neighboring pixels and the 8-bit weight of the second
+  struct SampleTable
+  {
+    std::vector<int> offset0, offset1, weight;
+  };
+  SampleTable sample_cols_, sample_rows_;
+  cv::Size sample_depth_size_, sample_rgb_size_;
+  int sample_rgb_step_, sample_color_step_;
+
+  // NULL unless ~latest_only is set; declared last so it stops first
+  boost::shared_ptr<image_proc::LatestDispatcher> latest_;
 
   virtual void onInit();
 
   void connectCb();
 
+  void syncCb(const sensor_msgs::ImageConstPtr& depth_msg,
+              const sensor_msgs::ImageConstPtr& rgb_msg,
+              const sensor_msgs::CameraInfoConstPtr& info_msg);
+
   void imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
                const sensor_msgs::ImageConstPtr& rgb_msg,
                const sensor_msgs::CameraInfoConstPtr& info_msg);
 
+  void updateSampling(const sensor_msgs::Image& depth_msg, const sensor_msgs::Image& rgb_msg,
+                      int color_step, double scale);
+
   template<typename T>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg,
                const sensor_msgs::ImageConstPtr& rgb_msg,
                const PointCloud::Ptr& cloud_msg,
-               int red_offset, int green_offset, int blue_offset, int color_step);
+               int red_offset, int green_offset, int blue_offset, int color_step,
+               bool sample);
 };
 
+namespace {
+
+inline uint8_t bilinear(const uint8_t* p00, const uint8_t* p01,
+                        const uint8_t* p10, const uint8_t* p11, int wx, int wy)
+{
+  int top    = *p00 * (256 - wx) + *p01 * wx;
+  int bottom = *p10 * (256 - wx) + *p11 * wx;
+  return (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+}
+
+} // namespace
+
 void PointCloudXyzrgbNodelet::onInit()
 {
   ros::NodeHandle& nh         = getNodeHandle();
@@ -102,23 +148,46 @@ void PointCloudXyzrgbNodelet::onInit()
   // Read parameters
   int queue_size;
   private_nh.param("queue_size", queue_size, 5);
+  // Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+  // see image_proc::QuantizedPoints
+  private_nh.param("quantize_points", quantize_points_, false);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "point_cloud_xyzrgb");
+
+  // RGB larger or smaller than the depth image is either resized as a whole
+  // first, or sampled at the scaled coordinates of each point
+  std::string rgb_sampling;
+  private_nh.param("rgb_sampling", rgb_sampling, std::string("resize"));
+  if (rgb_sampling == "nearest")
+    rgb_sampling_ = NEAREST;
+  else if (rgb_sampling == "bilinear")
+    rgb_sampling_ = BILINEAR;
+  else
+  {
+    if (rgb_sampling != "resize")
+      NODELET_WARN("Unknown rgb_sampling '%s', using 'resize'", rgb_sampling.c_str());
+    rgb_sampling_ = RESIZE;
+  }
+  sample_rgb_step_ = sample_color_step_ = 0;
+  // With ~latest_only, convert only the newest synchronized set
+  latest_ = image_proc::LatestDispatcher::create(private_nh, stats_);
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_, sub_rgb_, sub_info_) );
-  sync_->registerCallback(boost::bind(&PointCloudXyzrgbNodelet::imageCb, this, _1, _2, _3));
+  sync_->registerCallback(boost::bind(&PointCloudXyzrgbNodelet::syncCb, this, _1, _2, _3));
   
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&PointCloudXyzrgbNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_point_cloud_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_point_cloud_ = depth_nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+  pub_point_cloud_shm_.advertise(depth_nh, "points", 1, connect_cb);
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloudXyzrgbNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_point_cloud_.getNumSubscribers() == 0)
+  if (pub_point_cloud_.getNumSubscribers() == 0 && pub_point_cloud_shm_.getNumSubscribers() == 0)
   {
     sub_depth_.unsubscribe();
     sub_rgb_  .unsubscribe();
@@ -141,10 +210,23 @@ void PointCloudXyzrgbNodelet::connectCb()
   }
 }
 
+void PointCloudXyzrgbNodelet::syncCb(const sensor_msgs::ImageConstPtr& depth_msg,
+                                     const sensor_msgs::ImageConstPtr& rgb_msg,
+                                     const sensor_msgs::CameraInfoConstPtr& info_msg)
+{
+  if (latest_)
+    latest_->submit(depth_msg->header.stamp,
+                    boost::bind(&PointCloudXyzrgbNodelet::imageCb, this, depth_msg, rgb_msg, info_msg));
+  else
+    imageCb(depth_msg, rgb_msg, info_msg);
+}
+
 void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
                                       const sensor_msgs::ImageConstPtr& rgb_msg_in,
                                       const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
+  image_proc::StageTimer timer(stats_.get(), depth_msg->header.stamp);
+
   // Check for bad inputs
   if (depth_msg->header.frame_id != rgb_msg_in->header.frame_id)
   {
@@ -158,12 +240,14 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
 
   // Check if the input image has to be resized
   sensor_msgs::ImageConstPtr rgb_msg = rgb_msg_in;
+  bool sample = false;
+  float ratio = 1.0f;
   if (depth_msg->width != rgb_msg->width || depth_msg->height != rgb_msg->height)
   {
     sensor_msgs::CameraInfo info_msg_tmp = *info_msg;
     info_msg_tmp.width = depth_msg->width;
     info_msg_tmp.height = depth_msg->height;
-    float ratio = float(depth_msg->width)/float(rgb_msg->width);
+    ratio = float(depth_msg->width)/float(rgb_msg->width);
     info_msg_tmp.K[0] *= ratio;
     info_msg_tmp.K[2] *= ratio;
     info_msg_tmp.K[4] *= ratio;
@@ -174,55 +258,41 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
     info_msg_tmp.P[6] *= ratio;
     model_.fromCameraInfo(info_msg_tmp);
 
-    cv_bridge::CvImageConstPtr cv_ptr;
-    try
-    {
-      cv_ptr = cv_bridge::toCvShare(rgb_msg, rgb_msg->encoding);
-    }
-    catch (cv_bridge::Exception& e)
-    {
-      ROS_ERROR("cv_bridge exception: %s", e.what());
-      return;
-    }
-    cv_bridge::CvImage cv_rsz;
-    cv_rsz.header = cv_ptr->header;
-    cv_rsz.encoding = cv_ptr->encoding;
-    cv::resize(cv_ptr->image.rowRange(0,depth_msg->height/ratio), cv_rsz.image, cv::Size(depth_msg->width, depth_msg->height));
-    if ((rgb_msg->encoding == enc::RGB8) || (rgb_msg->encoding == enc::BGR8) || (rgb_msg->encoding == enc::MONO8))
-      rgb_msg = cv_rsz.toImageMsg();
+    // Sampled directly in convert(), no resized copy of the whole image
+    if (rgb_sampling_ != RESIZE)
+      sample = true;
     else
-      rgb_msg = cv_bridge::toCvCopy(cv_rsz.toImageMsg(), enc::RGB8)->toImageMsg();
+    {
+      cv_bridge::CvImageConstPtr cv_ptr;
+      try
+      {
+        cv_ptr = cv_bridge::toCvShare(rgb_msg, rgb_msg->encoding);
+      }
+      catch (cv_bridge::Exception& e)
+      {
+        ROS_ERROR("cv_bridge exception: %s", e.what());
+        return;
+      }
+      cv_bridge::CvImage cv_rsz;
+      cv_rsz.header = cv_ptr->header;
+      cv_rsz.encoding = cv_ptr->encoding;
+      cv::resize(cv_ptr->image.rowRange(0,depth_msg->height/ratio), cv_rsz.image, cv::Size(depth_msg->width, depth_msg->height));
+      if ((rgb_msg->encoding == enc::RGB8) || (rgb_msg->encoding == enc::BGR8) || (rgb_msg->encoding == enc::MONO8))
+        rgb_msg = cv_rsz.toImageMsg();
+      else
+        rgb_msg = cv_bridge::toCvCopy(cv_rsz.toImageMsg(), enc::RGB8)->toImageMsg();
 
-    //NODELET_ERROR_THROTTLE(5, "Depth resolution (%ux%u) does not match RGB resolution (%ux%u)",
-    //                       depth_msg->width, depth_msg->height, rgb_msg->width, rgb_msg->height);
-    //return;
+      //NODELET_ERROR_THROTTLE(5, "Depth resolution (%ux%u) does not match RGB resolution (%ux%u)",
+      //                       depth_msg->width, depth_msg->height, rgb_msg->width, rgb_msg->height);
+      //return;
+    }
   } else
     rgb_msg = rgb_msg_in;
 
-  // Supported color encodings: RGB8, BGR8, MONO8
+  // Supported color encodings: RGB8, BGR8, RGBA8, BGRA8, MONO8, MONO16, others
+  // are converted to RGB8 first
   int red_offset, green_offset, blue_offset, color_step;
-  if (rgb_msg->encoding == enc::RGB8)
-  {
-    red_offset   = 0;
-    green_offset = 1;
-    blue_offset  = 2;
-    color_step   = 3;
-  }
-  else if (rgb_msg->encoding == enc::BGR8)
-  {
-    red_offset   = 2;
-    green_offset = 1;
-    blue_offset  = 0;
-    color_step   = 3;
-  }
-  else if (rgb_msg->encoding == enc::MONO8)
-  {
-    red_offset   = 0;
-    green_offset = 0;
-    blue_offset  = 0;
-    color_step   = 1;
-  }
-  else
+  if (!colorLayout(*rgb_msg, red_offset, green_offset, blue_offset, color_step))
   {
     try
     {
@@ -233,14 +303,13 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
       NODELET_ERROR_THROTTLE(5, "Unsupported encoding [%s]: %s", rgb_msg->encoding.c_str(), e.what());
       return;
     }
-    red_offset   = 0;
-    green_offset = 1;
-    blue_offset  = 2;
-    color_step   = 3;
+    colorLayout(*rgb_msg, red_offset, green_offset, blue_offset, color_step);
   }
+  if (sample)
+    updateSampling(*depth_msg, *rgb_msg, color_step, 1.0 / ratio);
 
   // Allocate new point cloud message
-  PointCloud::Ptr cloud_msg (new PointCloud);
+  PointCloud::Ptr cloud_msg = MessagePool<PointCloud>::instance().allocate();
   cloud_msg->header = depth_msg->header; // Use depth image time stamp
   cloud_msg->height = depth_msg->height;
   cloud_msg->width  = depth_msg->width;
@@ -252,11 +321,11 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
 
   if (depth_msg->encoding == enc::TYPE_16UC1)
   {
-    convert<uint16_t>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    convert<uint16_t>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step, sample);
   }
   else if (depth_msg->encoding == enc::TYPE_32FC1)
   {
-    convert<float>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    convert<float>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step, sample);
   }
   else
   {
@@ -264,62 +333,126 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
     return;
   }
 
+  if (quantize_points_)
+    image_proc::quantizePoints(*cloud_msg);
+
+  timer.setBytes(cloud_msg->data.size());
+  pub_point_cloud_shm_.publish(*cloud_msg);
   pub_point_cloud_.publish (cloud_msg);
 }
 
+namespace {
+
+// Source pixels of out_size samples along an axis of in_size pixels scaled by
+// scale, with pixel centers aligned as in cv::resize. Offsets are multiples of
+// stride; nearest sampling uses only offset0.
+void buildSampleTable(int out_size, int in_size, double scale, int stride, bool interpolate,
+                      std::vector<int>& offset0, std::vector<int>& offset1, std::vector<int>& weight)
+{
+  offset0.resize(out_size);
+  offset1.resize(out_size);
+  weight.resize(out_size);
+  for (int i = 0; i < out_size; ++i)
+  {
+    double x = (i + 0.5) * scale - 0.5;
+    int x0, x1, w = 0;
+    if (interpolate)
+    {
+      x = std::max(0.0, std::min(x, in_size - 1.0));
+      x0 = (int)x;
+      x1 = std::min(x0 + 1, in_size - 1);
+      w = cvRound((x - x0) * 256);
+    }
+    else
+      x0 = x1 = std::max(0, std::min(cvRound(x), in_size - 1));
+    offset0[i] = x0 * stride;
+    offset1[i] = x1 * stride;
+    weight[i] = w;
+  }
+}
+
+} // namespace
+
+void PointCloudXyzrgbNodelet::updateSampling(const sensor_msgs::Image& depth_msg,
+                                             const sensor_msgs::Image& rgb_msg,
+                                             int color_step, double scale)
+{
+  cv::Size depth_size(depth_msg.width, depth_msg.height), rgb_size(rgb_msg.width, rgb_msg.height);
+  if (depth_size == sample_depth_size_ && rgb_size == sample_rgb_size_ &&
+      (int)rgb_msg.step == sample_rgb_step_ && color_step == sample_color_step_)
+    return;
+
+  // Same scale on both axes as the camera model, rows past the bottom of the
+  // RGB image repeat its last row
+  bool interpolate = rgb_sampling_ == BILINEAR;
+  buildSampleTable(depth_size.width, rgb_size.width, scale, color_step, interpolate,
+                   sample_cols_.offset0, sample_cols_.offset1, sample_cols_.weight);
+  buildSampleTable(depth_size.height, rgb_size.height, scale, rgb_msg.step, interpolate,
+                   sample_rows_.offset0, sample_rows_.offset1, sample_rows_.weight);
+  sample_depth_size_ = depth_size;
+  sample_rgb_size_ = rgb_size;
+  sample_rgb_step_ = rgb_msg.step;
+  sample_color_step_ = color_step;
+}
+
 template<typename T>
 void PointCloudXyzrgbNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg,
                                       const sensor_msgs::ImageConstPtr& rgb_msg,
                                       const PointCloud::Ptr& cloud_msg,
-                                      int red_offset, int green_offset, int blue_offset, int color_step)
+                                      int red_offset, int green_offset, int blue_offset, int color_step,
+                                      bool sample)
 {
-  // Use correct principal point from calibration
-  float center_x = model_.cx();
-  float center_y = model_.cy();
-
-  // Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
-  float constant_x = unit_scaling / model_.fx();
-  float constant_y = unit_scaling / model_.fy();
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  const uint8_t* rgb = &rgb_msg->data[0];
-  int rgb_skip = rgb_msg->step - rgb_msg->width * color_step;
-
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_r(*cloud_msg, "r");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_g(*cloud_msg, "g");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_b(*cloud_msg, "b");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_a(*cloud_msg, "a");
-
-  for (int v = 0; v < int(cloud_msg->height); ++v, depth_row += row_step, rgb += rgb_skip)
+  rays_.update(model_, depth_msg->width, depth_msg->height);
+
+  const uint8_t* depth_row = &depth_msg->data[0];
+  const uint8_t* rgb_data = &rgb_msg->data[0];
+  uint8_t* cloud_row = &cloud_msg->data[0];
+  int point_step = cloud_msg->point_step;
+  // rgb is packed as a little endian float: b, g, r, a
+  int rgb_offset = fieldOffset(*cloud_msg, "rgb");
+
+  for (int v = 0; v < int(cloud_msg->height); ++v, depth_row += depth_msg->step, cloud_row += cloud_msg->row_step)
   {
-    for (int u = 0; u < int(cloud_msg->width); ++u, rgb += color_step, ++iter_x, ++iter_y, ++iter_z, ++iter_a, ++iter_r, ++iter_g, ++iter_b)
-    {
-      T depth = depth_row[u];
+    // Fill in XYZ
+    convertRow(reinterpret_cast<const T*>(depth_row), v, cloud_msg->width, rays_, cloud_row, point_step);
 
-      // Check for invalid measurements
-      if (!DepthTraits<T>::valid(depth))
+    // Fill in color
+    uint8_t* point = cloud_row + rgb_offset;
+    if (!sample)
+    {
+      packColorRow(rgb_data + v * rgb_msg->step, cloud_msg->width, red_offset, green_offset, blue_offset,
+                   color_step, point, point_step);
+    }
+    else if (rgb_sampling_ == NEAREST)
+    {
+      const uint8_t* row = rgb_data + sample_rows_.offset0[v];
+      const int* column = &sample_cols_.offset0[0];
+      for (int u = 0; u < int(cloud_msg->width); ++u, point += point_step)
       {
-        *iter_x = *iter_y = *iter_z = bad_point;
+        const uint8_t* rgb = row + column[u];
+        point[0] = rgb[blue_offset];
+        point[1] = rgb[green_offset];
+        point[2] = rgb[red_offset];
+        point[3] = 255;
       }
-      else
+    }
+    else
+    {
+      const uint8_t* row0 = rgb_data + sample_rows_.offset0[v];
+      const uint8_t* row1 = rgb_data + sample_rows_.offset1[v];
+      int wy = sample_rows_.weight[v];
+      for (int u = 0; u < int(cloud_msg->width); ++u, point += point_step)
       {
-        // Fill in XYZ
-        *iter_x = (u - center_x) * depth * constant_x;
-        *iter_y = (v - center_y) * depth * constant_y;
-        *iter_z = DepthTraits<T>::toMeters(depth);
+        const uint8_t* p00 = row0 + sample_cols_.offset0[u];
+        const uint8_t* p01 = row0 + sample_cols_.offset1[u];
+        const uint8_t* p10 = row1 + sample_cols_.offset0[u];
+        const uint8_t* p11 = row1 + sample_cols_.offset1[u];
+        int wx = sample_cols_.weight[u];
+        point[0] = bilinear(p00 + blue_offset,  p01 + blue_offset,  p10 + blue_offset,  p11 + blue_offset,  wx, wy);
+        point[1] = bilinear(p00 + green_offset, p01 + green_offset, p10 + green_offset, p11 + green_offset, wx, wy);
+        point[2] = bilinear(p00 + red_offset,   p01 + red_offset,   p10 + red_offset,   p11 + red_offset,   wx, wy);
+        point[3] = 255;
       }
-
-      // Fill in color
-      *iter_a = 255;
-      *iter_r = rgb[red_offset];
-      *iter_g = rgb[green_offset];
-      *iter_b = rgb[blue_offset];
     }
   }
 }
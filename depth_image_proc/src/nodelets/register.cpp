@@ -44,7 +44,10 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <Eigen/Geometry>
 #include <eigen_conversions/eigen_msg.h>
-#include <depth_image_proc/depth_traits.h>
+#include <depth_image_proc/depth_registration.h>
+#include <depth_image_proc/message_pool.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/latest_dispatcher.h>
 
 namespace depth_image_proc {
 
@@ -70,19 +73,22 @@ class RegisterNodelet : public nodelet::Nodelet
   image_transport::CameraPublisher pub_registered_;
 
   image_geometry::PinholeCameraModel depth_model_, rgb_model_;
+  DepthRegistration registration_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  // NULL unless ~latest_only is set; declared last so it stops first
+  boost::shared_ptr<image_proc::LatestDispatcher> latest_;
 
   virtual void onInit();
 
   void connectCb();
 
+  void syncCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+              const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+              const sensor_msgs::CameraInfoConstPtr& rgb_info_msg);
+
   void imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
                const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
                const sensor_msgs::CameraInfoConstPtr& rgb_info_msg);
-
-  template<typename T>
-  void convert(const sensor_msgs::ImageConstPtr& depth_msg,
-               const sensor_msgs::ImagePtr& registered_msg,
-               const Eigen::Affine3d& depth_to_rgb);
 };
 
 void RegisterNodelet::onInit()
@@ -98,10 +104,19 @@ void RegisterNodelet::onInit()
   // Read parameters
   int queue_size;
   private_nh.param("queue_size", queue_size, 5);
+  // Rasterize depth triangles for dense output when the RGB camera has higher resolution
+  bool rasterize;
+  double max_discontinuity;
+  private_nh.param("rasterize", rasterize, false);
+  private_nh.param("max_discontinuity", max_discontinuity, 0.1);
+  registration_.setRasterize(rasterize, max_discontinuity);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "register");
+  // With ~latest_only, register only the newest synchronized set
+  latest_ = image_proc::LatestDispatcher::create(private_nh, stats_);
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_image_, sub_depth_info_, sub_rgb_info_) );
-  sync_->registerCallback(boost::bind(&RegisterNodelet::imageCb, this, _1, _2, _3));
+  sync_->registerCallback(boost::bind(&RegisterNodelet::syncCb, this, _1, _2, _3));
 
   // Monitor whether anyone is subscribed to the output
   image_transport::ImageTransport it_depth_reg(ros::NodeHandle(nh, "depth_registered"));
@@ -133,10 +148,23 @@ void RegisterNodelet::connectCb()
   }
 }
 
+void RegisterNodelet::syncCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+                             const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+                             const sensor_msgs::CameraInfoConstPtr& rgb_info_msg)
+{
+  if (latest_)
+    latest_->submit(depth_image_msg->header.stamp,
+                    boost::bind(&RegisterNodelet::imageCb, this, depth_image_msg, depth_info_msg, rgb_info_msg));
+  else
+    imageCb(depth_image_msg, depth_info_msg, rgb_info_msg);
+}
+
 void RegisterNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
                               const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
                               const sensor_msgs::CameraInfoConstPtr& rgb_info_msg)
 {
+  image_proc::StageTimer timer(stats_.get(), depth_image_msg->header.stamp);
+
   // Update camera models - these take binning & ROI into account
   depth_model_.fromCameraInfo(depth_info_msg);
   rgb_model_  .fromCameraInfo(rgb_info_msg);
@@ -159,24 +187,26 @@ void RegisterNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
     /// don't call publish() in this cb. What's going on roscpp?
   }
 
-  // Allocate registered depth image
-  sensor_msgs::ImagePtr registered_msg( new sensor_msgs::Image );
+  // Allocate registered depth image, recycling an earlier one when possible
+  sensor_msgs::ImagePtr registered_msg = MessagePool<sensor_msgs::Image>::instance().allocate();
   registered_msg->header.stamp    = depth_image_msg->header.stamp;
   registered_msg->header.frame_id = rgb_info_msg->header.frame_id;
   registered_msg->encoding        = depth_image_msg->encoding;
+  registered_msg->is_bigendian    = false;
   
   cv::Size resolution = rgb_model_.reducedResolution();
   registered_msg->height = resolution.height;
   registered_msg->width  = resolution.width;
   // step and data set in convert(), depend on depth data type
 
+  registration_.setTransform(depth_model_, rgb_model_, depth_to_rgb);
   if (depth_image_msg->encoding == enc::TYPE_16UC1)
   {
-    convert<uint16_t>(depth_image_msg, registered_msg, depth_to_rgb);
+    registration_.convert<uint16_t>(*depth_image_msg, *registered_msg);
   }
   else if (depth_image_msg->encoding == enc::TYPE_32FC1)
   {
-    convert<float>(depth_image_msg, registered_msg, depth_to_rgb);
+    registration_.convert<float>(*depth_image_msg, *registered_msg);
   }
   else
   {
@@ -188,74 +218,10 @@ void RegisterNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
   sensor_msgs::CameraInfoPtr registered_info_msg( new sensor_msgs::CameraInfo(*rgb_info_msg) );
   registered_info_msg->header.stamp = registered_msg->header.stamp;
 
+  timer.setBytes(registered_msg->data.size());
   pub_registered_.publish(registered_msg, registered_info_msg);
 }
 
-template<typename T>
-void RegisterNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg,
-                              const sensor_msgs::ImagePtr& registered_msg,
-                              const Eigen::Affine3d& depth_to_rgb)
-{
-  // Allocate memory for registered depth image
-  registered_msg->step = registered_msg->width * sizeof(T);
-  registered_msg->data.resize( registered_msg->height * registered_msg->step );
-  // data is already zero-filled in the uint16 case, but for floats we want to initialize everything to NaN.
-  DepthTraits<T>::initializeBuffer(registered_msg->data);
-
-  // Extract all the parameters we need
-  double inv_depth_fx = 1.0 / depth_model_.fx();
-  double inv_depth_fy = 1.0 / depth_model_.fy();
-  double depth_cx = depth_model_.cx(), depth_cy = depth_model_.cy();
-  double depth_Tx = depth_model_.Tx(), depth_Ty = depth_model_.Ty();
-  double rgb_fx = rgb_model_.fx(), rgb_fy = rgb_model_.fy();
-  double rgb_cx = rgb_model_.cx(), rgb_cy = rgb_model_.cy();
-  double rgb_Tx = rgb_model_.Tx(), rgb_Ty = rgb_model_.Ty();
-  
-  // Transform the depth values into the RGB frame
-  /// @todo When RGB is higher res, interpolate by rasterizing depth triangles onto the registered image  
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  T* registered_data = reinterpret_cast<T*>(&registered_msg->data[0]);
-  int raw_index = 0;
-  for (unsigned v = 0; v < depth_msg->height; ++v, depth_row += row_step)
-  {
-    for (unsigned u = 0; u < depth_msg->width; ++u, ++raw_index)
-    {
-      T raw_depth = depth_row[u];
-      if (!DepthTraits<T>::valid(raw_depth))
-        continue;
-      
-      double depth = DepthTraits<T>::toMeters(raw_depth);
-
-      /// @todo Combine all operations into one matrix multiply on (u,v,d)
-      // Reproject (u,v,Z) to (X,Y,Z,1) in depth camera frame
-      Eigen::Vector4d xyz_depth;
-      xyz_depth << ((u - depth_cx)*depth - depth_Tx) * inv_depth_fx,
-                   ((v - depth_cy)*depth - depth_Ty) * inv_depth_fy,
-                   depth,
-                   1;
-
-      // Transform to RGB camera frame
-      Eigen::Vector4d xyz_rgb = depth_to_rgb * xyz_depth;
-
-      // Project to (u,v) in RGB image
-      double inv_Z = 1.0 / xyz_rgb.z();
-      int u_rgb = (rgb_fx*xyz_rgb.x() + rgb_Tx)*inv_Z + rgb_cx + 0.5;
-      int v_rgb = (rgb_fy*xyz_rgb.y() + rgb_Ty)*inv_Z + rgb_cy + 0.5;
-      
-      if (u_rgb < 0 || u_rgb >= (int)registered_msg->width ||
-          v_rgb < 0 || v_rgb >= (int)registered_msg->height)
-        continue;
-      
-      T& reg_depth = registered_data[v_rgb*registered_msg->width + u_rgb];
-      T  new_depth = DepthTraits<T>::fromMeters(xyz_rgb.z());
-      // Validity and Z-buffer checks
-      if (!DepthTraits<T>::valid(reg_depth) || reg_depth > new_depth)
-        reg_depth = new_depth;
-    }
-  }
-}
-
 } // namespace depth_image_proc
 
 // Register as nodelet
@@ -0,0 +1,302 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <image_transport/image_transport.h>
+#include <image_transport/subscriber_filter.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/synchronizer.h>
+#include <message_filters/sync_policies/approximate_time.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+#include <sensor_msgs/image_encodings.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <image_geometry/pinhole_camera_model.h>
+#include <Eigen/Geometry>
+#include <eigen_conversions/eigen_msg.h>
+#include <depth_image_proc/depth_conversions.h>
+#include <depth_image_proc/depth_registration.h>
+#include <depth_image_proc/message_pool.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/latest_dispatcher.h>
+#include <image_proc/point_cloud_quantization.h>
+#include <image_proc/shm_ring.h>
+#include <cv_bridge/cv_bridge.h>
+
+namespace depth_image_proc {
+
+using namespace message_filters::sync_policies;
+namespace enc = sensor_msgs::image_encodings;
+
+/**
+ * Registers unregistered depth to the RGB camera and colors it in one go,
+ * publishing the XYZRGB cloud that register followed by point_cloud_xyzrgb
+ * would, without the registered depth image in between.
+ */
+class RegisterXyzrgbNodelet : public nodelet::Nodelet
+{
+  ros::NodeHandlePtr nh_depth_, nh_rgb_;
+  boost::shared_ptr<image_transport::ImageTransport> it_depth_, it_rgb_;
+
+  // Subscriptions
+  image_transport::SubscriberFilter sub_depth_image_, sub_rgb_image_;
+  message_filters::Subscriber<sensor_msgs::CameraInfo> sub_depth_info_, sub_rgb_info_;
+  boost::shared_ptr<tf2_ros::Buffer> tf_buffer_;
+  boost::shared_ptr<tf2_ros::TransformListener> tf_;
+  typedef ApproximateTime<sensor_msgs::Image, sensor_msgs::CameraInfo,
+                          sensor_msgs::Image, sensor_msgs::CameraInfo> SyncPolicy;
+  typedef message_filters::Synchronizer<SyncPolicy> Synchronizer;
+  boost::shared_ptr<Synchronizer> sync_;
+
+  // Publications
+  boost::mutex connect_mutex_;
+  typedef sensor_msgs::PointCloud2 PointCloud;
+  ros::Publisher pub_point_cloud_;
+  image_proc::ShmPublisher<PointCloud> pub_point_cloud_shm_; // points/shm, for other processes
+  bool quantize_points_;
+
+  image_geometry::PinholeCameraModel depth_model_, rgb_model_;
+  DepthRegistration registration_;
+  DepthRays rgb_rays_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  // NULL unless ~latest_only is set; declared last so it stops first
+  boost::shared_ptr<image_proc::LatestDispatcher> latest_;
+
+  virtual void onInit();
+
+  void connectCb();
+
+  void syncCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+              const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+              const sensor_msgs::ImageConstPtr& rgb_image_msg,
+              const sensor_msgs::CameraInfoConstPtr& rgb_info_msg);
+
+  void imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+               const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+               const sensor_msgs::ImageConstPtr& rgb_image_msg,
+               const sensor_msgs::CameraInfoConstPtr& rgb_info_msg);
+};
+
+void RegisterXyzrgbNodelet::onInit()
+{
+  ros::NodeHandle& nh         = getNodeHandle();
+  ros::NodeHandle& private_nh = getPrivateNodeHandle();
+  nh_depth_.reset( new ros::NodeHandle(nh, "depth") );
+  nh_rgb_.reset( new ros::NodeHandle(nh, "rgb") );
+  it_depth_.reset( new image_transport::ImageTransport(*nh_depth_) );
+  it_rgb_.reset( new image_transport::ImageTransport(*nh_rgb_) );
+  tf_buffer_.reset( new tf2_ros::Buffer );
+  tf_.reset( new tf2_ros::TransformListener(*tf_buffer_) );
+
+  // Read parameters
+  int queue_size;
+  private_nh.param("queue_size", queue_size, 5);
+  // Rasterize depth triangles for dense output when the RGB camera has higher resolution
+  bool rasterize;
+  double max_discontinuity;
+  private_nh.param("rasterize", rasterize, false);
+  private_nh.param("max_discontinuity", max_discontinuity, 0.1);
+  registration_.setRasterize(rasterize, max_discontinuity);
+  // Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+  // see image_proc::QuantizedPoints
+  private_nh.param("quantize_points", quantize_points_, false);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "register_xyzrgb");
+  // With ~latest_only, register only the newest synchronized set
+  latest_ = image_proc::LatestDispatcher::create(private_nh, stats_);
+
+  // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
+  sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_image_, sub_depth_info_,
+                                sub_rgb_image_, sub_rgb_info_) );
+  sync_->registerCallback(boost::bind(&RegisterXyzrgbNodelet::syncCb, this, _1, _2, _3, _4));
+
+  // Monitor whether anyone is subscribed to the output
+  ros::NodeHandle depth_reg_nh(nh, "depth_registered");
+  ros::SubscriberStatusCallback connect_cb = boost::bind(&RegisterXyzrgbNodelet::connectCb, this);
+  // Make sure we don't enter connectCb() between advertising and assigning to pub_point_cloud_
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  pub_point_cloud_ = depth_reg_nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+  pub_point_cloud_shm_.advertise(depth_reg_nh, "points", 1, connect_cb);
+}
+
+// Handles (un)subscribing when clients (un)subscribe
+void RegisterXyzrgbNodelet::connectCb()
+{
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  if (pub_point_cloud_.getNumSubscribers() == 0 && pub_point_cloud_shm_.getNumSubscribers() == 0)
+  {
+    sub_depth_image_.unsubscribe();
+    sub_depth_info_ .unsubscribe();
+    sub_rgb_image_  .unsubscribe();
+    sub_rgb_info_   .unsubscribe();
+  }
+  else if (!sub_depth_image_.getSubscriber())
+  {
+    ros::NodeHandle& private_nh = getPrivateNodeHandle();
+    // depth image can use different transport.(e.g. compressedDepth)
+    image_transport::TransportHints depth_hints("raw", ros::TransportHints(), private_nh, "depth_image_transport");
+    sub_depth_image_.subscribe(*it_depth_, "image_rect", 1, depth_hints);
+    sub_depth_info_ .subscribe(*nh_depth_, "camera_info", 1);
+
+    // rgb uses normal ros transport hints.
+    image_transport::TransportHints hints("raw", ros::TransportHints(), private_nh);
+    sub_rgb_image_.subscribe(*it_rgb_, "image_rect_color", 1, hints);
+    sub_rgb_info_ .subscribe(*nh_rgb_, "camera_info", 1);
+  }
+}
+
+void RegisterXyzrgbNodelet::syncCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+                                   const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+                                   const sensor_msgs::ImageConstPtr& rgb_image_msg,
+                                   const sensor_msgs::CameraInfoConstPtr& rgb_info_msg)
+{
+  if (latest_)
+    latest_->submit(depth_image_msg->header.stamp,
+                    boost::bind(&RegisterXyzrgbNodelet::imageCb, this,
+                                depth_image_msg, depth_info_msg, rgb_image_msg, rgb_info_msg));
+  else
+    imageCb(depth_image_msg, depth_info_msg, rgb_image_msg, rgb_info_msg);
+}
+
+void RegisterXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
+                                    const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
+                                    const sensor_msgs::ImageConstPtr& rgb_image_msg,
+                                    const sensor_msgs::CameraInfoConstPtr& rgb_info_msg)
+{
+  image_proc::StageTimer timer(stats_.get(), depth_image_msg->header.stamp);
+
+  // Update camera models - these take binning & ROI into account
+  depth_model_.fromCameraInfo(depth_info_msg);
+  rgb_model_  .fromCameraInfo(rgb_info_msg);
+
+  // Points are colored by the RGB pixel they land on, so the image has to
+  // match the calibrated resolution
+  cv::Size resolution = rgb_model_.reducedResolution();
+  if ((int)rgb_image_msg->width != resolution.width || (int)rgb_image_msg->height != resolution.height)
+  {
+    NODELET_ERROR_THROTTLE(5, "RGB image resolution (%ux%u) does not match its camera info (%dx%d)",
+                           rgb_image_msg->width, rgb_image_msg->height, resolution.width, resolution.height);
+    return;
+  }
+
+  // Supported color encodings: RGB8, BGR8, RGBA8, BGRA8, MONO8, MONO16, others
+  // are converted to RGB8 first
+  sensor_msgs::ImageConstPtr rgb_msg = rgb_image_msg;
+  int red_offset, green_offset, blue_offset, color_step;
+  if (!colorLayout(*rgb_msg, red_offset, green_offset, blue_offset, color_step))
+  {
+    try
+    {
+      rgb_msg = cv_bridge::toCvCopy(rgb_msg, enc::RGB8)->toImageMsg();
+    }
+    catch (cv_bridge::Exception& e)
+    {
+      NODELET_ERROR_THROTTLE(5, "Unsupported encoding [%s]: %s", rgb_msg->encoding.c_str(), e.what());
+      return;
+    }
+    colorLayout(*rgb_msg, red_offset, green_offset, blue_offset, color_step);
+  }
+
+  // Query tf2 for transform from (X,Y,Z) in depth camera frame to RGB camera frame
+  Eigen::Affine3d depth_to_rgb;
+  try
+  {
+    geometry_msgs::TransformStamped transform = tf_buffer_->lookupTransform (
+                          rgb_info_msg->header.frame_id, depth_info_msg->header.frame_id,
+                          depth_info_msg->header.stamp);
+
+    tf::transformMsgToEigen(transform.transform, depth_to_rgb);
+  }
+  catch (tf2::TransformException& ex)
+  {
+    NODELET_WARN_THROTTLE(2, "TF2 exception:\n%s", ex.what());
+    return;
+  }
+
+  // Allocate the cloud at RGB resolution in the RGB frame, recycling an earlier one when possible
+  PointCloud::Ptr cloud_msg = MessagePool<PointCloud>::instance().allocate();
+  cloud_msg->header.stamp    = depth_image_msg->header.stamp; // Use depth image time stamp
+  cloud_msg->header.frame_id = rgb_info_msg->header.frame_id;
+  cloud_msg->height = resolution.height;
+  cloud_msg->width  = resolution.width;
+  cloud_msg->is_dense = false;
+  cloud_msg->is_bigendian = false;
+
+  sensor_msgs::PointCloud2Modifier pcd_modifier(*cloud_msg);
+  pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
+
+  // Fill in XYZ: depth splatted into the RGB camera, back-projected through its rays
+  registration_.setTransform(depth_model_, rgb_model_, depth_to_rgb);
+  rgb_rays_.update(rgb_model_, resolution.width, resolution.height);
+  if (depth_image_msg->encoding == enc::TYPE_16UC1)
+  {
+    registration_.convert<uint16_t>(*depth_image_msg, rgb_rays_, *cloud_msg);
+  }
+  else if (depth_image_msg->encoding == enc::TYPE_32FC1)
+  {
+    registration_.convert<float>(*depth_image_msg, rgb_rays_, *cloud_msg);
+  }
+  else
+  {
+    NODELET_ERROR_THROTTLE(5, "Depth image has unsupported encoding [%s]", depth_image_msg->encoding.c_str());
+    return;
+  }
+
+  // Fill in color
+  const uint8_t* rgb_row = &rgb_msg->data[0];
+  uint8_t* point = &cloud_msg->data[0] + fieldOffset(*cloud_msg, "rgb");
+  for (int v = 0; v < resolution.height; ++v, rgb_row += rgb_msg->step, point += cloud_msg->row_step)
+  {
+    packColorRow(rgb_row, resolution.width, red_offset, green_offset, blue_offset,
+                 color_step, point, cloud_msg->point_step);
+  }
+
+  if (quantize_points_)
+    image_proc::quantizePoints(*cloud_msg);
+
+  timer.setBytes(cloud_msg->data.size());
+  pub_point_cloud_shm_.publish(*cloud_msg);
+  pub_point_cloud_.publish(cloud_msg);
+}
+
+} // namespace depth_image_proc
+
+// Register as nodelet
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_EXPORT_CLASS(depth_image_proc::RegisterXyzrgbNodelet,nodelet::Nodelet);
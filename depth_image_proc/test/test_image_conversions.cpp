@@ -0,0 +1,170 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <depth_image_proc/image_conversions.h>
+#include <gtest/gtest.h>
+#include <limits>
+#include <vector>
+
+using namespace depth_image_proc;
+
+namespace {
+
+const float NaN = std::numeric_limits<float>::quiet_NaN();
+const float INF = std::numeric_limits<float>::infinity();
+
+/**
+ * Runs kernel over the cases repeated 8 * size + 3 times, so every case is
+ * converted in each SSE lane and in the scalar tail, next to every other case,
+ * and checks each output against the expected value of its case.
+ */
+template<typename S, typename D, typename Kernel>
+void expectConversions(const Kernel& kernel, const std::vector<S>& cases, const std::vector<D>& expected)
+{
+  ASSERT_EQ(cases.size(), expected.size());
+  const size_t n = 8 * cases.size() + 3;
+  std::vector<S> src(n);
+  for (size_t i = 0; i < n; ++i)
+    src[i] = cases[i % cases.size()];
+  std::vector<D> dst(n);
+  kernel(&src[0], &dst[0], n);
+  for (size_t i = 0; i < n; ++i)
+    EXPECT_EQ(expected[i % cases.size()], dst[i]) << "case " << i % cases.size() << " at " << i;
+}
+
+struct Case
+{
+  float depth;
+  int expected;
+};
+
+TEST(MetersToMillimeters, roundsAndMasksEdgeValues)
+{
+  const Case table[] = {
+    { NaN, 0 }, { INF, 0 }, { -INF, 0 },
+    { 0.0f, 0 }, { -0.0f, 0 }, { -0.001f, 0 }, { -40.0f, 0 },
+    // Rounding to the nearest millimetre, below half a millimetre is invalid
+    { 0.0004f, 0 }, { 0.0006f, 1 }, { 0.001f, 1 }, { 1.2344f, 1234 }, { 1.2346f, 1235 },
+    // Values from 32768 mm on only fit uint16 through the biased signed pack
+    { 32.767f, 32767 }, { 32.768f, 32768 }, { 40.0f, 40000 },
+    // The largest depth is 65535 mm, anything from 65535.5 mm on is out of range
+    { 65.535f, 65535 }, { 65.5354f, 65535 }, { 65.5356f, 0 }, { 70.0f, 0 }, { 1e30f, 0 },
+  };
+  std::vector<float> cases;
+  std::vector<uint16_t> expected;
+  for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+    cases.push_back(table[i].depth);
+    expected.push_back(table[i].expected);
+  }
+  expectConversions(MetersToMillimeters(), cases, expected);
+}
+
+TEST(MillimetersToMeters, invalidatesZero)
+{
+  float meters = 0.0f;
+  const uint16_t zero = 0;
+  MillimetersToMeters()(&zero, &meters, 1);
+  EXPECT_TRUE(std::isnan(meters));
+
+  std::vector<uint16_t> cases;
+  const uint16_t values[] = { 1, 1234, 32767, 32768, 65535 };
+  cases.assign(values, values + 5);
+  std::vector<float> expected;
+  for (size_t i = 0; i < cases.size(); ++i)
+    expected.push_back(cases[i] * 0.001f);
+  expectConversions(MillimetersToMeters(), cases, expected);
+}
+
+// Baseline 0.1 m times focal length 500 px, in 1/16 px fixed point
+const float CONSTANT = 50.0f;
+const float INV_DELTA_D = 16.0f;
+
+TEST(DepthToDisparity, convertsFloatDepths)
+{
+  const float depths[] = { NaN, INF, -INF, 0.0f, -0.0f, -2.0f, 1e-30f, 0.5f, 2.0f, 3.0f, 1e30f };
+  std::vector<float> cases(depths, depths + sizeof(depths) / sizeof(depths[0]));
+  std::vector<float> expected;
+  for (size_t i = 0; i < cases.size(); ++i) {
+    const float z = cases[i];
+    // Invalid and infinite depths, and only those, give disparity 0
+    expected.push_back((z > 0.0f && z < INF) ? CONSTANT / z : 0.0f);
+  }
+  EXPECT_EQ(CONSTANT / 2.0f, expected[8]);
+  expectConversions(DepthToDisparity<float, float>(CONSTANT, INV_DELTA_D), cases, expected);
+}
+
+TEST(DepthToDisparity, convertsMillimetreDepths)
+{
+  const uint16_t depths[] = { 0, 1, 2, 3, 1000, 32768, 65535 };
+  std::vector<uint16_t> cases(depths, depths + sizeof(depths) / sizeof(depths[0]));
+  std::vector<float> expected;
+  for (size_t i = 0; i < cases.size(); ++i)
+    expected.push_back(cases[i] ? CONSTANT / cases[i] : 0.0f);
+  expectConversions(DepthToDisparity<uint16_t, float>(CONSTANT, INV_DELTA_D), cases, expected);
+}
+
+TEST(DepthToDisparity, roundsAndSaturatesFixedPoint)
+{
+  const Case table[] = {
+    { NaN, 0 }, { INF, 0 }, { -INF, 0 }, { 0.0f, 0 }, { -0.0f, 0 }, { -2.0f, 0 }, { 1e30f, 0 },
+    // 50 / 2 = 25 px is 400 / 16 px, 50 / 3 = 16.67 px rounds up to 267 / 16 px
+    { 2.0f, 400 }, { 3.0f, 267 }, { 40.0f, 20 },
+    // 50 / 0.0244 = 2049.2 px is beyond 32767 / 16 px and saturates
+    { 0.0244f, 32767 }, { 1e-30f, 32767 },
+  };
+  std::vector<float> cases;
+  std::vector<int16_t> expected;
+  for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+    cases.push_back(table[i].depth);
+    expected.push_back(table[i].expected);
+  }
+  expectConversions(DepthToDisparity<float, int16_t>(CONSTANT, INV_DELTA_D), cases, expected);
+}
+
+TEST(DepthToDisparity, saturatesMillimetreDepthsInFixedPoint)
+{
+  // The nearest depth of 1 mm against a constant in millimetres saturates
+  const uint16_t depths[] = { 0, 1, 1000, 65535 };
+  const int16_t values[] = { 0, 32767, 800, 12 };
+  std::vector<uint16_t> cases(depths, depths + 4);
+  std::vector<int16_t> expected(values, values + 4);
+  expectConversions(DepthToDisparity<uint16_t, int16_t>(CONSTANT * 1000, INV_DELTA_D), cases, expected);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,256 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/benchmark.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define IMAGE_PROC_BENCHMARK_TSC
+#endif
+
+namespace image_proc {
+
+namespace {
+
+inline uint64_t readCycles()
+{
+#ifdef IMAGE_PROC_BENCHMARK_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+double median(std::vector<double> values)
+{
+  std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+  return values[values.size() / 2];
+}
+
+// Deterministic texture: blurred noise for the matchers over a smooth gradient
+cv::Mat syntheticTexture(const cv::Size& size)
+{
+  cv::Mat noise(size, CV_8UC1);
+  cv::RNG rng(0x1234);
+  rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur(noise, noise, cv::Size(3, 3), 0.8);
+  cv::Mat texture(size, CV_8UC3);
+  for (int y = 0; y < size.height; ++y) {
+    const uint8_t* n = noise.ptr<uint8_t>(y);
+    cv::Vec3b* out = texture.ptr<cv::Vec3b>(y);
+    for (int x = 0; x < size.width; ++x) {
+      int g = (x * 128) / size.width + (y * 64) / size.height;
+      out[x] = cv::Vec3b(cv::saturate_cast<uint8_t>(n[x] / 2 + g),
+                         cv::saturate_cast<uint8_t>(n[x] / 2 + 64),
+                         cv::saturate_cast<uint8_t>(n[x] / 2 + 192 - g));
+    }
+  }
+  return texture;
+}
+
+// Tilted plane with a bump and about 2% holes, in millimeters
+cv::Mat syntheticDepth(const cv::Size& size)
+{
+  cv::Mat depth(size, CV_16UC1);
+  cv::RNG rng(0x5678);
+  for (int y = 0; y < size.height; ++y) {
+    uint16_t* out = depth.ptr<uint16_t>(y);
+    for (int x = 0; x < size.width; ++x) {
+      double u = (double)x / size.width, v = (double)y / size.height;
+      double z = 1000.0 + 2000.0 * u + 400.0 * std::sin(6.0 * v);
+      out[x] = rng.uniform(0, 50) == 0 ? 0 : (uint16_t)z;
+    }
+  }
+  return depth;
+}
+
+} // namespace
+
+Benchmark::Benchmark(int argc, char** argv)
+  : min_time_(0.5)
+{
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string option = argv[i];
+    if (option == "--filter")
+      filter_ = argv[i + 1];
+    else if (option == "--min-time")
+      min_time_ = std::atof(argv[i + 1]);
+    else if (option == "--threads")
+      cv::setNumThreads(std::atoi(argv[i + 1]));
+    else if (option == "--image")
+      image_ = cv::imread(argv[i + 1], -1);
+    else if (option == "--depth")
+      depth_ = cv::imread(argv[i + 1], -1);
+    else
+      std::fprintf(stderr, "Ignoring unknown option %s\n", argv[i]);
+  }
+  if (!depth_.empty() && depth_.depth() != CV_16U) {
+    std::fprintf(stderr, "Ignoring --depth, which is not a 16-bit image\n");
+    depth_.release();
+  }
+
+  std::printf("%d threads, %s image, %s depth\n", cv::getNumThreads(),
+              image_.empty() ? "synthetic" : "recorded", depth_.empty() ? "synthetic" : "recorded");
+  std::printf("%-36s %10s %7s %10s %10s %8s\n", "case", "size", "iters", "ms", "MP/s", "cyc/px");
+}
+
+std::vector<cv::Size> Benchmark::resolutions()
+{
+  std::vector<cv::Size> sizes;
+  sizes.push_back(cv::Size(640, 480));
+  sizes.push_back(cv::Size(1920, 1080));
+  sizes.push_back(cv::Size(3840, 2160));
+  return sizes;
+}
+
+void Benchmark::run(const std::string& name, const cv::Size& size, const boost::function<void ()>& body)
+{
+  if (!filter_.empty() && name.find(filter_) == std::string::npos)
+    return;
+
+  body(); // warm up caches and scratch buffers
+
+  std::vector<double> seconds, cycles;
+  double total = 0.0;
+  while (total < min_time_ || seconds.size() < 3) {
+    int64_t start = cv::getTickCount();
+    uint64_t start_cycles = readCycles();
+    body();
+    uint64_t end_cycles = readCycles();
+    double elapsed = (cv::getTickCount() - start) / cv::getTickFrequency();
+    seconds.push_back(elapsed);
+    cycles.push_back((double)(end_cycles - start_cycles));
+    total += elapsed;
+  }
+
+  double pixels = (double)size.width * size.height;
+  double frame_time = median(seconds);
+  char resolution[32];
+  std::snprintf(resolution, sizeof(resolution), "%dx%d", size.width, size.height);
+  std::printf("%-36s %10s %7d %10.3f %10.1f", name.c_str(), resolution, (int)seconds.size(),
+              frame_time * 1e3, pixels / frame_time * 1e-6);
+#ifdef IMAGE_PROC_BENCHMARK_TSC
+  std::printf(" %8.2f\n", median(cycles) / pixels);
+#else
+  std::printf(" %8s\n", "-");
+#endif
+  std::fflush(stdout);
+}
+
+cv::Mat Benchmark::image(const cv::Size& size, int type) const
+{
+  cv::Mat source;
+  if (image_.empty())
+    source = syntheticTexture(size);
+  else
+    cv::resize(image_, source, size, 0.0, 0.0, cv::INTER_AREA);
+
+  int channels = CV_MAT_CN(type);
+  if (source.channels() != channels) {
+    int code;
+    if (channels == 1)
+      code = source.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY;
+    else
+      code = source.channels() == 4 ? cv::COLOR_BGRA2BGR : cv::COLOR_GRAY2BGR;
+    cv::cvtColor(source, source, code);
+  }
+  if (source.depth() != CV_MAT_DEPTH(type)) {
+    // Rescale between the 8- and 16-bit ranges
+    double scale = source.depth() == CV_8U ? 257.0 : 1.0 / 257.0;
+    source.convertTo(source, type, scale);
+  }
+  return source;
+}
+
+cv::Mat Benchmark::depth(const cv::Size& size, int type) const
+{
+  cv::Mat millimeters;
+  if (depth_.empty())
+    millimeters = syntheticDepth(size);
+  else
+    cv::resize(depth_, millimeters, size, 0.0, 0.0, cv::INTER_NEAREST); // don't blend across holes
+
+  if (type == CV_16UC1)
+    return millimeters;
+
+  cv::Mat meters;
+  millimeters.convertTo(meters, CV_32FC1, 0.001);
+  // Holes are NaN in float depth
+  meters.setTo(cv::Scalar(std::numeric_limits<float>::quiet_NaN()), millimeters == 0);
+  return meters;
+}
+
+void Benchmark::stereoPair(const cv::Size& size, int max_disparity, cv::Mat& left, cv::Mat& right) const
+{
+  left = image(size, CV_8UC1);
+  right.create(size, CV_8UC1);
+  // right(x) = left(x + d), with d growing down the image
+  for (int y = 0; y < size.height; ++y) {
+    int d = (max_disparity * y) / size.height;
+    const uint8_t* l = left.ptr<uint8_t>(y);
+    uint8_t* r = right.ptr<uint8_t>(y);
+    for (int x = 0; x < size.width; ++x)
+      r[x] = l[std::min(x + d, size.width - 1)];
+  }
+}
+
+sensor_msgs::CameraInfo Benchmark::cameraInfo(const cv::Size& size, double baseline)
+{
+  double f = 0.87 * size.width; // 60 degrees horizontal field of view
+  double cx = 0.5 * (size.width - 1), cy = 0.5 * (size.height - 1);
+
+  sensor_msgs::CameraInfo info;
+  info.header.frame_id = "benchmark";
+  info.width = size.width;
+  info.height = size.height;
+  info.distortion_model = "plumb_bob";
+  info.D.resize(5, 0.0);
+  info.D[0] = -0.2;
+  info.D[1] = 0.05;
+  double K[9] = { f, 0.0, cx,  0.0, f, cy,  0.0, 0.0, 1.0 };
+  double R[9] = { 1.0, 0.0, 0.0,  0.0, 1.0, 0.0,  0.0, 0.0, 1.0 };
+  double P[12] = { f, 0.0, cx, -f * baseline,  0.0, f, cy, 0.0,  0.0, 0.0, 1.0, 0.0 };
+  std::copy(K, K + 9, info.K.begin());
+  std::copy(R, R + 9, info.R.begin());
+  std::copy(P, P + 12, info.P.begin());
+  return info;
+}
+
+} // namespace image_proc
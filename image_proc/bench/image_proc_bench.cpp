@@ -0,0 +1,107 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <image_proc/benchmark.h>
+#include <image_proc/processor.h>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
+#include "edge_aware.h"
+#include "decimate.h"
+
+using namespace image_proc;
+
+namespace {
+
+void benchProcess(Benchmark& bench, const cv::Size& size)
+{
+  sensor_msgs::ImageConstPtr raw =
+    cv_bridge::CvImage(std_msgs::Header(), sensor_msgs::image_encodings::BAYER_RGGB8,
+                       bench.image(size, CV_8UC1)).toImageMsg();
+  image_geometry::PinholeCameraModel model;
+  model.fromCameraInfo(Benchmark::cameraInfo(size));
+
+  Processor processor;
+  ImageSet output;
+  bench.run("process/mono_rect", size,
+            boost::bind(&Processor::process, &processor, raw, boost::cref(model), boost::ref(output),
+                        (int)(Processor::MONO | Processor::RECT)));
+  bench.run("process/all", size,
+            boost::bind(&Processor::process, &processor, raw, boost::cref(model), boost::ref(output),
+                        (int)Processor::ALL));
+  processor.fused_ = true;
+  bench.run("process/all_fused", size,
+            boost::bind(&Processor::process, &processor, raw, boost::cref(model), boost::ref(output),
+                        (int)Processor::ALL));
+}
+
+void benchDebayer(Benchmark& bench, const cv::Size& size)
+{
+  cv::Mat bayer8 = bench.image(size, CV_8UC1), bayer16 = bench.image(size, CV_16UC1);
+  cv::Mat color;
+  bench.run("debayer/edge_aware_8", size,
+            boost::bind(&debayerEdgeAware, boost::cref(bayer8), boost::ref(color), BAYER_RGGB));
+  bench.run("debayer/edge_aware_16", size,
+            boost::bind(&debayerEdgeAware, boost::cref(bayer16), boost::ref(color), BAYER_RGGB));
+  bench.run("debayer/edge_aware_weighted_8", size,
+            boost::bind(&debayerEdgeAwareWeighted, boost::cref(bayer8), boost::ref(color), BAYER_RGGB));
+  bench.run("debayer/edge_aware_weighted_16", size,
+            boost::bind(&debayerEdgeAwareWeighted, boost::cref(bayer16), boost::ref(color), BAYER_RGGB));
+}
+
+void benchDecimate(Benchmark& bench, const cv::Size& size)
+{
+  cv::Mat mono = bench.image(size, CV_8UC1), color = bench.image(size, CV_8UC3);
+  cv::Mat decimated;
+  bench.run("decimate/mono8_2x2", size,
+            boost::bind(&decimate<1>, boost::cref(mono), boost::ref(decimated), 2, 2));
+  bench.run("decimate/bgr8_2x2", size,
+            boost::bind(&decimate<3>, boost::cref(color), boost::ref(decimated), 2, 2));
+  bench.run("decimate/bgr8_4x4", size,
+            boost::bind(&decimate<3>, boost::cref(color), boost::ref(decimated), 4, 4));
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Benchmark bench(argc, argv);
+  std::vector<cv::Size> sizes = Benchmark::resolutions();
+  for (size_t i = 0; i < sizes.size(); ++i)
+  {
+    benchProcess(bench, sizes[i]);
+    benchDebayer(bench, sizes[i]);
+    benchDecimate(bench, sizes[i]);
+  }
+  return 0;
+}
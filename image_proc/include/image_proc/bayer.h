@@ -0,0 +1,66 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_BAYER_H
+#define IMAGE_PROC_BAYER_H
+
+#include <opencv2/core/core.hpp>
+#include <string>
+
+namespace image_proc {
+
+/// Bayer mosaic layouts, named by the colors of the top-left 2x2 quad in
+/// row-major order. The value is x + 2*y of the red pixel in that quad.
+enum BayerPattern
+{
+  BAYER_RGGB = 0,
+  BAYER_GRBG = 1,
+  BAYER_GBRG = 2,
+  BAYER_BGGR = 3
+};
+
+/// Look up the mosaic layout of an 8- or 16-bit Bayer encoding.
+/// Returns false if encoding is not a Bayer encoding.
+bool bayerPattern(const std::string& encoding, BayerPattern& pattern);
+
+/**
+ * Demosaic a CV_8UC1 or CV_16UC1 Bayer image straight to luminance, without
+ * building the intermediate color image. Colors are interpolated bilinearly
+ * and weighted like cv::COLOR_BGR2GRAY. mono gets the same depth as bayer.
+ * Rows run in parallel, through an SSE2 row kernel where available.
+ */
+void debayerMono(const cv::Mat& bayer, cv::Mat& mono, BayerPattern pattern);
+
+} // namespace image_proc
+
+#endif
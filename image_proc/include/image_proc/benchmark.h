@@ -0,0 +1,98 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_BENCHMARK_H
+#define IMAGE_PROC_BENCHMARK_H
+
+#include <opencv2/core/core.hpp>
+#include <boost/function.hpp>
+#include <sensor_msgs/CameraInfo.h>
+#include <string>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Minimal harness for the image_pipeline kernel benchmarks, which run outside
+ * ROS. It lives in libimage_proc_benchmark, which only builds with the tests. Each case is timed over repeated calls until a minimum time has passed
+ * and reported as throughput in megapixels per second and, on x86, TSC cycles
+ * per pixel (the TSC ticks at a fixed rate, so turbo and frequency scaling
+ * skew it against core cycles).
+ *
+ * Command line options:
+ *   --filter <text>    only run cases whose name contains text
+ *   --min-time <s>     time each case for at least this long (default 0.5)
+ *   --threads <n>      cv::setNumThreads(n) before running, to compare the
+ *                      parallel kernels against their serial baseline
+ *   --image <file>     recorded frame to use instead of synthetic texture
+ *   --depth <file>     recorded 16-bit depth image (millimeters) likewise
+ */
+class Benchmark
+{
+public:
+  Benchmark(int argc, char** argv);
+
+  /// The standard resolutions every kernel is run at: VGA, 1080p and 4K
+  static std::vector<cv::Size> resolutions();
+
+  /// Time body, which processes one frame of size pixels, and print a result line
+  void run(const std::string& name, const cv::Size& size, const boost::function<void ()>& body);
+
+  /// The recorded --image (or a synthetic texture) as a size image of type,
+  /// which may be CV_8UC1, CV_16UC1 or CV_8UC3. Single-channel output suits
+  /// as a Bayer mosaic.
+  cv::Mat image(const cv::Size& size, int type) const;
+
+  /// The recorded --depth (or synthetic depth with a few holes) as a size
+  /// image of CV_16UC1 millimeters or CV_32FC1 meters
+  cv::Mat depth(const cv::Size& size, int type) const;
+
+  /// Stereo pair over the same texture, the right image shifted by up to
+  /// max_disparity pixels, so block matching finds a disparity everywhere
+  void stereoPair(const cv::Size& size, int max_disparity, cv::Mat& left, cv::Mat& right) const;
+
+  /// Calibration of a camera of typical, mildly distorted 60 degree optics
+  /// at size resolution. A nonzero baseline (meters) makes it the right
+  /// camera of a rectified stereo pair.
+  static sensor_msgs::CameraInfo cameraInfo(const cv::Size& size, double baseline = 0.0);
+
+private:
+  std::string filter_;
+  double min_time_;
+  cv::Mat image_;
+  cv::Mat depth_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,149 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_INSTRUMENTATION_H
+#define IMAGE_PROC_INSTRUMENTATION_H
+
+#include <ros/node_handle.h>
+#include <ros/publisher.h>
+#include <ros/time.h>
+#include <ros/wall_timer.h>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <string>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Histogram over power-of-two buckets: bucket 0 counts zeros and bucket b
+ * counts values in [2^(b-1), 2^b). Recording is a few relaxed atomic
+ * increments, so any number of threads can record without locking; readers
+ * may see a value counted in one field and not yet in another.
+ */
+class Histogram : boost::noncopyable
+{
+public:
+  static const int BUCKETS = 40;
+
+  Histogram();
+
+  void record(uint64_t value);
+
+  uint64_t count() const { return count_.load(boost::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(boost::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(boost::memory_order_relaxed); }
+  uint64_t bucket(int b) const { return buckets_[b].load(boost::memory_order_relaxed); }
+
+  /// Upper bound of the bucket holding fraction q of the values, 0 if empty
+  uint64_t quantile(double q) const;
+
+private:
+  boost::atomic<uint64_t> buckets_[BUCKETS];
+  boost::atomic<uint64_t> count_;
+  boost::atomic<uint64_t> sum_;
+  boost::atomic<uint64_t> max_;
+};
+
+/**
+ * Cumulative per-frame statistics of one processing stage of a nodelet,
+ * published on /diagnostics by Instrumentation.
+ */
+struct StageStats : boost::noncopyable
+{
+  explicit StageStats(const std::string& name) : name(name), dropped(0) {}
+
+  std::string name;
+  Histogram latency_us; // callback start to end
+  Histogram queue_us;   // header stamp to callback start
+  Histogram bytes;      // size of the output allocated per frame
+  boost::atomic<uint64_t> dropped; // frames the input synchronizer dropped
+
+  /// Count one dropped frame; matches any synchronizer drop callback through boost::bind
+  void drop() { dropped.fetch_add(1, boost::memory_order_relaxed); }
+};
+
+typedef boost::shared_ptr<StageStats> StageStatsPtr;
+
+/**
+ * Times one frame through a stage, from construction to destruction. Does
+ * nothing if stats is NULL, i.e. if instrumentation is disabled.
+ */
+class StageTimer : boost::noncopyable
+{
+public:
+  StageTimer(StageStats* stats, const ros::Time& stamp);
+  ~StageTimer();
+
+  /// Record the size of the frame's output
+  void setBytes(size_t bytes) { if (stats_) stats_->bytes.record(bytes); }
+
+private:
+  StageStats* stats_;
+  ros::WallTime start_;
+};
+
+/**
+ * Process-wide registry of stage statistics. Every nodelet of a manager
+ * registers its stages here, and their histograms are published together as
+ * one diagnostic_msgs/DiagnosticArray at a low rate.
+ */
+class Instrumentation : boost::noncopyable
+{
+public:
+  /**
+   * Statistics for a stage of the nodelet with private node handle
+   * private_nh, or NULL unless its ~instrumentation parameter is set. The
+   * first stage registered starts publishing, every ~instrumentation_period
+   * seconds (default 1.0).
+   */
+  static StageStatsPtr stage(ros::NodeHandle& private_nh, const std::string& name);
+
+private:
+  Instrumentation() {}
+
+  static Instrumentation& instance();
+  void publish(const ros::WallTimerEvent& event);
+
+  boost::mutex mutex_;
+  std::vector<boost::weak_ptr<StageStats> > stages_;
+  ros::Publisher pub_;
+  ros::WallTimer timer_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,99 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_LATEST_DISPATCHER_H
+#define IMAGE_PROC_LATEST_DISPATCHER_H
+
+#include <image_proc/instrumentation.h>
+#include <ros/duration.h>
+#include <ros/node_handle.h>
+#include <ros/time.h>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace image_proc {
+
+/**
+ * Runs synchronized input sets on a thread of its own, always the newest one.
+ * A set submitted while another is still waiting replaces it, and a set older
+ * than max_age by the time it would start is skipped, so under overload the
+ * output rate drops instead of the latency growing. Both kinds of drop are
+ * counted and reported to on_drop, if given, before anything is processed.
+ */
+class LatestDispatcher : boost::noncopyable
+{
+public:
+  typedef boost::function<void ()> Task;
+
+  /// A zero max_age disables the age check
+  explicit LatestDispatcher(const ros::Duration& max_age, const Task& on_drop = Task());
+  ~LatestDispatcher();
+
+  /**
+   * Dispatcher configured from ~latest_only and ~max_age (seconds, 0 for no
+   * limit), or NULL unless ~latest_only is set. Drops count into stats, if any.
+   */
+  static boost::shared_ptr<LatestDispatcher> create(ros::NodeHandle& private_nh, const StageStatsPtr& stats);
+
+  void submit(const ros::Time& stamp, const Task& task);
+
+  /// Sets dropped so far, superseded or stale
+  uint64_t dropped() const { return dropped_.load(boost::memory_order_relaxed); }
+
+private:
+  void run();
+  bool stale(const ros::Time& stamp) const;
+  void drop(const char* reason, const ros::Time& stamp);
+
+  ros::Duration max_age_;
+  Task on_drop_;
+  boost::atomic<uint64_t> dropped_;
+
+  boost::mutex mutex_;
+  boost::condition_variable wake_;
+  Task pending_;
+  ros::Time pending_stamp_;
+  bool stopping_;
+
+  // Started last, so it never sees the members above unconstructed
+  boost::thread thread_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,171 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_ORDERED_EXECUTOR_H
+#define IMAGE_PROC_ORDERED_EXECUTOR_H
+
+#include <image_proc/worker_pool.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <ros/console.h>
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Runs per-frame work concurrently on a bounded pool while keeping outputs in
+ * submission order. Each task gets exclusive use of one State (camera model,
+ * scratch buffers, ...) and returns a closure that publishes its results; the
+ * closures run one at a time, in the order the tasks were submitted. At most
+ * one task per thread is in flight: submit() blocks until a State is free, so
+ * a backlog shows up as dropped messages in the subscriber queue.
+ *
+ * With zero threads, tasks run and publish synchronously inside submit().
+ */
+template <class State>
+class OrderedExecutor : boost::noncopyable
+{
+public:
+  typedef boost::function<void ()> Publish;
+  typedef boost::function<Publish (State&)> Task;
+
+  explicit OrderedExecutor(size_t num_threads)
+    : next_submit_(0), next_publish_(0), publishing_(false)
+  {
+    // Constructed separately rather than copied, so no two share scratch buffers
+    for (size_t i = 0; i < std::max(num_threads, size_t(1)); ++i) {
+      states_.push_back(boost::shared_ptr<State>(new State));
+      free_.push_back(states_.back().get());
+    }
+    if (num_threads > 0)
+      pool_.reset(new WorkerPool(num_threads));
+  }
+
+  ~OrderedExecutor()
+  {
+    // Join the workers first; tasks that have not started are dropped
+    pool_.reset();
+  }
+
+  void submit(const Task& task)
+  {
+    if (!pool_) {
+      publishSafely(run(task, *states_[0]));
+      return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (free_.empty())
+      state_available_.wait(lock);
+    State* state = free_.back();
+    free_.pop_back();
+    unsigned long sequence = next_submit_++;
+    lock.unlock();
+    pool_->submit(boost::bind(&OrderedExecutor::work, this, task, state, sequence));
+  }
+
+private:
+  static Publish run(const Task& task, State& state)
+  {
+    try {
+      return task(state);
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR("[image_proc] Frame processing threw an exception: %s", e.what());
+      return Publish();
+    }
+  }
+
+  // An exception must not leave work() with publishing_ still set, which
+  // would stall every later frame
+  static void publishSafely(const Publish& publish)
+  {
+    if (!publish)
+      return;
+    try {
+      publish();
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR("[image_proc] Publishing a frame threw an exception: %s", e.what());
+    }
+  }
+
+  void work(const Task& task, State* state, unsigned long sequence)
+  {
+    Publish publish = run(task, *state);
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    finished_[sequence] = publish;
+    free_.push_back(state);
+    state_available_.notify_one();
+
+    // Whoever finds the next frame in line publishes it and any that follow
+    if (publishing_)
+      return;
+    publishing_ = true;
+    while (!finished_.empty() && finished_.begin()->first == next_publish_) {
+      publish = finished_.begin()->second;
+      finished_.erase(finished_.begin());
+      ++next_publish_;
+      lock.unlock();
+      publishSafely(publish);
+      lock.lock();
+    }
+    publishing_ = false;
+  }
+
+  std::vector<boost::shared_ptr<State> > states_;
+
+  boost::mutex mutex_;
+  boost::condition_variable state_available_;
+  std::vector<State*> free_;
+  std::map<unsigned long, Publish> finished_;
+  unsigned long next_submit_;
+  unsigned long next_publish_;
+  bool publishing_;
+
+  // Destroyed first, so no worker outlives the state above
+  boost::scoped_ptr<WorkerPool> pool_;
+};
+
+} // namespace image_proc
+
+#endif
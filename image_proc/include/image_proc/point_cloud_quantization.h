@@ -0,0 +1,90 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_POINT_CLOUD_QUANTIZATION_H
+#define IMAGE_PROC_POINT_CLOUD_QUANTIZATION_H
+
+#include <sensor_msgs/PointCloud2.h>
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+
+namespace image_proc {
+
+/**
+ * Compact PointCloud2 layout shared by the point cloud producers: INT16 fields
+ * x_mm, y_mm and z_mm at offsets 0, 2 and 4 holding millimetres, followed by
+ * the remaining fields of the float layout, packed in their original order.
+ * The unit is in the field names, so consumers expecting x, y and z in meters
+ * do not find coordinates rather than misreading them. An xyz + rgb point
+ * takes 10 bytes instead of 16, with a range of +-32.767 m.
+ */
+struct QuantizedPoints
+{
+  /// Meters per coordinate unit
+  static const double SCALE;
+  /// Names of the x, y and z fields
+  static const char* const FIELD_NAMES[3];
+  /// Coordinate value of invalid (NaN or out of range) points, in all three fields
+  static const int16_t INVALID = -32768;
+};
+
+/// Millimetres of a coordinate in meters, or false if NaN or out of range
+inline bool toMillimeters(float meters, int16_t& mm)
+{
+  float value = std::floor(meters / (float)QuantizedPoints::SCALE + 0.5f);
+  if (!(value > QuantizedPoints::INVALID && value <= 32767.0f)) // also catches NaN
+    return false;
+  mm = (int16_t)value;
+  return true;
+}
+
+/// Write the x_mm, y_mm, z_mm fields of point xyz (meters) to out, unaligned
+inline void quantizeXyz(const float xyz[3], uint8_t* out)
+{
+  int16_t mm[3];
+  if (!toMillimeters(xyz[0], mm[0]) || !toMillimeters(xyz[1], mm[1]) || !toMillimeters(xyz[2], mm[2]))
+    mm[0] = mm[1] = mm[2] = QuantizedPoints::INVALID;
+  std::memcpy(out, mm, sizeof(mm));
+}
+
+/**
+ * Convert a cloud with FLOAT32 x, y, z at offsets 0, 4, 8 to the quantized
+ * layout in place, keeping its other fields. Returns false, leaving the cloud
+ * unchanged, if it does not have that layout or has padded rows.
+ */
+bool quantizePoints(sensor_msgs::PointCloud2& cloud);
+
+} // namespace image_proc
+
+#endif
@@ -36,7 +36,10 @@
 
 #include <opencv2/core/core.hpp>
 #include <image_geometry/pinhole_camera_model.h>
+#include <image_proc/bayer.h>
+#include <image_proc/rectification_maps.h>
 #include <sensor_msgs/Image.h>
+#include <vector>
 
 namespace image_proc {
 
@@ -49,16 +52,39 @@ struct ImageSet
   cv::Mat rect_color;
 };
 
+/// Scratch buffers of Processor::rectifyRows, kept by the caller between calls
+struct RowScratch
+{
+  cv::Mat color;
+  cv::Mat mono;
+  cv::Mat map1;
+};
+
+/// Edge of a flag dependency graph: computing output needs its prerequisites
+struct FlagDependency
+{
+  int output;
+  int prerequisites;
+};
+
+/// flags plus every flag the edges of graph pull in, transitively
+int resolveDependencies(int flags, const FlagDependency* graph, size_t num_edges);
+
 class Processor
 {
 public:
   Processor()
-    : interpolation_(cv::INTER_LINEAR)
+    : interpolation_(cv::INTER_LINEAR), fused_(false)
   {
   }
   
   int interpolation_;
 
+  /// Demosaic and rectify Bayer input in one pass over cache-sized tiles
+  /// instead of several full-frame passes. Only the requested outputs are
+  /// written; in particular color is left empty unless COLOR is requested.
+  bool fused_;
+
   enum {
     MONO       = 1 << 0,
     RECT       = 1 << 1,
@@ -67,9 +93,49 @@ public:
     ALL = MONO | RECT | COLOR | RECT_COLOR
   };
   
+  /// Outputs process() computes for flags: the requested ones plus every
+  /// intermediate they depend on
+  static int dependencies(int flags);
+
   bool process(const sensor_msgs::ImageConstPtr& raw_image,
                const image_geometry::PinholeCameraModel& model,
                ImageSet& output, int flags = ALL) const;
+
+  /// Size of the rectified images of model's camera
+  cv::Size rectifiedSize(const image_geometry::PinholeCameraModel& model) const;
+
+  /**
+   * Rectify only rows [rows.start, rows.end) of the mono image, demosaicing or
+   * converting just the raw rows they sample, so consumers can stream the
+   * rectified image in bands without any full-frame intermediate. rect is
+   * written in place if it already has rows.size() rows of the rectified width.
+   */
+  bool rectifyRows(const sensor_msgs::Image& raw_image,
+                   const image_geometry::PinholeCameraModel& model,
+                   const cv::Range& rows, cv::Mat& rect, RowScratch& scratch) const;
+
+  /**
+   * Demosaic 8-bit Bayer raw_image and rectify it through maps in one tiled
+   * pass, as process() does with fused_ set, but with any maps from
+   * RectificationMapCache, e.g. a decimated region. Outputs that already have
+   * the right size and type are written in place.
+   */
+  bool processFused(const sensor_msgs::Image& raw_image, const RectificationMaps& maps,
+                    ImageSet& output, int flags) const;
+
+private:
+  bool processFusedBayer(const cv::Mat& raw, int bayer_code, BayerPattern pattern,
+                         const RectificationMaps& maps, ImageSet& output, int flags) const;
+
+  const RectificationMaps& rectificationMaps(const image_geometry::PinholeCameraModel& model) const;
+
+  // Maps from the shared RectificationMapCache. stereo_image_proc runs both
+  // cameras through one Processor, so hold an entry per camera.
+  mutable std::vector<RectificationMapsConstPtr> maps_;
+
+  // Demosaiced raw rows of fused processing, when not an output themselves
+  mutable cv::Mat color_frame_;
+  mutable cv::Mat mono_frame_;
 };
 
 } //namespace image_proc
@@ -0,0 +1,138 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_RECTIFICATION_MAPS_H
+#define IMAGE_PROC_RECTIFICATION_MAPS_H
+
+#include <opencv2/core/core.hpp>
+#include <image_geometry/pinhole_camera_model.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Fixed-point rectification maps for one camera, in the layout cv::remap
+ * consumes directly: CV_16SC2 integer source coordinates plus a CV_16UC1
+ * index into OpenCV's interpolation table. Binning and ROI are already
+ * applied, so the maps cover exactly the (reduced) raw image.
+ *
+ * The maps can also produce just a region of the rectified image, decimated,
+ * in which case they sample the raw image once per output pixel, at the
+ * top-left rectified pixel of the block it stands for. That is the image
+ * crop_decimate's nearest neighbor decimation makes of the full rectified
+ * image, for a fraction of the work.
+ */
+struct RectificationMaps
+{
+  /// Number of rectified rows covered by each entry of band_sources
+  static const int BAND_ROWS = 16;
+
+  cv::Mat map1;
+  cv::Mat map2;
+
+  /// Calibration the maps were built from
+  sensor_msgs::CameraInfo info;
+
+  /// Output region and decimation the maps were built for
+  cv::Rect output_roi;
+  int decimation_x, decimation_y;
+
+  /// Calibration of the rectified output itself: K and P scaled and shifted
+  /// to its pixel grid, no distortion, no binning or ROI
+  sensor_msgs::CameraInfo rect_info;
+
+  /// Raw rows [start, end) sampled by each band of BAND_ROWS rectified rows,
+  /// including the widest (Lanczos) interpolation window
+  std::vector<cv::Range> band_sources;
+
+  /**
+   * Maps producing output_roi of the rectified image, relative to the region
+   * the raw image covers and clipped to it, decimated by decimation_x and
+   * decimation_y. An empty output_roi is the whole region, and a zero width or
+   * height extends to its edge.
+   */
+  RectificationMaps(const image_geometry::PinholeCameraModel& model,
+                    const cv::Rect& output_roi = cv::Rect(), int decimation_x = 1, int decimation_y = 1);
+
+  /**
+   * Calibration of the rectified output the constructor's arguments describe,
+   * which is rect_info of those maps. Needs no maps, for passing through
+   * images that are rectified already.
+   */
+  static sensor_msgs::CameraInfo rectifiedInfo(const image_geometry::PinholeCameraModel& model,
+                                               const cv::Rect& output_roi = cv::Rect(),
+                                               int decimation_x = 1, int decimation_y = 1);
+
+  /// True if these are the maps the constructor would build for these arguments
+  bool matches(const sensor_msgs::CameraInfo& info,
+               const cv::Rect& output_roi = cv::Rect(), int decimation_x = 1, int decimation_y = 1) const;
+
+  /// Rectify a whole image, equivalent to PinholeCameraModel::rectifyImage
+  void rectify(const cv::Mat& raw, cv::Mat& rectified, int interpolation) const;
+};
+
+typedef boost::shared_ptr<const RectificationMaps> RectificationMapsConstPtr;
+
+/// True if the two CameraInfos produce the same rectification maps
+bool sameRectification(const sensor_msgs::CameraInfo& a, const sensor_msgs::CameraInfo& b);
+
+/**
+ * Process-wide cache of rectification maps keyed by CameraInfo contents.
+ * Everything rectifying the same camera in one nodelet manager (image_proc's
+ * rectify_mono and rectify_color, stereo_image_proc's processor, ...) shares
+ * a single set of maps. Entries are only held weakly; maps are freed once the
+ * last user drops them.
+ */
+class RectificationMapCache
+{
+public:
+  static RectificationMapCache& instance();
+
+  /// Return the maps for model's calibration and the given output, building them on first use
+  RectificationMapsConstPtr get(const image_geometry::PinholeCameraModel& model,
+                                const cv::Rect& output_roi = cv::Rect(), int decimation_x = 1, int decimation_y = 1);
+
+private:
+  RectificationMapCache() {}
+
+  boost::mutex mutex_;
+  std::vector<boost::weak_ptr<const RectificationMaps> > entries_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,271 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_SHM_RING_H
+#define IMAGE_PROC_SHM_RING_H
+
+#include <image_proc/ShmDescriptor.h>
+#include <ros/node_handle.h>
+#include <ros/publisher.h>
+#include <ros/subscriber.h>
+#include <ros/serialization.h>
+#include <ros/console.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * POSIX shared-memory ring of equal slots, written round-robin by the one
+ * process that created it and read by any number of others. Each slot has a
+ * sequence number that is odd while the slot is being written, so a reader
+ * can tell whether the slot it copied from was overwritten meanwhile. Rings
+ * are only accessible to processes of the user that created them.
+ * Constructors throw std::runtime_error if the shared memory can't be set up.
+ */
+class ShmRing : boost::noncopyable
+{
+public:
+  /// Create a ring for writing; the shared-memory object is removed on destruction
+  ShmRing(const std::string& name, uint32_t slots, uint32_t slot_size);
+  /// Open a ring created by another process for reading
+  explicit ShmRing(const std::string& name);
+  ~ShmRing();
+
+  /// Name for a new ring, unique to this process. The first call also removes
+  /// the rings of processes that died without removing them.
+  static std::string uniqueName();
+
+  const std::string& name() const { return name_; }
+  uint32_t slots() const;
+  uint32_t slotSize() const;
+
+  /// Claim the next slot for a message of size bytes, filling in desc
+  uint8_t* beginWrite(uint32_t size, ShmDescriptor& desc);
+  /// Publish the slot claimed for desc
+  void endWrite(const ShmDescriptor& desc);
+
+  /// Buffer of desc's slot, or NULL if it no longer holds desc's message
+  const uint8_t* beginRead(const ShmDescriptor& desc) const;
+  /// True if desc's slot was not overwritten since beginRead
+  bool endRead(const ShmDescriptor& desc) const;
+
+private:
+  struct Header;
+  struct Slot;
+
+  void map(int fd, size_t size, bool writable);
+  Slot* slot(uint32_t index) const;
+
+  std::string name_;
+  bool owner_;
+  uint8_t* base_;
+  size_t size_;
+  uint32_t next_slot_;
+};
+
+/**
+ * Serializes messages into a ShmRing of its own, replacing the ring with a
+ * larger one when a message does not fit. Readers keep any ring they have
+ * mapped, and open the new one from the next descriptor. Thread-safe.
+ */
+template <class M>
+class ShmWriter : boost::noncopyable
+{
+public:
+  explicit ShmWriter(uint32_t slots = 4) : slots_(slots) {}
+
+  /// Write msg and fill in its descriptor; false (and logged) on failure
+  bool write(const M& msg, ShmDescriptor& desc)
+  {
+    namespace ser = ros::serialization;
+    const uint32_t size = ser::serializationLength(msg);
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    try {
+      if (!ring_ || ring_->slotSize() < size) {
+        // Headroom, so a slightly larger message does not replace the ring again
+        ring_.reset();
+        ring_.reset(new ShmRing(ShmRing::uniqueName(), slots_, size + size / 4));
+      }
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR_THROTTLE(10, "[image_proc] Could not create shared-memory ring: %s", e.what());
+      return false;
+    }
+    ser::OStream stream(ring_->beginWrite(size, desc), size);
+    ser::serialize(stream, msg);
+    ring_->endWrite(desc);
+    return true;
+  }
+
+private:
+  boost::mutex mutex_;
+  boost::scoped_ptr<ShmRing> ring_;
+  uint32_t slots_;
+};
+
+/**
+ * Reads the messages ShmWriter descriptors point at, mapping each ring the
+ * first time a descriptor names it. The serialized message is copied out of
+ * the ring before it is deserialized, so a slot overwritten mid-read is
+ * caught before any of it is trusted. Thread-safe.
+ */
+template <class M>
+class ShmReader : boost::noncopyable
+{
+public:
+  /// Message desc points at, or NULL if it was already overwritten or can't be read
+  boost::shared_ptr<M> read(const ShmDescriptor& desc)
+  {
+    namespace ser = ros::serialization;
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    try {
+      if (!ring_ || ring_->name() != desc.segment) {
+        ring_.reset();
+        ring_.reset(new ShmRing(desc.segment));
+      }
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR_THROTTLE(10, "[image_proc] Could not open shared-memory ring: %s", e.what());
+      return boost::shared_ptr<M>();
+    }
+
+    const uint8_t* data = ring_->beginRead(desc);
+    if (!data) {
+      ROS_DEBUG("[image_proc] Shared-memory message overwritten before reading");
+      return boost::shared_ptr<M>();
+    }
+    buffer_.resize(desc.size);
+    if (desc.size > 0)
+      std::memcpy(&buffer_[0], data, desc.size);
+    if (!ring_->endRead(desc)) {
+      ROS_DEBUG("[image_proc] Shared-memory message overwritten while reading");
+      return boost::shared_ptr<M>();
+    }
+
+    boost::shared_ptr<M> msg = boost::make_shared<M>();
+    try {
+      ser::IStream stream(buffer_.empty() ? NULL : &buffer_[0], desc.size);
+      ser::deserialize(stream, *msg);
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR_THROTTLE(10, "[image_proc] Could not deserialize shared-memory message: %s", e.what());
+      return boost::shared_ptr<M>();
+    }
+    return msg;
+  }
+
+private:
+  boost::mutex mutex_;
+  boost::scoped_ptr<ShmRing> ring_;
+  std::vector<uint8_t> buffer_;
+};
+
+/**
+ * Publishes messages of type M through shared memory, alongside a regular
+ * publisher of the same topic: descriptors go out on <topic>/shm, and
+ * nothing is written while that has no subscribers.
+ */
+template <class M>
+class ShmPublisher
+{
+public:
+  void advertise(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                 const ros::SubscriberStatusCallback& connect_cb = ros::SubscriberStatusCallback())
+  {
+    writer_.reset(new ShmWriter<M>);
+    pub_ = nh.advertise<ShmDescriptor>(topic + "/shm", queue_size, connect_cb, connect_cb);
+  }
+
+  uint32_t getNumSubscribers() const { return pub_ ? pub_.getNumSubscribers() : 0; }
+
+  void publish(const M& msg) const
+  {
+    if (getNumSubscribers() == 0)
+      return;
+    ShmDescriptorPtr desc = boost::make_shared<ShmDescriptor>();
+    desc->header = msg.header;
+    if (writer_->write(msg, *desc))
+      pub_.publish(desc);
+  }
+
+private:
+  ros::Publisher pub_;
+  boost::shared_ptr<ShmWriter<M> > writer_;
+};
+
+/// Receives what a ShmPublisher publishes, from another process
+template <class M>
+class ShmSubscriber
+{
+public:
+  typedef boost::function<void (const boost::shared_ptr<const M>&)> Callback;
+
+  void subscribe(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size, const Callback& callback)
+  {
+    reader_.reset(new ShmReader<M>);
+    sub_ = nh.subscribe<ShmDescriptor>(topic + "/shm", queue_size,
+                                       boost::bind(&ShmSubscriber::descriptorCb, reader_, callback, _1));
+  }
+
+  void shutdown() { sub_.shutdown(); }
+
+private:
+  static void descriptorCb(const boost::shared_ptr<ShmReader<M> >& reader, const Callback& callback,
+                           const ShmDescriptorConstPtr& desc)
+  {
+    boost::shared_ptr<const M> msg = reader->read(*desc);
+    if (msg)
+      callback(msg);
+  }
+
+  ros::Subscriber sub_;
+  boost::shared_ptr<ShmReader<M> > reader_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,98 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_PROC_WORKER_POOL_H
+#define IMAGE_PROC_WORKER_POOL_H
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <deque>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Fixed set of worker threads running submitted tasks. Every worker has its
+ * own queue: tasks submitted from a worker go to that worker's queue, others
+ * are spread round-robin, and every queue runs oldest first. A worker whose
+ * queue is empty steals the oldest task from another. Submitting and taking tasks only lock the queues they
+ * touch; the pool-wide lock is only taken to put idle workers to sleep and
+ * wake them. Tasks still queued on destruction are discarded.
+ */
+class WorkerPool : boost::noncopyable
+{
+public:
+  typedef boost::function<void ()> Task;
+
+  /// Start num_threads workers, or one per core if num_threads is 0
+  explicit WorkerPool(size_t num_threads = 0);
+  ~WorkerPool();
+
+  void submit(const Task& task);
+
+  size_t size() const { return workers_.size(); }
+
+private:
+  struct Worker
+  {
+    boost::mutex mutex;
+    std::deque<Task> tasks;
+    boost::thread::id id;
+  };
+
+  void run(size_t index);
+  bool take(size_t index, Task& task);
+
+  std::vector<boost::shared_ptr<Worker> > workers_;
+  boost::thread_group threads_;
+
+  // Tasks pushed and not popped yet, and workers asleep waiting for one. A
+  // worker counts itself asleep before checking queued_, and submit counts
+  // the task before checking sleeping_, so one of them always sees the other.
+  boost::atomic<size_t> queued_;
+  boost::atomic<size_t> sleeping_;
+  boost::atomic<size_t> next_worker_;
+  boost::atomic<bool> stopping_;
+  // Only for sleeping and waking workers
+  boost::mutex mutex_;
+  boost::condition_variable wake_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,249 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/bayer.h"
+#include <sensor_msgs/image_encodings.h>
+#include <boost/cstdint.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace image_proc {
+
+namespace enc = sensor_msgs::image_encodings;
+
+bool bayerPattern(const std::string& encoding, BayerPattern& pattern)
+{
+  if (encoding == enc::BAYER_RGGB8 || encoding == enc::BAYER_RGGB16)
+    pattern = BAYER_RGGB;
+  else if (encoding == enc::BAYER_GRBG8 || encoding == enc::BAYER_GRBG16)
+    pattern = BAYER_GRBG;
+  else if (encoding == enc::BAYER_GBRG8 || encoding == enc::BAYER_GBRG16)
+    pattern = BAYER_GBRG;
+  else if (encoding == enc::BAYER_BGGR8 || encoding == enc::BAYER_BGGR16)
+    pattern = BAYER_BGGR;
+  else
+    return false;
+  return true;
+}
+
+namespace {
+
+// Luminance weights of cv::COLOR_BGR2GRAY in Q14
+const uint32_t W_R = 4899, W_G = 9617, W_B = 1868;
+
+// Every site computes
+//   Y = (c*center + h*(left + right) + v*(up + down) + d*(diagonals)) >> 16
+// which folds the bilinear averages and the luminance weights together. The
+// sums stay below 2^32 even for 16-bit input.
+struct SiteWeights
+{
+  uint32_t c, h, v, d;
+};
+
+const SiteWeights RED_SITE    = { 4 * W_R, W_G, W_G, W_B };
+const SiteWeights BLUE_SITE   = { 4 * W_B, W_G, W_G, W_R };
+const SiteWeights GREEN_R_ROW = { 4 * W_G, 2 * W_R, 2 * W_B, 0 };
+const SiteWeights GREEN_B_ROW = { 4 * W_G, 2 * W_B, 2 * W_R, 0 };
+
+inline uint32_t luminance(const SiteWeights& w, uint32_t c, uint32_t h, uint32_t v, uint32_t d)
+{
+  return (w.c * c + w.h * h + w.v * v + w.d * d + (1u << 15)) >> 16;
+}
+
+#if defined(__SSE2__)
+// Eight uint8 widened to int16
+inline __m128i widen(const uint8_t* src)
+{
+  return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), _mm_setzero_si128());
+}
+
+// Interior columns of a row from x = 1, eight at a time; returns the first
+// column left for the scalar loop. Lane i holds column x + i with x odd, so
+// even lanes take the odd-column weights w[1] and odd lanes take w[0].
+//
+// 8 bit: the neighbor sums fit int16, and halving the center weight (all are
+// even) brings every weight below 2^15, so _mm_madd_epi16 forms the sums of
+// products exactly.
+int debayerMonoRowSse2(const uint8_t* up, const uint8_t* cur, const uint8_t* down, uint8_t* out,
+                       int width, const SiteWeights* w)
+{
+  const __m128i wch = _mm_set_epi16(w[0].h, w[0].c / 2, w[1].h, w[1].c / 2,
+                                    w[0].h, w[0].c / 2, w[1].h, w[1].c / 2);
+  const __m128i wvd = _mm_set_epi16(w[0].d, w[0].v, w[1].d, w[1].v,
+                                    w[0].d, w[0].v, w[1].d, w[1].v);
+  const __m128i round = _mm_set1_epi32(1 << 15);
+  int x = 1;
+  for (; x + 8 < width; x += 8) {
+    const __m128i c = widen(cur + x);
+    const __m128i h = _mm_add_epi16(widen(cur + x - 1), widen(cur + x + 1));
+    const __m128i v = _mm_add_epi16(widen(up + x), widen(down + x));
+    const __m128i d = _mm_add_epi16(_mm_add_epi16(widen(up + x - 1), widen(up + x + 1)),
+                                    _mm_add_epi16(widen(down + x - 1), widen(down + x + 1)));
+    const __m128i c2 = _mm_add_epi16(c, c);
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c2, h), wch),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(v, d), wvd));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c2, h), wch),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(v, d), wvd));
+    lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 16);
+    hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 16);
+    const __m128i y = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(y, y));
+  }
+  return x;
+}
+
+// 16 bit: the neighbor sums don't fit int16, so the high and low bytes of
+// the pixels each go through the 8-bit arithmetic above, and the two sums
+// join as high * 256 + low in uint32 like luminance().
+inline __m128i byteOf(const uint16_t* src, bool high)
+{
+  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+  return high ? _mm_srli_epi16(v, 8) : _mm_and_si128(v, _mm_set1_epi16(0xff));
+}
+
+int debayerMonoRowSse2(const uint16_t* up, const uint16_t* cur, const uint16_t* down, uint16_t* out,
+                       int width, const SiteWeights* w)
+{
+  const __m128i wch = _mm_set_epi16(w[0].h, w[0].c / 2, w[1].h, w[1].c / 2,
+                                    w[0].h, w[0].c / 2, w[1].h, w[1].c / 2);
+  const __m128i wvd = _mm_set_epi16(w[0].d, w[0].v, w[1].d, w[1].v,
+                                    w[0].d, w[0].v, w[1].d, w[1].v);
+  const __m128i round = _mm_set1_epi32(1 << 15);
+  const __m128i bias = _mm_set1_epi32(32768), bias16 = _mm_set1_epi16(-32768);
+  int x = 1;
+  for (; x + 8 < width; x += 8) {
+    // Pixels 0-3 in lo, 4-7 in hi
+    __m128i lo = round, hi = round;
+    for (int high = 1; high >= 0; --high) {
+      const __m128i c = byteOf(cur + x, high);
+      const __m128i c2 = _mm_add_epi16(c, c);
+      const __m128i h = _mm_add_epi16(byteOf(cur + x - 1, high), byteOf(cur + x + 1, high));
+      const __m128i v = _mm_add_epi16(byteOf(up + x, high), byteOf(down + x, high));
+      const __m128i d = _mm_add_epi16(_mm_add_epi16(byteOf(up + x - 1, high), byteOf(up + x + 1, high)),
+                                      _mm_add_epi16(byteOf(down + x - 1, high), byteOf(down + x + 1, high)));
+      const __m128i sum_lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c2, h), wch),
+                                           _mm_madd_epi16(_mm_unpacklo_epi16(v, d), wvd));
+      const __m128i sum_hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c2, h), wch),
+                                           _mm_madd_epi16(_mm_unpackhi_epi16(v, d), wvd));
+      lo = _mm_add_epi32(lo, high ? _mm_slli_epi32(sum_lo, 8) : sum_lo);
+      hi = _mm_add_epi32(hi, high ? _mm_slli_epi32(sum_hi, 8) : sum_hi);
+    }
+    // Shifted into int16 range for the signed pack, and back after it
+    lo = _mm_sub_epi32(_mm_srli_epi32(lo, 16), bias);
+    hi = _mm_sub_epi32(_mm_srli_epi32(hi, 16), bias);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_xor_si128(_mm_packs_epi32(lo, hi), bias16));
+  }
+  return x;
+}
+#endif
+
+// w[0] applies to even columns, w[1] to odd columns. Missing neighbors past
+// the left and right edges are reflected, which keeps their color.
+template <typename T>
+void debayerMonoRow(const T* up, const T* cur, const T* down, T* out, int width,
+                    const SiteWeights* w)
+{
+  out[0] = luminance(w[0], cur[0], 2 * cur[1], up[0] + down[0], 2 * (up[1] + down[1]));
+
+  // Two columns per iteration so the weights stay loop-invariant
+  int x = 1;
+#if defined(__SSE2__)
+  x = debayerMonoRowSse2(up, cur, down, out, width, w);
+#endif
+  for (; x + 1 < width - 1; x += 2) {
+    out[x] = luminance(w[1], cur[x], cur[x-1] + cur[x+1], up[x] + down[x],
+                       up[x-1] + up[x+1] + down[x-1] + down[x+1]);
+    out[x+1] = luminance(w[0], cur[x+1], cur[x] + cur[x+2], up[x+1] + down[x+1],
+                         up[x] + up[x+2] + down[x] + down[x+2]);
+  }
+  if (x < width - 1) {
+    out[x] = luminance(w[x & 1], cur[x], cur[x-1] + cur[x+1], up[x] + down[x],
+                       up[x-1] + up[x+1] + down[x-1] + down[x+1]);
+  }
+
+  const int l = width - 1;
+  out[l] = luminance(w[l & 1], cur[l], 2 * cur[l-1], up[l] + down[l], 2 * (up[l-1] + down[l-1]));
+}
+
+template <typename T>
+class DebayerMonoBody : public cv::ParallelLoopBody
+{
+public:
+  DebayerMonoBody(const cv::Mat& bayer, cv::Mat& mono, BayerPattern pattern)
+    : bayer_(bayer), mono_(mono), red_x_(pattern & 1), red_y_(pattern >> 1)
+  {
+    red_row_[red_x_] = RED_SITE;
+    red_row_[1 - red_x_] = GREEN_R_ROW;
+    blue_row_[1 - red_x_] = BLUE_SITE;
+    blue_row_[red_x_] = GREEN_B_ROW;
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    const int last = bayer_.rows - 1;
+    for (int y = rows.start; y < rows.end; ++y) {
+      const T* up   = bayer_.ptr<T>(y > 0 ? y - 1 : 1);
+      const T* cur  = bayer_.ptr<T>(y);
+      const T* down = bayer_.ptr<T>(y < last ? y + 1 : last - 1);
+      const SiteWeights* w = ((y & 1) == red_y_) ? red_row_ : blue_row_;
+      debayerMonoRow(up, cur, down, mono_.ptr<T>(y), bayer_.cols, w);
+    }
+  }
+
+private:
+  const cv::Mat& bayer_;
+  cv::Mat& mono_;
+  int red_x_, red_y_;
+  SiteWeights red_row_[2], blue_row_[2];
+};
+
+} // namespace
+
+void debayerMono(const cv::Mat& bayer, cv::Mat& mono, BayerPattern pattern)
+{
+  CV_Assert(bayer.type() == CV_8UC1 || bayer.type() == CV_16UC1);
+  mono.create(bayer.size(), bayer.type());
+  if (bayer.rows < 2 || bayer.cols < 2) {
+    // Not even one full quad to interpolate from
+    bayer.copyTo(mono);
+    return;
+  }
+
+  if (bayer.depth() == CV_8U)
+    cv::parallel_for_(cv::Range(0, bayer.rows), DebayerMonoBody<uint8_t>(bayer, mono, pattern));
+  else
+    cv::parallel_for_(cv::Range(0, bayer.rows), DebayerMonoBody<uint16_t>(bayer, mono, pattern));
+}
+
+} // namespace image_proc
@@ -0,0 +1,197 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/instrumentation.h"
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <algorithm>
+#include <sstream>
+
+namespace image_proc {
+
+Histogram::Histogram()
+  : count_(0), sum_(0), max_(0)
+{
+  for (int b = 0; b < BUCKETS; ++b)
+    buckets_[b].store(0, boost::memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t value)
+{
+  int b = 0;
+  for (uint64_t v = value; v != 0 && b < BUCKETS - 1; v >>= 1)
+    ++b;
+  buckets_[b].fetch_add(1, boost::memory_order_relaxed);
+  count_.fetch_add(1, boost::memory_order_relaxed);
+  sum_.fetch_add(value, boost::memory_order_relaxed);
+  uint64_t old_max = max_.load(boost::memory_order_relaxed);
+  while (value > old_max && !max_.compare_exchange_weak(old_max, value, boost::memory_order_relaxed))
+    ;
+}
+
+uint64_t Histogram::quantile(double q) const
+{
+  uint64_t total = count();
+  if (total == 0)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * total + 0.5)), seen = 0;
+  for (int b = 0; b < BUCKETS; ++b) {
+    seen += bucket(b);
+    if (seen >= rank)
+      return b == 0 ? 0 : (uint64_t(1) << b) - 1;
+  }
+  return max();
+}
+
+StageTimer::StageTimer(StageStats* stats, const ros::Time& stamp)
+  : stats_(stats)
+{
+  if (!stats_)
+    return;
+  start_ = ros::WallTime::now();
+  // Stamps ahead of the clock (e.g. from another host) count as no wait
+  ros::Time now = ros::Time::now();
+  if (!stamp.isZero() && now > stamp)
+    stats_->queue_us.record((now - stamp).toNSec() / 1000);
+  else
+    stats_->queue_us.record(0);
+}
+
+StageTimer::~StageTimer()
+{
+  if (stats_)
+    stats_->latency_us.record((ros::WallTime::now() - start_).toNSec() / 1000);
+}
+
+Instrumentation& Instrumentation::instance()
+{
+  static Instrumentation instrumentation;
+  return instrumentation;
+}
+
+StageStatsPtr Instrumentation::stage(ros::NodeHandle& private_nh, const std::string& name)
+{
+  bool enabled;
+  private_nh.param("instrumentation", enabled, false);
+  if (!enabled)
+    return StageStatsPtr();
+
+  StageStatsPtr stats(new StageStats(private_nh.getNamespace() + ": " + name));
+  Instrumentation& self = instance();
+  boost::lock_guard<boost::mutex> lock(self.mutex_);
+  self.stages_.push_back(stats);
+  if (!self.timer_.isValid()) {
+    double period;
+    private_nh.param("instrumentation_period", period, 1.0);
+    ros::NodeHandle nh;
+    self.pub_ = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+    self.timer_ = nh.createWallTimer(ros::WallDuration(period),
+                                     boost::bind(&Instrumentation::publish, &self, _1));
+  }
+  return stats;
+}
+
+namespace {
+
+template <typename T>
+void addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const T& value)
+{
+  std::ostringstream out;
+  out << value;
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = out.str();
+  status.values.push_back(kv);
+}
+
+void addHistogram(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const Histogram& histogram)
+{
+  uint64_t count = histogram.count();
+  addValue(status, key + " mean", count ? histogram.sum() / count : 0);
+  addValue(status, key + " p50", histogram.quantile(0.5));
+  addValue(status, key + " p90", histogram.quantile(0.9));
+  addValue(status, key + " p99", histogram.quantile(0.99));
+  addValue(status, key + " max", histogram.max());
+
+  // Bucket counts up to the last nonempty one; bucket b holds values below 2^b
+  int last = Histogram::BUCKETS - 1;
+  while (last > 0 && histogram.bucket(last) == 0)
+    --last;
+  std::ostringstream buckets;
+  for (int b = 0; b <= last; ++b)
+    buckets << (b ? " " : "") << histogram.bucket(b);
+  addValue(status, key + " histogram", buckets.str());
+}
+
+} // namespace
+
+void Instrumentation::publish(const ros::WallTimerEvent&)
+{
+  diagnostic_msgs::DiagnosticArray array;
+  array.header.stamp = ros::Time::now();
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    for (size_t i = 0; i < stages_.size(); ) {
+      StageStatsPtr stats = stages_[i].lock();
+      if (!stats) {
+        // Nodelet unloaded
+        stages_[i] = stages_.back();
+        stages_.pop_back();
+        continue;
+      }
+      ++i;
+
+      diagnostic_msgs::DiagnosticStatus status;
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.name = stats->name;
+      uint64_t frames = stats->latency_us.count();
+      std::ostringstream message;
+      message << frames << " frames, " << stats->dropped.load(boost::memory_order_relaxed) << " dropped";
+      status.message = message.str();
+      addValue(status, "frames", frames);
+      addValue(status, "dropped", stats->dropped.load(boost::memory_order_relaxed));
+      addHistogram(status, "latency us", stats->latency_us);
+      addHistogram(status, "queue us", stats->queue_us);
+      addHistogram(status, "bytes", stats->bytes);
+      array.status.push_back(status);
+    }
+  }
+  if (!array.status.empty())
+    pub_.publish(array);
+}
+
+} // namespace image_proc
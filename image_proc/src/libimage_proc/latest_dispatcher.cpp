@@ -0,0 +1,141 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/latest_dispatcher.h"
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <ros/console.h>
+#include <algorithm>
+#include <exception>
+
+namespace image_proc {
+
+LatestDispatcher::LatestDispatcher(const ros::Duration& max_age, const Task& on_drop)
+  : max_age_(max_age), on_drop_(on_drop), dropped_(0), stopping_(false),
+    thread_(boost::bind(&LatestDispatcher::run, this))
+{
+}
+
+LatestDispatcher::~LatestDispatcher()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+boost::shared_ptr<LatestDispatcher> LatestDispatcher::create(ros::NodeHandle& private_nh,
+                                                             const StageStatsPtr& stats)
+{
+  bool latest_only;
+  private_nh.param("latest_only", latest_only, false);
+  if (!latest_only)
+    return boost::shared_ptr<LatestDispatcher>();
+
+  double max_age;
+  private_nh.param("max_age", max_age, 0.0);
+  Task on_drop;
+  if (stats)
+    on_drop = boost::bind(&StageStats::drop, stats.get());
+  return boost::shared_ptr<LatestDispatcher>(new LatestDispatcher(ros::Duration(std::max(max_age, 0.0)), on_drop));
+}
+
+void LatestDispatcher::submit(const ros::Time& stamp, const Task& task)
+{
+  if (stale(stamp)) {
+    drop("stale", stamp);
+    return;
+  }
+
+  bool superseded;
+  ros::Time superseded_stamp;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    superseded = !pending_.empty();
+    superseded_stamp = pending_stamp_;
+    pending_ = task;
+    pending_stamp_ = stamp;
+  }
+  wake_.notify_one();
+  if (superseded)
+    drop("superseded", superseded_stamp);
+}
+
+bool LatestDispatcher::stale(const ros::Time& stamp) const
+{
+  return !max_age_.isZero() && !stamp.isZero() && ros::Time::now() - stamp > max_age_;
+}
+
+void LatestDispatcher::drop(const char* reason, const ros::Time& stamp)
+{
+  dropped_.fetch_add(1, boost::memory_order_relaxed);
+  ROS_DEBUG("[image_proc] Dropped %s input set stamped %f", reason, stamp.toSec());
+  if (on_drop_)
+    on_drop_();
+}
+
+void LatestDispatcher::run()
+{
+  for (;;) {
+    Task task;
+    ros::Time stamp;
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (pending_.empty() && !stopping_)
+        wake_.wait(lock);
+      if (stopping_)
+        return;
+      task.swap(pending_);
+      stamp = pending_stamp_;
+    }
+
+    // The set may have aged while the previous one was processed
+    if (stale(stamp)) {
+      drop("stale", stamp);
+      continue;
+    }
+    try {
+      task();
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR("[image_proc] Frame processing threw an exception: %s", e.what());
+    }
+  }
+}
+
+} // namespace image_proc
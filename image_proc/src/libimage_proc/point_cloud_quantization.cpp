@@ -0,0 +1,128 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/point_cloud_quantization.h"
+
+namespace image_proc {
+
+const double QuantizedPoints::SCALE = 0.001;
+const char* const QuantizedPoints::FIELD_NAMES[3] = { "x_mm", "y_mm", "z_mm" };
+
+namespace {
+
+size_t fieldSize(uint8_t datatype)
+{
+  switch (datatype)
+  {
+    case sensor_msgs::PointField::INT8:
+    case sensor_msgs::PointField::UINT8:
+      return 1;
+    case sensor_msgs::PointField::INT16:
+    case sensor_msgs::PointField::UINT16:
+      return 2;
+    case sensor_msgs::PointField::INT32:
+    case sensor_msgs::PointField::UINT32:
+    case sensor_msgs::PointField::FLOAT32:
+      return 4;
+    case sensor_msgs::PointField::FLOAT64:
+      return 8;
+  }
+  return 0;
+}
+
+bool isFloatField(const sensor_msgs::PointField& field, const char* name, uint32_t offset)
+{
+  return field.name == name && field.offset == offset && field.count == 1 &&
+         field.datatype == sensor_msgs::PointField::FLOAT32;
+}
+
+} // namespace
+
+bool quantizePoints(sensor_msgs::PointCloud2& cloud)
+{
+  const std::vector<sensor_msgs::PointField>& fields = cloud.fields;
+  if (fields.size() < 3 || !isFloatField(fields[0], "x", 0) || !isFloatField(fields[1], "y", 4) ||
+      !isFloatField(fields[2], "z", 8) || cloud.row_step != cloud.width * cloud.point_step)
+    return false;
+
+  // The remaining fields, which must come in increasing offset order, are packed
+  // after the coordinates. Each ends up at an offset no larger than before, so
+  // copying them point by point in increasing order never overwrites bytes not
+  // read yet.
+  std::vector<sensor_msgs::PointField> quantized(3);
+  std::vector<uint32_t> source_offsets;
+  uint32_t point_step = 3 * sizeof(int16_t);
+  uint32_t source_end = 12;
+  for (int i = 0; i < 3; ++i)
+  {
+    quantized[i].name = QuantizedPoints::FIELD_NAMES[i];
+    quantized[i].offset = i * sizeof(int16_t);
+    quantized[i].datatype = sensor_msgs::PointField::INT16;
+    quantized[i].count = 1;
+  }
+  for (size_t i = 3; i < fields.size(); ++i)
+  {
+    size_t size = fieldSize(fields[i].datatype) * fields[i].count;
+    if (fields[i].offset < source_end || size == 0)
+      return false;
+    source_end = fields[i].offset + size;
+    quantized.push_back(fields[i]);
+    quantized.back().offset = point_step;
+    source_offsets.push_back(fields[i].offset);
+    point_step += size;
+  }
+
+  size_t count = (size_t)cloud.width * cloud.height;
+  uint8_t* data = cloud.data.empty() ? NULL : &cloud.data[0];
+  for (size_t p = 0; p < count; ++p)
+  {
+    const uint8_t* src = data + p * cloud.point_step;
+    uint8_t* dst = data + p * point_step;
+    float xyz[3];
+    std::memcpy(xyz, src, sizeof(xyz));
+    quantizeXyz(xyz, dst);
+    for (size_t f = 0; f < source_offsets.size(); ++f)
+    {
+      size_t size = fieldSize(quantized[f + 3].datatype) * quantized[f + 3].count;
+      std::memmove(dst + quantized[f + 3].offset, src + source_offsets[f], size);
+    }
+  }
+
+  cloud.fields.swap(quantized);
+  cloud.point_step = point_step;
+  cloud.row_step = cloud.width * point_step;
+  cloud.data.resize(cloud.row_step * cloud.height); // shrinking keeps the capacity
+  return true;
+}
+
+} // namespace image_proc
@@ -32,20 +32,145 @@
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
 #include "image_proc/processor.h"
+#include "image_proc/bayer.h"
 #include <sensor_msgs/image_encodings.h>
 #include <ros/console.h>
+#include <opencv2/imgproc/imgproc.hpp>
 
 namespace image_proc {
 
 namespace enc = sensor_msgs::image_encodings;
 
+// Hold on to at most this many cameras' maps per Processor
+static const size_t MAX_CACHED_MAPS = 4;
+
+// Grow a scratch buffer to at least rows x cols, returning a view of exactly that size
+static cv::Mat scratchRows(cv::Mat& buffer, int rows, int cols, int type)
+{
+  if (buffer.rows < rows || buffer.cols != cols || buffer.type() != type)
+    buffer.create(rows, cols, type);
+  return buffer.rowRange(0, rows);
+}
+
+// Demosaic raw Bayer rows [rows.start, rows.end) into color_tile and/or mono_tile.
+// rows.start must be even to preserve the Bayer phase.
+static void demosaicRows(const cv::Mat& raw, int bayer_code, BayerPattern pattern,
+                         const cv::Range& rows, bool want_color, bool want_mono,
+                         cv::Mat& color_buffer, cv::Mat& mono_buffer,
+                         cv::Mat& color_tile, cv::Mat& mono_tile)
+{
+  // Demosaic two extra rows on each side so the tile edges see the same
+  // neighborhood as a full-frame conversion would
+  const int pad_start = std::max(0, rows.start - 2);
+  const int pad_end = std::min(raw.rows, rows.end + 2);
+  const cv::Mat padded_raw = raw.rowRange(pad_start, pad_end);
+  const cv::Range tile(rows.start - pad_start, rows.end - pad_start);
+  if (want_color) {
+    cv::Mat padded = scratchRows(color_buffer, padded_raw.rows, raw.cols, CV_8UC3);
+    cv::cvtColor(padded_raw, padded, bayer_code);
+    color_tile = padded.rowRange(tile);
+    if (want_mono) {
+      mono_tile = scratchRows(mono_buffer, rows.size(), raw.cols, CV_8UC1);
+      cv::cvtColor(color_tile, mono_tile, cv::COLOR_BGR2GRAY);
+    }
+  }
+  else if (want_mono) {
+    cv::Mat padded = scratchRows(mono_buffer, padded_raw.rows, raw.cols, CV_8UC1);
+    debayerMono(padded_raw, padded, pattern);
+    mono_tile = padded.rowRange(tile);
+  }
+}
+
+// Demosaic raw Bayer rows [rows.start, rows.end) into the same rows of the
+// raw-sized color_frame and/or mono_frame, whichever is not empty.
+// rows.start must be even.
+static void demosaicIntoFrame(const cv::Mat& raw, int bayer_code, BayerPattern pattern,
+                              const cv::Range& rows, cv::Mat& color_buffer, cv::Mat& mono_buffer,
+                              cv::Mat& color_frame, cv::Mat& mono_frame)
+{
+  if (rows.empty())
+    return;
+  cv::Mat color_tile, mono_tile;
+  demosaicRows(raw, bayer_code, pattern, rows, !color_frame.empty(), !mono_frame.empty(),
+               color_buffer, mono_buffer, color_tile, mono_tile);
+  if (!color_frame.empty())
+    color_tile.copyTo(color_frame.rowRange(rows));
+  if (!mono_frame.empty())
+    mono_tile.copyTo(mono_frame.rowRange(rows));
+}
+
+// Grow the demosaiced rows of color_frame and mono_frame to cover rows, which
+// must start even. done stays one contiguous range, so each raw row is
+// demosaiced at most once however much the rows of neighboring bands overlap.
+static void demosaicCovering(const cv::Mat& raw, int bayer_code, BayerPattern pattern,
+                             const cv::Range& rows, cv::Range& done,
+                             cv::Mat& color_buffer, cv::Mat& mono_buffer,
+                             cv::Mat& color_frame, cv::Mat& mono_frame)
+{
+  if (done.empty()) {
+    demosaicIntoFrame(raw, bayer_code, pattern, rows, color_buffer, mono_buffer, color_frame, mono_frame);
+    done = rows;
+    return;
+  }
+  if (rows.start < done.start) {
+    demosaicIntoFrame(raw, bayer_code, pattern, cv::Range(rows.start, done.start),
+                      color_buffer, mono_buffer, color_frame, mono_frame);
+    done.start = rows.start;
+  }
+  if (rows.end > done.end) {
+    // Restart on an even row; the row redone comes out the same
+    demosaicIntoFrame(raw, bayer_code, pattern, cv::Range(done.end & ~1, rows.end),
+                      color_buffer, mono_buffer, color_frame, mono_frame);
+    done.end = rows.end;
+  }
+}
+
+// OpenCV conversion code for an 8-bit Bayer encoding, or 0 if unsupported
+static int bayerConversionCode(const std::string& encoding)
+{
+  if (encoding == enc::BAYER_RGGB8)
+    return cv::COLOR_BayerBG2BGR;
+  if (encoding == enc::BAYER_BGGR8)
+    return cv::COLOR_BayerRG2BGR;
+  if (encoding == enc::BAYER_GBRG8)
+    return cv::COLOR_BayerGR2BGR;
+  if (encoding == enc::BAYER_GRBG8)
+    return cv::COLOR_BayerGB2BGR;
+  return 0;
+}
+
+int resolveDependencies(int flags, const FlagDependency* graph, size_t num_edges)
+{
+  // Expand until nothing new gets pulled in
+  int needed = flags, previous;
+  do {
+    previous = needed;
+    for (size_t i = 0; i < num_edges; ++i) {
+      if (needed & graph[i].output)
+        needed |= graph[i].prerequisites;
+    }
+  } while (needed != previous);
+  return needed;
+}
+
+int Processor::dependencies(int flags)
+{
+  // Direct prerequisites of each derived output; MONO and COLOR only need the
+  // raw image
+  static const FlagDependency graph[] = {
+    { RECT,       MONO },
+    { RECT_COLOR, COLOR },
+  };
+  return resolveDependencies(flags, graph, sizeof(graph) / sizeof(graph[0]));
+}
+
 bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
                         const image_geometry::PinholeCameraModel& model,
                         ImageSet& output, int flags) const
 {
-  static const int MONO_EITHER = MONO | RECT;
-  static const int COLOR_EITHER = COLOR | RECT_COLOR;
   if (!(flags & ALL)) return true;
+  // Unrectified images needed, as outputs or to be rectified
+  const int needed = dependencies(flags);
   
   // Check if raw_image is color
   const std::string& raw_encoding = raw_image->encoding;
@@ -64,31 +189,33 @@ bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
   
   // Bayer case
   if (raw_encoding.find("bayer") != std::string::npos) {
-    // Convert to color BGR
-    /// @todo Faster to convert directly to mono when color is not requested, but OpenCV doesn't support
-    int code = 0;
-    if (raw_encoding == enc::BAYER_RGGB8)
-      code = cv::COLOR_BayerBG2BGR;
-    else if (raw_encoding == enc::BAYER_BGGR8)
-      code = cv::COLOR_BayerRG2BGR;
-    else if (raw_encoding == enc::BAYER_GBRG8)
-      code = cv::COLOR_BayerGR2BGR;
-    else if (raw_encoding == enc::BAYER_GRBG8)
-      code = cv::COLOR_BayerGB2BGR;
-    else {
+    int code = bayerConversionCode(raw_encoding);
+    if (!code) {
       ROS_ERROR("[image_proc] Unsupported encoding '%s'", raw_encoding.c_str());
       return false;
     }
-    cv::cvtColor(raw, output.color, code);
-    output.color_encoding = enc::BGR8;
-    
-    if (flags & MONO_EITHER)
-      cv::cvtColor(output.color, output.mono, cv::COLOR_BGR2GRAY);
+    BayerPattern pattern;
+    bayerPattern(raw_encoding, pattern);
+    if (fused_ && (flags & (RECT | RECT_COLOR)))
+      return processFusedBayer(raw, code, pattern, rectificationMaps(model), output, flags);
+
+    if (needed & COLOR) {
+      // Convert to color BGR
+      cv::cvtColor(raw, output.color, code);
+      output.color_encoding = enc::BGR8;
+
+      if (needed & MONO)
+        cv::cvtColor(output.color, output.mono, cv::COLOR_BGR2GRAY);
+    }
+    else {
+      // Only mono requested, skip the color image entirely
+      debayerMono(raw, output.mono, pattern);
+    }
   }
   // Color case
   else if (raw_type == CV_8UC3) {
     output.color = raw;
-    if (flags & MONO_EITHER) {
+    if (needed & MONO) {
       int code = (raw_encoding == enc::BGR8) ? cv::COLOR_BGR2GRAY : cv::COLOR_RGB2GRAY;
       cv::cvtColor(output.color, output.mono, code);
     }
@@ -96,7 +223,7 @@ bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
   // Mono case
   else if (raw_encoding == enc::MONO8) {
     output.mono = raw;
-    if (flags & COLOR_EITHER) {
+    if (needed & COLOR) {
       output.color_encoding = enc::MONO8;
       output.color = raw;
     }
@@ -119,12 +246,185 @@ bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
   
   /// @todo If no distortion, could just point to the colorized data. But copy is
   /// already way faster than remap.
+  if (flags & (RECT | RECT_COLOR)) {
+    const RectificationMaps& maps = rectificationMaps(model);
+    if (flags & RECT)
+      maps.rectify(output.mono, output.rect, interpolation_);
+    if (flags & RECT_COLOR)
+      maps.rectify(output.color, output.rect_color, interpolation_);
+  }
+
+  return true;
+}
+
+bool Processor::processFused(const sensor_msgs::Image& raw_image, const RectificationMaps& maps,
+                             ImageSet& output, int flags) const
+{
+  int code = bayerConversionCode(raw_image.encoding);
+  BayerPattern pattern;
+  if (!code || !bayerPattern(raw_image.encoding, pattern)) {
+    ROS_ERROR("[image_proc] Unsupported encoding '%s' for fused processing", raw_image.encoding.c_str());
+    return false;
+  }
+  const cv::Mat raw(raw_image.height, raw_image.width, CV_8UC1,
+                    const_cast<uint8_t*>(&raw_image.data[0]), raw_image.step);
+  return processFusedBayer(raw, code, pattern, maps, output, flags);
+}
+
+bool Processor::processFusedBayer(const cv::Mat& raw, int bayer_code, BayerPattern pattern,
+                                  const RectificationMaps& maps, ImageSet& output, int flags) const
+{
+  if (maps.map1.empty() || raw.rows < 2) {
+    ROS_ERROR("[image_proc] Could not build rectification maps for fused processing");
+    return false;
+  }
+
+  const int needed = dependencies(flags);
+  const bool want_mono = needed & MONO;
+  const bool want_color = needed & COLOR;
+  output.color_encoding = enc::BGR8;
+  if (flags & MONO)
+    output.mono.create(raw.size(), CV_8UC1);
+  if (flags & COLOR)
+    output.color.create(raw.size(), CV_8UC3);
   if (flags & RECT)
-    model.rectifyImage(output.mono, output.rect, interpolation_);
+    output.rect.create(maps.map1.size(), CV_8UC1);
   if (flags & RECT_COLOR)
-    model.rectifyImage(output.color, output.rect_color, interpolation_);
+    output.rect_color.create(maps.map1.size(), CV_8UC3);
+
+  // Demosaiced rows stay at their raw row, in the unrectified outputs when
+  // those are requested and in raw-sized scratch otherwise, so the rows that
+  // consecutive bands share are demosaiced once, while still cache resident.
+  cv::Mat color_frame, mono_frame;
+  if (want_color)
+    color_frame = (flags & COLOR) ? output.color : scratchRows(color_frame_, raw.rows, raw.cols, CV_8UC3);
+  if (want_mono)
+    mono_frame = (flags & MONO) ? output.mono : scratchRows(mono_frame_, raw.rows, raw.cols, CV_8UC1);
+
+  cv::Mat color_buffer, mono_buffer, band_map1;
+  cv::Range done(0, 0);
+  const int bands = maps.band_sources.size();
+  for (int b = 0; b < bands; ++b) {
+    const cv::Range dst(b * RectificationMaps::BAND_ROWS,
+                        std::min(maps.map1.rows, (b + 1) * RectificationMaps::BAND_ROWS));
+    cv::Range src = maps.band_sources[b];
+    if (src.empty()) {
+      // Band maps entirely outside the raw image
+      if (flags & RECT)
+        output.rect.rowRange(dst).setTo(0);
+      if (flags & RECT_COLOR)
+        output.rect_color.rowRange(dst).setTo(0);
+      continue;
+    }
+    src.start &= ~1;
+    demosaicCovering(raw, bayer_code, pattern, src, done, color_buffer, mono_buffer, color_frame, mono_frame);
+
+    // Shift the band's maps into the coordinates of its source rows
+    cv::subtract(maps.map1.rowRange(dst), cv::Scalar(0, src.start), band_map1);
+    const cv::Mat band_map2 = maps.map2.rowRange(dst);
+    if (flags & RECT) {
+      cv::Mat rect_rows = output.rect.rowRange(dst);
+      cv::remap(mono_frame.rowRange(src), rect_rows, band_map1, band_map2, interpolation_, cv::BORDER_CONSTANT);
+    }
+    if (flags & RECT_COLOR) {
+      cv::Mat rect_rows = output.rect_color.rowRange(dst);
+      cv::remap(color_frame.rowRange(src), rect_rows, band_map1, band_map2, interpolation_, cv::BORDER_CONSTANT);
+    }
+  }
+
+  // Raw rows the maps never sample, only needed by the unrectified outputs
+  if (flags & (MONO | COLOR)) {
+    cv::Mat color_out = (flags & COLOR) ? output.color : cv::Mat();
+    cv::Mat mono_out = (flags & MONO) ? output.mono : cv::Mat();
+    demosaicCovering(raw, bayer_code, pattern, cv::Range(0, raw.rows), done,
+                     color_buffer, mono_buffer, color_out, mono_out);
+  }
+
+  return true;
+}
+
+cv::Size Processor::rectifiedSize(const image_geometry::PinholeCameraModel& model) const
+{
+  return rectificationMaps(model).map1.size();
+}
+
+bool Processor::rectifyRows(const sensor_msgs::Image& raw_image,
+                            const image_geometry::PinholeCameraModel& model,
+                            const cv::Range& rows, cv::Mat& rect, RowScratch& scratch) const
+{
+  const RectificationMaps& maps = rectificationMaps(model);
+  if (maps.map1.empty() || rows.start < 0 || rows.end > maps.map1.rows) {
+    ROS_ERROR("[image_proc] Rows %d-%d are outside the rectified image", rows.start, rows.end);
+    return false;
+  }
+  if (rect.rows != rows.size() || rect.cols != maps.map1.cols || rect.type() != CV_8UC1)
+    rect.create(rows.size(), maps.map1.cols, CV_8UC1);
+  if (rows.empty())
+    return true;
+
+  // Raw rows sampled by the bands covering the requested rows
+  cv::Range src(raw_image.height, 0);
+  const int first_band = rows.start / RectificationMaps::BAND_ROWS;
+  const int last_band = (rows.end - 1) / RectificationMaps::BAND_ROWS;
+  for (int b = first_band; b <= last_band; ++b) {
+    const cv::Range& band = maps.band_sources[b];
+    if (!band.empty()) {
+      src.start = std::min(src.start, band.start);
+      src.end = std::max(src.end, band.end);
+    }
+  }
+  if (src.start >= src.end) {
+    // Rows map entirely outside the raw image
+    rect.setTo(0);
+    return true;
+  }
+
+  const std::string& raw_encoding = raw_image.encoding;
+  const bool color = (raw_encoding == enc::BGR8 || raw_encoding == enc::RGB8);
+  const cv::Mat raw(raw_image.height, raw_image.width, color ? CV_8UC3 : CV_8UC1,
+                    const_cast<uint8_t*>(&raw_image.data[0]), raw_image.step);
+  cv::Mat mono_tile;
+  if (raw_encoding.find("bayer") != std::string::npos) {
+    int code = bayerConversionCode(raw_encoding);
+    BayerPattern pattern;
+    if (!code || !bayerPattern(raw_encoding, pattern)) {
+      ROS_ERROR("[image_proc] Unsupported encoding '%s'", raw_encoding.c_str());
+      return false;
+    }
+    src.start &= ~1;
+    cv::Mat color_tile;
+    demosaicRows(raw, code, pattern, src, false, true,
+                 scratch.color, scratch.mono, color_tile, mono_tile);
+  }
+  else if (color) {
+    mono_tile = scratchRows(scratch.mono, src.size(), raw.cols, CV_8UC1);
+    int code = (raw_encoding == enc::BGR8) ? cv::COLOR_BGR2GRAY : cv::COLOR_RGB2GRAY;
+    cv::cvtColor(raw.rowRange(src), mono_tile, code);
+  }
+  else if (raw_encoding == enc::MONO8) {
+    mono_tile = raw.rowRange(src);
+  }
+  else {
+    ROS_ERROR("[image_proc] Unsupported encoding '%s'", raw_encoding.c_str());
+    return false;
+  }
 
+  // Shift the maps into tile coordinates
+  cv::subtract(maps.map1.rowRange(rows), cv::Scalar(0, src.start), scratch.map1);
+  cv::remap(mono_tile, rect, scratch.map1, maps.map2.rowRange(rows), interpolation_, cv::BORDER_CONSTANT);
   return true;
 }
 
+const RectificationMaps& Processor::rectificationMaps(const image_geometry::PinholeCameraModel& model) const
+{
+  for (size_t i = 0; i < maps_.size(); ++i) {
+    if (sameRectification(maps_[i]->info, model.cameraInfo()))
+      return *maps_[i];
+  }
+  if (maps_.size() >= MAX_CACHED_MAPS)
+    maps_.erase(maps_.begin());
+  maps_.push_back(RectificationMapCache::instance().get(model));
+  return *maps_.back();
+}
+
 } //namespace image_proc
@@ -0,0 +1,247 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/rectification_maps.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <algorithm>
+#include <climits>
+
+namespace image_proc {
+
+const int RectificationMaps::BAND_ROWS;
+
+namespace {
+
+// Where rectified output pixels come from, for one camera and output request
+struct OutputGrid
+{
+  cv::Matx33d K_binned;  // intrinsics of the binned raw image
+  cv::Matx34d P;         // projection onto the output pixels
+  cv::Rect raw_roi;      // region of the binned image the raw image covers
+  cv::Size size;         // size of the output
+};
+
+OutputGrid outputGrid(const image_geometry::PinholeCameraModel& model,
+                      const cv::Rect& output_roi, int decimation_x, int decimation_y)
+{
+  // Same construction as PinholeCameraModel::initRectificationMaps, which we
+  // can't reach directly.
+  OutputGrid grid;
+  const int binning_x = std::max(1u, model.binningX());
+  const int binning_y = std::max(1u, model.binningY());
+  cv::Size binned_resolution = model.fullResolution();
+  binned_resolution.width  /= binning_x;
+  binned_resolution.height /= binning_y;
+
+  grid.K_binned = model.fullIntrinsicMatrix();
+  cv::Matx34d P_binned = model.fullProjectionMatrix();
+  if (binning_x > 1) {
+    double scale_x = 1.0 / binning_x;
+    grid.K_binned(0,0) *= scale_x;
+    grid.K_binned(0,2) *= scale_x;
+    P_binned(0,0) *= scale_x;
+    P_binned(0,2) *= scale_x;
+    P_binned(0,3) *= scale_x;
+  }
+  if (binning_y > 1) {
+    double scale_y = 1.0 / binning_y;
+    grid.K_binned(1,1) *= scale_y;
+    grid.K_binned(1,2) *= scale_y;
+    P_binned(1,1) *= scale_y;
+    P_binned(1,2) *= scale_y;
+    P_binned(1,3) *= scale_y;
+  }
+
+  // Region of the binned image the raw image covers
+  const sensor_msgs::CameraInfo& info = model.cameraInfo();
+  grid.raw_roi = cv::Rect(cv::Point(), binned_resolution);
+  if (info.roi.x_offset != 0 || info.roi.y_offset != 0 ||
+      (info.roi.height != 0 && info.roi.height != info.height) ||
+      (info.roi.width  != 0 && info.roi.width  != info.width)) {
+    grid.raw_roi = cv::Rect(info.roi.x_offset / binning_x, info.roi.y_offset / binning_y,
+                            info.roi.width / binning_x, info.roi.height / binning_y);
+  }
+
+  // Rectified region to produce, by default the one matching the raw image
+  cv::Rect roi = grid.raw_roi;
+  if (output_roi != cv::Rect()) {
+    cv::Rect requested(grid.raw_roi.x + output_roi.x, grid.raw_roi.y + output_roi.y,
+                       output_roi.width  ? output_roi.width  : grid.raw_roi.width,
+                       output_roi.height ? output_roi.height : grid.raw_roi.height);
+    requested &= grid.raw_roi;
+    if (requested.area() > 0)
+      roi = requested;
+  }
+  const int dx = std::max(decimation_x, 1);
+  const int dy = std::max(decimation_y, 1);
+  grid.size = cv::Size(std::max(roi.width / dx, 1), std::max(roi.height / dy, 1));
+
+  // Output pixel (u', v') is rectified pixel roi.tl() + (u' * dx, v' * dy),
+  // the top-left one of its block as in crop_decimate and binning, so the
+  // output projection is P' = A * P with A taking rectified pixels to output
+  // pixels. Sampling maps built from P' directly are the full maps cropped
+  // and decimated.
+  cv::Matx33d A(1.0 / dx, 0.0, -roi.x / (double)dx,
+                0.0, 1.0 / dy, -roi.y / (double)dy,
+                0.0, 0.0, 1.0);
+  grid.P = A * P_binned;
+  return grid;
+}
+
+cv::Matx33d outputIntrinsics(const OutputGrid& grid)
+{
+  return cv::Matx33d(grid.P(0,0), grid.P(0,1), grid.P(0,2),
+                     grid.P(1,0), grid.P(1,1), grid.P(1,2),
+                     grid.P(2,0), grid.P(2,1), grid.P(2,2));
+}
+
+sensor_msgs::CameraInfo outputInfo(const sensor_msgs::CameraInfo& info, const OutputGrid& grid)
+{
+  sensor_msgs::CameraInfo rect_info;
+  rect_info.width = grid.size.width;
+  rect_info.height = grid.size.height;
+  rect_info.distortion_model = info.distortion_model;
+  rect_info.D.assign(info.D.size(), 0.0);
+  const cv::Matx33d K = outputIntrinsics(grid);
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      rect_info.K[3*i + j] = K(i, j);
+      rect_info.R[3*i + j] = (i == j) ? 1.0 : 0.0;
+    }
+    for (int j = 0; j < 4; ++j)
+      rect_info.P[4*i + j] = grid.P(i, j);
+  }
+  return rect_info;
+}
+
+} // namespace
+
+RectificationMaps::RectificationMaps(const image_geometry::PinholeCameraModel& model,
+                                     const cv::Rect& output_roi, int decimation_x, int decimation_y)
+  : info(model.cameraInfo()), output_roi(output_roi),
+    decimation_x(decimation_x), decimation_y(decimation_y)
+{
+  const OutputGrid grid = outputGrid(model, output_roi, decimation_x, decimation_y);
+  cv::initUndistortRectifyMap(grid.K_binned, model.distortionCoeffs(), model.rotationMatrix(),
+                              outputIntrinsics(grid), grid.size, CV_16SC2, map1, map2);
+  // map1 holds integer (x,y) source coordinates, which shift with the raw image
+  // ROI offset; the subpixel table indices in map2 stay as they are
+  if (grid.raw_roi.x != 0 || grid.raw_roi.y != 0)
+    map1 -= cv::Scalar(grid.raw_roi.x, grid.raw_roi.y);
+  const cv::Size raw_size = grid.raw_roi.size();
+  rect_info = outputInfo(info, grid);
+
+  // Record which raw rows each band of rectified rows reads. Lanczos reads
+  // 3 rows above and 4 below the integer source row.
+  const int bands = (map1.rows + BAND_ROWS - 1) / BAND_ROWS;
+  band_sources.resize(bands);
+  for (int b = 0; b < bands; ++b) {
+    int lo = INT_MAX, hi = INT_MIN;
+    const int end_row = std::min(map1.rows, (b + 1) * BAND_ROWS);
+    for (int r = b * BAND_ROWS; r < end_row; ++r) {
+      const cv::Vec2s* row = map1.ptr<cv::Vec2s>(r);
+      for (int c = 0; c < map1.cols; ++c) {
+        lo = std::min(lo, (int)row[c][1]);
+        hi = std::max(hi, (int)row[c][1]);
+      }
+    }
+    int start = std::max(0, lo - 3);
+    int end = std::min(raw_size.height, hi + 5);
+    band_sources[b] = (start < end) ? cv::Range(start, end) : cv::Range(0, 0);
+  }
+}
+
+sensor_msgs::CameraInfo RectificationMaps::rectifiedInfo(const image_geometry::PinholeCameraModel& model,
+                                                         const cv::Rect& output_roi,
+                                                         int decimation_x, int decimation_y)
+{
+  return outputInfo(model.cameraInfo(), outputGrid(model, output_roi, decimation_x, decimation_y));
+}
+
+bool RectificationMaps::matches(const sensor_msgs::CameraInfo& info, const cv::Rect& output_roi,
+                                int decimation_x, int decimation_y) const
+{
+  return this->output_roi == output_roi && this->decimation_x == decimation_x &&
+         this->decimation_y == decimation_y && sameRectification(this->info, info);
+}
+
+void RectificationMaps::rectify(const cv::Mat& raw, cv::Mat& rectified, int interpolation) const
+{
+  cv::remap(raw, rectified, map1, map2, interpolation, cv::BORDER_CONSTANT);
+}
+
+bool sameRectification(const sensor_msgs::CameraInfo& a, const sensor_msgs::CameraInfo& b)
+{
+  return a.width == b.width && a.height == b.height &&
+         a.binning_x == b.binning_x && a.binning_y == b.binning_y &&
+         a.roi.x_offset == b.roi.x_offset && a.roi.y_offset == b.roi.y_offset &&
+         a.roi.width == b.roi.width && a.roi.height == b.roi.height &&
+         a.distortion_model == b.distortion_model &&
+         a.D == b.D && a.K == b.K && a.R == b.R && a.P == b.P;
+}
+
+RectificationMapCache& RectificationMapCache::instance()
+{
+  static RectificationMapCache cache;
+  return cache;
+}
+
+RectificationMapsConstPtr RectificationMapCache::get(const image_geometry::PinholeCameraModel& model,
+                                                     const cv::Rect& output_roi,
+                                                     int decimation_x, int decimation_y)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  RectificationMapsConstPtr maps;
+  std::vector<boost::weak_ptr<const RectificationMaps> >::iterator it = entries_.begin();
+  while (it != entries_.end()) {
+    RectificationMapsConstPtr entry = it->lock();
+    if (!entry) {
+      it = entries_.erase(it);
+      continue;
+    }
+    if (!maps && entry->matches(model.cameraInfo(), output_roi, decimation_x, decimation_y))
+      maps = entry;
+    ++it;
+  }
+  if (!maps) {
+    maps.reset(new RectificationMaps(model, output_roi, decimation_x, decimation_y));
+    entries_.push_back(maps);
+  }
+  return maps;
+}
+
+} // namespace image_proc
@@ -0,0 +1,255 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/shm_ring.h"
+#include <boost/atomic.hpp>
+#include <boost/thread/once.hpp>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace image_proc {
+
+namespace {
+
+const uint32_t RING_MAGIC = 0x53484d31; // "SHM1"
+const size_t ALIGNMENT = 64;
+
+size_t aligned(size_t size)
+{
+  return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+std::runtime_error systemError(const std::string& what, const std::string& name)
+{
+  return std::runtime_error(what + " '" + name + "': " + std::strerror(errno));
+}
+
+boost::once_flag stale_rings_removed = BOOST_ONCE_INIT;
+
+// Unlinks the rings of this user that processes killed before their
+// destructors ran left behind: those named after a process no longer running,
+// and those named after this process, which can only be from an earlier
+// process with the same id since this one has not created any yet.
+void removeStaleRings()
+{
+  DIR* dir = opendir("/dev/shm");
+  if (!dir)
+    return;
+  const int self = getpid();
+  const uid_t uid = geteuid();
+  while (struct dirent* entry = readdir(dir)) {
+    int pid;
+    unsigned counter;
+    char extra;
+    if (std::sscanf(entry->d_name, "image_proc_%d_%u%c", &pid, &counter, &extra) != 2)
+      continue;
+    // EPERM means the process runs, as another user
+    if (pid != self && (kill(pid, 0) == 0 || errno != ESRCH))
+      continue;
+    struct stat st;
+    const std::string name(entry->d_name);
+    if (stat(("/dev/shm/" + name).c_str(), &st) != 0 || st.st_uid != uid)
+      continue;
+    if (shm_unlink(("/" + name).c_str()) == 0)
+      ROS_DEBUG("[image_proc] Removed stale shared-memory ring /%s", name.c_str());
+  }
+  closedir(dir);
+}
+
+} // namespace
+
+// Layout: Header, then one Slot per slot, then the slot buffers, each aligned
+struct ShmRing::Header
+{
+  uint32_t magic;
+  uint32_t slots;
+  uint32_t slot_size;
+};
+
+struct ShmRing::Slot
+{
+  boost::atomic<uint64_t> sequence; // odd while the slot is being written
+};
+
+ShmRing::ShmRing(const std::string& name, uint32_t slots, uint32_t slot_size)
+  : name_(name), owner_(true), base_(NULL), size_(0), next_slot_(0)
+{
+  slots = std::max(slots, 1u);
+  slot_size = aligned(std::max(slot_size, 1u));
+  const size_t size = aligned(sizeof(Header)) + aligned(slots * sizeof(Slot)) + (size_t)slots * slot_size;
+
+  // Only readable by processes of the same user
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    throw systemError("Could not create shared memory", name);
+  if (ftruncate(fd, size) != 0) {
+    std::runtime_error error = systemError("Could not size shared memory", name);
+    close(fd);
+    shm_unlink(name.c_str());
+    throw error;
+  }
+  try {
+    map(fd, size, true);
+  }
+  catch (...) {
+    shm_unlink(name.c_str());
+    throw;
+  }
+
+  Header* header = reinterpret_cast<Header*>(base_);
+  header->slots = slots;
+  header->slot_size = slot_size;
+  for (uint32_t i = 0; i < slots; ++i)
+    slot(i)->sequence.store(0, boost::memory_order_relaxed);
+  // Readers check the magic number last, once everything else is in place
+  boost::atomic_thread_fence(boost::memory_order_release);
+  header->magic = RING_MAGIC;
+}
+
+ShmRing::ShmRing(const std::string& name)
+  : name_(name), owner_(false), base_(NULL), size_(0), next_slot_(0)
+{
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    throw systemError("Could not open shared memory", name);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    std::runtime_error error = systemError("Could not stat shared memory", name);
+    close(fd);
+    throw error;
+  }
+  map(fd, st.st_size, false);
+
+  const Header* header = reinterpret_cast<const Header*>(base_);
+  bool valid = size_ >= aligned(sizeof(Header)) && header->magic == RING_MAGIC &&
+               header->slots > 0 &&
+               size_ >= aligned(sizeof(Header)) + aligned(header->slots * sizeof(Slot)) +
+                        (size_t)header->slots * header->slot_size;
+  boost::atomic_thread_fence(boost::memory_order_acquire);
+  if (!valid) {
+    munmap(base_, size_);
+    throw std::runtime_error("Shared memory '" + name + "' is not a ring");
+  }
+}
+
+ShmRing::~ShmRing()
+{
+  munmap(base_, size_);
+  if (owner_)
+    shm_unlink(name_.c_str());
+}
+
+std::string ShmRing::uniqueName()
+{
+  boost::call_once(stale_rings_removed, &removeStaleRings);
+  static boost::atomic<unsigned> counter(0);
+  std::ostringstream name;
+  name << "/image_proc_" << getpid() << "_" << counter.fetch_add(1, boost::memory_order_relaxed);
+  return name.str();
+}
+
+void ShmRing::map(int fd, size_t size, bool writable)
+{
+  void* base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid without the descriptor
+  close(fd);
+  if (base == MAP_FAILED)
+    throw systemError("Could not map shared memory", name_);
+  base_ = static_cast<uint8_t*>(base);
+  size_ = size;
+}
+
+uint32_t ShmRing::slots() const
+{
+  return reinterpret_cast<const Header*>(base_)->slots;
+}
+
+uint32_t ShmRing::slotSize() const
+{
+  return reinterpret_cast<const Header*>(base_)->slot_size;
+}
+
+ShmRing::Slot* ShmRing::slot(uint32_t index) const
+{
+  return reinterpret_cast<Slot*>(base_ + aligned(sizeof(Header))) + index;
+}
+
+uint8_t* ShmRing::beginWrite(uint32_t size, ShmDescriptor& desc)
+{
+  const uint32_t index = next_slot_;
+  next_slot_ = (next_slot_ + 1) % slots();
+  Slot* s = slot(index);
+  const uint64_t sequence = s->sequence.load(boost::memory_order_relaxed) + 1;
+  s->sequence.store(sequence, boost::memory_order_relaxed);
+  // The odd sequence number must be visible before any of the new contents
+  boost::atomic_thread_fence(boost::memory_order_release);
+
+  desc.segment = name_;
+  desc.slot = index;
+  desc.sequence = sequence + 1;
+  desc.size = size;
+  return base_ + aligned(sizeof(Header)) + aligned(slots() * sizeof(Slot)) + (size_t)index * slotSize();
+}
+
+void ShmRing::endWrite(const ShmDescriptor& desc)
+{
+  slot(desc.slot)->sequence.store(desc.sequence, boost::memory_order_release);
+}
+
+const uint8_t* ShmRing::beginRead(const ShmDescriptor& desc) const
+{
+  if (desc.slot >= slots() || desc.size > slotSize())
+    return NULL;
+  if (slot(desc.slot)->sequence.load(boost::memory_order_acquire) != desc.sequence)
+    return NULL;
+  return base_ + aligned(sizeof(Header)) + aligned(slots() * sizeof(Slot)) + (size_t)desc.slot * slotSize();
+}
+
+bool ShmRing::endRead(const ShmDescriptor& desc) const
+{
+  // Order the copy out of the slot before the check that it was not overwritten
+  boost::atomic_thread_fence(boost::memory_order_acquire);
+  return slot(desc.slot)->sequence.load(boost::memory_order_relaxed) == desc.sequence;
+}
+
+} // namespace image_proc
@@ -0,0 +1,149 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "image_proc/worker_pool.h"
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <ros/console.h>
+#include <algorithm>
+#include <exception>
+
+namespace image_proc {
+
+WorkerPool::WorkerPool(size_t num_threads)
+  : queued_(0), sleeping_(0), next_worker_(0), stopping_(false)
+{
+  if (num_threads == 0)
+    num_threads = std::max(boost::thread::hardware_concurrency(), 1u);
+
+  for (size_t i = 0; i < num_threads; ++i)
+    workers_.push_back(boost::shared_ptr<Worker>(new Worker));
+  // Workers look each other up by thread id, so record them all before any task runs
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  for (size_t i = 0; i < num_threads; ++i)
+    workers_[i]->id = threads_.create_thread(boost::bind(&WorkerPool::run, this, i))->get_id();
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  threads_.join_all();
+}
+
+void WorkerPool::submit(const Task& task)
+{
+  size_t index = workers_.size();
+  boost::thread::id self = boost::this_thread::get_id();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i]->id == self) {
+      index = i;
+      break;
+    }
+  }
+  if (index == workers_.size())
+    index = next_worker_++ % workers_.size();
+
+  // Counted before it is pushed, so queued_ never drops below the queued tasks
+  ++queued_;
+  {
+    boost::lock_guard<boost::mutex> queue_lock(workers_[index]->mutex);
+    workers_[index]->tasks.push_back(task);
+  }
+  if (sleeping_ > 0) {
+    // Taking the lock orders the wakeup after the sleeper's check of queued_
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+}
+
+bool WorkerPool::take(size_t index, Task& task)
+{
+  {
+    Worker& own = *workers_[index];
+    boost::lock_guard<boost::mutex> lock(own.mutex);
+    // Oldest first, so a task resubmitted from a worker waits its turn
+    if (!own.tasks.empty()) {
+      own.tasks.front().swap(task);
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker& victim = *workers_[(index + i) % workers_.size()];
+    boost::lock_guard<boost::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      victim.tasks.front().swap(task);
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::run(size_t index)
+{
+  {
+    // Wait for the constructor to finish recording thread ids
+    boost::lock_guard<boost::mutex> lock(mutex_);
+  }
+  Task task;
+  while (!stopping_) {
+    if (!take(index, task)) {
+      // Nothing queued, or a task counted in queued_ is not pushed yet
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      ++sleeping_;
+      while (queued_ == 0 && !stopping_)
+        wake_.wait(lock);
+      --sleeping_;
+      continue;
+    }
+    --queued_;
+
+    try {
+      task();
+    }
+    catch (const std::exception& e) {
+      ROS_ERROR("[image_proc] Worker task threw an exception: %s", e.what());
+    }
+    task.clear();
+  }
+}
+
+} // namespace image_proc
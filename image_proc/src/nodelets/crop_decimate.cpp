@@ -31,6 +31,7 @@
 *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
+#include <boost/make_shared.hpp>
 #include <boost/version.hpp>
 #if ((BOOST_VERSION / 100) % 1000) >= 53
 #include <boost/thread/lock_guard.hpp>
@@ -43,11 +44,15 @@
 #include <dynamic_reconfigure/server.h>
 #include <cv_bridge/cv_bridge.h>
 #include <image_proc/CropDecimateConfig.h>
+#include <image_proc/instrumentation.h>
+#include "decimate.h"
 #include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <vector>
 
 namespace image_proc {
 
-using namespace cv_bridge; // CvImage, toCvShare
+using namespace cv_bridge; // CvImageConstPtr, toCvShare
 
 class CropDecimateNodelet : public nodelet::Nodelet
 {
@@ -66,6 +71,8 @@ class CropDecimateNodelet : public nodelet::Nodelet
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
   Config config_;
 
+  StageStatsPtr stats_;
+
   virtual void onInit();
 
   void connectCb();
@@ -93,6 +100,8 @@ void CropDecimateNodelet::onInit()
   ReconfigureServer::CallbackType f = boost::bind(&CropDecimateNodelet::configCb, this, _1, _2);
   reconfigure_server_->setCallback(f);
 
+  stats_ = Instrumentation::stage(private_nh, "crop_decimate");
+
   // Monitor whether anyone is subscribed to the output
   image_transport::SubscriberStatusCallback connect_cb = boost::bind(&CropDecimateNodelet::connectCb, this);
   ros::SubscriberStatusCallback connect_cb_info = boost::bind(&CropDecimateNodelet::connectCb, this);
@@ -114,6 +123,20 @@ void CropDecimateNodelet::connectCb()
   }
 }
 
+// Allocate an outgoing image message and return a cv::Mat view of its buffer
+static cv::Mat allocateImage(const std_msgs::Header& header, const std::string& encoding,
+                             int rows, int cols, int type, sensor_msgs::ImagePtr& msg)
+{
+  msg = boost::make_shared<sensor_msgs::Image>();
+  msg->header   = header;
+  msg->height   = rows;
+  msg->width    = cols;
+  msg->encoding = encoding;
+  msg->step     = cols * CV_ELEM_SIZE(type);
+  msg->data.resize(msg->height * msg->step);
+  return cv::Mat(rows, cols, type, msg->data.empty() ? NULL : &msg->data[0], msg->step);
+}
+
 template <typename T>
 void debayer2x2toBGR(const cv::Mat& src, cv::Mat& dst, int R, int G1, int G2, int B)
 {
@@ -139,30 +162,51 @@ void debayer2x2toBGR(const cv::Mat& src, cv::Mat& dst, int R, int G1, int G2, in
   }
 }
 
-// Templated on pixel size, in bytes (MONO8 = 1, BGR8 = 3, RGBA16 = 8, ...)
-template <int N>
-void decimate(const cv::Mat& src, cv::Mat& dst, int decimation_x, int decimation_y)
+// Debayer and decimate in one pass, each BGR output pixel made from a block of
+// quads_x x quads_y Bayer quads. With AREA the block is averaged (binning),
+// otherwise its top-left quad is sampled. dst must already have the output size.
+template <typename T, bool AREA>
+void debayerDecimate(const cv::Mat& src, cv::Mat& dst, int R, int G1, int G2, int B,
+                     int quads_x, int quads_y)
 {
-  dst.create(src.rows / decimation_y, src.cols / decimation_x, src.type());
-
-  int src_row_step = src.step[0] * decimation_y;
-  int src_pixel_step = N * decimation_x;
-  int dst_row_step = dst.step[0];
-
-  const uint8_t* src_row = src.ptr();
-  uint8_t* dst_row = dst.ptr();
-  
+  const int src_row_step = src.step1();
+  const int dst_row_step = dst.step1();
+  const int quads = AREA ? quads_x * quads_y : 1;
+  const int sample_rows = AREA ? quads_y : 1;
+  const int sample_cols = AREA ? quads_x : 1;
+  const int round = AREA ? quads / 2 : 0; // sampling truncates green like debayer2x2toBGR
+  std::vector<uint32_t> sums(dst.cols * 3);
+
+  const T* src_block = src.ptr<T>();
+  T* dst_row = dst.ptr<T>();
   for (int y = 0; y < dst.rows; ++y)
   {
-    const uint8_t* src_pixel = src_row;
-    uint8_t* dst_pixel = dst_row;
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int qy = 0; qy < sample_rows; ++qy)
+    {
+      const T* src_row = src_block + qy * 2 * src_row_step;
+      for (int x = 0; x < dst.cols; ++x)
+      {
+        const T* quad = src_row + x * quads_x * 2;
+        uint32_t b = 0, g = 0, r = 0;
+        for (int qx = 0; qx < sample_cols; ++qx, quad += 2)
+        {
+          b += quad[B];
+          g += quad[G1] + quad[G2];
+          r += quad[R];
+        }
+        sums[x*3 + 0] += b;
+        sums[x*3 + 1] += g;
+        sums[x*3 + 2] += r;
+      }
+    }
     for (int x = 0; x < dst.cols; ++x)
     {
-      memcpy(dst_pixel, src_pixel, N); // Should inline with small, fixed N
-      src_pixel += src_pixel_step;
-      dst_pixel += N;
+      dst_row[x*3 + 0] = (sums[x*3 + 0] + round) / quads;
+      dst_row[x*3 + 1] = (sums[x*3 + 1] + 2 * round) / (2 * quads);
+      dst_row[x*3 + 2] = (sums[x*3 + 2] + round) / quads;
     }
-    src_row += src_row_step;
+    src_block += src_row_step * 2 * quads_y;
     dst_row += dst_row_step;
   }
 }
@@ -172,6 +216,7 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
 {
   /// @todo Check image dimensions match info_msg
   /// @todo Publish tweaks to config_ so they appear in reconfigure_gui
+  StageTimer timer(stats_.get(), image_msg->header.stamp);
 
   Config config;
   {
@@ -218,9 +263,12 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   CvImageConstPtr source = toCvShare(image_msg);
 
   // Except in Bayer downsampling case, output has same encoding as the input
-  CvImage output(source->header, source->encoding);
+  std::string encoding = source->encoding;
   // Apply ROI (no copy, still a view of the image_msg data)
-  output.image = source->image(cv::Rect(config.x_offset, config.y_offset, width, height));
+  cv::Mat image = source->image(cv::Rect(config.x_offset, config.y_offset, width, height));
+
+  // The last processing stage writes straight into the outgoing message
+  sensor_msgs::ImagePtr out_image;
 
   // Special case: when decimating Bayer images, we first do a 2x2 decimation to BGR
   if (is_bayer && (decimation_x > 1 || decimation_y > 1))
@@ -231,72 +279,107 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
       return;
     }
 
-    cv::Mat bgr;
-    int step = output.image.step1();
-    if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_RGGB8)
-      debayer2x2toBGR<uint8_t>(output.image, bgr, 0, 1, step, step + 1);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_BGGR8)
-      debayer2x2toBGR<uint8_t>(output.image, bgr, step + 1, 1, step, 0);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_GBRG8)
-      debayer2x2toBGR<uint8_t>(output.image, bgr, step, 0, step + 1, 1);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_GRBG8)
-      debayer2x2toBGR<uint8_t>(output.image, bgr, 1, 0, step + 1, step);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_RGGB16)
-      debayer2x2toBGR<uint16_t>(output.image, bgr, 0, 1, step, step + 1);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_BGGR16)
-      debayer2x2toBGR<uint16_t>(output.image, bgr, step + 1, 1, step, 0);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_GBRG16)
-      debayer2x2toBGR<uint16_t>(output.image, bgr, step, 0, step + 1, 1);
-    else if (image_msg->encoding == sensor_msgs::image_encodings::BAYER_GRBG16)
-      debayer2x2toBGR<uint16_t>(output.image, bgr, 1, 0, step + 1, step);
+    decimation_x /= 2;
+    decimation_y /= 2;
+    encoding = (image.depth() == CV_8U) ? sensor_msgs::image_encodings::BGR8
+                                        : sensor_msgs::image_encodings::BGR16;
+
+    // Offsets of the color samples within each Bayer quad
+    namespace enc = sensor_msgs::image_encodings;
+    const std::string& raw_encoding = image_msg->encoding;
+    int step = image.step1();
+    int R, G1, G2, B;
+    if (raw_encoding == enc::BAYER_RGGB8 || raw_encoding == enc::BAYER_RGGB16) {
+      R = 0; G1 = 1; G2 = step; B = step + 1;
+    }
+    else if (raw_encoding == enc::BAYER_BGGR8 || raw_encoding == enc::BAYER_BGGR16) {
+      R = step + 1; G1 = 1; G2 = step; B = 0;
+    }
+    else if (raw_encoding == enc::BAYER_GBRG8 || raw_encoding == enc::BAYER_GBRG16) {
+      R = step; G1 = 0; G2 = step + 1; B = 1;
+    }
+    else if (raw_encoding == enc::BAYER_GRBG8 || raw_encoding == enc::BAYER_GRBG16) {
+      R = 1; G1 = 0; G2 = step + 1; B = step;
+    }
     else
     {
       NODELET_ERROR_THROTTLE(2, "Unrecognized Bayer encoding '%s'", image_msg->encoding.c_str());
       return;
     }
 
-    output.image = bgr;
-    output.encoding = (bgr.depth() == CV_8U) ? sensor_msgs::image_encodings::BGR8
-                                             : sensor_msgs::image_encodings::BGR16;
-    decimation_x /= 2;
-    decimation_y /= 2;
+    bool area = config.interpolation == image_proc::CropDecimate_Area;
+    if ((decimation_x == 1 && decimation_y == 1) || area ||
+        config.interpolation == image_proc::CropDecimate_NN)
+    {
+      // Read each output pixel's Bayer quads straight from the ROI into the message
+      cv::Mat bgr = allocateImage(source->header, encoding,
+                                  image.rows / (2 * decimation_y), image.cols / (2 * decimation_x),
+                                  CV_MAKETYPE(image.depth(), 3), out_image);
+      if (image.depth() == CV_8U)
+      {
+        if (area)
+          debayerDecimate<uint8_t, true>(image, bgr, R, G1, G2, B, decimation_x, decimation_y);
+        else
+          debayerDecimate<uint8_t, false>(image, bgr, R, G1, G2, B, decimation_x, decimation_y);
+      }
+      else
+      {
+        if (area)
+          debayerDecimate<uint16_t, true>(image, bgr, R, G1, G2, B, decimation_x, decimation_y);
+        else
+          debayerDecimate<uint16_t, false>(image, bgr, R, G1, G2, B, decimation_x, decimation_y);
+      }
+      decimation_x = decimation_y = 1;
+      image = bgr;
+    }
+    else
+    {
+      // Other interpolations resample the 2x2-debayered image below
+      cv::Mat bgr;
+      if (image.depth() == CV_8U)
+        debayer2x2toBGR<uint8_t>(image, bgr, R, G1, G2, B);
+      else
+        debayer2x2toBGR<uint16_t>(image, bgr, R, G1, G2, B);
+      image = bgr;
+    }
   }
 
   // Apply further downsampling, if necessary
   if (decimation_x > 1 || decimation_y > 1)
   {
-    cv::Mat decimated;
+    cv::Mat decimated = allocateImage(source->header, encoding, image.rows / decimation_y,
+                                      image.cols / decimation_x, image.type(), out_image);
 
     if (config.interpolation == image_proc::CropDecimate_NN)
     {
       // Use optimized method instead of OpenCV's more general NN resize
-      int pixel_size = output.image.elemSize();
+      int pixel_size = image.elemSize();
       switch (pixel_size)
       {
         // Currently support up through 4-channel float
         case 1:
-          decimate<1>(output.image, decimated, decimation_x, decimation_y);
+          decimate<1>(image, decimated, decimation_x, decimation_y);
           break;
         case 2:
-          decimate<2>(output.image, decimated, decimation_x, decimation_y);
+          decimate<2>(image, decimated, decimation_x, decimation_y);
           break;
         case 3:
-          decimate<3>(output.image, decimated, decimation_x, decimation_y);
+          decimate<3>(image, decimated, decimation_x, decimation_y);
           break;
         case 4:
-          decimate<4>(output.image, decimated, decimation_x, decimation_y);
+          decimate<4>(image, decimated, decimation_x, decimation_y);
           break;
         case 6:
-          decimate<6>(output.image, decimated, decimation_x, decimation_y);
+          decimate<6>(image, decimated, decimation_x, decimation_y);
           break;
         case 8:
-          decimate<8>(output.image, decimated, decimation_x, decimation_y);
+          decimate<8>(image, decimated, decimation_x, decimation_y);
           break;
         case 12:
-          decimate<12>(output.image, decimated, decimation_x, decimation_y);
+          decimate<12>(image, decimated, decimation_x, decimation_y);
           break;
         case 16:
-          decimate<16>(output.image, decimated, decimation_x, decimation_y);
+          decimate<16>(image, decimated, decimation_x, decimation_y);
           break;
         default:
           NODELET_ERROR_THROTTLE(2, "Unsupported pixel size, %d bytes", pixel_size);
@@ -306,16 +389,17 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
     else
     {
       // Linear, cubic, area, ...
-      cv::Size size(output.image.cols / decimation_x, output.image.rows / decimation_y);
-      cv::resize(output.image, decimated, size, 0.0, 0.0, config.interpolation);
+      cv::resize(image, decimated, decimated.size(), 0.0, 0.0, config.interpolation);
     }
-
-    output.image = decimated;
   }
 
-  // Create output Image message
-  /// @todo Could save copies by allocating this above and having output.image alias it
-  sensor_msgs::ImagePtr out_image = output.toImageMsg();
+  // Crop only: the one copy out of the source message
+  if (!out_image)
+  {
+    cv::Mat cropped = allocateImage(source->header, encoding, image.rows, image.cols,
+                                    image.type(), out_image);
+    image.copyTo(cropped);
+  }
 
   // Create updated CameraInfo message
   sensor_msgs::CameraInfoPtr out_info = boost::make_shared<sensor_msgs::CameraInfo>(*info_msg);
@@ -331,6 +415,7 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   if (width != (int)image_msg->width || height != (int)image_msg->height)
     out_info->roi.do_rectify = true;
   
+  timer.setBytes(out_image->data.size());
   pub_.publish(out_image, out_info);
 }
 
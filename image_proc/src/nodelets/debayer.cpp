@@ -43,6 +43,8 @@
 #include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
 #include <image_proc/DebayerConfig.h>
+#include <image_proc/bayer.h>
+#include <image_proc/instrumentation.h>
 
 #include <opencv2/imgproc/imgproc.hpp>
 // Until merged into OpenCV
@@ -71,6 +73,8 @@ class DebayerNodelet : public nodelet::Nodelet
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
   Config config_;
 
+  StageStatsPtr stats_;
+
   virtual void onInit();
 
   void connectCb();
@@ -91,6 +95,8 @@ void DebayerNodelet::onInit()
   ReconfigureServer::CallbackType f = boost::bind(&DebayerNodelet::configCb, this, _1, _2);
   reconfigure_server_->setCallback(f);
 
+  stats_ = Instrumentation::stage(private_nh, "debayer");
+
   // Monitor whether anyone is subscribed to the output
   typedef image_transport::SubscriberStatusCallback ConnectCB;
   ConnectCB connect_cb = boost::bind(&DebayerNodelet::connectCb, this);
@@ -115,6 +121,7 @@ void DebayerNodelet::connectCb()
 
 void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
 {
+  StageTimer timer(stats_.get(), raw_msg->header.stamp);
   int bit_depth = enc::bitDepth(raw_msg->encoding);
   //@todo Fix as soon as bitDepth fixes it
   if (raw_msg->encoding == enc::YUV422)
@@ -132,6 +139,26 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
         NODELET_WARN_THROTTLE(30,
                             "Raw image data from topic '%s' has unsupported depth: %d",
                             sub_raw_.getTopic().c_str(), bit_depth);
+      } else if (enc::isBayer(raw_msg->encoding)) {
+        // Demosaic straight to luminance, writing into the message buffer
+        BayerPattern pattern;
+        bayerPattern(raw_msg->encoding, pattern);
+        int type = bit_depth == 8 ? CV_8UC1 : CV_16UC1;
+        const cv::Mat bayer(raw_msg->height, raw_msg->width, type,
+                            const_cast<uint8_t*>(&raw_msg->data[0]), raw_msg->step);
+
+        sensor_msgs::ImagePtr gray_msg = boost::make_shared<sensor_msgs::Image>();
+        gray_msg->header   = raw_msg->header;
+        gray_msg->height   = raw_msg->height;
+        gray_msg->width    = raw_msg->width;
+        gray_msg->encoding = bit_depth == 8 ? enc::MONO8 : enc::MONO16;
+        gray_msg->step     = gray_msg->width * (bit_depth / 8);
+        gray_msg->data.resize(gray_msg->height * gray_msg->step);
+
+        cv::Mat gray(gray_msg->height, gray_msg->width, type, &gray_msg->data[0], gray_msg->step);
+        debayerMono(bayer, gray, pattern);
+        timer.setBytes(gray_msg->data.size());
+        pub_mono_.publish(gray_msg);
       } else {
         // Use cv_bridge to convert to Mono. If a type is not supported,
         // it will error out there
@@ -196,19 +223,12 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
           algorithm == Debayer_EdgeAwareWeighted)
       {
         // These algorithms are not in OpenCV yet
-        if (raw_msg->encoding != enc::BAYER_GRBG8)
-        {
-          NODELET_WARN_THROTTLE(30, "Edge aware algorithms currently only support GRBG8 Bayer. "
-                                "Falling back to bilinear interpolation.");
-          algorithm = Debayer_Bilinear;
-        }
+        BayerPattern pattern;
+        bayerPattern(raw_msg->encoding, pattern);
+        if (algorithm == Debayer_EdgeAware)
+          debayerEdgeAware(bayer, color, pattern);
         else
-        {
-          if (algorithm == Debayer_EdgeAware)
-            debayerEdgeAware(bayer, color);
-          else
-            debayerEdgeAwareWeighted(bayer, color);
-        }
+          debayerEdgeAwareWeighted(bayer, color, pattern);
       }
       if (algorithm == Debayer_Bilinear ||
           algorithm == Debayer_VNG)
@@ -233,6 +253,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
         cv::cvtColor(bayer, color, code);
       }
       
+      timer.setBytes(color_msg->data.size());
       pub_color_.publish(color_msg);
   }
   else if (raw_msg->encoding == enc::YUV422)
@@ -32,773 +32,282 @@
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
 #include "edge_aware.h"
-
-#define AVG(a,b) (((int)(a) + (int)(b)) >> 1)
-#define AVG3(a,b,c) (((int)(a) + (int)(b) + (int)(c)) / 3)
-#define AVG4(a,b,c,d) (((int)(a) + (int)(b) + (int)(c) + (int)(d)) >> 2)
-#define WAVG4(a,b,c,d,x,y)  ( ( ((int)(a) + (int)(b)) * (int)(x) + ((int)(c) + (int)(d)) * (int)(y) ) / ( 2 * ((int)(x) + (int(y))) ) )
-using namespace std;
+#include <opencv2/imgproc/imgproc.hpp>
+#include <boost/cstdint.hpp>
+#include <cstdlib>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace image_proc {
 
-void debayerEdgeAware(const cv::Mat& bayer, cv::Mat& color)
-{
-  unsigned width = bayer.cols;
-  unsigned height = bayer.rows;
-  unsigned rgb_line_step = color.step[0];
-  unsigned rgb_line_skip = rgb_line_step - width * 3;
-  int bayer_line_step = bayer.step[0];
-  int bayer_line_step2 = bayer_line_step * 2;
-
-  unsigned char* rgb_buffer = color.data;
-  unsigned char* bayer_pixel = bayer.data;
-  unsigned yIdx, xIdx;
-
-  int dh, dv;
+namespace {
 
-  // first two pixel values for first two lines
-  // Bayer         0 1 2
-  //         0     G r g
-  // line_step     b g b
-  // line_step2    g r g
+// Site kinds, by the raw color at the pixel (green split by the color of its row)
+enum { RED, GREEN_R_ROW, GREEN_B_ROW, BLUE };
 
-  rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-  rgb_buffer[1] = bayer_pixel[0]; // green pixel
-  rgb_buffer[rgb_line_step + 2] = rgb_buffer[2] = bayer_pixel[bayer_line_step]; // blue;
+// Green at a red or blue site, interpolated along the smoother direction
+template <bool WEIGHTED>
+inline int edgeGreen(int n, int s, int w, int e)
+{
+  const int dv = std::abs(n - s);
+  const int dh = std::abs(w - e);
+  if (WEIGHTED) {
+    // Weight each direction by the other one's gradient; flat areas fall back
+    // to the plain average. Single precision is exact for 8 bit and within one
+    // count for 16 bit, and matches the SSE2 path below operation for operation.
+    const int flat = (dh + dv) == 0;
+    const float num = (float)(n + s) * (float)(dh + flat) + (float)(w + e) * (float)(dv + flat);
+    return (int)(num / (float)(2 * (dh + dv + 2 * flat)));
+  }
+  const int vertical = (n + s) >> 1;
+  const int horizontal = (w + e) >> 1;
+  const int both = (n + s + w + e) >> 2;
+  return dh > dv ? vertical : (dv > dh ? horizontal : both);
+}
 
-  // Bayer         0 1 2
-  //         0     g R g
-  // line_step     b g b
-  // line_step2    g r g
-  //rgb_pixel[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
+// Demosaic one pixel to BGR. xl and xr index the left and right neighbors so
+// the image edges can pass reflected columns.
+template <typename T, bool WEIGHTED, int KIND>
+inline void edgeAwareSite(const T* up, const T* cur, const T* down, int xl, int x, int xr, T* bgr)
+{
+  const int c = cur[x];
+  const int n = up[x], s = down[x], w = cur[xl], e = cur[xr];
+  if (KIND == RED || KIND == BLUE) {
+    const int diagonal = (up[xl] + up[xr] + down[xl] + down[xr]) >> 2;
+    bgr[1] = edgeGreen<WEIGHTED>(n, s, w, e);
+    bgr[KIND == RED ? 2 : 0] = c;
+    bgr[KIND == RED ? 0 : 2] = diagonal;
+  }
+  else {
+    const int horizontal = (w + e) >> 1;
+    const int vertical = (n + s) >> 1;
+    bgr[1] = c;
+    bgr[KIND == GREEN_R_ROW ? 2 : 0] = horizontal;
+    bgr[KIND == GREEN_R_ROW ? 0 : 2] = vertical;
+  }
+}
 
-  // BGBG line
-  // Bayer         0 1 2
-  //         0     g r g
-  // line_step     B g b
-  // line_step2    g r g
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-  rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[bayer_line_step2]);
-  //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
+#if defined(__SSE2__)
+// Integer lanes wide enough for the sums of four neighbors: 8 pixels of int16
+// for 8-bit input, 4 pixels of int32 for 16-bit input
+template <typename T> struct Lanes;
 
-  // pixel (1, 1)  0 1 2
-  //         0     g r g
-  // line_step     b G b
-  // line_step2    g r g
-  //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = AVG( bayer_pixel[line_step] , bayer_pixel[line_step+2] );
+template <> struct Lanes<uint8_t>
+{
+  typedef int16_t Lane;
+  enum { N = 8 };
 
-  rgb_buffer += 6;
-  bayer_pixel += 2;
-  // rest of the first two lines
-  for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
+  static __m128i load(const uint8_t* src)
+  {
+    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), _mm_setzero_si128());
+  }
+  static __m128i add(__m128i a, __m128i b) { return _mm_add_epi16(a, b); }
+  static __m128i shr(__m128i a, int bits) { return _mm_srli_epi16(a, bits); }
+  static __m128i absdiff(__m128i a, __m128i b) { return _mm_max_epi16(_mm_sub_epi16(a, b), _mm_sub_epi16(b, a)); }
+  static __m128i greater(__m128i a, __m128i b) { return _mm_cmpgt_epi16(a, b); }
+  static __m128i isZero(__m128i a) { return _mm_cmpeq_epi16(a, _mm_setzero_si128()); }
+  static __m128i one() { return _mm_set1_epi16(1); }
+  // Lane i holds column x + i with x odd
+  static __m128i sites(int color_x)
   {
-    // GRGR line
-    // Bayer        -1 0 1 2
-    //           0   r G r g
-    //   line_step   g b g b
-    // line_step2    r g r g
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[2] = bayer_pixel[bayer_line_step + 1];
+    return color_x ? _mm_set_epi16(0, -1, 0, -1, 0, -1, 0, -1) : _mm_set_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+  }
 
-    // Bayer        -1 0 1 2
-    //          0    r g R g
-    //  line_step    g b g b
-    // line_step2    r g r g
-    rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 5] = rgb_buffer[5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
+  // (ns*a + we*b) / den; the numerator is exact in int32 and in float
+  static __m128i weighted(__m128i ns, __m128i we, __m128i a, __m128i b, __m128i den)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    __m128 lo = _mm_cvtepi32_ps(_mm_madd_epi16(_mm_unpacklo_epi16(ns, we), _mm_unpacklo_epi16(a, b)));
+    __m128 hi = _mm_cvtepi32_ps(_mm_madd_epi16(_mm_unpackhi_epi16(ns, we), _mm_unpackhi_epi16(a, b)));
+    lo = _mm_div_ps(lo, _mm_cvtepi32_ps(_mm_unpacklo_epi16(den, zero)));
+    hi = _mm_div_ps(hi, _mm_cvtepi32_ps(_mm_unpackhi_epi16(den, zero)));
+    return _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+  }
+};
 
-    // BGBG line
-    // Bayer         -1 0 1 2
-    //         0      r g r g
-    // line_step      g B g b
-    // line_step2     r g r g
-    rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
+template <> struct Lanes<uint16_t>
+{
+  typedef int32_t Lane;
+  enum { N = 4 };
 
-    // Bayer         -1 0 1 2
-    //         0      r g r g
-    // line_step      g b G b
-    // line_step2     r g r g
-    rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    //rgb_pixel[rgb_line_step + 5] = AVG( bayer_pixel[line_step] , bayer_pixel[line_step+2] );
+  static __m128i load(const uint16_t* src)
+  {
+    return _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), _mm_setzero_si128());
+  }
+  static __m128i add(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+  static __m128i shr(__m128i a, int bits) { return _mm_srli_epi32(a, bits); }
+  static __m128i absdiff(__m128i a, __m128i b)
+  {
+    const __m128i d = _mm_sub_epi32(a, b), sign = _mm_srai_epi32(d, 31);
+    return _mm_sub_epi32(_mm_xor_si128(d, sign), sign);
+  }
+  static __m128i greater(__m128i a, __m128i b) { return _mm_cmpgt_epi32(a, b); }
+  static __m128i isZero(__m128i a) { return _mm_cmpeq_epi32(a, _mm_setzero_si128()); }
+  static __m128i one() { return _mm_set1_epi32(1); }
+  static __m128i sites(int color_x)
+  {
+    return color_x ? _mm_set_epi32(0, -1, 0, -1) : _mm_set_epi32(-1, 0, -1, 0);
   }
 
-  // last two pixel values for first two lines
-  // GRGR line
-  // Bayer        -1 0 1
-  //           0   r G r
-  //   line_step   g b g
-  // line_step2    r g r
-  rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-  rgb_buffer[1] = bayer_pixel[0];
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = rgb_buffer[5] = rgb_buffer[2] = bayer_pixel[bayer_line_step];
+  // Same operations as the scalar edgeGreen, so both round alike
+  static __m128i weighted(__m128i ns, __m128i we, __m128i a, __m128i b, __m128i den)
+  {
+    const __m128 num = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(ns), _mm_cvtepi32_ps(a)),
+                                  _mm_mul_ps(_mm_cvtepi32_ps(we), _mm_cvtepi32_ps(b)));
+    return _mm_cvttps_epi32(_mm_div_ps(num, _mm_cvtepi32_ps(den)));
+  }
+};
 
-  // Bayer        -1 0 1
-  //          0    r g R
-  //  line_step    g b g
-  // line_step2    r g r
-  rgb_buffer[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-  //rgb_pixel[5] = bayer_pixel[line_step];
+inline __m128i select(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
 
-  // BGBG line
-  // Bayer        -1 0 1
-  //          0    r g r
-  //  line_step    g B g
-  // line_step2    r g r
-  rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-  rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-  //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
+// Interior columns of a row from x = 1, Lanes<T>::N at a time. The red or
+// blue sites of the row sit at column parity COLOR_X, and OWN is the BGR
+// index of their color. The channels are computed as planes and interleaved
+// on the way out. Returns the first column left for the scalar loop, which
+// is still odd.
+template <typename T, bool WEIGHTED, int COLOR_X, int OWN>
+int edgeAwareRowSse2(const T* up, const T* cur, const T* down, T* out, int width)
+{
+  typedef Lanes<T> L;
+  const __m128i color = L::sites(COLOR_X);
+  int x = 1;
+  for (; x + L::N < width; x += L::N) {
+    const __m128i n = L::load(up + x), s = L::load(down + x);
+    const __m128i w = L::load(cur + x - 1), c = L::load(cur + x), e = L::load(cur + x + 1);
+    const __m128i ns = L::add(n, s), we = L::add(w, e);
+    const __m128i vertical = L::shr(ns, 1), horizontal = L::shr(we, 1);
+    const __m128i diagonal = L::shr(L::add(L::add(L::load(up + x - 1), L::load(up + x + 1)),
+                                           L::add(L::load(down + x - 1), L::load(down + x + 1))), 2);
 
-  // Bayer         -1 0 1
-  //         0      r g r
-  // line_step      g b G
-  // line_step2     r g r
-  rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
+    // edgeGreen
+    const __m128i dv = L::absdiff(n, s), dh = L::absdiff(w, e);
+    __m128i green;
+    if (WEIGHTED) {
+      const __m128i flat = _mm_and_si128(L::isZero(L::add(dh, dv)), L::one());
+      const __m128i half_den = L::add(L::add(dh, dv), L::add(flat, flat));
+      green = L::weighted(ns, we, L::add(dh, flat), L::add(dv, flat), L::add(half_den, half_den));
+    }
+    else {
+      green = select(L::greater(dh, dv), vertical,
+                     select(L::greater(dv, dh), horizontal, L::shr(L::add(ns, we), 2)));
+    }
 
-  bayer_pixel += bayer_line_step + 2;
-  rgb_buffer += rgb_line_step + 6 + rgb_line_skip;
-  // main processing
-  for (yIdx = 2; yIdx < height - 2; yIdx += 2)
-  {
-    // first two pixel values
-    // Bayer         0 1 2
-    //        -1     b g b
-    //         0     G r g
-    // line_step     b g b
-    // line_step2    g r g
-    
-    rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-    rgb_buffer[1] = bayer_pixel[0]; // green pixel
-    rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]); // blue;
-    
-    // Bayer         0 1 2
-    //        -1     b g b
-    //         0     g R g
-    // line_step     b g b
-    // line_step2    g r g
-    //rgb_pixel[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-    rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step]);
-    
-    // BGBG line
-    // Bayer         0 1 2
-    //         0     g r g
-    // line_step     B g b
-    // line_step2    g r g
-    rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[bayer_line_step2]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-    
-    // pixel (1, 1)  0 1 2
-    //         0     g r g
-    // line_step     b G b
-    // line_step2    g r g
-    //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-    
-    rgb_buffer += 6;
-    bayer_pixel += 2;
-    // continue with rest of the line
-    for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
-    {
-      // GRGR line
-      // Bayer        -1 0 1 2
-      //          -1   g b g b
-      //           0   r G r g
-      //   line_step   g b g b
-      // line_step2    r g r g
-      rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-      rgb_buffer[1] = bayer_pixel[0];
-      rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-      
-      // Bayer        -1 0 1 2
-      //          -1   g b g b
-      //          0    r g R g
-      //  line_step    g b g b
-      // line_step2    r g r g
-      
-      dh = abs (bayer_pixel[0] - bayer_pixel[2]);
-      dv = abs (bayer_pixel[-bayer_line_step + 1] - bayer_pixel[bayer_line_step + 1]);
-      
-      if (dh > dv)
-        rgb_buffer[4] = AVG (bayer_pixel[-bayer_line_step + 1], bayer_pixel[bayer_line_step + 1]);
-      else if (dv > dh)
-        rgb_buffer[4] = AVG (bayer_pixel[0], bayer_pixel[2]);
-      else
-        rgb_buffer[4] = AVG4 (bayer_pixel[-bayer_line_step + 1], bayer_pixel[bayer_line_step + 1], bayer_pixel[0], bayer_pixel[2]);
-      
-      rgb_buffer[3] = bayer_pixel[1];
-      rgb_buffer[5] = AVG4 (bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step], bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-      
-      // BGBG line
-      // Bayer         -1 0 1 2
-      //         -1     g b g b
-      //          0     r g r g
-      // line_step      g B g b
-      // line_step2     r g r g
-      rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-      rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-      
-      dv = abs (bayer_pixel[0] - bayer_pixel[bayer_line_step2]);
-      dh = abs (bayer_pixel[bayer_line_step - 1] - bayer_pixel[bayer_line_step + 1]);
-      
-      if (dv > dh)
-        rgb_buffer[rgb_line_step + 1] = AVG (bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-      else if (dh > dv)
-        rgb_buffer[rgb_line_step + 1] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step2]);
-      else
-        rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-      
-      // Bayer         -1 0 1 2
-      //         -1     g b g b
-      //          0     r g r g
-      // line_step      g b G b
-      // line_step2     r g r g
-      rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-      rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-      rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
+    typename L::Lane planes[3][L::N];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[OWN]), select(color, c, horizontal));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[1]), select(color, green, c));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[2 - OWN]), select(color, diagonal, vertical));
+    T* bgr = out + 3 * x;
+    for (int i = 0; i < L::N; ++i, bgr += 3) {
+      bgr[0] = planes[0][i];
+      bgr[1] = planes[1][i];
+      bgr[2] = planes[2][i];
     }
-    
-    // last two pixels of the line
-    // last two pixel values for first two lines
-    // GRGR line
-    // Bayer        -1 0 1
-    //           0   r G r
-    //   line_step   g b g
-    // line_step2    r g r
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = rgb_buffer[5] = rgb_buffer[2] = bayer_pixel[bayer_line_step];
-    
-    // Bayer        -1 0 1
-    //          0    r g R
-    //  line_step    g b g
-    // line_step2    r g r
-    rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-    //rgb_pixel[5] = bayer_pixel[line_step];
-    
-    // BGBG line
-    // Bayer        -1 0 1
-    //          0    r g r
-    //  line_step    g B g
-    // line_step2    r g r
-    rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
-    
-    // Bayer         -1 0 1
-    //         0      r g r
-    // line_step      g b G
-    // line_step2     r g r
-    rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
-    
-    bayer_pixel += bayer_line_step + 2;
-    rgb_buffer += rgb_line_step + 6 + rgb_line_skip;
   }
-  
-  //last two lines
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     G r g
-  // line_step     b g b
-  
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-  rgb_buffer[1] = bayer_pixel[0]; // green pixel
-  rgb_buffer[rgb_line_step + 2] = rgb_buffer[2] = bayer_pixel[bayer_line_step]; // blue;
-  
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g R g
-  // line_step     b g b
-  //rgb_pixel[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-  rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step]);
-  
-  // BGBG line
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g r g
-  // line_step     B g b
-  //rgb_pixel[rgb_line_step    ] = bayer_pixel[1];
-  rgb_buffer[rgb_line_step + 1] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-  
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g r g
-  // line_step     b G b
-  //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-  
-  rgb_buffer += 6;
-  bayer_pixel += 2;
-  // rest of the last two lines
-  for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
-  {
-    // GRGR line
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r G r g
-    // line_step    g b g b
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-    
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g R g
-    // line_step    g b g b
-    rgb_buffer[rgb_line_step + 3] = rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-    rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[-bayer_line_step + 2]);
-    
-    // BGBG line
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g r g
-    // line_step    g B g b
-    rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[-1], bayer_pixel[1]);
-    rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-    
-    
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g r g
-    // line_step    g b G b
-    //rgb_pixel[rgb_line_step + 3] = bayer_pixel[1];
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-  }
-  
-  // last two pixel values for first two lines
-  // GRGR line
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r G r
-  // line_step    g b g
-  rgb_buffer[rgb_line_step ] = rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-  rgb_buffer[1] = bayer_pixel[0];
-  rgb_buffer[5] = rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-  
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g R
-  // line_step    g b g
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[-bayer_line_step + 1]);
-  //rgb_pixel[5] = AVG( bayer_pixel[line_step], bayer_pixel[-line_step] );
-  
-  // BGBG line
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g r
-  // line_step    g B g
-  //rgb_pixel[rgb_line_step    ] = AVG2( bayer_pixel[-1], bayer_pixel[1] );
-  rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-  
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g r
-  // line_step    g b G
-  //rgb_pixel[rgb_line_step + 3] = bayer_pixel[1];
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
+  return x;
 }
+#endif
 
-void debayerEdgeAwareWeighted(const cv::Mat& bayer, cv::Mat& color)
+// One output row, with the site kinds of even and odd columns fixed at
+// compile time so the inner loop has no per-pixel dispatch
+template <typename T, bool WEIGHTED, int EVEN, int ODD>
+void edgeAwareRow(const T* up, const T* cur, const T* down, T* out, int width)
 {
-  unsigned width = bayer.cols;
-  unsigned height = bayer.rows;
-  unsigned rgb_line_step = color.step[0];
-  unsigned rgb_line_skip = rgb_line_step - width * 3;
-  int bayer_line_step = bayer.step[0];
-  int bayer_line_step2 = bayer_line_step * 2;
-
-  unsigned char* rgb_buffer = color.data;
-  unsigned char* bayer_pixel = bayer.data;
-  unsigned yIdx, xIdx;
+  edgeAwareSite<T, WEIGHTED, EVEN>(up, cur, down, 1, 0, 1, out);
 
-  int dh, dv;
+  int x = 1;
+#if defined(__SSE2__)
+  const bool color_even = EVEN == RED || EVEN == BLUE;
+  const bool red_row = EVEN == RED || ODD == RED;
+  x = edgeAwareRowSse2<T, WEIGHTED, color_even ? 0 : 1, red_row ? 2 : 0>(up, cur, down, out, width);
+#endif
+  for (; x + 1 < width - 1; x += 2) {
+    edgeAwareSite<T, WEIGHTED, ODD>(up, cur, down, x - 1, x, x + 1, out + 3 * x);
+    edgeAwareSite<T, WEIGHTED, EVEN>(up, cur, down, x, x + 1, x + 2, out + 3 * (x + 1));
+  }
+  if (x < width - 1) {
+    // x is odd here
+    edgeAwareSite<T, WEIGHTED, ODD>(up, cur, down, x - 1, x, x + 1, out + 3 * x);
+    ++x;
+  }
 
-  // first two pixel values for first two lines
-  // Bayer         0 1 2
-  //         0     G r g
-  // line_step     b g b
-  // line_step2    g r g
+  const int l = width - 1;
+  if (l & 1)
+    edgeAwareSite<T, WEIGHTED, ODD>(up, cur, down, l - 1, l, l - 1, out + 3 * l);
+  else if (l > 0)
+    edgeAwareSite<T, WEIGHTED, EVEN>(up, cur, down, l - 1, l, l - 1, out + 3 * l);
+}
 
-  rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-  rgb_buffer[1] = bayer_pixel[0]; // green pixel
-  rgb_buffer[rgb_line_step + 2] = rgb_buffer[2] = bayer_pixel[bayer_line_step]; // blue;
-  
-  // Bayer         0 1 2
-  //         0     g R g
-  // line_step     b g b
-  // line_step2    g r g
-  //rgb_pixel[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-  
-  // BGBG line
-  // Bayer         0 1 2
-  //         0     g r g
-  // line_step     B g b
-  // line_step2    g r g
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-  rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[bayer_line_step2]);
-  //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
-  
-  // pixel (1, 1)  0 1 2
-  //         0     g r g
-  // line_step     b G b
-  // line_step2    g r g
-  //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = AVG( bayer_pixel[line_step] , bayer_pixel[line_step+2] );
-  
-  rgb_buffer += 6;
-  bayer_pixel += 2;
-  // rest of the first two lines
-  for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
+template <typename T, bool WEIGHTED>
+class EdgeAwareBody : public cv::ParallelLoopBody
+{
+public:
+  EdgeAwareBody(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern)
+    : bayer_(bayer), color_(color), red_x_(pattern & 1), red_y_(pattern >> 1)
   {
-    // GRGR line
-    // Bayer        -1 0 1 2
-    //           0   r G r g
-    //   line_step   g b g b
-    // line_step2    r g r g
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[2] = bayer_pixel[bayer_line_step + 1];
-    
-    // Bayer        -1 0 1 2
-    //          0    r g R g
-    //  line_step    g b g b
-    // line_step2    r g r g
-    rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 5] = rgb_buffer[5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-    
-    // BGBG line
-    // Bayer         -1 0 1 2
-    //         0      r g r g
-    // line_step      g B g b
-    // line_step2     r g r g
-    rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-    
-    // Bayer         -1 0 1 2
-    //         0      r g r g
-    // line_step      g b G b
-    // line_step2     r g r g
-    rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    //rgb_pixel[rgb_line_step + 5] = AVG( bayer_pixel[line_step] , bayer_pixel[line_step+2] );
   }
-  
-  // last two pixel values for first two lines
-  // GRGR line
-  // Bayer        -1 0 1
-  //           0   r G r
-  //   line_step   g b g
-  // line_step2    r g r
-  rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-  rgb_buffer[1] = bayer_pixel[0];
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = rgb_buffer[5] = rgb_buffer[2] = bayer_pixel[bayer_line_step];
-  
-  // Bayer        -1 0 1
-  //          0    r g R
-  //  line_step    g b g
-  // line_step2    r g r
-  rgb_buffer[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-  //rgb_pixel[5] = bayer_pixel[line_step];
-  
-  // BGBG line
-  // Bayer        -1 0 1
-  //          0    r g r
-  //  line_step    g B g
-  // line_step2    r g r
-  rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-  rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-  //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
-  
-  // Bayer         -1 0 1
-  //         0      r g r
-  // line_step      g b G
-  // line_step2     r g r
-  rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
-  
-  bayer_pixel += bayer_line_step + 2;
-  rgb_buffer += rgb_line_step + 6 + rgb_line_skip;
-  // main processing
-  for (yIdx = 2; yIdx < height - 2; yIdx += 2)
+
+  virtual void operator()(const cv::Range& rows) const
   {
-    // first two pixel values
-    // Bayer         0 1 2
-    //        -1     b g b
-    //         0     G r g
-    // line_step     b g b
-    // line_step2    g r g
-    
-    rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-    rgb_buffer[1] = bayer_pixel[0]; // green pixel
-    rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]); // blue;
-    
-    // Bayer         0 1 2
-    //        -1     b g b
-    //         0     g R g
-    // line_step     b g b
-    // line_step2    g r g
-    //rgb_pixel[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-    rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step]);
-    
-    // BGBG line
-    // Bayer         0 1 2
-    //         0     g r g
-    // line_step     B g b
-    // line_step2    g r g
-    rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[bayer_line_step2]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-    
-    // pixel (1, 1)  0 1 2
-    //         0     g r g
-    // line_step     b G b
-    // line_step2    g r g
-    //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-    
-    rgb_buffer += 6;
-    bayer_pixel += 2;
-    // continue with rest of the line
-    for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
-    {
-      // GRGR line
-      // Bayer        -1 0 1 2
-      //          -1   g b g b
-      //           0   r G r g
-      //   line_step   g b g b
-      // line_step2    r g r g
-      rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-      rgb_buffer[1] = bayer_pixel[0];
-      rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-      
-      // Bayer        -1 0 1 2
-      //          -1   g b g b
-      //          0    r g R g
-      //  line_step    g b g b
-      // line_step2    r g r g
-      
-      dh = abs (bayer_pixel[0] - bayer_pixel[2]);
-      dv = abs (bayer_pixel[-bayer_line_step + 1] - bayer_pixel[bayer_line_step + 1]);
-      
-      if (dv == 0 && dh == 0)
-        rgb_buffer[4] = AVG4 (bayer_pixel[1 - bayer_line_step], bayer_pixel[1 + bayer_line_step], bayer_pixel[0], bayer_pixel[2]);
-      else
-        rgb_buffer[4] = WAVG4 (bayer_pixel[1 - bayer_line_step], bayer_pixel[1 + bayer_line_step], bayer_pixel[0], bayer_pixel[2], dh, dv);
-      rgb_buffer[3] = bayer_pixel[1];
-      rgb_buffer[5] = AVG4 (bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step], bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-      
-      // BGBG line
-      // Bayer         -1 0 1 2
-      //         -1     g b g b
-      //          0     r g r g
-      // line_step      g B g b
-      // line_step2     r g r g
-      rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-      rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-      
-      dv = abs (bayer_pixel[0] - bayer_pixel[bayer_line_step2]);
-      dh = abs (bayer_pixel[bayer_line_step - 1] - bayer_pixel[bayer_line_step + 1]);
-      
-      if (dv == 0 && dh == 0)
-        rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
+    const int last = bayer_.rows - 1;
+    const int width = bayer_.cols;
+    for (int y = rows.start; y < rows.end; ++y) {
+      // Reflect rows past the top and bottom, which keeps their colors
+      const T* up   = bayer_.ptr<T>(y > 0 ? y - 1 : 1);
+      const T* cur  = bayer_.ptr<T>(y);
+      const T* down = bayer_.ptr<T>(y < last ? y + 1 : last - 1);
+      T* out = color_.ptr<T>(y);
+      const bool red_row = (y & 1) == red_y_;
+      if (red_row && red_x_ == 0)
+        edgeAwareRow<T, WEIGHTED, RED, GREEN_R_ROW>(up, cur, down, out, width);
+      else if (red_row)
+        edgeAwareRow<T, WEIGHTED, GREEN_R_ROW, RED>(up, cur, down, out, width);
+      else if (red_x_ == 0)
+        edgeAwareRow<T, WEIGHTED, GREEN_B_ROW, BLUE>(up, cur, down, out, width);
       else
-        rgb_buffer[rgb_line_step + 1] = WAVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1], dh, dv);
-      
-      // Bayer         -1 0 1 2
-      //         -1     g b g b
-      //          0     r g r g
-      // line_step      g b G b
-      // line_step2     r g r g
-      rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-      rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-      rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
+        edgeAwareRow<T, WEIGHTED, BLUE, GREEN_B_ROW>(up, cur, down, out, width);
     }
-    
-    // last two pixels of the line
-    // last two pixel values for first two lines
-    // GRGR line
-    // Bayer        -1 0 1
-    //           0   r G r
-    //   line_step   g b g
-    // line_step2    r g r
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = rgb_buffer[5] = rgb_buffer[2] = bayer_pixel[bayer_line_step];
-    
-    // Bayer        -1 0 1
-    //          0    r g R
-    //  line_step    g b g
-    // line_step2    r g r
-    rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-    //rgb_pixel[5] = bayer_pixel[line_step];
-    
-    // BGBG line
-    // Bayer        -1 0 1
-    //          0    r g r
-    //  line_step    g B g
-    // line_step2    r g r
-    rgb_buffer[rgb_line_step ] = AVG4 (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1], bayer_pixel[-1], bayer_pixel[bayer_line_step2 - 1]);
-    rgb_buffer[rgb_line_step + 1] = AVG4 (bayer_pixel[0], bayer_pixel[bayer_line_step2], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    //rgb_pixel[rgb_line_step + 2] = bayer_pixel[line_step];
-    
-    // Bayer         -1 0 1
-    //         0      r g r
-    // line_step      g b G
-    // line_step2     r g r
-    rgb_buffer[rgb_line_step + 3] = AVG (bayer_pixel[1], bayer_pixel[bayer_line_step2 + 1]);
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
-    
-    bayer_pixel += bayer_line_step + 2;
-    rgb_buffer += rgb_line_step + 6 + rgb_line_skip;
   }
-  
-  //last two lines
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     G r g
-  // line_step     b g b
-  
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[rgb_line_step ] = rgb_buffer[3] = rgb_buffer[0] = bayer_pixel[1]; // red pixel
-  rgb_buffer[1] = bayer_pixel[0]; // green pixel
-  rgb_buffer[rgb_line_step + 2] = rgb_buffer[2] = bayer_pixel[bayer_line_step]; // blue;
-  
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g R g
-  // line_step     b g b
-  //rgb_pixel[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-  rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[2 - bayer_line_step]);
-  
-  // BGBG line
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g r g
-  // line_step     B g b
-  //rgb_pixel[rgb_line_step    ] = bayer_pixel[1];
-  rgb_buffer[rgb_line_step + 1] = AVG (bayer_pixel[0], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
 
-  // Bayer         0 1 2
-  //        -1     b g b
-  //         0     g r g
-  // line_step     b G b
-  //rgb_pixel[rgb_line_step + 3] = AVG( bayer_pixel[1] , bayer_pixel[line_step2+1] );
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
-  
-  rgb_buffer += 6;
-  bayer_pixel += 2;
-  // rest of the last two lines
-  for (xIdx = 2; xIdx < width - 2; xIdx += 2, rgb_buffer += 6, bayer_pixel += 2)
-  {
-    // GRGR line
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r G r g
-    // line_step    g b g b
-    rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-    rgb_buffer[1] = bayer_pixel[0];
-    rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-    
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g R g
-    // line_step    g b g b
-    rgb_buffer[rgb_line_step + 3] = rgb_buffer[3] = bayer_pixel[1];
-    rgb_buffer[4] = AVG4 (bayer_pixel[0], bayer_pixel[2], bayer_pixel[bayer_line_step + 1], bayer_pixel[1 - bayer_line_step]);
-    rgb_buffer[5] = AVG4 (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2], bayer_pixel[-bayer_line_step], bayer_pixel[-bayer_line_step + 2]);
+private:
+  const cv::Mat& bayer_;
+  cv::Mat& color_;
+  int red_x_, red_y_;
+};
 
-    // BGBG line
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g r g
-    // line_step    g B g b
-    rgb_buffer[rgb_line_step ] = AVG (bayer_pixel[-1], bayer_pixel[1]);
-    rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-    rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-    
-    
-    // Bayer       -1 0 1 2
-    //        -1    g b g b
-    //         0    r g r g
-    // line_step    g b G b
-    //rgb_pixel[rgb_line_step + 3] = bayer_pixel[1];
-    rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-    rgb_buffer[rgb_line_step + 5] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[bayer_line_step + 2]);
+template <bool WEIGHTED>
+void debayer(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern)
+{
+  CV_Assert(bayer.type() == CV_8UC1 || bayer.type() == CV_16UC1);
+  if (bayer.rows < 2 || bayer.cols < 2) {
+    // Too small for the neighborhood, leave it to OpenCV's bilinear debayer
+    static const int codes[] = { cv::COLOR_BayerBG2BGR, cv::COLOR_BayerGB2BGR,
+                                 cv::COLOR_BayerGR2BGR, cv::COLOR_BayerRG2BGR };
+    cv::cvtColor(bayer, color, codes[pattern]);
+    return;
   }
-  
-  // last two pixel values for first two lines
-  // GRGR line
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r G r
-  // line_step    g b g
-  rgb_buffer[rgb_line_step ] = rgb_buffer[0] = AVG (bayer_pixel[1], bayer_pixel[-1]);
-  rgb_buffer[1] = bayer_pixel[0];
-  rgb_buffer[5] = rgb_buffer[2] = AVG (bayer_pixel[bayer_line_step], bayer_pixel[-bayer_line_step]);
-  
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g R
-  // line_step    g b g
-  rgb_buffer[rgb_line_step + 3] = rgb_buffer[3] = bayer_pixel[1];
-  rgb_buffer[4] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step + 1], bayer_pixel[-bayer_line_step + 1]);
-  //rgb_pixel[5] = AVG( bayer_pixel[line_step], bayer_pixel[-line_step] );
-  
-  // BGBG line
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g r
-  // line_step    g B g
-  //rgb_pixel[rgb_line_step    ] = AVG2( bayer_pixel[-1], bayer_pixel[1] );
-  rgb_buffer[rgb_line_step + 1] = AVG3 (bayer_pixel[0], bayer_pixel[bayer_line_step - 1], bayer_pixel[bayer_line_step + 1]);
-  rgb_buffer[rgb_line_step + 5] = rgb_buffer[rgb_line_step + 2] = bayer_pixel[bayer_line_step];
-  
-  // Bayer       -1 0 1
-  //        -1    g b g
-  //         0    r g r
-  // line_step    g b G
-  //rgb_pixel[rgb_line_step + 3] = bayer_pixel[1];
-  rgb_buffer[rgb_line_step + 4] = bayer_pixel[bayer_line_step + 1];
-  //rgb_pixel[rgb_line_step + 5] = bayer_pixel[line_step];
+  color.create(bayer.size(), CV_MAKETYPE(bayer.depth(), 3));
+
+  const cv::Range rows(0, bayer.rows);
+  if (bayer.depth() == CV_8U)
+    cv::parallel_for_(rows, EdgeAwareBody<uint8_t, WEIGHTED>(bayer, color, pattern));
+  else
+    cv::parallel_for_(rows, EdgeAwareBody<uint16_t, WEIGHTED>(bayer, color, pattern));
+}
+
+} // namespace
+
+void debayerEdgeAware(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern)
+{
+  debayer<false>(bayer, color, pattern);
+}
 
+void debayerEdgeAwareWeighted(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern)
+{
+  debayer<true>(bayer, color, pattern);
 }
 
 } // namespace image_proc
@@ -35,14 +35,18 @@
 #define IMAGE_PROC_EDGE_AWARE
 
 #include <opencv2/core/core.hpp>
+#include <image_proc/bayer.h>
 
 // Edge-aware debayering algorithms, intended for eventual inclusion in OpenCV.
+// Both take CV_8UC1 or CV_16UC1 input in any Bayer layout and write BGR of the
+// same depth. Rows are processed in parallel, with an SSE2 row kernel where
+// available. Images smaller than 2x2 go through OpenCV's bilinear debayer.
 
 namespace image_proc {
 
-void debayerEdgeAware(const cv::Mat& bayer, cv::Mat& color);
+void debayerEdgeAware(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern);
 
-void debayerEdgeAwareWeighted(const cv::Mat& bayer, cv::Mat& color);
+void debayerEdgeAwareWeighted(const cv::Mat& bayer, cv::Mat& color, BayerPattern pattern);
 
 } // namespace image_proc
 
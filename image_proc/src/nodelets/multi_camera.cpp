@@ -0,0 +1,267 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <image_transport/image_transport.h>
+#include <image_geometry/pinhole_camera_model.h>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <image_proc/processor.h>
+#include <image_proc/worker_pool.h>
+
+namespace image_proc {
+
+namespace enc = sensor_msgs::image_encodings;
+
+/**
+ * Debayers and rectifies any number of cameras on one shared worker pool,
+ * replacing a debayer and two rectify nodelets per camera. Cameras are listed
+ * as namespaces in ~cameras; each publishes the same topics the separate
+ * nodelets would. At most one frame per camera is processed at a time, so
+ * each camera's outputs stay in order, and a frame still waiting when the
+ * next one arrives is replaced by it.
+ */
+class MultiCameraNodelet : public nodelet::Nodelet
+{
+  struct Camera
+  {
+    Camera() : flags(0), busy(false) {}
+
+    std::string name;
+    boost::shared_ptr<image_transport::ImageTransport> it;
+    image_transport::CameraSubscriber sub;
+    image_transport::Publisher pub_mono, pub_color, pub_rect, pub_rect_color;
+
+    // Processing state, only touched by the one task running for this camera
+    Processor processor;
+    image_geometry::PinholeCameraModel model;
+    ImageSet images;
+
+    // Guards the outputs to compute and the frame waiting to be processed
+    boost::mutex mutex;
+    int flags; // Processor flags of the subscribed outputs
+    sensor_msgs::ImageConstPtr pending_image;
+    sensor_msgs::CameraInfoConstPtr pending_info;
+    bool busy;
+    std::string info_topic; // For messages from the workers, which can't read sub
+
+  };
+  typedef boost::shared_ptr<Camera> CameraPtr;
+
+  std::vector<CameraPtr> cameras_;
+  boost::shared_ptr<WorkerPool> pool_;
+  int queue_size_;
+
+  boost::mutex connect_mutex_;
+
+  virtual void onInit();
+
+  void connectCb(Camera* camera);
+
+  void imageCb(Camera* camera,
+               const sensor_msgs::ImageConstPtr& image_msg,
+               const sensor_msgs::CameraInfoConstPtr& info_msg);
+
+  void process(Camera* camera);
+
+  void publish(const image_transport::Publisher& pub, const std_msgs::Header& header,
+               const std::string& encoding, const cv::Mat& image);
+
+public:
+  ~MultiCameraNodelet();
+};
+
+MultiCameraNodelet::~MultiCameraNodelet()
+{
+  // Stop the workers before the cameras they process go away
+  for (size_t i = 0; i < cameras_.size(); ++i)
+    cameras_[i]->sub.shutdown();
+  pool_.reset();
+}
+
+void MultiCameraNodelet::onInit()
+{
+  ros::NodeHandle &nh         = getNodeHandle();
+  ros::NodeHandle &private_nh = getPrivateNodeHandle();
+
+  // Read parameters
+  private_nh.param("queue_size", queue_size_, 5);
+  int num_worker_threads;
+  private_nh.param("num_worker_threads", num_worker_threads, 0);
+  int interpolation;
+  private_nh.param("interpolation", interpolation, (int)cv::INTER_LINEAR);
+  bool fused;
+  private_nh.param("fused", fused, false);
+  std::vector<std::string> names;
+  if (!private_nh.getParam("cameras", names) || names.empty())
+  {
+    NODELET_ERROR("No cameras given, set ~cameras to a list of camera namespaces");
+    return;
+  }
+
+  pool_.reset(new WorkerPool(std::max(num_worker_threads, 0)));
+
+  // Make sure we don't enter connectCb() before all publishers are assigned
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  for (size_t i = 0; i < names.size(); ++i)
+  {
+    CameraPtr camera = boost::make_shared<Camera>();
+    camera->name = names[i];
+    camera->it.reset(new image_transport::ImageTransport(ros::NodeHandle(nh, names[i])));
+    camera->processor.interpolation_ = interpolation;
+    camera->processor.fused_ = fused;
+
+    // Monitor whether anyone is subscribed to the output
+    image_transport::SubscriberStatusCallback connect_cb =
+      boost::bind(&MultiCameraNodelet::connectCb, this, camera.get());
+    camera->pub_mono       = camera->it->advertise("image_mono",       1, connect_cb, connect_cb);
+    camera->pub_color      = camera->it->advertise("image_color",      1, connect_cb, connect_cb);
+    camera->pub_rect       = camera->it->advertise("image_rect",       1, connect_cb, connect_cb);
+    camera->pub_rect_color = camera->it->advertise("image_rect_color", 1, connect_cb, connect_cb);
+    cameras_.push_back(camera);
+  }
+}
+
+// Handles (un)subscribing when clients (un)subscribe
+void MultiCameraNodelet::connectCb(Camera* camera)
+{
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  // Work out once which outputs to compute, instead of on every frame
+  int flags = 0;
+  if (camera->pub_mono.getNumSubscribers() > 0)       flags |= Processor::MONO;
+  if (camera->pub_color.getNumSubscribers() > 0)      flags |= Processor::COLOR;
+  if (camera->pub_rect.getNumSubscribers() > 0)       flags |= Processor::RECT;
+  if (camera->pub_rect_color.getNumSubscribers() > 0) flags |= Processor::RECT_COLOR;
+  {
+    boost::lock_guard<boost::mutex> camera_lock(camera->mutex);
+    camera->flags = flags;
+  }
+  NODELET_DEBUG("Camera '%s' publishes outputs 0x%x, computing 0x%x", camera->name.c_str(),
+                flags, Processor::dependencies(flags));
+
+  if (flags == 0)
+    camera->sub.shutdown();
+  else if (!camera->sub)
+  {
+    image_transport::TransportHints hints("raw", ros::TransportHints(), getPrivateNodeHandle());
+    camera->sub = camera->it->subscribeCamera("image_raw", queue_size_,
+                                              boost::bind(&MultiCameraNodelet::imageCb, this, camera, _1, _2),
+                                              ros::VoidPtr(), hints);
+    boost::lock_guard<boost::mutex> camera_lock(camera->mutex);
+    camera->info_topic = camera->sub.getInfoTopic();
+  }
+}
+
+void MultiCameraNodelet::imageCb(Camera* camera,
+                                 const sensor_msgs::ImageConstPtr& image_msg,
+                                 const sensor_msgs::CameraInfoConstPtr& info_msg)
+{
+  boost::lock_guard<boost::mutex> lock(camera->mutex);
+  camera->pending_image = image_msg;
+  camera->pending_info = info_msg;
+  if (!camera->busy)
+  {
+    camera->busy = true;
+    pool_->submit(boost::bind(&MultiCameraNodelet::process, this, camera));
+  }
+}
+
+void MultiCameraNodelet::process(Camera* camera)
+{
+  // One frame per task, so a busy camera gives its worker back to the others
+  sensor_msgs::ImageConstPtr image_msg;
+  sensor_msgs::CameraInfoConstPtr info_msg;
+  int flags;
+  std::string info_topic;
+  {
+    boost::lock_guard<boost::mutex> lock(camera->mutex);
+    image_msg.swap(camera->pending_image);
+    info_msg.swap(camera->pending_info);
+    flags = camera->flags;
+    info_topic = camera->info_topic;
+  }
+
+  // Verify camera is actually calibrated
+  if ((flags & (Processor::RECT | Processor::RECT_COLOR)) && info_msg->K[0] == 0.0)
+  {
+    NODELET_ERROR_THROTTLE(30, "Rectified topics of camera '%s' requested but camera publishing '%s' "
+                           "is uncalibrated", camera->name.c_str(), info_topic.c_str());
+    flags &= ~(Processor::RECT | Processor::RECT_COLOR);
+  }
+
+  if (flags)
+  {
+    camera->model.fromCameraInfo(info_msg);
+    if (camera->processor.process(image_msg, camera->model, camera->images, flags))
+    {
+      const ImageSet& images = camera->images;
+      if (flags & Processor::MONO)
+        publish(camera->pub_mono, image_msg->header, enc::MONO8, images.mono);
+      if (flags & Processor::COLOR)
+        publish(camera->pub_color, image_msg->header, images.color_encoding, images.color);
+      if (flags & Processor::RECT)
+        publish(camera->pub_rect, image_msg->header, enc::MONO8, images.rect);
+      if (flags & Processor::RECT_COLOR)
+        publish(camera->pub_rect_color, image_msg->header, images.color_encoding, images.rect_color);
+    }
+  }
+
+  // Queue the camera behind the others if a frame arrived meanwhile
+  boost::lock_guard<boost::mutex> lock(camera->mutex);
+  if (camera->pending_image)
+    pool_->submit(boost::bind(&MultiCameraNodelet::process, this, camera));
+  else
+    camera->busy = false;
+}
+
+void MultiCameraNodelet::publish(const image_transport::Publisher& pub, const std_msgs::Header& header,
+                                 const std::string& encoding, const cv::Mat& image)
+{
+  sensor_msgs::ImagePtr msg = boost::make_shared<sensor_msgs::Image>();
+  cv_bridge::CvImage(header, encoding, image).toImageMsg(*msg);
+  pub.publish(msg);
+}
+
+} // namespace image_proc
+
+// Register nodelet
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_EXPORT_CLASS( image_proc::MultiCameraNodelet, nodelet::Nodelet)
@@ -31,6 +31,7 @@
 *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
+#include <boost/make_shared.hpp>
 #include <boost/version.hpp>
 #if ((BOOST_VERSION / 100) % 1000) >= 53
 #include <boost/thread/lock_guard.hpp>
@@ -41,20 +42,30 @@
 #include <image_transport/image_transport.h>
 #include <image_geometry/pinhole_camera_model.h>
 #include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
 #include <image_proc/RectifyConfig.h>
+#include <image_proc/rectification_maps.h>
+#include <image_proc/processor.h>
+#include <image_proc/ordered_executor.h>
+#include <image_proc/instrumentation.h>
 
 namespace image_proc {
 
+namespace enc = sensor_msgs::image_encodings;
+
 class RectifyNodelet : public nodelet::Nodelet
 {
   // ROS communication
   boost::shared_ptr<image_transport::ImageTransport> it_;
   image_transport::CameraSubscriber sub_camera_;
   int queue_size_;
+  bool fused_;
+  bool fused_color_;
   
   boost::mutex connect_mutex_;
   image_transport::Publisher pub_rect_;
+  ros::Publisher pub_info_; // calibration of image_rect, scaled to its resolution
 
   // Dynamic reconfigure
   boost::recursive_mutex config_mutex_;
@@ -63,8 +74,17 @@ class RectifyNodelet : public nodelet::Nodelet
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
   Config config_;
 
-  // Processing state (note: only safe because we're using single-threaded NodeHandle!)
-  image_geometry::PinholeCameraModel model_;
+  // Processing state, one per frame in flight
+  struct State
+  {
+    image_geometry::PinholeCameraModel model;
+    RectificationMapsConstPtr maps; // shared with other nodelets rectifying this camera
+    Processor processor; // scratch for fused demosaicing
+  };
+  typedef OrderedExecutor<State> Executor;
+  boost::shared_ptr<Executor> executor_;
+
+  StageStatsPtr stats_;
 
   virtual void onInit();
 
@@ -73,6 +93,13 @@ class RectifyNodelet : public nodelet::Nodelet
   void imageCb(const sensor_msgs::ImageConstPtr& image_msg,
                const sensor_msgs::CameraInfoConstPtr& info_msg);
 
+  Executor::Publish rectify(State& state,
+                            const sensor_msgs::ImageConstPtr& image_msg,
+                            const sensor_msgs::CameraInfoConstPtr& info_msg);
+
+  void publishRect(const sensor_msgs::ImageConstPtr& rect_msg,
+                   const sensor_msgs::CameraInfoConstPtr& rect_info_msg);
+
   void configCb(Config &config, uint32_t level);
 };
 
@@ -84,68 +111,149 @@ void RectifyNodelet::onInit()
 
   // Read parameters
   private_nh.param("queue_size", queue_size_, 5);
+  // Rectify this many frames concurrently; 0 rectifies in the subscriber callback
+  int num_worker_threads;
+  private_nh.param("num_worker_threads", num_worker_threads, 0);
+  executor_.reset(new Executor(std::max(num_worker_threads, 0)));
+  // Rectify image_raw instead of image_mono, demosaicing Bayer input (bilinear)
+  // in the same tiled pass; ~fused_color publishes color rather than mono
+  private_nh.param("fused", fused_, false);
+  private_nh.param("fused_color", fused_color_, false);
 
   // Set up dynamic reconfigure
   reconfigure_server_.reset(new ReconfigureServer(config_mutex_, private_nh));
   ReconfigureServer::CallbackType f = boost::bind(&RectifyNodelet::configCb, this, _1, _2);
   reconfigure_server_->setCallback(f);
 
+  stats_ = Instrumentation::stage(private_nh, "rectify");
+
   // Monitor whether anyone is subscribed to the output
   image_transport::SubscriberStatusCallback connect_cb = boost::bind(&RectifyNodelet::connectCb, this);
+  ros::SubscriberStatusCallback connect_cb_info = boost::bind(&RectifyNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_rect_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_rect_  = it_->advertise("image_rect",  1, connect_cb, connect_cb);
+  pub_info_  = nh.advertise<sensor_msgs::CameraInfo>("camera_info_rect", 1, connect_cb_info, connect_cb_info);
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void RectifyNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_rect_.getNumSubscribers() == 0)
+  if (pub_rect_.getNumSubscribers() == 0 && pub_info_.getNumSubscribers() == 0)
     sub_camera_.shutdown();
   else if (!sub_camera_)
   {
     image_transport::TransportHints hints("raw", ros::TransportHints(), getPrivateNodeHandle());
-    sub_camera_ = it_->subscribeCamera("image_mono", queue_size_, &RectifyNodelet::imageCb, this, hints);
+    sub_camera_ = it_->subscribeCamera(fused_ ? "image_raw" : "image_mono", queue_size_,
+                                       &RectifyNodelet::imageCb, this, hints);
   }
 }
 
 void RectifyNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
                              const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
+  executor_->submit(boost::bind(&RectifyNodelet::rectify, this, _1, image_msg, info_msg));
+}
+
+RectifyNodelet::Executor::Publish RectifyNodelet::rectify(State& state,
+                                                          const sensor_msgs::ImageConstPtr& image_msg,
+                                                          const sensor_msgs::CameraInfoConstPtr& info_msg)
+{
+  // Queue wait includes the time spent waiting for a worker
+  StageTimer timer(stats_.get(), image_msg->header.stamp);
+
   // Verify camera is actually calibrated
   if (info_msg->K[0] == 0.0) {
     NODELET_ERROR_THROTTLE(30, "Rectified topic '%s' requested but camera publishing '%s' "
                            "is uncalibrated", pub_rect_.getTopic().c_str(),
                            sub_camera_.getInfoTopic().c_str());
-    return;
+    return Executor::Publish();
   }
 
-  // If zero distortion, just pass the message along
-  if (info_msg->D.empty() || info_msg->D[0] == 0.0)
+  int interpolation, decimation_x, decimation_y;
+  cv::Rect roi;
   {
-    pub_rect_.publish(image_msg);
-    return;
+    boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
+    interpolation = config_.interpolation;
+    decimation_x = config_.decimation_x;
+    decimation_y = config_.decimation_y;
+    roi = cv::Rect(config_.x_offset, config_.y_offset, config_.width, config_.height);
   }
 
-  // Update the camera model
-  model_.fromCameraInfo(info_msg);
+  // In fused mode the input is image_raw, which needs demosaicing or at least
+  // conversion to mono unless it already is what we publish
+  const std::string& encoding = image_msg->encoding;
+  const bool demosaic = fused_ && enc::isBayer(encoding);
+  const bool to_mono = fused_ && !fused_color_ && !demosaic && encoding != enc::MONO8;
+
+  // If zero distortion and full resolution, just pass the message along, with
+  // the same rectified calibration the maps would have published
+  bool full_output = (decimation_x == 1 && decimation_y == 1 && roi == cv::Rect());
+  if (full_output && !demosaic && !to_mono && (info_msg->D.empty() || info_msg->D[0] == 0.0))
+  {
+    state.model.fromCameraInfo(info_msg);
+    sensor_msgs::CameraInfoPtr rect_info_msg =
+      boost::make_shared<sensor_msgs::CameraInfo>(RectificationMaps::rectifiedInfo(state.model));
+    rect_info_msg->header = image_msg->header;
+    return boost::bind(&RectifyNodelet::publishRect, this, image_msg,
+                       sensor_msgs::CameraInfoConstPtr(rect_info_msg));
+  }
+
+  // Update the camera model and maps only when the calibration or output changes
+  if (!state.maps || !state.maps->matches(*info_msg, roi, decimation_x, decimation_y))
+  {
+    state.model.fromCameraInfo(info_msg);
+    state.maps = RectificationMapCache::instance().get(state.model, roi, decimation_x, decimation_y);
+  }
+  const RectificationMaps& maps = *state.maps;
   
+  // Allocate new rectified image message
+  cv::Mat image;
+  int rect_type;
+  sensor_msgs::ImagePtr rect_msg = boost::make_shared<sensor_msgs::Image>();
+  if (demosaic) {
+    rect_type = fused_color_ ? CV_8UC3 : CV_8UC1;
+    rect_msg->encoding = fused_color_ ? enc::BGR8 : enc::MONO8;
+  }
+  else {
+    image = cv_bridge::toCvShare(image_msg, to_mono ? enc::MONO8 : std::string())->image;
+    rect_type = image.type();
+    rect_msg->encoding = to_mono ? enc::MONO8 : encoding;
+  }
+  rect_msg->header   = image_msg->header;
+  rect_msg->height   = maps.map1.rows;
+  rect_msg->width    = maps.map1.cols;
+  rect_msg->step     = rect_msg->width * CV_ELEM_SIZE(rect_type);
+  rect_msg->data.resize(rect_msg->height * rect_msg->step);
+
   // Create cv::Mat views onto both buffers
-  const cv::Mat image = cv_bridge::toCvShare(image_msg)->image;
-  cv::Mat rect;
+  cv::Mat rect(rect_msg->height, rect_msg->width, rect_type, &rect_msg->data[0], rect_msg->step);
+
+  sensor_msgs::CameraInfoPtr rect_info_msg = boost::make_shared<sensor_msgs::CameraInfo>(maps.rect_info);
+  rect_info_msg->header = image_msg->header;
 
   // Rectify and publish
-  int interpolation;
-  {
-    boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
-    interpolation = config_.interpolation;
+  if (demosaic) {
+    ImageSet images;
+    (fused_color_ ? images.rect_color : images.rect) = rect;
+    state.processor.interpolation_ = interpolation;
+    if (!state.processor.processFused(*image_msg, maps, images, fused_color_ ? Processor::RECT_COLOR
+                                                                             : Processor::RECT))
+      return Executor::Publish();
   }
-  model_.rectifyImage(image, rect, interpolation);
+  else
+    maps.rectify(image, rect, interpolation);
+  timer.setBytes(rect_msg->data.size());
+  return boost::bind(&RectifyNodelet::publishRect, this, sensor_msgs::ImageConstPtr(rect_msg),
+                     sensor_msgs::CameraInfoConstPtr(rect_info_msg));
+}
 
-  // Allocate new rectified image message
-  sensor_msgs::ImagePtr rect_msg = cv_bridge::CvImage(image_msg->header, image_msg->encoding, rect).toImageMsg();
+void RectifyNodelet::publishRect(const sensor_msgs::ImageConstPtr& rect_msg,
+                                 const sensor_msgs::CameraInfoConstPtr& rect_info_msg)
+{
   pub_rect_.publish(rect_msg);
+  pub_info_.publish(rect_info_msg);
 }
 
 void RectifyNodelet::configCb(Config &config, uint32_t level)
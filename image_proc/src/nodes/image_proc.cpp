@@ -61,6 +61,10 @@ int main(int argc, char **argv)
   int queue_size;
   if (private_nh.getParam("queue_size", queue_size))
     shared_params["queue_size"] = queue_size;
+  // Rectify straight from image_raw, demosaicing in the same pass
+  bool fused = false;
+  if (private_nh.getParam("fused", fused))
+    shared_params["fused"] = fused;
 
   nodelet::Loader manager(false); // Don't bring up the manager ROS API
   nodelet::M_string remappings;
@@ -70,19 +74,22 @@ int main(int argc, char **argv)
   std::string debayer_name = ros::this_node::getName() + "_debayer";
   manager.load(debayer_name, "image_proc/debayer", remappings, my_argv);
 
-  // Rectify nodelet, image_mono -> image_rect
+  // Rectify nodelet, image_mono (image_raw if fused) -> image_rect
   std::string rectify_mono_name = ros::this_node::getName() + "_rectify_mono";
   if (shared_params.valid())
     ros::param::set(rectify_mono_name, shared_params);
   manager.load(rectify_mono_name, "image_proc/rectify", remappings, my_argv);
 
-  // Rectify nodelet, image_color -> image_rect_color
+  // Rectify nodelet, image_color (image_raw if fused) -> image_rect_color
   // NOTE: Explicitly resolve any global remappings here, so they don't get hidden.
   remappings["image_mono"] = ros::names::resolve("image_color");
   remappings["image_rect"] = ros::names::resolve("image_rect_color");
   std::string rectify_color_name = ros::this_node::getName() + "_rectify_color";
-  if (shared_params.valid())
-    ros::param::set(rectify_color_name, shared_params);
+  XmlRpc::XmlRpcValue color_params = shared_params;
+  if (fused)
+    color_params["fused_color"] = true;
+  if (color_params.valid())
+    ros::param::set(rectify_color_name, color_params);
   manager.load(rectify_color_name, "image_proc/rectify", remappings, my_argv);
 
   // Check for only the original camera topics
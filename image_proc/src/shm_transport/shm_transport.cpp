@@ -0,0 +1,83 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <image_transport/simple_publisher_plugin.h>
+#include <image_transport/simple_subscriber_plugin.h>
+#include <image_proc/shm_ring.h>
+
+namespace image_proc {
+
+/**
+ * image_transport plugin "shm": images are written to a shared-memory ring
+ * and only their descriptors are sent, for subscribers on the same host.
+ */
+class ShmPublisherPlugin : public image_transport::SimplePublisherPlugin<ShmDescriptor>
+{
+public:
+  virtual std::string getTransportName() const { return "shm"; }
+
+protected:
+  virtual void publish(const sensor_msgs::Image& message, const PublishFn& publish_fn) const
+  {
+    ShmDescriptor desc;
+    desc.header = message.header;
+    if (writer_.write(message, desc))
+      publish_fn(desc);
+  }
+
+private:
+  mutable ShmWriter<sensor_msgs::Image> writer_;
+};
+
+class ShmSubscriberPlugin : public image_transport::SimpleSubscriberPlugin<ShmDescriptor>
+{
+public:
+  virtual std::string getTransportName() const { return "shm"; }
+
+protected:
+  virtual void internalCallback(const ShmDescriptorConstPtr& message, const Callback& user_cb)
+  {
+    sensor_msgs::ImageConstPtr image = reader_.read(*message);
+    if (image)
+      user_cb(image);
+  }
+
+private:
+  ShmReader<sensor_msgs::Image> reader_;
+};
+
+} // namespace image_proc
+
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_EXPORT_CLASS( image_proc::ShmPublisherPlugin, image_transport::PublisherPlugin)
+PLUGINLIB_EXPORT_CLASS( image_proc::ShmSubscriberPlugin, image_transport::SubscriberPlugin)
@@ -0,0 +1,263 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <image_proc/bayer.h>
+#include "../src/nodelets/edge_aware.h"
+#include <gtest/gtest.h>
+#include <boost/cstdint.hpp>
+#include <cstdlib>
+
+using namespace image_proc;
+
+namespace {
+
+/// Random mosaic, with runs of equal values so flat and tied gradients occur too
+cv::Mat randomBayer(int rows, int cols, int type, unsigned int seed)
+{
+  cv::Mat bayer(rows, cols, type);
+  srand(seed);
+  const int max = type == CV_8UC1 ? 255 : 65535;
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      const int value = rand() % 3 == 0 ? max - (x & 1) : rand() % (max + 1);
+      if (type == CV_8UC1)
+        bayer.at<uint8_t>(y, x) = value;
+      else
+        bayer.at<uint16_t>(y, x) = value;
+    }
+  }
+  return bayer;
+}
+
+template <typename T>
+int rawAt(const cv::Mat& bayer, int y, int x)
+{
+  // Reflect past the edges, which keeps the color of the site
+  if (y < 0) y = 1;
+  if (y >= bayer.rows) y = bayer.rows - 2;
+  if (x < 0) x = 1;
+  if (x >= bayer.cols) x = bayer.cols - 2;
+  return bayer.at<T>(y, x);
+}
+
+/// Reference for one pixel, straight from the definition of the algorithm
+template <typename T>
+cv::Vec3i edgeAwarePixel(const cv::Mat& bayer, BayerPattern pattern, bool weighted, int y, int x)
+{
+  const int c = rawAt<T>(bayer, y, x);
+  const int n = rawAt<T>(bayer, y - 1, x), s = rawAt<T>(bayer, y + 1, x);
+  const int w = rawAt<T>(bayer, y, x - 1), e = rawAt<T>(bayer, y, x + 1);
+  const int vertical = (n + s) >> 1, horizontal = (w + e) >> 1;
+  const bool red_row = (y & 1) == (pattern >> 1);
+  const bool color_site = (x & 1) == (red_row ? (pattern & 1) : 1 - (pattern & 1));
+  const int own = red_row ? 2 : 0;
+
+  cv::Vec3i bgr;
+  if (!color_site) {
+    bgr[1] = c;
+    bgr[own] = horizontal;
+    bgr[2 - own] = vertical;
+    return bgr;
+  }
+
+  const int dv = std::abs(n - s), dh = std::abs(w - e);
+  if (weighted) {
+    const int flat = dh + dv == 0;
+    const float num = (float)(n + s) * (float)(dh + flat) + (float)(w + e) * (float)(dv + flat);
+    bgr[1] = (int)(num / (float)(2 * (dh + dv + 2 * flat)));
+  }
+  else if (dh > dv)
+    bgr[1] = vertical;
+  else if (dv > dh)
+    bgr[1] = horizontal;
+  else
+    bgr[1] = (n + s + w + e) >> 2;
+  bgr[own] = c;
+  bgr[2 - own] = (rawAt<T>(bayer, y - 1, x - 1) + rawAt<T>(bayer, y - 1, x + 1) +
+                  rawAt<T>(bayer, y + 1, x - 1) + rawAt<T>(bayer, y + 1, x + 1)) >> 2;
+  return bgr;
+}
+
+template <typename T>
+void expectEdgeAware(const cv::Mat& bayer, BayerPattern pattern, bool weighted)
+{
+  cv::Mat color;
+  if (weighted)
+    debayerEdgeAwareWeighted(bayer, color, pattern);
+  else
+    debayerEdgeAware(bayer, color, pattern);
+  ASSERT_EQ(bayer.size(), color.size());
+  ASSERT_EQ(CV_MAKETYPE(bayer.depth(), 3), color.type());
+
+  int mismatches = 0;
+  for (int y = 0; y < bayer.rows; ++y) {
+    for (int x = 0; x < bayer.cols; ++x) {
+      const cv::Vec3i expected = edgeAwarePixel<T>(bayer, pattern, weighted, y, x);
+      const T* actual = color.ptr<T>(y) + 3 * x;
+      for (int k = 0; k < 3; ++k) {
+        if (actual[k] != expected[k] && mismatches++ < 10)
+          ADD_FAILURE() << "pattern " << pattern << ", " << bayer.cols << "x" << bayer.rows
+                        << ", pixel (" << x << ", " << y << ") channel " << k << ": "
+                        << (int)actual[k] << " != " << expected[k];
+      }
+    }
+  }
+}
+
+void expectEdgeAware(int type, bool weighted)
+{
+  // Widths on both sides of every multiple of the SSE2 step, for the scalar tail
+  for (int cols = 2; cols <= 40; ++cols) {
+    for (int rows = 2; rows <= 5; ++rows) {
+      for (int pattern = 0; pattern < 4; ++pattern) {
+        const cv::Mat bayer = randomBayer(rows, cols, type, cols * 16 + rows * 4 + pattern);
+        if (type == CV_8UC1)
+          expectEdgeAware<uint8_t>(bayer, (BayerPattern)pattern, weighted);
+        else
+          expectEdgeAware<uint16_t>(bayer, (BayerPattern)pattern, weighted);
+      }
+    }
+  }
+}
+
+/// Bilinear demosaic followed by the cv::COLOR_BGR2GRAY weights in Q14. Every
+/// channel is taken as four times its bilinear average, hence the shift by 16.
+template <typename T>
+int monoPixel(const cv::Mat& bayer, BayerPattern pattern, int y, int x)
+{
+  const int c = rawAt<T>(bayer, y, x);
+  const int h = rawAt<T>(bayer, y, x - 1) + rawAt<T>(bayer, y, x + 1);
+  const int v = rawAt<T>(bayer, y - 1, x) + rawAt<T>(bayer, y + 1, x);
+  const int d = rawAt<T>(bayer, y - 1, x - 1) + rawAt<T>(bayer, y - 1, x + 1) +
+                rawAt<T>(bayer, y + 1, x - 1) + rawAt<T>(bayer, y + 1, x + 1);
+  const bool red_row = (y & 1) == (pattern >> 1);
+  const bool color_site = (x & 1) == (red_row ? (pattern & 1) : 1 - (pattern & 1));
+
+  int64_t r, g, b;
+  if (color_site) {
+    g = h + v;
+    r = red_row ? 4 * c : d;
+    b = red_row ? d : 4 * c;
+  }
+  else {
+    g = 4 * c;
+    r = 2 * (red_row ? h : v);
+    b = 2 * (red_row ? v : h);
+  }
+  return (int)((4899 * r + 9617 * g + 1868 * b + (1 << 15)) >> 16);
+}
+
+template <typename T>
+void expectMono(const cv::Mat& bayer, BayerPattern pattern)
+{
+  cv::Mat mono;
+  debayerMono(bayer, mono, pattern);
+  ASSERT_EQ(bayer.size(), mono.size());
+  ASSERT_EQ(bayer.type(), mono.type());
+
+  int mismatches = 0;
+  for (int y = 0; y < bayer.rows; ++y) {
+    for (int x = 0; x < bayer.cols; ++x) {
+      const int expected = monoPixel<T>(bayer, pattern, y, x);
+      const int actual = mono.at<T>(y, x);
+      if (actual != expected && mismatches++ < 10)
+        ADD_FAILURE() << "pattern " << pattern << ", " << bayer.cols << "x" << bayer.rows
+                      << ", pixel (" << x << ", " << y << "): " << actual << " != " << expected;
+    }
+  }
+}
+
+void expectMono(int type)
+{
+  for (int cols = 2; cols <= 40; ++cols) {
+    for (int rows = 2; rows <= 5; ++rows) {
+      for (int pattern = 0; pattern < 4; ++pattern) {
+        const cv::Mat bayer = randomBayer(rows, cols, type, cols * 16 + rows * 4 + pattern);
+        if (type == CV_8UC1)
+          expectMono<uint8_t>(bayer, (BayerPattern)pattern);
+        else
+          expectMono<uint16_t>(bayer, (BayerPattern)pattern);
+      }
+    }
+  }
+}
+
+} // namespace
+
+TEST(DebayerMono, matchesDefinition8)
+{
+  expectMono(CV_8UC1);
+}
+
+TEST(DebayerMono, matchesDefinition16)
+{
+  expectMono(CV_16UC1);
+}
+
+TEST(EdgeAware, matchesDefinition8)
+{
+  expectEdgeAware(CV_8UC1, false);
+}
+
+TEST(EdgeAware, matchesDefinition16)
+{
+  expectEdgeAware(CV_16UC1, false);
+}
+
+TEST(EdgeAwareWeighted, matchesDefinition8)
+{
+  expectEdgeAware(CV_8UC1, true);
+}
+
+TEST(EdgeAwareWeighted, matchesDefinition16)
+{
+  expectEdgeAware(CV_16UC1, true);
+}
+
+TEST(EdgeAware, fallsBackOnDegenerateSizes)
+{
+  const int sizes[][2] = { { 1, 1 }, { 1, 8 }, { 8, 1 } };
+  for (int i = 0; i < 3; ++i) {
+    const cv::Mat bayer = randomBayer(sizes[i][0], sizes[i][1], CV_8UC1, i);
+    cv::Mat color;
+    EXPECT_NO_THROW(debayerEdgeAware(bayer, color, BAYER_RGGB));
+    EXPECT_EQ(bayer.size(), color.size());
+    EXPECT_NO_THROW(debayerEdgeAwareWeighted(bayer, color, BAYER_GRBG));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
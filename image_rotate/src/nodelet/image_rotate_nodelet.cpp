@@ -52,16 +52,71 @@
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <dynamic_reconfigure/server.h>
+#include <boost/thread/mutex.hpp>
 #include <math.h>
+#include <vector>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
 namespace image_rotate {
+
+// Fills the CV_16SC2 and CV_16UC1 remap tables of an inverse affine map, one
+// output row per index, with the fixed-point arithmetic cv::warpAffine uses
+// for its own tables: per row a start point, per column a precomputed step.
+class AffineMapBody : public cv::ParallelLoopBody
+{
+public:
+  AffineMapBody(const cv::Mat_<double>& inverse, cv::Mat& map1, cv::Mat& map2)
+    : inverse_(inverse), map1_(map1), map2_(map2), x_steps_(map1.cols), y_steps_(map1.cols)
+  {
+    for (int u = 0; u < map1.cols; ++u)
+    {
+      x_steps_[u] = cv::saturate_cast<int>(inverse(0, 0) * u * AB_SCALE);
+      y_steps_[u] = cv::saturate_cast<int>(inverse(1, 0) * u * AB_SCALE);
+    }
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    const int round_delta = AB_SCALE / cv::INTER_TAB_SIZE / 2;
+    const int cols = map1_.cols;
+    for (int v = rows.start; v < rows.end; ++v)
+    {
+      const int x0 = cv::saturate_cast<int>((inverse_(0, 1) * v + inverse_(0, 2)) * AB_SCALE) + round_delta;
+      const int y0 = cv::saturate_cast<int>((inverse_(1, 1) * v + inverse_(1, 2)) * AB_SCALE) + round_delta;
+      short* xy = map1_.ptr<short>(v);
+      ushort* alpha = map2_.ptr<ushort>(v);
+      for (int u = 0; u < cols; ++u)
+      {
+        const int x = (x0 + x_steps_[u]) >> (AB_BITS - cv::INTER_BITS);
+        const int y = (y0 + y_steps_[u]) >> (AB_BITS - cv::INTER_BITS);
+        xy[2 * u] = cv::saturate_cast<short>(x >> cv::INTER_BITS);
+        xy[2 * u + 1] = cv::saturate_cast<short>(y >> cv::INTER_BITS);
+        alpha[u] = (ushort)((y & (cv::INTER_TAB_SIZE - 1)) * cv::INTER_TAB_SIZE + (x & (cv::INTER_TAB_SIZE - 1)));
+      }
+    }
+  }
+
+private:
+  // Fractional bits of the coordinates before rounding to INTER_BITS
+  static const int AB_BITS = 10;
+  static const int AB_SCALE = 1 << AB_BITS;
+
+  const cv::Mat_<double>& inverse_;
+  cv::Mat& map1_;
+  cv::Mat& map2_;
+  std::vector<int> x_steps_;
+  std::vector<int> y_steps_;
+};
+
 class ImageRotateNodelet : public nodelet::Nodelet
 {
   tf2_ros::Buffer tf_buffer_;
   boost::shared_ptr<tf2_ros::TransformListener> tf_sub_;
   tf2_ros::TransformBroadcaster tf_pub_;
 
+  // Guards config_ and the vectors built from it, read by the image callbacks
+  // and the refresh timer while the reconfigure callback writes them
+  boost::mutex config_mutex_;
   image_rotate::ImageRotateConfig config_;
   dynamic_reconfigure::Server<image_rotate::ImageRotateConfig> srv;
 
@@ -79,21 +134,44 @@ class ImageRotateNodelet : public nodelet::Nodelet
   double angle_;
   ros::Time prev_stamp_;
 
+  // Warp maps for map_angle_, reused while the angle stays within angle_tolerance
+  cv::Mat map1_, map2_;
+  cv::Size map_in_size_;
+  int map_out_size_;
+  double map_angle_;
+
+  // Latest angle from the tf_refresh_rate timer, if enabled
+  boost::mutex tf_mutex_;
+  ros::Timer tf_timer_;
+  std::string tf_input_frame_id_;
+  double tf_angle_;
+  bool tf_angle_valid_;
+
   void reconfigureCallback(image_rotate::ImageRotateConfig &new_config, uint32_t level)
   {
-    config_ = new_config;
-    target_vector_.vector.x = config_.target_x;
-    target_vector_.vector.y = config_.target_y;
-    target_vector_.vector.z = config_.target_z;
-
-    source_vector_.vector.x = config_.source_x;
-    source_vector_.vector.y = config_.source_y;
-    source_vector_.vector.z = config_.source_z;
+    {
+      boost::mutex::scoped_lock lock(config_mutex_);
+      config_ = new_config;
+      target_vector_.vector.x = config_.target_x;
+      target_vector_.vector.y = config_.target_y;
+      target_vector_.vector.z = config_.target_z;
+
+      source_vector_.vector.x = config_.source_x;
+      source_vector_.vector.y = config_.source_y;
+      source_vector_.vector.z = config_.source_z;
+    }
     if (subscriber_count_)
     { // @todo Could do this without an interruption at some point.
       unsubscribe();
       subscribe();
     }
+    updateTfTimer();
+  }
+
+  image_rotate::ImageRotateConfig currentConfig()
+  {
+    boost::mutex::scoped_lock lock(config_mutex_);
+    return config_;
   }
 
   const std::string &frameWithDefault(const std::string &frame, const std::string &image_frame)
@@ -113,52 +191,203 @@ class ImageRotateNodelet : public nodelet::Nodelet
     do_work(msg, msg->header.frame_id);
   }
 
-  void do_work(const sensor_msgs::ImageConstPtr& msg, const std::string input_frame_from_msg)
+  // Wrap an angle difference to [-pi, pi]
+  static double angleDifference(double a, double b)
   {
+    double delta = fmod(a - b, 2.0 * M_PI);
+    if (delta > M_PI)
+      delta -= 2.0 * M_PI;
+    else if (delta < - M_PI)
+      delta += 2.0 * M_PI;
+    return delta;
+  }
+
+  // Angle between the target and source vectors in the image frame at the
+  // given time. Returns false, leaving angle alone, if either vector projects
+  // to zero; throws tf2::TransformException if a transform is unavailable.
+  bool lookupAngle(const std::string& input_frame_id, const ros::Time& stamp, double& angle)
+  {
+    // Local copies, the refresh timer may run concurrently with image callbacks
+    // and reconfiguration
+    image_rotate::ImageRotateConfig config;
+    geometry_msgs::Vector3Stamped target_vector, source_vector;
+    {
+      boost::mutex::scoped_lock lock(config_mutex_);
+      config = config_;
+      target_vector = target_vector_;
+      source_vector = source_vector_;
+    }
+
+    // Transform the target vector into the image frame.
+    target_vector.header.stamp = stamp;
+    target_vector.header.frame_id = frameWithDefault(config.target_frame_id, input_frame_id);
+    geometry_msgs::Vector3Stamped target_vector_transformed;
+    geometry_msgs::TransformStamped transform = tf_buffer_.lookupTransform(config.target_frame_id, input_frame_id, stamp);
+    tf2::doTransform(target_vector, target_vector_transformed, transform);
+
+    // Transform the source vector into the image frame.
+    source_vector.header.stamp = stamp;
+    source_vector.header.frame_id = frameWithDefault(config.source_frame_id, input_frame_id);
+    geometry_msgs::Vector3Stamped source_vector_transformed;
+    transform = tf_buffer_.lookupTransform(config.source_frame_id, input_frame_id, stamp);
+    tf2::doTransform(source_vector, source_vector_transformed, transform);
+
+    //NODELET_INFO("target: %f %f %f", target_vector_.x(), target_vector_.y(), target_vector_.z());
+    //NODELET_INFO("target_transformed: %f %f %f", target_vector_transformed.x(), target_vector_transformed.y(), target_vector_transformed.z());
+    //NODELET_INFO("source: %f %f %f", source_vector_.x(), source_vector_.y(), source_vector_.z());
+    //NODELET_INFO("source_transformed: %f %f %f", source_vector_transformed.x(), source_vector_transformed.y(), source_vector_transformed.z());
+
+    // Calculate the angle of the rotation.
+    if ((target_vector_transformed.vector.x    != 0 || target_vector_transformed.vector.y    != 0) &&
+        (source_vector_transformed.vector.x != 0 || source_vector_transformed.vector.y != 0))
+    {
+      angle = atan2(target_vector_transformed.vector.y, target_vector_transformed.vector.x);
+      angle -= atan2(source_vector_transformed.vector.y, source_vector_transformed.vector.x);
+      return true;
+    }
+    return false;
+  }
+
+  void tfTimerCallback(const ros::TimerEvent&)
+  {
+    std::string input_frame_id;
+    {
+      boost::mutex::scoped_lock lock(tf_mutex_);
+      input_frame_id = tf_input_frame_id_;
+    }
+    if (input_frame_id.empty())
+      return; // no image yet
+
+    double angle;
+    bool valid = false;
     try
     {
-      std::string input_frame_id = frameWithDefault(config_.input_frame_id, input_frame_from_msg);
-
-      // Transform the target vector into the image frame.
-      target_vector_.header.stamp = msg->header.stamp;
-      target_vector_.header.frame_id = frameWithDefault(config_.target_frame_id, input_frame_id);
-      geometry_msgs::Vector3Stamped target_vector_transformed;
-      geometry_msgs::TransformStamped transform = tf_buffer_.lookupTransform(config_.target_frame_id, input_frame_id, msg->header.stamp);
-      tf2::doTransform(target_vector_, target_vector_transformed, transform);
-
-      // Transform the source vector into the image frame.
-      source_vector_.header.stamp = msg->header.stamp;
-      source_vector_.header.frame_id = frameWithDefault(config_.source_frame_id, input_frame_id);
-      geometry_msgs::Vector3Stamped source_vector_transformed;
-      transform = tf_buffer_.lookupTransform(config_.source_frame_id, input_frame_id, msg->header.stamp);
-      tf2::doTransform(source_vector_, source_vector_transformed, transform);
-
-      //NODELET_INFO("target: %f %f %f", target_vector_.x(), target_vector_.y(), target_vector_.z());
-      //NODELET_INFO("target_transformed: %f %f %f", target_vector_transformed.x(), target_vector_transformed.y(), target_vector_transformed.z());
-      //NODELET_INFO("source: %f %f %f", source_vector_.x(), source_vector_.y(), source_vector_.z());
-      //NODELET_INFO("source_transformed: %f %f %f", source_vector_transformed.x(), source_vector_transformed.y(), source_vector_transformed.z());
-
-      // Calculate the angle of the rotation.
-      double angle = angle_;
-      if ((target_vector_transformed.vector.x    != 0 || target_vector_transformed.vector.y    != 0) &&
-          (source_vector_transformed.vector.x != 0 || source_vector_transformed.vector.y != 0))
+      valid = lookupAngle(input_frame_id, ros::Time(0), angle);
+    }
+    catch (tf2::TransformException &e)
+    {
+      NODELET_ERROR_THROTTLE(10, "Transform error: %s", e.what());
+    }
+
+    boost::mutex::scoped_lock lock(tf_mutex_);
+    if (input_frame_id != tf_input_frame_id_)
+      return; // looked up for a frame no longer in use
+    tf_angle_valid_ = valid;
+    if (valid)
+      tf_angle_ = angle;
+  }
+
+  // Angle for an image in input_frame_id, from the refresh timer or a lookup at stamp
+  void targetAngle(const image_rotate::ImageRotateConfig& config, const std::string& input_frame_id,
+                   const ros::Time& stamp, double& angle)
+  {
+    if (config.tf_refresh_rate > 0)
+    {
+      boost::mutex::scoped_lock lock(tf_mutex_);
+      if (input_frame_id == tf_input_frame_id_ && tf_angle_valid_)
       {
-        angle = atan2(target_vector_transformed.vector.y, target_vector_transformed.vector.x);
-        angle -= atan2(source_vector_transformed.vector.y, source_vector_transformed.vector.x);
+        angle = tf_angle_;
+        return;
       }
+      // Until the timer catches up with a new frame, look up per image
+      tf_input_frame_id_ = input_frame_id;
+      tf_angle_valid_ = false;
+    }
+    lookupAngle(input_frame_id, stamp, angle);
+  }
+
+  // Side of the square output image, see output_image_size
+  static int outputSize(const image_rotate::ImageRotateConfig& config, int cols, int rows)
+  {
+    int max_dim = cols > rows ? cols : rows;
+    int min_dim = cols < rows ? cols : rows;
+    int noblack_dim = min_dim / sqrt(2);
+    int diag_dim = sqrt(cols*cols + rows*rows);
+    int candidates[] = { noblack_dim, min_dim, max_dim, diag_dim, diag_dim }; // diag_dim repeated to simplify limit case.
+    int step = config.output_image_size;
+    return candidates[step] + (candidates[step + 1] - candidates[step]) * (config.output_image_size - step);
+  }
+
+  // Precompute the fixed-point remap tables of the rotation by angle (rad)
+  void updateMaps(const cv::Size& in_size, int out_size, double angle)
+  {
+    // Rotate about the center of the input pixel grid, ((cols - 1) / 2,
+    // (rows - 1) / 2), onto that of the output, as rotateQuarterTurns does
+    cv::Point2f center((in_size.width - 1) / 2.0, (in_size.height - 1) / 2.0);
+    cv::Mat rot_matrix = cv::getRotationMatrix2D(center, 180 * angle / M_PI, 1);
+    rot_matrix.at<double>(0, 2) += (out_size - in_size.width) / 2.0;
+    rot_matrix.at<double>(1, 2) += (out_size - in_size.height) / 2.0;
+
+    // remap() samples the input at the inverse-rotated output coordinates
+    cv::Mat_<double> inverse;
+    cv::invertAffineTransform(rot_matrix, inverse);
+    map1_.create(out_size, out_size, CV_16SC2);
+    map2_.create(out_size, out_size, CV_16UC1);
+    cv::parallel_for_(cv::Range(0, out_size), AffineMapBody(inverse, map1_, map2_));
+
+    map_in_size_ = in_size;
+    map_out_size_ = out_size;
+    map_angle_ = angle;
+  }
+
+  // Exact counterclockwise rotation by quarter turns with transpose and flip,
+  // about the same centers as the warp. Where the output and rotated sizes
+  // differ by an odd number of pixels, that center falls between pixels and
+  // the image is placed half a pixel up and left of it. Only the part of the
+  // input landing in the output is read.
+  static void rotateQuarterTurns(const cv::Mat& in, cv::Mat& out, int turns, int out_size)
+  {
+    cv::Size rotated_size = (turns % 2) ? cv::Size(in.rows, in.cols) : in.size();
+    cv::Point offset(cvFloor((out_size - rotated_size.width) / 2.0),
+                     cvFloor((out_size - rotated_size.height) / 2.0));
+    cv::Rect canvas(0, 0, out_size, out_size);
+    cv::Rect out_rect = cv::Rect(offset, rotated_size) & canvas;
+    if (out_rect == canvas)
+      out.create(out_size, out_size, in.type());
+    else
+      out = cv::Mat::zeros(out_size, out_size, in.type());
+    if (out_rect.area() == 0)
+      return;
+
+    cv::Rect r = out_rect - offset; // in rotated image coordinates
+    cv::Mat dst = out(out_rect);
+    switch (turns)
+    {
+      case 0:
+        in(r).copyTo(dst);
+        break;
+      case 1: // rotated(x, y) = in(cols - 1 - y, x)
+        cv::transpose(in(cv::Rect(in.cols - r.y - r.height, r.x, r.height, r.width)), dst);
+        cv::flip(dst, dst, 0);
+        break;
+      case 2: // rotated(x, y) = in(cols - 1 - x, rows - 1 - y)
+        cv::flip(in(cv::Rect(in.cols - r.x - r.width, in.rows - r.y - r.height, r.width, r.height)), dst, -1);
+        break;
+      case 3: // rotated(x, y) = in(y, rows - 1 - x)
+        cv::transpose(in(cv::Rect(r.y, in.rows - r.x - r.width, r.height, r.width)), dst);
+        cv::flip(dst, dst, 1);
+        break;
+    }
+  }
+
+  void do_work(const sensor_msgs::ImageConstPtr& msg, const std::string input_frame_from_msg)
+  {
+    const image_rotate::ImageRotateConfig config = currentConfig();
+    try
+    {
+      std::string input_frame_id = frameWithDefault(config.input_frame_id, input_frame_from_msg);
+
+      double angle = angle_;
+      targetAngle(config, input_frame_id, msg->header.stamp, angle);
 
       // Rate limit the rotation.
-      if (config_.max_angular_rate == 0)
+      if (config.max_angular_rate == 0)
         angle_ = angle;
       else
       {
-        double delta = fmod(angle - angle_, 2.0 * M_PI);
-        if (delta > M_PI)
-          delta -= 2.0 * M_PI;
-        else if (delta < - M_PI)
-          delta += 2.0 * M_PI;
+        double delta = angleDifference(angle, angle_);
 
-        double max_delta = config_.max_angular_rate * (msg->header.stamp - prev_stamp_).toSec();
+        double max_delta = config.max_angular_rate * (msg->header.stamp - prev_stamp_).toSec();
         if (delta > max_delta)
           delta = max_delta;
         else if (delta < -max_delta)
@@ -175,14 +404,31 @@ class ImageRotateNodelet : public nodelet::Nodelet
 
     //NODELET_INFO("angle: %f", 180 * angle_ / M_PI);
 
+    // Choose the rotation actually applied: an exact quarter turn, or the
+    // cached warp, when either is within angle_tolerance of angle_.
+    int out_size = outputSize(config, msg->width, msg->height);
+    double image_angle = angle_;
+    int quarter_turns = -1;
+    double quarters = floor(angle_ / (M_PI / 2) + 0.5);
+    if (fabs(angle_ - quarters * (M_PI / 2)) <= config.angle_tolerance)
+    {
+      image_angle = quarters * (M_PI / 2);
+      quarter_turns = (((int)quarters % 4) + 4) % 4;
+    }
+    else if (!map1_.empty() && map_in_size_ == cv::Size(msg->width, msg->height) &&
+             map_out_size_ == out_size && fabs(angleDifference(angle_, map_angle_)) <= config.angle_tolerance)
+    {
+      image_angle = map_angle_;
+    }
+
     // Publish the transform.
     geometry_msgs::TransformStamped transform;
     transform.transform.translation.x = 0;
     transform.transform.translation.y = 0;
     transform.transform.translation.z = 0;
-    tf::quaternionEigenToMsg(Eigen::Quaterniond(Eigen::AngleAxis<double>(angle_, Eigen::Vector3d(0.0, 0.0, 1.0))), transform.transform.rotation);
+    tf::quaternionEigenToMsg(Eigen::Quaterniond(Eigen::AngleAxis<double>(image_angle, Eigen::Vector3d(0.0, 0.0, 1.0))), transform.transform.rotation);
     transform.header.frame_id = msg->header.frame_id;
-    transform.child_frame_id = frameWithDefault(config_.output_frame_id, msg->header.frame_id + "_rotated");
+    transform.child_frame_id = frameWithDefault(config.output_frame_id, msg->header.frame_id + "_rotated");
     transform.header.stamp = msg->header.stamp;
     tf_pub_.sendTransform(transform);
 
@@ -192,26 +438,17 @@ class ImageRotateNodelet : public nodelet::Nodelet
       // Convert the image into something opencv can handle.
       cv::Mat in_image = cv_bridge::toCvShare(msg, msg->encoding)->image;
 
-      // Compute the output image size.
-      int max_dim = in_image.cols > in_image.rows ? in_image.cols : in_image.rows;
-      int min_dim = in_image.cols < in_image.rows ? in_image.cols : in_image.rows;
-      int noblack_dim = min_dim / sqrt(2);
-      int diag_dim = sqrt(in_image.cols*in_image.cols + in_image.rows*in_image.rows);
-      int out_size;
-      int candidates[] = { noblack_dim, min_dim, max_dim, diag_dim, diag_dim }; // diag_dim repeated to simplify limit case.
-      int step = config_.output_image_size;
-      out_size = candidates[step] + (candidates[step + 1] - candidates[step]) * (config_.output_image_size - step);
-      //NODELET_INFO("out_size: %d", out_size);
-
-      // Compute the rotation matrix.
-      cv::Mat rot_matrix = cv::getRotationMatrix2D(cv::Point2f(in_image.cols / 2.0, in_image.rows / 2.0), 180 * angle_ / M_PI, 1);
-      cv::Mat translation = rot_matrix.col(2);
-      rot_matrix.at<double>(0, 2) += (out_size - in_image.cols) / 2.0;
-      rot_matrix.at<double>(1, 2) += (out_size - in_image.rows) / 2.0;
-
       // Do the rotation
       cv::Mat out_image;
-      cv::warpAffine(in_image, out_image, rot_matrix, cv::Size(out_size, out_size));
+      if (quarter_turns >= 0)
+        rotateQuarterTurns(in_image, out_image, quarter_turns, out_size);
+      else
+      {
+        if (map1_.empty() || image_angle != map_angle_ ||
+            in_image.size() != map_in_size_ || out_size != map_out_size_)
+          updateMaps(in_image.size(), out_size, image_angle);
+        cv::remap(in_image, out_image, map1_, map2_, cv::INTER_LINEAR);
+      }
 
       // Publish the image.
       sensor_msgs::Image::Ptr out_img = cv_bridge::CvImage(msg->header, msg->encoding, out_image).toImageMsg();
@@ -229,7 +466,8 @@ class ImageRotateNodelet : public nodelet::Nodelet
   void subscribe()
   {
     NODELET_DEBUG("Subscribing to image topic.");
-    if (config_.use_camera_info && config_.input_frame_id.empty())
+    const image_rotate::ImageRotateConfig config = currentConfig();
+    if (config.use_camera_info && config.input_frame_id.empty())
       cam_sub_ = it_->subscribeCamera("image", 3, &ImageRotateNodelet::imageCallbackWithInfo, this);
     else
       img_sub_ = it_->subscribe("image", 3, &ImageRotateNodelet::imageCallback, this);
@@ -242,10 +480,27 @@ class ImageRotateNodelet : public nodelet::Nodelet
       cam_sub_.shutdown();
   }
 
+  // Run the refresh timer at the configured tf_refresh_rate while subscribed,
+  // restarting it from scratch, and stop it otherwise
+  void updateTfTimer()
+  {
+    tf_timer_.stop();
+    const double rate = currentConfig().tf_refresh_rate;
+    if (subscriber_count_ == 0 || rate <= 0)
+      return;
+    {
+      boost::mutex::scoped_lock lock(tf_mutex_);
+      tf_input_frame_id_.clear();
+      tf_angle_valid_ = false;
+    }
+    tf_timer_ = nh_.createTimer(ros::Duration(1.0 / rate), &ImageRotateNodelet::tfTimerCallback, this);
+  }
+
   void connectCb(const image_transport::SingleSubscriberPublisher& ssp)
   {
     if (subscriber_count_++ == 0) {
       subscribe();
+      updateTfTimer();
     }
   }
 
@@ -254,6 +509,7 @@ class ImageRotateNodelet : public nodelet::Nodelet
     subscriber_count_--;
     if (subscriber_count_ == 0) {
       unsubscribe();
+      updateTfTimer();
     }
   }
 
@@ -265,6 +521,10 @@ public:
     subscriber_count_ = 0;
     angle_ = 0;
     prev_stamp_ = ros::Time(0, 0);
+    map_out_size_ = 0;
+    map_angle_ = 0;
+    tf_angle_ = 0;
+    tf_angle_valid_ = false;
     tf_sub_.reset(new tf2_ros::TransformListener(tf_buffer_));
     image_transport::SubscriberStatusCallback connect_cb    = boost::bind(&ImageRotateNodelet::connectCb, this, _1);
     image_transport::SubscriberStatusCallback disconnect_cb = boost::bind(&ImageRotateNodelet::disconnectCb, this, _1);
@@ -36,7 +36,12 @@
 #include <sensor_msgs/image_encodings.h>
 #include <stereo_msgs/DisparityImage.h>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "window_thread.h"
+#ifdef HAVE_OPENGL
+#include "gl_window.h"
+#include <boost/scoped_ptr.hpp>
+#endif
 
 #ifdef HAVE_GTK
 #include <gtk/gtk.h>
@@ -67,7 +72,12 @@ class DisparityNodelet : public nodelet::Nodelet
 
   std::string window_name_;
   ros::Subscriber sub_;
+  cv::Mat_<cv::Vec3b> colormap_bgr_; // colormap as a lookup table for cv::LUT
   cv::Mat_<cv::Vec3b> disparity_color_;
+  cv::Mat_<uchar> disparity_index_; // scratch buffer of colormap indices
+#ifdef HAVE_OPENGL
+  boost::scoped_ptr<GlWindow> gl_window_;
+#endif
   
   virtual void onInit();
   
@@ -79,6 +89,10 @@ public:
 
 DisparityNodelet::~DisparityNodelet()
 {
+#ifdef HAVE_OPENGL
+  // Unregisters the draw callback while the window still exists
+  gl_window_.reset();
+#endif
   cv::destroyWindow(window_name_);
 }
 
@@ -99,7 +113,33 @@ void DisparityNodelet::onInit()
   bool autosize;
   local_nh.param("autosize", autosize, false);
 
-  cv::namedWindow(window_name_, autosize ? cv::WND_PROP_AUTOSIZE : 0);
+  colormap_bgr_.create(1, 256);
+  for (int i = 0; i < 256; ++i)
+    colormap_bgr_(0, i) = cv::Vec3b(colormap[3*i + 2], colormap[3*i + 1], colormap[3*i + 0]);
+
+  // Colormap on the GPU instead, uploading the raw disparities
+  bool opengl;
+  local_nh.param("opengl", opengl, false);
+#ifdef HAVE_OPENGL
+  if (opengl)
+  {
+    try {
+      gl_window_.reset(new GlWindow(window_name_, autosize));
+      gl_window_->setColormap(colormap);
+    }
+    catch (cv::Exception& e) {
+      NODELET_WARN("Unable to create OpenGL window, falling back to CPU display: %s", e.what());
+      cv::destroyWindow(window_name_);
+      opengl = false;
+    }
+  }
+#else
+  if (opengl)
+    NODELET_WARN("image_view was built without OpenGL, falling back to CPU display");
+  opengl = false;
+#endif
+  if (!opengl)
+    cv::namedWindow(window_name_, autosize ? cv::WND_PROP_AUTOSIZE : 0);
 #if CV_MAJOR_VERSION ==2
 #ifdef HAVE_GTK
   // Register appropriate handler for when user closes the display window
@@ -126,10 +166,12 @@ void DisparityNodelet::imageCb(const stereo_msgs::DisparityImageConstPtr& msg)
                            "max_disparity are not set");
     return;
   }
-  if (msg->image.encoding != sensor_msgs::image_encodings::TYPE_32FC1)
+  bool fixed_point = msg->image.encoding == sensor_msgs::image_encodings::TYPE_16SC1;
+  if (msg->image.encoding != sensor_msgs::image_encodings::TYPE_32FC1 && !fixed_point)
   {
     NODELET_ERROR_THROTTLE(30, "Disparity image must be 32-bit floating point "
-                           "(encoding '32FC1'), but has encoding '%s'",
+                           "(encoding '32FC1') or 16-bit fixed point (encoding "
+                           "'16SC1'), but has encoding '%s'",
                            msg->image.encoding.c_str());
     return;
   }
@@ -139,23 +181,28 @@ void DisparityNodelet::imageCb(const stereo_msgs::DisparityImageConstPtr& msg)
   float max_disparity = msg->max_disparity;
   float multiplier = 255.0f / (max_disparity - min_disparity);
 
-  const cv::Mat_<float> dmat(msg->image.height, msg->image.width,
-                             (float*)&msg->image.data[0], msg->image.step);
-  disparity_color_.create(msg->image.height, msg->image.width);
-    
-  for (int row = 0; row < disparity_color_.rows; ++row) {
-    const float* d = dmat[row];
-    cv::Vec3b *disparity_color = disparity_color_[row],
-              *disparity_color_end = disparity_color + disparity_color_.cols;
-    for (; disparity_color < disparity_color_end; ++disparity_color, ++d) {
-      int index = (*d - min_disparity) * multiplier + 0.5;
-      index = std::min(255, std::max(0, index));
-      // Fill as BGR
-      (*disparity_color)[2] = colormap[3*index + 0];
-      (*disparity_color)[1] = colormap[3*index + 1];
-      (*disparity_color)[0] = colormap[3*index + 2];
-    }
+#ifdef HAVE_OPENGL
+  if (gl_window_)
+  {
+    // Float samples reach the shader as is, 16-bit ones normalized to c / 32767
+    // (older GL versions use (2c + 1) / 65535, less than a fixed-point step off)
+    float scale = 1.0f / (max_disparity - min_disparity);
+    float offset = -min_disparity * scale;
+    if (fixed_point)
+      scale *= 32767.0f * msg->delta_d;
+    gl_window_->show(msg, msg->image, scale, offset, true);
+    return;
   }
+#endif
+
+  // index = round((d - min) * multiplier), saturated to [0,255], then colormapped
+  // as BGR; with fixed point d = value * delta_d, converted in the same pass
+  cv::Mat dmat(msg->image.height, msg->image.width, fixed_point ? CV_16SC1 : CV_32FC1,
+               const_cast<uint8_t*>(&msg->image.data[0]), msg->image.step);
+  double alpha = fixed_point ? msg->delta_d * multiplier : multiplier;
+  dmat.convertTo(disparity_index_, CV_8U, alpha, -min_disparity * multiplier);
+  cv::cvtColor(disparity_index_, disparity_color_, cv::COLOR_GRAY2BGR);
+  cv::LUT(disparity_color_, colormap_bgr_, disparity_color_);
 
   /// @todo For Electric, consider option to draw outline of valid window
 #if 0
@@ -0,0 +1,331 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "gl_window.h"
+#include <opencv2/highgui/highgui.hpp>
+#include <ros/console.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+struct TextureFormat
+{
+  const char* encoding;
+  GLint internal_format;
+  GLenum format, type;
+  int pixel_size;
+};
+
+// Signed and floating point samples go to float textures, so neither their sign
+// nor their range is clamped before the shader sees them
+const TextureFormat FORMATS[] = {
+  { "mono8",  GL_LUMINANCE8,        GL_LUMINANCE, GL_UNSIGNED_BYTE,  1 },
+  { "8UC1",   GL_LUMINANCE8,        GL_LUMINANCE, GL_UNSIGNED_BYTE,  1 },
+  { "mono16", GL_LUMINANCE16,       GL_LUMINANCE, GL_UNSIGNED_SHORT, 2 },
+  { "16UC1",  GL_LUMINANCE16,       GL_LUMINANCE, GL_UNSIGNED_SHORT, 2 },
+  { "16SC1",  GL_LUMINANCE32F_ARB,  GL_LUMINANCE, GL_SHORT,          2 },
+  { "32FC1",  GL_LUMINANCE32F_ARB,  GL_LUMINANCE, GL_FLOAT,          4 },
+  { "bgr8",   GL_RGB8,              GL_BGR,       GL_UNSIGNED_BYTE,  3 },
+  { "rgb8",   GL_RGB8,              GL_RGB,       GL_UNSIGNED_BYTE,  3 },
+  { "bgra8",  GL_RGBA8,             GL_BGRA,      GL_UNSIGNED_BYTE,  4 },
+  { "rgba8",  GL_RGBA8,             GL_RGBA,      GL_UNSIGNED_BYTE,  4 },
+};
+
+const TextureFormat* findFormat(const std::string& encoding)
+{
+  for (size_t i = 0; i < sizeof(FORMATS) / sizeof(FORMATS[0]); ++i)
+  {
+    if (encoding == FORMATS[i].encoding)
+      return &FORMATS[i];
+  }
+  return NULL;
+}
+
+const char* IMAGE_SHADER =
+  "uniform sampler2D image;\n"
+  "uniform float scale;\n"
+  "uniform float offset;\n"
+  "void main()\n"
+  "{\n"
+  "  gl_FragColor = vec4(texture2D(image, gl_TexCoord[0].st).rgb * scale + offset, 1.0);\n"
+  "}\n";
+
+// Same index as the CPU colormapping: round(t * 255), sampled at the texel center
+const char* COLORMAP_SHADER =
+  "uniform sampler2D image;\n"
+  "uniform sampler2D colormap;\n"
+  "uniform float scale;\n"
+  "uniform float offset;\n"
+  "void main()\n"
+  "{\n"
+  "  float t = clamp(texture2D(image, gl_TexCoord[0].st).r * scale + offset, 0.0, 1.0);\n"
+  "  gl_FragColor = texture2D(colormap, vec2((t * 255.0 + 0.5) / 256.0, 0.5));\n"
+  "}\n";
+
+GLuint compileProgram(const char* source)
+{
+  GLuint shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  GLint ok = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+  {
+    char log[1024] = "";
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    ROS_ERROR("Failed to compile display shader: %s", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader); // freed along with the program
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok)
+  {
+    ROS_ERROR("Failed to link display shader");
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+bool hostIsBigEndian()
+{
+  const uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 0;
+}
+
+} // namespace
+
+namespace image_view {
+
+GlWindow::GlWindow(const std::string& name, bool autosize)
+  : name_(name), autosize_(autosize), have_pending_(false),
+    shown_width_(0), shown_height_(0), colormap_dirty_(false),
+    gl_ready_(false), texture_(0), colormap_texture_(0),
+    program_(0), colormap_program_(0), width_(0), height_(0)
+{
+  pending_.image = current_.image = NULL;
+  std::memset(colormap_, 0, sizeof(colormap_));
+  cv::namedWindow(name_, cv::WINDOW_OPENGL | (autosize ? cv::WINDOW_AUTOSIZE : 0));
+  cv::setOpenGlDrawCallback(name_, &GlWindow::drawCb, this);
+}
+
+GlWindow::~GlWindow()
+{
+  cv::setOpenGlDrawCallback(name_, 0, 0);
+}
+
+bool GlWindow::supported(const std::string& encoding)
+{
+  return findFormat(encoding) != NULL;
+}
+
+void GlWindow::show(const boost::shared_ptr<const void>& owner, const sensor_msgs::Image& image,
+                    float scale, float offset, bool colormap)
+{
+  bool resize = false;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    // Replacing an image not drawn yet just drops it, the display can't keep up
+    pending_.owner = owner;
+    pending_.image = &image;
+    pending_.scale = scale;
+    pending_.offset = offset;
+    pending_.colormap = colormap;
+    have_pending_ = true;
+    if ((int)image.width != shown_width_ || (int)image.height != shown_height_)
+    {
+      shown_width_ = image.width;
+      shown_height_ = image.height;
+      resize = autosize_;
+    }
+  }
+
+  // Outside the lock, OpenCV may draw synchronously
+  if (resize)
+    cv::resizeWindow(name_, image.width, image.height);
+  cv::updateWindow(name_);
+}
+
+void GlWindow::setColormap(const unsigned char* rgb)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  std::memcpy(colormap_, rgb, sizeof(colormap_));
+  colormap_dirty_ = true;
+}
+
+void GlWindow::drawCb(void* param)
+{
+  reinterpret_cast<GlWindow*>(param)->draw();
+}
+
+bool GlWindow::initGl()
+{
+  program_ = compileProgram(IMAGE_SHADER);
+  colormap_program_ = compileProgram(COLORMAP_SHADER);
+  if (!program_ || !colormap_program_)
+    return false;
+
+  glGenTextures(1, &texture_);
+  glGenTextures(1, &colormap_texture_);
+  glBindTexture(GL_TEXTURE_2D, colormap_texture_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  return true;
+}
+
+void GlWindow::upload(const sensor_msgs::Image& image)
+{
+  const TextureFormat* format = findFormat(image.encoding);
+  if (!format || image.step % format->pixel_size != 0)
+    return;
+
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, image.step / format->pixel_size);
+  glPixelStorei(GL_UNPACK_SWAP_BYTES, (image.is_bigendian != 0) != hostIsBigEndian());
+  const GLvoid* data = image.data.empty() ? NULL : &image.data[0];
+  if ((int)image.width == width_ && (int)image.height == height_ && image.encoding == format_)
+  {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height,
+                    format->format, format->type, data);
+  }
+  else
+  {
+    glTexImage2D(GL_TEXTURE_2D, 0, format->internal_format, image.width, image.height, 0,
+                 format->format, format->type, data);
+    width_ = image.width;
+    height_ = image.height;
+    format_ = image.encoding;
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+}
+
+void GlWindow::draw()
+{
+  if (!gl_ready_)
+  {
+    if (!initGl())
+    {
+      cv::setOpenGlDrawCallback(name_, 0, 0);
+      return;
+    }
+    gl_ready_ = true;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (colormap_dirty_)
+    {
+      glBindTexture(GL_TEXTURE_2D, colormap_texture_);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 256, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, colormap_);
+      colormap_dirty_ = false;
+    }
+    if (have_pending_)
+    {
+      upload(*pending_.image);
+      current_ = pending_;
+      current_.owner.reset(); // the texture holds the pixels now
+      current_.image = NULL;
+      pending_.owner.reset();
+      have_pending_ = false;
+    }
+  }
+
+  glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  if (width_ == 0 || height_ == 0)
+    return;
+
+  // Fit the image into the viewport, keeping its aspect ratio
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  float sx = 1.0f, sy = 1.0f;
+  float aspect = (float)width_ / height_;
+  float viewport_aspect = (float)viewport[2] / std::max(viewport[3], 1);
+  if (aspect > viewport_aspect)
+    sy = viewport_aspect / aspect;
+  else
+    sx = aspect / viewport_aspect;
+
+  GLuint program = current_.colormap ? colormap_program_ : program_;
+  glUseProgram(program);
+  glUniform1i(glGetUniformLocation(program, "image"), 0);
+  glUniform1f(glGetUniformLocation(program, "scale"), current_.scale);
+  glUniform1f(glGetUniformLocation(program, "offset"), current_.offset);
+  if (current_.colormap)
+  {
+    glUniform1i(glGetUniformLocation(program, "colormap"), 1);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, colormap_texture_);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  // Colormap indices must not be interpolated across disparity edges
+  GLint filter = current_.colormap ? GL_NEAREST : GL_LINEAR;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glEnable(GL_TEXTURE_2D);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0f, 0.0f); glVertex2f(-sx,  sy);
+  glTexCoord2f(1.0f, 0.0f); glVertex2f( sx,  sy);
+  glTexCoord2f(1.0f, 1.0f); glVertex2f( sx, -sy);
+  glTexCoord2f(0.0f, 1.0f); glVertex2f(-sx, -sy);
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
+  glUseProgram(0);
+}
+
+} // namespace image_view
@@ -0,0 +1,109 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_VIEW_GL_WINDOW_H
+#define IMAGE_VIEW_GL_WINDOW_H
+
+#include <sensor_msgs/Image.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+
+namespace image_view {
+
+/**
+ * Display window drawn through OpenGL. Images are uploaded as textures in
+ * their message encoding and scaled, converted to RGB or colormapped by a
+ * fragment shader, so the CPU never touches the pixels. Uploads happen in
+ * OpenCV's draw callback, on the thread owning the GL context.
+ */
+class GlWindow
+{
+public:
+  /// Create the window. Throws cv::Exception if OpenCV has no OpenGL support.
+  GlWindow(const std::string& name, bool autosize);
+
+  /// Unregister the draw callback, so OpenCV never calls into a destroyed window
+  ~GlWindow();
+
+  /// Whether images of this encoding can be uploaded without conversion
+  static bool supported(const std::string& encoding);
+
+  /**
+   * Queue an image for display. A sample s of the image, as normalized by GL
+   * (integers to [0,1] or [-1,1], floats as is), is displayed as s * scale +
+   * offset. With a colormap the result, clamped to [0,1], selects one of the
+   * 256 entries. owner keeps the image data alive until it has been uploaded.
+   */
+  void show(const boost::shared_ptr<const void>& owner, const sensor_msgs::Image& image,
+            float scale = 1.0f, float offset = 0.0f, bool colormap = false);
+
+  /// Set the 256-entry colormap, RGB order
+  void setColormap(const unsigned char* rgb);
+
+private:
+  struct Frame
+  {
+    boost::shared_ptr<const void> owner;
+    const sensor_msgs::Image* image;
+    float scale, offset;
+    bool colormap;
+  };
+
+  static void drawCb(void* param);
+  void draw();
+  bool initGl();
+  void upload(const sensor_msgs::Image& image);
+
+  std::string name_;
+  bool autosize_;
+
+  boost::mutex mutex_;
+  Frame pending_;
+  bool have_pending_;
+  int shown_width_, shown_height_;
+  unsigned char colormap_[768];
+  bool colormap_dirty_;
+
+  // Only touched from the draw callback
+  Frame current_;
+  bool gl_ready_;
+  unsigned int texture_, colormap_texture_;
+  unsigned int program_, colormap_program_;
+  int width_, height_;
+  std::string format_;
+};
+
+} // namespace image_view
+
+#endif
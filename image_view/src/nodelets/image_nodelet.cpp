@@ -36,11 +36,16 @@
 #include <image_transport/image_transport.h>
 
 #include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
 #include <opencv2/highgui/highgui.hpp>
 #include "window_thread.h"
+#ifdef HAVE_OPENGL
+#include "gl_window.h"
+#endif
 
 #include <boost/thread.hpp>
 #include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #ifdef HAVE_GTK
 #include <gtk/gtk.h>
@@ -72,6 +77,10 @@ class ImageNodelet : public nodelet::Nodelet
 
   boost::mutex image_mutex_;
   cv::Mat last_image_;
+  sensor_msgs::ImageConstPtr last_msg_; // converted only when saving in OpenGL mode
+#ifdef HAVE_OPENGL
+  boost::scoped_ptr<GlWindow> gl_window_;
+#endif
   
   std::string window_name_;
   boost::format filename_format_;
@@ -80,6 +89,9 @@ class ImageNodelet : public nodelet::Nodelet
   virtual void onInit();
   
   void imageCb(const sensor_msgs::ImageConstPtr& msg);
+#ifdef HAVE_OPENGL
+  void showGl(const sensor_msgs::ImageConstPtr& msg);
+#endif
 
   static void mouseCb(int event, int x, int y, int flags, void* param);
 
@@ -96,6 +108,10 @@ ImageNodelet::ImageNodelet()
 
 ImageNodelet::~ImageNodelet()
 {
+#ifdef HAVE_OPENGL
+  // Unregisters the draw callback while the window still exists
+  gl_window_.reset();
+#endif
   cv::destroyWindow(window_name_);
 }
 
@@ -133,7 +149,28 @@ void ImageNodelet::onInit()
   local_nh.param("filename_format", format_string, std::string("frame%04i.jpg"));
   filename_format_.parse(format_string);
 
-  cv::namedWindow(window_name_, autosize ? cv::WND_PROP_AUTOSIZE : 0);
+  // Draw through OpenGL, leaving scaling and color conversion to the GPU
+  bool opengl;
+  local_nh.param("opengl", opengl, false);
+#ifdef HAVE_OPENGL
+  if (opengl)
+  {
+    try {
+      gl_window_.reset(new GlWindow(window_name_, autosize));
+    }
+    catch (cv::Exception& e) {
+      NODELET_WARN("Unable to create OpenGL window, falling back to CPU display: %s", e.what());
+      cv::destroyWindow(window_name_);
+      opengl = false;
+    }
+  }
+#else
+  if (opengl)
+    NODELET_WARN("image_view was built without OpenGL, falling back to CPU display");
+  opengl = false;
+#endif
+  if (!opengl)
+    cv::namedWindow(window_name_, autosize ? cv::WND_PROP_AUTOSIZE : 0);
   cv::setMouseCallback(window_name_, &ImageNodelet::mouseCb, this);
   
 #ifdef HAVE_GTK
@@ -155,6 +192,14 @@ void ImageNodelet::onInit()
 
 void ImageNodelet::imageCb(const sensor_msgs::ImageConstPtr& msg)
 {
+#ifdef HAVE_OPENGL
+  if (gl_window_)
+  {
+    showGl(msg);
+    return;
+  }
+#endif
+
   image_mutex_.lock();
 
   // We want to scale floating point images so that they display nicely
@@ -176,6 +221,55 @@ void ImageNodelet::imageCb(const sensor_msgs::ImageConstPtr& msg)
     cv::imshow(window_name_, last_image_);
 }
 
+#ifdef HAVE_OPENGL
+void ImageNodelet::showGl(const sensor_msgs::ImageConstPtr& msg)
+{
+  {
+    boost::lock_guard<boost::mutex> guard(image_mutex_);
+    last_msg_ = msg;
+    last_image_.release();
+  }
+
+  if (!GlWindow::supported(msg->encoding))
+  {
+    // Bayer, YUV and the like still need the CPU conversion
+    try {
+      bool do_dynamic_scaling = (msg->encoding.find("F") != std::string::npos);
+      cv_bridge::CvImageConstPtr display =
+        cvtColorForDisplay(cv_bridge::toCvShare(msg), "", do_dynamic_scaling);
+      sensor_msgs::ImageConstPtr converted = display->toImageMsg();
+      gl_window_->show(converted, *converted);
+    }
+    catch (cv_bridge::Exception& e) {
+      NODELET_ERROR_THROTTLE(30, "Unable to convert '%s' image for display: '%s'",
+                             msg->encoding.c_str(), e.what());
+    }
+    return;
+  }
+
+  float scale = 1.0f, offset = 0.0f;
+  if (msg->encoding == sensor_msgs::image_encodings::TYPE_32FC1 && !msg->data.empty())
+  {
+    // Same dynamic scaling as the CPU path, but only a min/max pass on the CPU
+    const cv::Mat image(msg->height, msg->width, CV_32FC1,
+                        const_cast<uint8_t*>(&msg->data[0]), msg->step);
+    double min_value, max_value;
+    cv::minMaxLoc(image, &min_value, &max_value);
+    if (max_value > min_value)
+    {
+      scale = 1.0 / (max_value - min_value);
+      offset = -min_value * scale;
+    }
+  }
+  else if (msg->encoding == sensor_msgs::image_encodings::TYPE_16SC1)
+  {
+    // GL normalizes signed samples to [-1,1]
+    scale = offset = 0.5f;
+  }
+  gl_window_->show(msg, *msg, scale, offset);
+}
+#endif
+
 void ImageNodelet::mouseCb(int event, int x, int y, int flags, void* param)
 {
   ImageNodelet *this_ = reinterpret_cast<ImageNodelet*>(param);
@@ -193,6 +287,21 @@ void ImageNodelet::mouseCb(int event, int x, int y, int flags, void* param)
   
   boost::lock_guard<boost::mutex> guard(this_->image_mutex_);
 
+  if (this_->last_image_.empty() && this_->last_msg_)
+  {
+    // OpenGL mode keeps only the message, convert it now
+    try {
+      bool do_dynamic_scaling = (this_->last_msg_->encoding.find("F") != std::string::npos);
+      this_->last_image_ = cvtColorForDisplay(cv_bridge::toCvShare(this_->last_msg_), "",
+                                              do_dynamic_scaling)->image;
+    }
+    catch (cv_bridge::Exception& e) {
+      NODELET_ERROR("Unable to convert '%s' image for saving: '%s'",
+                    this_->last_msg_->encoding.c_str(), e.what());
+      return;
+    }
+  }
+
   const cv::Mat &image = this_->last_image_;
   if (image.empty())
   {
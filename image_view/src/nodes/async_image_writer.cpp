@@ -0,0 +1,430 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "async_image_writer.h"
+#include <opencv2/highgui/highgui.hpp>
+#include <ros/console.h>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace image_view {
+
+/**
+ * Raw frames appended to preallocated memory-mapped files. Each file is a
+ * sequence of records: a RecordHeader, the file name and image encoding, then
+ * the pixel rows without padding, each record 8-byte aligned. A record with a
+ * zero magic, or the end of the file, ends the sequence. When a record does
+ * not fit, the file is truncated to its records and the next one is started.
+ * Once a file cannot be created or mapped, every later append fails too,
+ * rather than trying the next file name for each frame.
+ */
+class FrameContainer : boost::noncopyable
+{
+public:
+  static const uint32_t RECORD_MAGIC = 0x52474d49; // "IMGR"
+
+  struct RecordHeader
+  {
+    uint32_t magic;
+    uint32_t name_size;
+    uint64_t data_size;
+    uint64_t stamp; // nanoseconds
+    int32_t rows;
+    int32_t cols;
+    int32_t type; // OpenCV type of the pixels
+    uint32_t encoding_size;
+  };
+
+  FrameContainer(const std::string& prefix, size_t file_size)
+    : prefix_(prefix), file_size_(file_size), index_(0), fd_(-1), map_(NULL), size_(0), used_(0),
+      failed_(false) {}
+  ~FrameContainer() { close(); }
+
+  bool append(const std::string& name, const cv_bridge::CvImage& image);
+  /// Start writing back what was appended so far, without waiting for it
+  void sync() { if (map_) msync(map_, used_, MS_ASYNC); }
+  void close();
+
+private:
+  bool open(size_t min_size);
+
+  std::string prefix_;
+  size_t file_size_;
+  int index_;
+  int fd_;
+  uint8_t* map_;
+  size_t size_, used_;
+  bool failed_; // a file could not be opened, see open()
+};
+
+bool FrameContainer::open(size_t min_size)
+{
+  std::string path = (boost::format("%s_%04d.frames") % prefix_ % index_++).str();
+  size_ = std::max(file_size_, min_size);
+  used_ = 0;
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    ROS_ERROR("Could not create container %s: %s", path.c_str(), strerror(errno));
+    failed_ = true;
+    return false;
+  }
+  // Allocate the blocks up front, so appending never waits on the filesystem
+  int err = posix_fallocate(fd_, 0, size_);
+  if (err == 0)
+    map_ = static_cast<uint8_t*>(mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+  if (err != 0 || map_ == MAP_FAILED) {
+    ROS_ERROR("Could not map %d bytes of container %s: %s", (int)size_, path.c_str(),
+              strerror(err ? err : errno));
+    map_ = NULL;
+    close();
+    failed_ = true;
+    return false;
+  }
+  ROS_INFO("Writing frames to container %s", path.c_str());
+  return true;
+}
+
+void FrameContainer::close()
+{
+  if (map_) {
+    munmap(map_, size_);
+    map_ = NULL;
+  }
+  if (fd_ >= 0) {
+    // Drop the preallocated tail that was never used
+    if (ftruncate(fd_, used_) != 0)
+      ROS_WARN("Could not truncate container: %s", strerror(errno));
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool FrameContainer::append(const std::string& name, const cv_bridge::CvImage& image)
+{
+  const cv::Mat& mat = image.image;
+  size_t row_size = mat.cols * mat.elemSize();
+  size_t text_size = (sizeof(RecordHeader) + name.size() + image.encoding.size() + 7) & ~(size_t)7;
+  size_t record_size = text_size + ((mat.rows * row_size + 7) & ~(size_t)7);
+  if (failed_)
+    return false;
+  if (!map_ || used_ + record_size > size_) {
+    close();
+    if (!open(record_size))
+      return false;
+  }
+
+  uint8_t* record = map_ + used_;
+  RecordHeader header;
+  header.magic = RECORD_MAGIC;
+  header.name_size = name.size();
+  header.data_size = mat.rows * row_size;
+  header.stamp = image.header.stamp.toNSec();
+  header.rows = mat.rows;
+  header.cols = mat.cols;
+  header.type = mat.type();
+  header.encoding_size = image.encoding.size();
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), name.data(), name.size());
+  memcpy(record + sizeof(header) + name.size(), image.encoding.data(), image.encoding.size());
+  uint8_t* data = record + text_size;
+  for (int y = 0; y < mat.rows; ++y, data += row_size)
+    memcpy(data, mat.ptr(y), row_size);
+  used_ += record_size;
+  return true;
+}
+
+AsyncImageWriter::Options::Options()
+  : encoder_threads(0), max_pending(64), batch_bytes(16 << 20), sync(false),
+    container_size(size_t(1) << 30)
+{
+}
+
+AsyncImageWriter::Options::Options(const ros::NodeHandle& nh)
+{
+  int max_pending, batch_mb, container_mb;
+  nh.param("encoder_threads", encoder_threads, 0);
+  nh.param("max_pending", max_pending, 64);
+  nh.param("batch_mb", batch_mb, 16);
+  nh.param("sync", sync, false);
+  // Raw frames into preallocated memory-mapped files instead of one file per image
+  nh.param("container", container, std::string(""));
+  nh.param("container_mb", container_mb, 1024);
+  this->max_pending = std::max(max_pending, 1);
+  batch_bytes = (size_t)std::max(batch_mb, 1) << 20;
+  container_size = (size_t)std::max(container_mb, 1) << 20;
+}
+
+AsyncImageWriter::AsyncImageWriter(const Options& options)
+  : options_(options), io_queue_bytes_(0), encoding_(0), stopping_(false)
+{
+  if (!options_.container.empty())
+    container_.reset(new FrameContainer(options_.container, options_.container_size));
+  else {
+    int threads = options_.encoder_threads > 0 ? options_.encoder_threads
+                                               : std::max(1, (int)boost::thread::hardware_concurrency());
+    for (int i = 0; i < threads; ++i)
+      encoders_.create_thread(boost::bind(&AsyncImageWriter::encodeLoop, this));
+  }
+  io_thread_ = boost::thread(&AsyncImageWriter::ioLoop, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  encode_cond_.notify_all();
+  encoders_.join_all();
+  io_cond_.notify_all();
+  io_thread_.join();
+}
+
+bool AsyncImageWriter::write(const std::string& filename, const cv_bridge::CvImageConstPtr& image)
+{
+  Job job;
+  job.filename = filename;
+  job.image = image;
+  return push(job);
+}
+
+bool AsyncImageWriter::writeData(const std::string& filename, const std::string& data)
+{
+  Job job;
+  job.filename = filename;
+  job.data.assign(data.begin(), data.end());
+  return push(job);
+}
+
+bool AsyncImageWriter::push(const Job& job)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (stats_.pending >= options_.max_pending) {
+      ++stats_.dropped;
+      return false;
+    }
+    ++stats_.queued;
+    ++stats_.pending;
+    stats_.max_pending = std::max(stats_.max_pending, stats_.pending);
+    // Images are encoded first, unless they go raw into the container
+    if (job.image && !container_) {
+      encode_queue_.push_back(job);
+      encode_cond_.notify_one();
+      return true;
+    }
+    io_queue_.push_back(job);
+    io_queue_bytes_ += job.image ? job.image->image.total() * job.image->image.elemSize() : job.data.size();
+  }
+  io_cond_.notify_one();
+  return true;
+}
+
+void AsyncImageWriter::encodeLoop()
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  for (;;) {
+    while (encode_queue_.empty() && !stopping_)
+      encode_cond_.wait(lock);
+    if (encode_queue_.empty())
+      return; // stopping, and everything is encoded
+
+    Job job = encode_queue_.front();
+    encode_queue_.pop_front();
+    ++encoding_;
+    lock.unlock();
+
+    int64_t start = cv::getTickCount();
+    std::string::size_type dot = job.filename.rfind('.');
+    std::string extension = dot == std::string::npos ? std::string(".png") : job.filename.substr(dot);
+    std::vector<uchar> data;
+    bool ok = false;
+    try {
+      ok = cv::imencode(extension, job.image->image, data);
+    }
+    catch (cv::Exception& e) {
+      ROS_ERROR("Could not encode %s: %s", job.filename.c_str(), e.what());
+    }
+    double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+    job.image.reset();
+    job.data.swap(data);
+
+    lock.lock();
+    --encoding_;
+    stats_.encode_seconds += seconds;
+    if (ok) {
+      io_queue_bytes_ += job.data.size();
+      io_queue_.push_back(job);
+    }
+    else {
+      ++stats_.failed;
+      --stats_.pending;
+      idle_cond_.notify_all();
+    }
+    io_cond_.notify_one();
+  }
+}
+
+void AsyncImageWriter::ioLoop()
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  std::vector<Job> batch;
+  for (;;) {
+    while (io_queue_.empty() && !(stopping_ && encode_queue_.empty() && encoding_ == 0))
+      io_cond_.wait(lock);
+    if (io_queue_.empty())
+      break; // stopping, and everything is written
+
+    // Take whatever is ready, up to a batch
+    size_t batch_bytes = 0;
+    while (!io_queue_.empty() && (batch.empty() || batch_bytes < options_.batch_bytes)) {
+      Job& job = io_queue_.front();
+      size_t bytes = job.image ? job.image->image.total() * job.image->image.elemSize() : job.data.size();
+      batch_bytes += bytes;
+      io_queue_bytes_ -= bytes;
+      batch.push_back(job);
+      io_queue_.pop_front();
+    }
+    lock.unlock();
+
+    int64_t start = cv::getTickCount();
+    size_t failed = writeBatch(batch);
+    double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    lock.lock();
+    stats_.written += batch.size() - failed;
+    stats_.failed += failed;
+    stats_.pending -= batch.size();
+    stats_.bytes += batch_bytes;
+    stats_.write_seconds += seconds;
+    batch.clear();
+    idle_cond_.notify_all();
+  }
+  lock.unlock();
+  if (container_)
+    container_->close();
+}
+
+size_t AsyncImageWriter::writeBatch(std::vector<Job>& batch)
+{
+  size_t failed = 0;
+  std::vector<int> fds;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    Job& job = batch[i];
+    if (job.image) {
+      if (!container_->append(job.filename, *job.image))
+        ++failed;
+      continue;
+    }
+
+    int fd = ::open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      ROS_ERROR("Could not create %s: %s", job.filename.c_str(), strerror(errno));
+      ++failed;
+      continue;
+    }
+    const uint8_t* data = job.data.empty() ? NULL : &job.data[0];
+    size_t left = job.data.size();
+    while (left > 0) {
+      ssize_t n = ::write(fd, data, left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        ROS_ERROR("Could not write %s: %s", job.filename.c_str(), strerror(errno));
+        ++failed;
+        break;
+      }
+      data += n;
+      left -= n;
+    }
+    if (options_.sync)
+      fds.push_back(fd); // synced together below
+    else
+      ::close(fd);
+  }
+
+  // One sync per batch instead of one per file
+  for (size_t i = 0; i < fds.size(); ++i) {
+    fdatasync(fds[i]);
+    ::close(fds[i]);
+  }
+  if (options_.sync && container_)
+    container_->sync();
+  return failed;
+}
+
+void AsyncImageWriter::flush()
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (stats_.pending > 0)
+    idle_cond_.wait(lock);
+}
+
+AsyncImageWriter::Stats AsyncImageWriter::stats() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return stats_;
+}
+
+void AsyncImageWriter::logStats()
+{
+  Stats now, last;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    now = stats_;
+    last = logged_;
+    logged_ = stats_;
+    // Report the peak since the previous call
+    stats_.max_pending = stats_.pending;
+  }
+  size_t written = now.written - last.written;
+  size_t encoded = written + now.failed - last.failed;
+  ROS_INFO("Wrote %d frames (%.1f MB), dropped %d, failed %d; %d pending, peak %d of %d; "
+           "%.1f ms encoding and %.1f ms writing per frame",
+           (int)written, (now.bytes - last.bytes) / 1e6, (int)(now.dropped - last.dropped),
+           (int)(now.failed - last.failed), (int)now.pending, (int)now.max_pending, (int)options_.max_pending,
+           encoded ? 1e3 * (now.encode_seconds - last.encode_seconds) / encoded : 0.0,
+           written ? 1e3 * (now.write_seconds - last.write_seconds) / written : 0.0);
+}
+
+} // namespace image_view
@@ -0,0 +1,139 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef IMAGE_VIEW_ASYNC_IMAGE_WRITER_H
+#define IMAGE_VIEW_ASYNC_IMAGE_WRITER_H
+
+#include <ros/node_handle.h>
+#include <cv_bridge/cv_bridge.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace image_view {
+
+class FrameContainer;
+
+/**
+ * Writes images to disk off the subscriber thread. A pool of encoder threads
+ * compresses images in parallel (by the filename's extension, as cv::imwrite
+ * would), and a single I/O thread writes the results in batches, syncing once
+ * per batch. In container mode images are not encoded at all but appended raw
+ * to large preallocated, memory-mapped container files.
+ *
+ * Frames are dropped, and counted, rather than queued without bound once
+ * max_pending are waiting to be written.
+ */
+class AsyncImageWriter : boost::noncopyable
+{
+public:
+  struct Options
+  {
+    Options();
+    /// Read the options from the ~encoder_threads, ~max_pending, ~batch_mb,
+    /// ~sync, ~container and ~container_mb parameters of node handle nh
+    explicit Options(const ros::NodeHandle& nh);
+
+    int encoder_threads;   // 0 uses one per core
+    size_t max_pending;    // frames queued or in work before write() drops
+    size_t batch_bytes;    // the I/O thread writes up to this much before syncing
+    bool sync;             // fdatasync files (msync containers) after each batch
+    std::string container; // if set, path prefix of the raw container files
+    size_t container_size; // bytes preallocated per container file
+  };
+
+  /// Counters since construction; pending and max_pending are frame counts
+  struct Stats
+  {
+    Stats() : queued(0), written(0), dropped(0), failed(0), pending(0), max_pending(0),
+              bytes(0), encode_seconds(0.0), write_seconds(0.0) {}
+    size_t queued, written, dropped, failed;
+    size_t pending, max_pending;
+    size_t bytes;
+    double encode_seconds, write_seconds;
+  };
+
+  explicit AsyncImageWriter(const Options& options);
+  /// Writes out everything queued before returning
+  ~AsyncImageWriter();
+
+  /// Queue image to be saved as filename; returns false if the frame was dropped
+  bool write(const std::string& filename, const cv_bridge::CvImageConstPtr& image);
+
+  /// Queue a small file written as is, e.g. a calibration next to its image
+  bool writeData(const std::string& filename, const std::string& data);
+
+  /// Block until everything queued so far is written
+  void flush();
+
+  Stats stats() const;
+
+  /// Log the counters and the back-pressure since the last call
+  void logStats();
+
+private:
+  struct Job
+  {
+    std::string filename;
+    cv_bridge::CvImageConstPtr image; // to encode, or to append raw in container mode
+    std::vector<uint8_t> data;        // encoded file contents
+  };
+
+  bool push(const Job& job);
+  void encodeLoop();
+  void ioLoop();
+  /// Returns the number of jobs that failed
+  size_t writeBatch(std::vector<Job>& batch);
+
+  Options options_;
+  boost::scoped_ptr<FrameContainer> container_;
+
+  mutable boost::mutex mutex_; // guards everything below
+  boost::condition_variable encode_cond_, io_cond_, idle_cond_;
+  std::deque<Job> encode_queue_, io_queue_;
+  size_t io_queue_bytes_;
+  int encoding_; // jobs the encoders are working on
+  bool stopping_;
+  Stats stats_, logged_;
+  boost::thread_group encoders_;
+  boost::thread io_thread_;
+};
+
+} // namespace image_view
+
+#endif
@@ -41,6 +41,9 @@
 
 #include <boost/thread.hpp>
 #include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "async_image_writer.h"
 
 class ExtractImages
 {
@@ -55,6 +58,8 @@ private:
   int count_;
   double _time;
   double sec_per_frame_;
+  boost::scoped_ptr<image_view::AsyncImageWriter> writer_;
+  ros::WallTimer stats_timer_;
 
 #if defined(_VIDEO)
   CvVideoWriter* video_writer;
@@ -73,6 +78,14 @@ public:
 
     local_nh.param("sec_per_frame", sec_per_frame_, 0.1);
 
+    writer_.reset(new image_view::AsyncImageWriter(image_view::AsyncImageWriter::Options(local_nh)));
+    // Periodically report how far behind the disk writes are
+    double stats_period;
+    local_nh.param("stats_period", stats_period, 10.0);
+    if (stats_period > 0.0)
+      stats_timer_ = local_nh.createWallTimer(ros::WallDuration(stats_period),
+                                              boost::bind(&image_view::AsyncImageWriter::logStats, writer_.get()));
+
     image_transport::ImageTransport it(nh);
     sub_ = it.subscribe(topic, 1, &ExtractImages::image_cb, this, transport);
 
@@ -85,6 +98,8 @@ public:
 
   ~ExtractImages()
   {
+    writer_->flush();
+    writer_->logStats();
   }
 
   void image_cb(const sensor_msgs::ImageConstPtr& msg)
@@ -99,10 +114,12 @@ public:
     if (msg->encoding.find("bayer") != std::string::npos)
       boost::const_pointer_cast<sensor_msgs::Image>(msg)->encoding = "mono8";
 
+    cv_bridge::CvImageConstPtr cv_ptr;
     cv::Mat image;
     try
     {
-      image = cv_bridge::toCvShare(msg, "bgr8")->image;
+      cv_ptr = cv_bridge::toCvShare(msg, "bgr8");
+      image = cv_ptr->image;
     } catch(cv_bridge::Exception)
     {
       ROS_ERROR("Unable to convert %s image to bgr8", msg->encoding.c_str());
@@ -117,7 +134,11 @@ public:
         std::string filename = (filename_format_ % count_).str();
 
 #if !defined(_VIDEO)
-        cv::imwrite(filename, image);
+        // Encoded and written on the writer's threads
+        if (!writer_->write(filename, cv_ptr)) {
+          ROS_WARN_THROTTLE(5, "Disk writes falling behind, dropped image %s", filename.c_str());
+          return;
+        }
 #else
         if(!video_writer)
         {
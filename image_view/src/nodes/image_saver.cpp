@@ -36,11 +36,14 @@
 #include <ros/ros.h>
 #include <cv_bridge/cv_bridge.h>
 #include <image_transport/image_transport.h>
-#include <camera_calibration_parsers/parse.h>
+#include <camera_calibration_parsers/parse_ini.h>
 #include <boost/format.hpp>
+#include <sstream>
 
 #include <std_srvs/Empty.h>
 
+#include "async_image_writer.h"
+
 boost::format g_format;
 bool save_all_image, save_image_service;
 std::string encoding;
@@ -54,7 +57,8 @@ bool service(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
  */
 class Callbacks {
 public:
-  Callbacks() : is_first_image_(true), has_camera_info_(false), count_(0) {
+  explicit Callbacks(image_view::AsyncImageWriter& writer)
+    : writer_(writer), is_first_image_(true), has_camera_info_(false), count_(0) {
   }
 
   void callbackWithoutCameraInfo(const sensor_msgs::ImageConstPtr& image_msg)
@@ -89,24 +93,26 @@ public:
     // save the CameraInfo
     if (info) {
       filename = filename.replace(filename.rfind("."), filename.length(), ".ini");
-      camera_calibration_parsers::writeCalibration(filename, "camera", *info);
+      std::ostringstream ini;
+      camera_calibration_parsers::writeCalibrationIni(ini, "camera", *info);
+      writer_.writeData(filename, ini.str());
     }
 
     count_++;
   }
 private:
   bool saveImage(const sensor_msgs::ImageConstPtr& image_msg, std::string &filename) {
-    cv::Mat image;
+    cv_bridge::CvImageConstPtr image;
     try
     {
-      image = cv_bridge::toCvShare(image_msg, encoding)->image;
+      image = cv_bridge::toCvShare(image_msg, encoding);
     } catch(cv_bridge::Exception)
     {
       ROS_ERROR("Unable to convert %s image to bgr8", image_msg->encoding.c_str());
       return false;
     }
 
-    if (!image.empty()) {
+    if (!image->image.empty()) {
       try {
         filename = (g_format).str();
       } catch (...) { g_format.clear(); }
@@ -118,7 +124,11 @@ private:
       } catch (...) { g_format.clear(); }
 
       if ( save_all_image || save_image_service ) {
-        cv::imwrite(filename, image);
+        // Encoded and written on the writer's threads
+        if (!writer_.write(filename, image)) {
+          ROS_WARN_THROTTLE(5, "Disk writes falling behind, dropped image %s", filename.c_str());
+          return false;
+        }
         ROS_INFO("Saved image %s", filename.c_str());
 
         save_image_service = false;
@@ -131,6 +141,7 @@ private:
   }
 
 private:
+  image_view::AsyncImageWriter& writer_;
   bool is_first_image_;
   bool has_camera_info_;
   size_t count_;
@@ -143,7 +154,9 @@ int main(int argc, char** argv)
   image_transport::ImageTransport it(nh);
   std::string topic = nh.resolveName("image");
 
-  Callbacks callbacks;
+  ros::NodeHandle local_nh("~");
+  image_view::AsyncImageWriter writer((image_view::AsyncImageWriter::Options(local_nh)));
+  Callbacks callbacks(writer);
   // Useful when CameraInfo is being published
   image_transport::CameraSubscriber sub_image_and_camera = it.subscribeCamera(topic, 1,
                                                                               &Callbacks::callbackWithCameraInfo,
@@ -152,7 +165,6 @@ int main(int argc, char** argv)
   image_transport::Subscriber sub_image = it.subscribe(
       topic, 1, boost::bind(&Callbacks::callbackWithoutCameraInfo, &callbacks, _1));
 
-  ros::NodeHandle local_nh("~");
   std::string format_string;
   local_nh.param("filename_format", format_string, std::string("left%04i.%s"));
   local_nh.param("encoding", encoding, std::string("bgr8"));
@@ -160,5 +172,15 @@ int main(int argc, char** argv)
   g_format.parse(format_string);
   ros::ServiceServer save = local_nh.advertiseService ("save", service);
 
+  // Periodically report how far behind the disk writes are
+  double stats_period;
+  local_nh.param("stats_period", stats_period, 10.0);
+  ros::WallTimer stats_timer;
+  if (stats_period > 0.0)
+    stats_timer = nh.createWallTimer(ros::WallDuration(stats_period),
+                                     boost::bind(&image_view::AsyncImageWriter::logStats, &writer));
+
   ros::spin();
+  writer.flush();
+  writer.logStats();
 }
@@ -349,6 +349,7 @@ private:
   ImageConstPtr last_left_msg_, last_right_msg_;
   cv::Mat last_left_image_, last_right_image_;
   cv::Mat_<cv::Vec3b> disparity_color_;
+  cv::Mat_<float> float_disparity_; // scratch buffer for fixed-point disparity
   boost::mutex image_mutex_;
   
   boost::format filename_format_;
@@ -466,9 +467,19 @@ public:
     float max_disparity = disparity_msg->max_disparity;
     float multiplier = 255.0f / (max_disparity - min_disparity);
 
-    assert(disparity_msg->image.encoding == enc::TYPE_32FC1);
-    const cv::Mat_<float> dmat(disparity_msg->image.height, disparity_msg->image.width,
-                               (float*)&disparity_msg->image.data[0], disparity_msg->image.step);
+    cv::Mat_<float> dmat;
+    if (disparity_msg->image.encoding == enc::TYPE_16SC1) {
+      // Fixed-point disparity, d = value * delta_d
+      const cv::Mat_<int16_t> fixed(disparity_msg->image.height, disparity_msg->image.width,
+                                    (int16_t*)&disparity_msg->image.data[0], disparity_msg->image.step);
+      fixed.convertTo(float_disparity_, CV_32F, disparity_msg->delta_d);
+      dmat = float_disparity_;
+    }
+    else {
+      assert(disparity_msg->image.encoding == enc::TYPE_32FC1);
+      dmat = cv::Mat_<float>(disparity_msg->image.height, disparity_msg->image.width,
+                             (float*)&disparity_msg->image.data[0], disparity_msg->image.step);
+    }
     disparity_color_.create(disparity_msg->image.height, disparity_msg->image.width);
     
     for (int row = 0; row < disparity_color_.rows; ++row) {
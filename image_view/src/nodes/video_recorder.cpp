@@ -22,91 +22,334 @@
 #include <ros/ros.h>
 #include <cv_bridge/cv_bridge.h>
 #include <image_transport/image_transport.h>
-#include <camera_calibration_parsers/parse.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <boost/circular_buffer.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <algorithm>
+#include <fstream>
 #if CV_MAJOR_VERSION == 3
 #include <opencv2/videoio.hpp>
 #endif
 
-cv::VideoWriter outputVideo;
+// Records an image topic to a video file. Frames are encoded on a dedicated
+// thread fed by a bounded queue, so a slow encoder drops frames by an explicit
+// policy instead of stalling the subscription, and can be a hardware encoder
+// behind a GStreamer pipeline. With ~passthrough the compressed image_transport
+// frames are written out as is, without decoding or encoding at all.
+class VideoRecorder
+{
+public:
+    VideoRecorder();
+    ~VideoRecorder() { stop(); }
+
+    bool init(ros::NodeHandle& local_nh);
+    void start(ros::NodeHandle& nh);
+    /// Write out the queued frames and close the file
+    void stop();
+    const std::string& filename() const { return filename_; }
+
+private:
+    struct Frame
+    {
+        cv_bridge::CvImageConstPtr image;             // for encoding
+        sensor_msgs::CompressedImageConstPtr compressed; // for pass-through
+    };
+
+    void imageCb(const sensor_msgs::ImageConstPtr& image_msg);
+    void compressedCb(const sensor_msgs::CompressedImageConstPtr& compressed_msg);
+    void push(const Frame& frame);
+    void writeLoop();
+    bool open(const cv::Size& size);
+    void write(const Frame& frame);
 
-int g_count = 0;
-std::string encoding;
-std::string codec;
-int fps;
-std::string filename;
+    image_transport::Subscriber sub_image_;
+    ros::Subscriber sub_compressed_;
 
-void callback(const sensor_msgs::ImageConstPtr& image_msg, const sensor_msgs::CameraInfoConstPtr& info)
+    std::string filename_;
+    std::string encoding_;
+    std::string codec_;
+    std::string pipeline_; // GStreamer pipeline ending in a sink, replaces codec
+    int fps_;
+    bool passthrough_;
+    bool drop_oldest_; // else drop the incoming frame when the queue is full
+
+    boost::mutex mutex_; // guards the queue and counters
+    boost::condition_variable queue_cond_;
+    boost::circular_buffer<Frame> queue_;
+    bool stopping_;
+    size_t recorded_, dropped_;
+    boost::thread writer_;
+
+    // Only touched by the writer thread
+    cv::VideoWriter video_;
+    std::ofstream stream_;
+    bool failed_;
+};
+
+VideoRecorder::VideoRecorder()
+    : fps_(15), passthrough_(false), drop_oldest_(true),
+      stopping_(false), recorded_(0), dropped_(0), failed_(false)
 {
-    if (!outputVideo.isOpened() && !info) return;
-    else if (!outputVideo.isOpened() && info) {
+}
 
-        cv::Size size(info->width, info->height);
+namespace {
 
-        outputVideo.open(filename, 
-#if CV_MAJOR_VERSION == 3
-                cv::VideoWriter::fourcc(codec.c_str()[0],
-#else
-                CV_FOURCC(codec.c_str()[0],
-#endif
-                          codec.c_str()[1],
-                          codec.c_str()[2],
-                          codec.c_str()[3]), 
-                fps,
-                size,
-                true);
-
-        if (!outputVideo.isOpened())
-        {
-            ROS_ERROR("Could not create the output video! Check filename and/or support for codec.");
-            exit(-1);
+// Double-quoted GStreamer launch string, so paths with spaces or '!' stay one value
+std::string quoteGstString(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '"' || value[i] == '\\')
+            quoted += '\\';
+        quoted += value[i];
+    }
+    return quoted + "\"";
+}
+
+// GStreamer encoder elements of the hardware presets, all muxed as H.264 in Matroska
+std::string encoderPipeline(const std::string& encoder, const std::string& filename)
+{
+    std::string element;
+    if (encoder == "vaapi")
+        element = "vaapih264enc";
+    else if (encoder == "nvenc")
+        element = "nvh264enc";
+    else if (encoder == "v4l2")
+        element = "v4l2h264enc";
+    else
+        return "";
+    return "appsrc ! videoconvert ! " + element + " ! h264parse ! matroskamux ! filesink location=" +
+        quoteGstString(filename);
+}
+
+} // namespace
+
+bool VideoRecorder::init(ros::NodeHandle& local_nh)
+{
+    local_nh.param("fps", fps_, 15);
+    local_nh.param("codec", codec_, std::string("MJPG"));
+    local_nh.param("encoding", encoding_, std::string("bgr8"));
+    // Write compressed image_transport frames without re-encoding. JPEG frames
+    // make a raw MJPEG stream, e.g. "ffmpeg -f mjpeg -r 15 -i in -c copy out.avi"
+    local_nh.param("passthrough", passthrough_, false);
+    // "software" encodes with codec; "vaapi", "nvenc" and "v4l2" (M2M) use a
+    // hardware H.264 encoder through GStreamer; ~pipeline overrides either
+    std::string encoder;
+    local_nh.param("encoder", encoder, std::string("software"));
+    // By default named after what is actually written: a raw MJPEG stream,
+    // Matroska from the hardware presets, or an AVI container
+    std::string default_filename = "output.avi";
+    if (passthrough_)
+        default_filename = "output.mjpeg";
+    else if (encoder != "software")
+        default_filename = "output.mkv";
+    local_nh.param("filename", filename_, default_filename);
+    local_nh.param("pipeline", pipeline_, std::string(""));
+    // Frames waiting for the encoder; when full, drop the "oldest" or the "newest" frame
+    int queue_size;
+    local_nh.param("queue_size", queue_size, 30);
+    std::string drop_policy;
+    local_nh.param("drop_policy", drop_policy, std::string("oldest"));
+
+    if (pipeline_.empty() && encoder != "software") {
+        pipeline_ = encoderPipeline(encoder, filename_);
+        if (pipeline_.empty()) {
+            ROS_ERROR("Unknown encoder '%s', use software, vaapi, nvenc or v4l2", encoder.c_str());
+            return false;
         }
+    }
+#if CV_MAJOR_VERSION != 3
+    if (!pipeline_.empty()) {
+        ROS_ERROR("GStreamer pipelines need OpenCV 3");
+        return false;
+    }
+#endif
+    if (pipeline_.empty() && !passthrough_ && codec_.size() != 4) {
+        ROS_ERROR("The video codec must be a FOURCC identifier (4 chars)");
+        return false;
+    }
+    if (drop_policy != "oldest" && drop_policy != "newest") {
+        ROS_ERROR("Unknown drop policy '%s', use oldest or newest", drop_policy.c_str());
+        return false;
+    }
+    drop_oldest_ = drop_policy == "oldest";
+    queue_.set_capacity(std::max(queue_size, 1));
+    return true;
+}
 
-        ROS_INFO_STREAM("Starting to record " << codec << " video at " << size << "@" << fps << "fps. Press Ctrl+C to stop recording." );
+void VideoRecorder::start(ros::NodeHandle& nh)
+{
+    writer_ = boost::thread(&VideoRecorder::writeLoop, this);
 
+    std::string topic = nh.resolveName("image");
+    if (passthrough_) {
+        sub_compressed_ = nh.subscribe(topic + "/compressed", 10, &VideoRecorder::compressedCb, this);
+        ROS_INFO_STREAM("Waiting for topic " << topic << "/compressed...");
     }
-    else if (outputVideo.isOpened() && info) return;
+    else {
+        image_transport::ImageTransport it(nh);
+        sub_image_ = it.subscribe(topic, 10, &VideoRecorder::imageCb, this);
+        ROS_INFO_STREAM("Waiting for topic " << topic << "...");
+    }
+}
+
+void VideoRecorder::stop()
+{
+    sub_image_.shutdown();
+    sub_compressed_.shutdown();
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    queue_cond_.notify_one();
+    if (writer_.joinable()) {
+        writer_.join();
+        ROS_INFO("Recorded %d frames, dropped %d", (int)recorded_, (int)dropped_);
+    }
+}
 
-    cv::Mat image;
+void VideoRecorder::imageCb(const sensor_msgs::ImageConstPtr& image_msg)
+{
+    // Shares the message data when it already has the output encoding
+    Frame frame;
     try
     {
-        image = cv_bridge::toCvShare(image_msg, encoding)->image;
+        frame.image = cv_bridge::toCvShare(image_msg, encoding_);
     } catch(cv_bridge::Exception)
     {
-        ROS_ERROR("Unable to convert %s image to %s", image_msg->encoding.c_str(), encoding.c_str());
+        ROS_ERROR("Unable to convert %s image to %s", image_msg->encoding.c_str(), encoding_.c_str());
         return;
     }
-
-    if (!image.empty()) {
-        outputVideo << image;
-        ROS_INFO_STREAM("Recording frame " << g_count << "\x1b[1F");
-        g_count++;
-    } else {
+    if (frame.image->image.empty()) {
         ROS_WARN("Frame skipped, no data!");
+        return;
+    }
+    push(frame);
+}
+
+void VideoRecorder::compressedCb(const sensor_msgs::CompressedImageConstPtr& compressed_msg)
+{
+    if (compressed_msg->format.find("jpeg") == std::string::npos) {
+        ROS_WARN_THROTTLE(5, "Frame skipped, pass-through only supports JPEG, not '%s'",
+                          compressed_msg->format.c_str());
+        return;
+    }
+    Frame frame;
+    frame.compressed = compressed_msg;
+    push(frame);
+}
+
+void VideoRecorder::push(const Frame& frame)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (queue_.full()) {
+            ++dropped_;
+            ROS_WARN_THROTTLE(5, "Encoder falling behind, dropped %d frames so far", (int)dropped_);
+            if (!drop_oldest_)
+                return;
+        }
+        queue_.push_back(frame); // overwrites the oldest frame when full
+    }
+    queue_cond_.notify_one();
+}
+
+void VideoRecorder::writeLoop()
+{
+    for (;;) {
+        Frame frame;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (queue_.empty() && !stopping_)
+                queue_cond_.wait(lock);
+            if (queue_.empty())
+                break; // stopping, and everything is written
+            frame = queue_.front();
+            queue_.pop_front();
+        }
+        if (!failed_)
+            write(frame);
+    }
+    video_.release();
+    stream_.close();
+}
+
+bool VideoRecorder::open(const cv::Size& size)
+{
+    if (passthrough_) {
+        stream_.open(filename_.c_str(), std::ios::binary);
+        if (!stream_)
+            ROS_ERROR("Could not create the output file %s", filename_.c_str());
+        else
+            ROS_INFO_STREAM("Starting to record JPEG frames to " << filename_ << ". Press Ctrl+C to stop recording.");
+        return stream_.good();
+    }
+
+    if (!pipeline_.empty()) {
+        // The GStreamer backend parses a filename with a FOURCC of 0 as a launch pipeline
+        video_.open(pipeline_, 0, fps_, size, true);
     }
+    else {
+        video_.open(filename_,
+#if CV_MAJOR_VERSION == 3
+                    cv::VideoWriter::fourcc(codec_.c_str()[0],
+#else
+                    CV_FOURCC(codec_.c_str()[0],
+#endif
+                              codec_.c_str()[1],
+                              codec_.c_str()[2],
+                              codec_.c_str()[3]),
+                    fps_,
+                    size,
+                    true);
+    }
+
+    if (!video_.isOpened()) {
+        ROS_ERROR("Could not create the output video! Check filename and/or support for codec or pipeline.");
+        return false;
+    }
+    ROS_INFO_STREAM("Starting to record " << (pipeline_.empty() ? codec_ : pipeline_) << " video at "
+                    << size << "@" << fps_ << "fps. Press Ctrl+C to stop recording.");
+    return true;
+}
+
+void VideoRecorder::write(const Frame& frame)
+{
+    bool opened = passthrough_ ? stream_.is_open() : video_.isOpened();
+    cv::Size size = frame.image ? frame.image->image.size() : cv::Size();
+    if (!opened && !open(size)) {
+        failed_ = true;
+        ros::shutdown();
+        return;
+    }
+
+    if (frame.compressed)
+        stream_.write(reinterpret_cast<const char*>(&frame.compressed->data[0]), frame.compressed->data.size());
+    else
+        video_ << frame.image->image;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    ROS_INFO_STREAM("Recording frame " << recorded_ << "\x1b[1F");
+    ++recorded_;
 }
 
 int main(int argc, char** argv)
 {
     ros::init(argc, argv, "video_recorder", ros::init_options::AnonymousName);
     ros::NodeHandle nh;
-    image_transport::ImageTransport it(nh);
-    std::string topic = nh.resolveName("image");
-    image_transport::CameraSubscriber sub_camera = it.subscribeCamera(topic, 1, &callback);
-    image_transport::Subscriber sub_image = it.subscribe(topic, 1,
-            boost::bind(callback, _1, sensor_msgs::CameraInfoConstPtr()));
-
     ros::NodeHandle local_nh("~");
-    local_nh.param("filename", filename, std::string("output.avi"));
-    local_nh.param("fps", fps, 15);
-    local_nh.param("codec", codec, std::string("MJPG"));
-    local_nh.param("encoding", encoding, std::string("bgr8"));
 
-    if (codec.size() != 4) {
-        ROS_ERROR("The video codec must be a FOURCC identifier (4 chars)");
+    VideoRecorder recorder;
+    if (!recorder.init(local_nh))
         exit(-1);
-    }
-
-    ROS_INFO_STREAM("Waiting for topic " << topic << "...");
+    recorder.start(nh);
     ros::spin();
-    std::cout << "\nVideo saved as " << filename << std::endl;
+    recorder.stop();
+    std::cout << "\nVideo saved as " << recorder.filename() << std::endl;
 }
@@ -0,0 +1,262 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "async_image_writer.h"
+#include <gtest/gtest.h>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using image_view::AsyncImageWriter;
+
+namespace {
+
+// Record layout of the container files, see FrameContainer
+struct RecordHeader
+{
+  uint32_t magic;
+  uint32_t name_size;
+  uint64_t data_size;
+  uint64_t stamp;
+  int32_t rows;
+  int32_t cols;
+  int32_t type;
+  uint32_t encoding_size;
+};
+
+const uint32_t RECORD_MAGIC = 0x52474d49;
+
+bool exists(const std::string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+std::string readFile(const std::string& path)
+{
+  std::ifstream file(path.c_str(), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+cv_bridge::CvImageConstPtr makeImage(int rows, int cols, int type, const std::string& encoding, int seed)
+{
+  cv_bridge::CvImagePtr image = boost::make_shared<cv_bridge::CvImage>();
+  image->header.stamp = ros::Time(100 + seed, seed);
+  image->encoding = encoding;
+  image->image.create(rows, cols, type);
+  cv::RNG rng(seed);
+  rng.fill(image->image, cv::RNG::UNIFORM, 0, 256);
+  return image;
+}
+
+class AsyncImageWriterTest : public testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    char pattern[] = "/tmp/async_image_writer_XXXXXX";
+    ASSERT_TRUE(mkdtemp(pattern) != NULL);
+    dir_ = pattern;
+  }
+
+  virtual void TearDown()
+  {
+    std::string command = "rm -rf '" + dir_ + "'";
+    if (system(command.c_str()) != 0)
+      ADD_FAILURE() << "Could not remove " << dir_;
+  }
+
+  std::string path(const std::string& name) const
+  {
+    return dir_ + "/" + name;
+  }
+
+  std::string dir_;
+};
+
+} // namespace
+
+TEST_F(AsyncImageWriterTest, writesEncodedFiles)
+{
+  AsyncImageWriter::Options options;
+  options.encoder_threads = 2;
+  AsyncImageWriter writer(options);
+
+  std::vector<cv_bridge::CvImageConstPtr> images;
+  for (int i = 0; i < 5; ++i) {
+    images.push_back(makeImage(10, 20, CV_8UC3, "bgr8", i));
+    EXPECT_TRUE(writer.write(path((boost::format("frame%04d.png") % i).str()), images.back()));
+  }
+  EXPECT_TRUE(writer.writeData(path("frame.ini"), "[image]\nwidth\n20\n"));
+  writer.flush();
+
+  AsyncImageWriter::Stats stats = writer.stats();
+  EXPECT_EQ(6u, stats.queued);
+  EXPECT_EQ(6u, stats.written);
+  EXPECT_EQ(0u, stats.dropped);
+  EXPECT_EQ(0u, stats.failed);
+  EXPECT_EQ(0u, stats.pending);
+  for (int i = 0; i < 5; ++i) {
+    cv::Mat read = cv::imread(path((boost::format("frame%04d.png") % i).str()), -1);
+    ASSERT_EQ(images[i]->image.size(), read.size());
+    ASSERT_EQ(images[i]->image.type(), read.type());
+    EXPECT_EQ(0, cv::norm(images[i]->image, read, cv::NORM_INF)) << "frame " << i;
+  }
+  EXPECT_EQ("[image]\nwidth\n20\n", readFile(path("frame.ini")));
+}
+
+TEST_F(AsyncImageWriterTest, appendsRawRecordsToContainers)
+{
+  std::vector<cv_bridge::CvImageConstPtr> images;
+  std::vector<std::string> names;
+  {
+    AsyncImageWriter::Options options;
+    options.container = path("raw");
+    options.container_size = 1024; // a few records per file, so files roll over
+    AsyncImageWriter writer(options);
+    for (int i = 0; i < 10; ++i) {
+      images.push_back(i % 2 ? makeImage(16, 30, CV_8UC1, "mono8", i)
+                             : makeImage(7, 9, CV_16UC1, "16UC1", i));
+      names.push_back((boost::format("frame%04d.png") % i).str());
+      EXPECT_TRUE(writer.write(names.back(), images.back()));
+    }
+  } // closing the writer truncates the last file to its records
+
+  size_t frame = 0;
+  int files = 0;
+  for (;; ++files) {
+    std::string file = path((boost::format("raw_%04d.frames") % files).str());
+    if (!exists(file))
+      break;
+    const std::string data = readFile(file);
+    size_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= data.size()) {
+      RecordHeader header;
+      memcpy(&header, data.data() + offset, sizeof(header));
+      if (header.magic == 0)
+        break;
+      ASSERT_EQ(RECORD_MAGIC, header.magic);
+      ASSERT_LT(frame, images.size());
+      const cv::Mat& mat = images[frame]->image;
+      const char* text = data.data() + offset + sizeof(header);
+      EXPECT_EQ(names[frame], std::string(text, header.name_size));
+      EXPECT_EQ(images[frame]->encoding, std::string(text + header.name_size, header.encoding_size));
+      EXPECT_EQ(images[frame]->header.stamp.toNSec(), header.stamp);
+      EXPECT_EQ(mat.rows, header.rows);
+      EXPECT_EQ(mat.cols, header.cols);
+      EXPECT_EQ(mat.type(), header.type);
+      ASSERT_EQ(mat.total() * mat.elemSize(), header.data_size);
+
+      size_t text_size = (sizeof(header) + header.name_size + header.encoding_size + 7) & ~(size_t)7;
+      ASSERT_LE(offset + text_size + header.data_size, data.size());
+      cv::Mat read(mat.rows, mat.cols, mat.type(), const_cast<char*>(data.data() + offset + text_size));
+      EXPECT_EQ(0, cv::norm(mat, read, cv::NORM_INF)) << "frame " << frame;
+      offset += text_size + ((header.data_size + 7) & ~(size_t)7);
+      ++frame;
+    }
+    // Truncated to its records on close
+    EXPECT_EQ(data.size(), offset);
+  }
+  EXPECT_EQ(images.size(), frame);
+  EXPECT_GT(files, 1);
+}
+
+TEST_F(AsyncImageWriterTest, dropsFramesWhenWritesFallBehind)
+{
+  // Opening a FIFO for writing blocks until it has a reader, which stalls
+  // the I/O thread with everything queued after it still pending
+  const std::string fifo = path("stall");
+  ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600));
+
+  AsyncImageWriter::Options options;
+  options.encoder_threads = 1;
+  options.max_pending = 3;
+  AsyncImageWriter writer(options);
+  EXPECT_TRUE(writer.writeData(fifo, "x"));
+  EXPECT_TRUE(writer.writeData(path("a.txt"), "a"));
+  EXPECT_TRUE(writer.write(path("b.png"), makeImage(4, 4, CV_8UC1, "mono8", 0)));
+  EXPECT_FALSE(writer.writeData(path("c.txt"), "c"));
+  EXPECT_FALSE(writer.write(path("d.png"), makeImage(4, 4, CV_8UC1, "mono8", 1)));
+  EXPECT_EQ(2u, writer.stats().dropped);
+  EXPECT_EQ(3u, writer.stats().max_pending);
+
+  int reader = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+  ASSERT_GE(reader, 0);
+  writer.flush();
+  char byte = 0;
+  EXPECT_EQ(1, read(reader, &byte, 1));
+  EXPECT_EQ('x', byte);
+  close(reader);
+
+  AsyncImageWriter::Stats stats = writer.stats();
+  EXPECT_EQ(3u, stats.written);
+  EXPECT_EQ(0u, stats.pending);
+  EXPECT_TRUE(exists(path("a.txt")));
+  EXPECT_TRUE(exists(path("b.png")));
+  EXPECT_FALSE(exists(path("c.txt")));
+  EXPECT_FALSE(exists(path("d.png")));
+}
+
+TEST_F(AsyncImageWriterTest, latchesContainerFailure)
+{
+  AsyncImageWriter::Options options;
+  options.container = path("missing/raw");
+  AsyncImageWriter writer(options);
+  EXPECT_TRUE(writer.write("frame0000.png", makeImage(4, 4, CV_8UC1, "mono8", 0)));
+  writer.flush();
+  EXPECT_EQ(1u, writer.stats().failed);
+
+  // Later frames neither retry nor move on to the next file name
+  ASSERT_EQ(0, mkdir(path("missing").c_str(), 0700));
+  EXPECT_TRUE(writer.write("frame0001.png", makeImage(4, 4, CV_8UC1, "mono8", 1)));
+  writer.flush();
+  EXPECT_EQ(2u, writer.stats().failed);
+  EXPECT_EQ(0u, writer.stats().written);
+  EXPECT_FALSE(exists(path("missing/raw_0000.frames")));
+  EXPECT_FALSE(exists(path("missing/raw_0001.frames")));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
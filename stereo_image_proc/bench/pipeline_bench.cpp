@@ -0,0 +1,417 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+// Replays the camera topics of a bag into a running nodelet graph at a sweep
+// of frame rates, and reports per rate the end-to-end latency percentiles and
+// drop fraction of each output topic, the busy time of each instrumented
+// stage (from /diagnostics, see image_proc/instrumentation.h) and finally the
+// highest rate sustained without drops. See launch/pipeline_bench.launch.
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/version.hpp>
+#if ((BOOST_VERSION / 100) % 1000) >= 53
+#include <boost/thread/lock_guard.hpp>
+#endif
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace stereo_image_proc {
+
+/// Header stamp of any message starting with a std_msgs/Header, deserialized
+/// without touching the rest of the message
+struct HeaderStamp
+{
+  ros::Time stamp;
+};
+
+} // namespace stereo_image_proc
+
+namespace ros {
+namespace message_traits {
+
+template<> struct MD5Sum<stereo_image_proc::HeaderStamp>
+{
+  static const char* value() { return "*"; }
+  static const char* value(const stereo_image_proc::HeaderStamp&) { return value(); }
+};
+
+template<> struct DataType<stereo_image_proc::HeaderStamp>
+{
+  static const char* value() { return "*"; }
+  static const char* value(const stereo_image_proc::HeaderStamp&) { return value(); }
+};
+
+template<> struct Definition<stereo_image_proc::HeaderStamp>
+{
+  static const char* value() { return ""; }
+  static const char* value(const stereo_image_proc::HeaderStamp&) { return value(); }
+};
+
+} // namespace message_traits
+
+namespace serialization {
+
+template<> struct Serializer<stereo_image_proc::HeaderStamp>
+{
+  template<typename Stream>
+  inline static void read(Stream& stream, stereo_image_proc::HeaderStamp& m)
+  {
+    uint32_t seq;
+    stream.next(seq);
+    stream.next(m.stamp);
+  }
+
+  template<typename Stream>
+  inline static void write(Stream&, const stereo_image_proc::HeaderStamp&) {}
+
+  inline static uint32_t serializedLength(const stereo_image_proc::HeaderStamp&) { return 0; }
+};
+
+} // namespace serialization
+} // namespace ros
+
+namespace stereo_image_proc {
+
+class PipelineBench
+{
+public:
+  PipelineBench();
+
+  bool load(const std::string& path, int max_frames);
+
+  /// Sweep the rates, returning the highest one sustained without drops (0 if none)
+  double run();
+
+private:
+  // One message of a frame, to be republished on publishers_[publisher]
+  struct Message
+  {
+    size_t publisher;
+    sensor_msgs::ImageConstPtr image; // either image or info is set
+    sensor_msgs::CameraInfoConstPtr info;
+  };
+  typedef std::vector<Message> Frame;
+
+  // Latencies (seconds) of the frames received on one output since the step started
+  struct Output
+  {
+    std::string topic;
+    ros::Subscriber sub;
+    std::vector<double> latencies;
+  };
+
+  // Latest cumulative numbers of one instrumented stage
+  struct Stage
+  {
+    Stage() : frames(0.0), busy(0.0), start_busy(0.0) {}
+    double frames;
+    double busy; // seconds spent in the stage callback
+    double start_busy;
+  };
+
+  void outputCb(size_t output, const boost::shared_ptr<const HeaderStamp>& msg);
+  void diagnosticsCb(const diagnostic_msgs::DiagnosticArrayConstPtr& msg);
+  void publish(const Frame& frame);
+  /// Publish frames at rate for duration seconds; returns the number published
+  size_t replay(double rate, double duration, size_t& next_frame);
+  bool report(double rate, size_t sent, double elapsed);
+
+  ros::NodeHandle nh_, private_nh_;
+  std::vector<std::string> topics_;
+  std::vector<ros::Publisher> publishers_;
+  std::vector<Frame> frames_;
+  std::vector<double> rates_;
+  double duration_, warmup_, settle_, max_drop_;
+
+  boost::mutex mutex_; // guards the members below
+  std::vector<Output> outputs_;
+  ros::Time step_start_; // frames stamped earlier belong to the previous step
+  std::map<std::string, Stage> stages_;
+  ros::Subscriber diagnostics_sub_;
+};
+
+PipelineBench::PipelineBench()
+  : private_nh_("~")
+{
+  if (!private_nh_.getParam("rates", rates_)) {
+    double defaults[] = { 5.0, 10.0, 15.0, 20.0, 30.0, 45.0, 60.0 };
+    rates_.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+  }
+  std::sort(rates_.begin(), rates_.end());
+  private_nh_.param("duration", duration_, 10.0);
+  private_nh_.param("warmup", warmup_, 3.0);
+  private_nh_.param("settle", settle_, 1.0);
+  private_nh_.param("max_drop", max_drop_, 0.01);
+
+  std::vector<std::string> outputs;
+  if (!private_nh_.getParam("outputs", outputs)) {
+    outputs.push_back("stereo/disparity");
+    outputs.push_back("stereo/points2");
+  }
+  outputs_.resize(outputs.size());
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    outputs_[i].topic = nh_.resolveName(outputs[i]);
+    outputs_[i].sub = nh_.subscribe<HeaderStamp>(outputs_[i].topic, 10,
+                                                 boost::bind(&PipelineBench::outputCb, this, i, _1));
+  }
+  diagnostics_sub_ = nh_.subscribe("/diagnostics", 10, &PipelineBench::diagnosticsCb, this);
+}
+
+bool PipelineBench::load(const std::string& path, int max_frames)
+{
+  rosbag::Bag bag;
+  try {
+    bag.open(path, rosbag::bagmode::Read);
+  }
+  catch (rosbag::BagException& e) {
+    ROS_ERROR("Could not open bag %s: %s", path.c_str(), e.what());
+    return false;
+  }
+
+  // Group the camera messages by header stamp, so the synchronizers downstream
+  // still see matching stamps after restamping
+  std::vector<std::string> types;
+  types.push_back("sensor_msgs/Image");
+  types.push_back("sensor_msgs/CameraInfo");
+  rosbag::View view(bag, rosbag::TypeQuery(types));
+  std::map<ros::Time, Frame> frames;
+  BOOST_FOREACH(const rosbag::MessageInstance& m, view)
+  {
+    Message message;
+    ros::Time stamp;
+    std::vector<std::string>::iterator topic = std::find(topics_.begin(), topics_.end(), m.getTopic());
+    message.publisher = topic - topics_.begin();
+    if ((message.image = m.instantiate<sensor_msgs::Image>()))
+      stamp = message.image->header.stamp;
+    else if ((message.info = m.instantiate<sensor_msgs::CameraInfo>()))
+      stamp = message.info->header.stamp;
+    else
+      continue;
+
+    if (topic == topics_.end()) {
+      topics_.push_back(m.getTopic());
+      if (message.image)
+        publishers_.push_back(nh_.advertise<sensor_msgs::Image>(m.getTopic(), 10));
+      else
+        publishers_.push_back(nh_.advertise<sensor_msgs::CameraInfo>(m.getTopic(), 10));
+    }
+    frames[stamp].push_back(message);
+    if ((int)frames.size() > max_frames)
+      break;
+  }
+  // The last frame may be incomplete
+  if ((int)frames.size() > max_frames)
+    frames.erase(--frames.end());
+
+  for (std::map<ros::Time, Frame>::const_iterator it = frames.begin(); it != frames.end(); ++it)
+    frames_.push_back(it->second);
+  ROS_INFO("Loaded %d frames on %d topics from %s", (int)frames_.size(), (int)topics_.size(), path.c_str());
+  return !frames_.empty();
+}
+
+void PipelineBench::outputCb(size_t output, const boost::shared_ptr<const HeaderStamp>& msg)
+{
+  ros::Time now = ros::Time::now();
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (msg->stamp >= step_start_)
+    outputs_[output].latencies.push_back((now - msg->stamp).toSec());
+}
+
+void PipelineBench::diagnosticsCb(const diagnostic_msgs::DiagnosticArrayConstPtr& msg)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  BOOST_FOREACH(const diagnostic_msgs::DiagnosticStatus& status, msg->status)
+  {
+    double frames = -1.0, mean_us = -1.0;
+    BOOST_FOREACH(const diagnostic_msgs::KeyValue& kv, status.values)
+    {
+      if (kv.key == "frames")
+        frames = std::atof(kv.value.c_str());
+      else if (kv.key == "latency us mean")
+        mean_us = std::atof(kv.value.c_str());
+    }
+    if (frames < 0.0 || mean_us < 0.0)
+      continue; // not published by image_proc::Instrumentation
+    Stage& stage = stages_[status.name];
+    stage.frames = frames;
+    stage.busy = frames * mean_us * 1e-6;
+  }
+}
+
+void PipelineBench::publish(const Frame& frame)
+{
+  // Every message of the frame gets the same fresh stamp, which the latency is
+  // measured from. Publish copies, the previous ones may still be queued.
+  ros::Time stamp = ros::Time::now();
+  BOOST_FOREACH(const Message& message, frame)
+  {
+    if (message.image) {
+      sensor_msgs::ImagePtr image = boost::make_shared<sensor_msgs::Image>(*message.image);
+      image->header.stamp = stamp;
+      publishers_[message.publisher].publish(image);
+    }
+    else {
+      sensor_msgs::CameraInfoPtr info = boost::make_shared<sensor_msgs::CameraInfo>(*message.info);
+      info->header.stamp = stamp;
+      publishers_[message.publisher].publish(info);
+    }
+  }
+}
+
+size_t PipelineBench::replay(double rate, double duration, size_t& next_frame)
+{
+  ros::WallDuration period(1.0 / rate);
+  ros::WallTime next = ros::WallTime::now(), end = next + ros::WallDuration(duration);
+  size_t sent = 0;
+  for (; next < end && ros::ok(); next += period, ++sent) {
+    ros::WallTime now = ros::WallTime::now();
+    if (next > now)
+      (next - now).sleep();
+    publish(frames_[next_frame]);
+    next_frame = (next_frame + 1) % frames_.size();
+  }
+  return sent;
+}
+
+namespace {
+
+double percentile(const std::vector<double>& sorted, double q)
+{
+  size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[i];
+}
+
+} // namespace
+
+bool PipelineBench::report(double rate, size_t sent, double elapsed)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  bool sustained = true;
+  std::printf("\n%.1f Hz, %d frames in %.1f s\n", rate, (int)sent, elapsed);
+  std::printf("  %-36s %8s %8s %8s %8s %8s\n", "output", "dropped", "p50 ms", "p90 ms", "p99 ms", "max ms");
+  for (size_t i = 0; i < outputs_.size(); ++i) {
+    std::vector<double>& latencies = outputs_[i].latencies;
+    double dropped = sent ? 1.0 - (double)latencies.size() / sent : 0.0;
+    sustained = sustained && dropped <= max_drop_;
+    if (latencies.empty()) {
+      std::printf("  %-36s %7.1f%% %8s %8s %8s %8s\n", outputs_[i].topic.c_str(), 100.0 * dropped,
+                  "-", "-", "-", "-");
+      continue;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("  %-36s %7.1f%% %8.1f %8.1f %8.1f %8.1f\n", outputs_[i].topic.c_str(), 100.0 * dropped,
+                1e3 * percentile(latencies, 0.5), 1e3 * percentile(latencies, 0.9),
+                1e3 * percentile(latencies, 0.99), 1e3 * latencies.back());
+  }
+
+  // Busy time is wall time inside the stage callback, in percent of one core;
+  // stages running parallel kernels may use more CPU than that
+  if (!stages_.empty())
+    std::printf("  %-36s %8s\n", "stage", "busy");
+  for (std::map<std::string, Stage>::iterator it = stages_.begin(); it != stages_.end(); ++it) {
+    std::printf("  %-36s %7.1f%%\n", it->first.c_str(), 100.0 * (it->second.busy - it->second.start_busy) / elapsed);
+  }
+  std::fflush(stdout);
+  return sustained;
+}
+
+double PipelineBench::run()
+{
+  // Let the lazy subscriptions of the graph connect before measuring
+  size_t next_frame = 0;
+  ROS_INFO("Warming up for %.1f s", warmup_);
+  replay(rates_.front(), warmup_, next_frame);
+
+  double sustained_rate = 0.0;
+  for (size_t r = 0; r < rates_.size() && ros::ok(); ++r) {
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      step_start_ = ros::Time::now();
+      for (size_t i = 0; i < outputs_.size(); ++i)
+        outputs_[i].latencies.clear();
+      for (std::map<std::string, Stage>::iterator it = stages_.begin(); it != stages_.end(); ++it)
+        it->second.start_busy = it->second.busy;
+    }
+    ros::WallTime start = ros::WallTime::now();
+    size_t sent = replay(rates_[r], duration_, next_frame);
+    double elapsed = (ros::WallTime::now() - start).toSec();
+    // Let the last frames and diagnostics through
+    ros::WallDuration(settle_).sleep();
+
+    if (report(rates_[r], sent, elapsed))
+      sustained_rate = rates_[r];
+    else
+      break; // higher rates only drop more
+  }
+  return sustained_rate;
+}
+
+} // namespace stereo_image_proc
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "pipeline_bench");
+  ros::NodeHandle private_nh("~");
+  std::string bag;
+  if (!private_nh.getParam("bag", bag)) {
+    ROS_ERROR("Set ~bag to the bag to replay");
+    return 1;
+  }
+  int max_frames;
+  private_nh.param("max_frames", max_frames, 300);
+
+  stereo_image_proc::PipelineBench bench;
+  if (!bench.load(bag, max_frames))
+    return 1;
+
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+  double rate = bench.run();
+  if (rate > 0.0)
+    std::printf("\nMaximum sustained rate: %.1f Hz\n", rate);
+  else
+    std::printf("\nNo rate sustained without drops\n");
+  return 0;
+}
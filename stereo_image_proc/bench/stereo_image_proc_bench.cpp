@@ -0,0 +1,89 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <stereo_image_proc/processor.h>
+#include <image_proc/benchmark.h>
+#include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
+
+using namespace stereo_image_proc;
+using image_proc::Benchmark;
+
+namespace {
+
+void benchDisparity(Benchmark& bench, const cv::Size& size)
+{
+  cv::Mat left, right;
+  bench.stereoPair(size, 48, left, right);
+  image_geometry::StereoCameraModel model;
+  model.fromCameraInfo(Benchmark::cameraInfo(size), Benchmark::cameraInfo(size, 0.1));
+
+  StereoProcessor processor;
+  processor.setDisparityRange(64);
+  stereo_msgs::DisparityImage disparity;
+  boost::function<void ()> match =
+    boost::bind(&StereoProcessor::processDisparity, &processor,
+                boost::cref(left), boost::cref(right), boost::cref(model), boost::ref(disparity));
+
+  processor.setStereoType(StereoProcessor::BM);
+  bench.run("disparity/bm", size, match);
+  processor.setParallel(true);
+  bench.run("disparity/bm_parallel", size, match);
+  processor.setParallel(false);
+  processor.setFixedPointDisparity(true);
+  bench.run("disparity/bm_fixed_point", size, match);
+  processor.setFixedPointDisparity(false);
+  processor.setStereoType(StereoProcessor::SGBM);
+  bench.run("disparity/sgbm", size, match);
+
+  // Points from the last (SGBM) disparity image
+  cv::Mat color = bench.image(size, CV_8UC3);
+  sensor_msgs::PointCloud2 points;
+  boost::function<void ()> project =
+    boost::bind(&StereoProcessor::processPoints2, &processor, boost::cref(disparity), boost::cref(color),
+                sensor_msgs::image_encodings::BGR8, boost::cref(model), boost::ref(points));
+  bench.run("points2/organized", size, project);
+  processor.setCompactPoints2(true);
+  bench.run("points2/compact", size, project);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Benchmark bench(argc, argv);
+  std::vector<cv::Size> sizes = Benchmark::resolutions();
+  for (size_t i = 0; i < sizes.size(); ++i)
+    benchDisparity(bench, sizes[i]);
+  return 0;
+}
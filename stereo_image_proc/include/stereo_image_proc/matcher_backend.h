@@ -0,0 +1,78 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#ifndef STEREO_IMAGE_PROC_MATCHER_BACKEND_H
+#define STEREO_IMAGE_PROC_MATCHER_BACKEND_H
+
+#include <opencv2/core/core.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace stereo_image_proc {
+
+/// Block matching settings a backend may honor; see StereoProcessor for their meaning
+struct MatcherParameters
+{
+  int min_disparity;
+  int disparity_range;
+  int correlation_window_size;
+  int texture_threshold;
+  int prefilter_cap;
+  float uniqueness_ratio;
+};
+
+/**
+ * Block matcher implementation used by StereoProcessor::processDisparity for
+ * stereo types not computed by the built-in OpenCV CPU matchers.
+ */
+class MatcherBackend
+{
+public:
+  virtual ~MatcherBackend() {}
+
+  /**
+   * Compute the disparity of left_rect w.r.t. right_rect as 16-bit fixed point
+   * (16 times the disparity), marking invalid pixels with a value below
+   * 16 * min_disparity just as cv::StereoBM does. Returns false on failure.
+   */
+  virtual bool compute(const cv::Mat& left_rect, const cv::Mat& right_rect,
+                       const MatcherParameters& params, cv::Mat_<int16_t>& disparity16) = 0;
+};
+
+typedef boost::shared_ptr<MatcherBackend> MatcherBackendPtr;
+
+/// CUDA block matcher, or an empty pointer if OpenCV was built without cudastereo
+MatcherBackendPtr createCudaBlockMatcher();
+
+} //namespace stereo_image_proc
+
+#endif
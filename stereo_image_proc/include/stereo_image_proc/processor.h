@@ -35,10 +35,14 @@
 #define STEREO_IMAGE_PROC_PROCESSOR_H
 
 #include <image_proc/processor.h>
+#include <stereo_image_proc/matcher_backend.h>
 #include <image_geometry/stereo_camera_model.h>
 #include <stereo_msgs/DisparityImage.h>
 #include <sensor_msgs/PointCloud.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/image_encodings.h>
+#include <algorithm>
+#include <vector>
 
 namespace stereo_image_proc {
 
@@ -51,25 +55,55 @@ struct StereoImageSet
   sensor_msgs::PointCloud2 points2;
 };
 
+/**
+ * View of a DisparityImage as float disparities. 32FC1 images are wrapped
+ * without copying; 16SC1 fixed point (d = value * delta_d) is converted into
+ * scratch.
+ */
+inline cv::Mat_<float> floatDisparity(const stereo_msgs::DisparityImage& disparity, cv::Mat_<float>& scratch)
+{
+  const sensor_msgs::Image& dimage = disparity.image;
+  uint8_t* data = const_cast<uint8_t*>(dimage.data.empty() ? NULL : &dimage.data[0]);
+  if (dimage.encoding == sensor_msgs::image_encodings::TYPE_16SC1) {
+    const cv::Mat_<int16_t> fixed(dimage.height, dimage.width, (int16_t*)data, dimage.step);
+    fixed.convertTo(scratch, CV_32F, disparity.delta_d);
+    return scratch;
+  }
+  return cv::Mat_<float>(dimage.height, dimage.width, (float*)data, dimage.step);
+}
+
+/**
+ * Removes speckles as cv::filterSpeckles(disparity, invalid, max_size,
+ * max_diff) does, labeling nbands horizontal bands in parallel and merging
+ * the regions across their borders. labels and sizes are scratch buffers.
+ */
+void filterSpecklesBanded(cv::Mat_<int16_t>& disparity, int16_t invalid, int max_size, int max_diff,
+                          int nbands, cv::Mat_<uint32_t>& labels, cv::Mat_<uint32_t>& sizes);
+
 class StereoProcessor
 {
 public:
   
   StereoProcessor()
 #if CV_MAJOR_VERSION == 3
+    : compact_points2_(false), quantize_points2_(false), parallel_(false), parallel_speckle_filter_(false), fixed_point_disparity_(false),
+      incremental_(false), incremental_threshold_(2.0), pyramid_levels_(0), streaming_(false)
   {
     block_matcher_ = cv::StereoBM::create();
     sg_block_matcher_ = cv::StereoSGBM::create(1, 1, 10);
 #else
     : block_matcher_(cv::StereoBM::BASIC_PRESET),
-      sg_block_matcher_()
+      sg_block_matcher_(),
+      compact_points2_(false), quantize_points2_(false), parallel_(false), parallel_speckle_filter_(false), fixed_point_disparity_(false),
+      incremental_(false), incremental_threshold_(2.0), pyramid_levels_(0), streaming_(false)
   {
 #endif
   }
 
   enum StereoType
   {
-    BM, SGBM
+    BM, SGBM,
+    CUDA_BM // falls back to BM if OpenCV has no usable cudastereo module
   };
 
   enum {
@@ -84,6 +118,9 @@ public:
     DISPARITY        = 1 << 8,
     POINT_CLOUD      = 1 << 9,
     POINT_CLOUD2     = 1 << 10,
+    // Color point clouds from LEFT_RECT instead of LEFT_RECT_COLOR, so only
+    // mono processing runs when intensity is enough
+    MONO_POINTS      = 1 << 11,
 
     LEFT_ALL = LEFT_MONO | LEFT_RECT | LEFT_COLOR | LEFT_RECT_COLOR,
     RIGHT_ALL = RIGHT_MONO | RIGHT_RECT | RIGHT_COLOR | RIGHT_RECT_COLOR,
@@ -94,11 +131,86 @@ public:
   inline
   StereoType getStereoType() const {return current_stereo_algorithm_;}
   inline
-  void setStereoType(StereoType type) {current_stereo_algorithm_ = type;}
+  void setStereoType(StereoType type)
+  {
+    current_stereo_algorithm_ = type;
+    if (type == CUDA_BM && !cuda_matcher_)
+      cuda_matcher_ = createCudaBlockMatcher();
+  }
 
   int getInterpolation() const;
   void setInterpolation(int interp);
 
+  bool getFusedRectification() const;
+  void setFusedRectification(bool fused);
+
+  // If set, processPoints2 outputs only the valid points, as a dense 1 x N cloud
+  bool getCompactPoints2() const;
+  void setCompactPoints2(bool compact);
+
+  // If set, processPoints2 outputs int16 millimetre x_mm, y_mm, z_mm fields,
+  // see image_proc::QuantizedPoints
+  bool getQuantizePoints2() const;
+  void setQuantizePoints2(bool quantize);
+
+  // If set, process the left and right images concurrently and split block
+  // matching into overlapping horizontal stripes, each with its own matcher,
+  // across threads. Speckles are removed once the stripes are joined, as
+  // the matcher does on the whole image; SGBM path costs only see the stripe
+  // plus its margin, so SGBM results can differ slightly near stripe borders.
+  bool getParallel() const;
+  void setParallel(bool parallel);
+
+  // If set, processDisparity removes speckles itself once the whole disparity
+  // image is matched, instead of leaving it to the matcher: a connected
+  // components pass over horizontal tiles in parallel, merged across tile
+  // borders. Results are those of cv::filterSpeckles on the full frame.
+  // Streaming still filters inside the matcher.
+  bool getParallelSpeckleFilter() const;
+  void setParallelSpeckleFilter(bool parallel);
+
+  // If set, processDisparity outputs the matcher's native 16SC1 fixed-point
+  // disparity (delta_d = 1/16) instead of converting it to 32FC1
+  bool getFixedPointDisparity() const;
+  void setFixedPointDisparity(bool fixed_point);
+
+  // Sub-rectangle of the left rectified image to match, in pixels, clamped to
+  // the image. A zero width or height extends it to the right or bottom edge,
+  // so the default empty rectangle matches the full frame, as does a region
+  // entirely outside the image. Disparities outside the region are invalid.
+  cv::Rect getMatchingRoi() const;
+  void setMatchingRoi(const cv::Rect& roi);
+
+  // If set, processDisparity only rematches tiles whose neighbourhood changed
+  // since the previous frame and reuses the previous disparities elsewhere. A
+  // tile of either image has changed when its mean absolute difference from the
+  // image the cached disparities were computed from exceeds the threshold.
+  // Changing any matcher parameter or the image size restarts from a full match.
+  bool getIncremental() const;
+  void setIncremental(bool incremental);
+
+  double getIncrementalThreshold() const;
+  void setIncrementalThreshold(double mean_abs_diff);
+
+  // Number of 2x area-decimation levels for coarse-to-fine matching; 0 (the
+  // default) searches the full disparity range at full resolution. Otherwise
+  // the decimated images are searched over the scaled-down range first, and
+  // each tile of the full-resolution images is then searched only around the
+  // coarse disparities found for it. Small structures missed at the coarse
+  // level are lost.
+  int getPyramidLevels() const;
+  void setPyramidLevels(int levels);
+
+  // If set, process() rectifies the mono images in horizontal bands and feeds
+  // each band to the matcher as soon as it and its margin are ready, instead
+  // of rectifying both images in full first. With parallel processing, the
+  // next band is rectified while the current one is matched. Unless requested
+  // themselves, the full rectified mono images are never built. Results near
+  // band borders behave as with parallel stripes. Incremental, pyramid and
+  // region of interest matching and the CUDA matcher process full frames.
+  bool getStreaming() const;
+  void setStreaming(bool streaming);
+
   // Disparity pre-filtering parameters
 
   int getPreFilterSize() const;
@@ -145,12 +257,19 @@ public:
   int getDisp12MaxDiff() const;
   void setDisp12MaxDiff(int disp12MaxDiff);
 
+  // Outputs process() computes for flags: the requested ones plus every
+  // intermediate they depend on
+  static int dependencies(int flags);
+
   // Do all the work!
   bool process(const sensor_msgs::ImageConstPtr& left_raw,
                const sensor_msgs::ImageConstPtr& right_raw,
                const image_geometry::StereoCameraModel& model,
                StereoImageSet& output, int flags) const;
 
+  // The disparity and point cloud stages keep separate scratch, so one frame's
+  // processPoints or processPoints2 may run while processDisparity matches the
+  // next. Calls of the same stage must not overlap.
   void processDisparity(const cv::Mat& left_rect, const cv::Mat& right_rect,
                         const image_geometry::StereoCameraModel& model,
                         stereo_msgs::DisparityImage& disparity) const;
@@ -165,9 +284,91 @@ public:
                       sensor_msgs::PointCloud2& points) const;
 
 private:
+  class MonoBody;
+  class StripeBody;
+  class StreamBody;
+  struct StreamJob;
+
+  // Rectified rows of one camera around a band being streamed
+  struct StreamWindow
+  {
+    StreamWindow() : rows(0, 0) {}
+    cv::Mat buffer; // first rows.size() rows are valid
+    cv::Range rows;
+  };
+
+  // Matcher and output buffer of one horizontal stripe of parallel matching
+  struct MatcherStripe
+  {
+#if CV_MAJOR_VERSION == 3
+    MatcherStripe()
+      : block_matcher(cv::StereoBM::create()), sg_block_matcher(cv::StereoSGBM::create(1, 1, 10)) {}
+    cv::Ptr<cv::StereoBM> block_matcher;
+    cv::Ptr<cv::StereoSGBM> sg_block_matcher;
+#else
+    cv::StereoBM block_matcher;
+    cv::StereoSGBM sg_block_matcher;
+#endif
+    cv::Mat_<int16_t> disparity16;
+  };
+
+  // Scratch buffers the disparity stage (processDisparity, streaming) writes
+  // while matching one frame
+  struct DisparityScratch
+  {
+    cv::Mat_<int16_t> disparity16; // 16-bit signed disparity image
+    cv::Mat_<int16_t> roi_disparity16; // full-frame disparity when matching a region
+    std::vector<MatcherStripe> stripes;
+    // pyramid matching
+    cv::Mat pyramid_left, pyramid_right;
+    cv::Mat_<int16_t> coarse_disparity16;
+    cv::Mat_<int16_t> pyramid_disparity16;
+    // streaming, double-buffered per camera so the next band can be
+    // rectified while the current one is matched
+    StreamWindow stream_windows[2][2];
+    image_proc::RowScratch stream_scratch[2];
+    cv::Mat_<int16_t> stream_disparity16;
+    // speckle filtering: labels holds union-find parents, speckle_sizes the
+    // sizes of the regions rooted at each pixel
+    cv::Mat_<uint32_t> labels;
+    cv::Mat_<uint32_t> speckle_sizes;
+  };
+
+  // Scratch buffers the point cloud stage (processPoints) writes
+  struct PointsScratch
+  {
+    cv::Mat_<cv::Vec3f> dense_points;
+    cv::Mat_<float> float_disparity; // float conversion of fixed-point disparity
+  };
+
+  void match(const cv::Mat& left_rect, const cv::Mat& right_rect) const;
+  void matchPyramid(const cv::Mat& left_rect, const cv::Mat& right_rect) const;
+  void matchDirect(const cv::Mat& left_rect, const cv::Mat& right_rect) const;
+  // Sets the matchers' search range without changing the configured one
+  void setSearchRange(int min_disparity, int disparity_range) const;
+  // Sets the matchers' speckle window without changing the configured one
+  void setMatcherSpeckleSize(int size) const;
+  void filterSpeckles(cv::Mat_<int16_t>& disparity16) const;
+  const cv::Mat_<int16_t>& matchIncremental(const cv::Mat& left_rect, const cv::Mat& right_rect) const;
+  std::vector<double> matcherState() const;
+  cv::Rect matchingContext(const cv::Rect& roi) const;
+  int contextMargin(StereoType algorithm) const;
+  void matchStripes(const cv::Mat& left_rect, const cv::Mat& right_rect, StereoType algorithm) const;
+  void copyMatcherParameters(MatcherStripe& stripe) const;
+  void fillDisparityImage(const cv::Mat_<int16_t>& disparity16, const cv::Rect& roi,
+                          const image_geometry::StereoCameraModel& model,
+                          stereo_msgs::DisparityImage& disparity) const;
+  bool streamable() const;
+  bool processStreaming(const sensor_msgs::ImageConstPtr& left_raw,
+                        const sensor_msgs::ImageConstPtr& right_raw,
+                        const image_geometry::StereoCameraModel& model,
+                        StereoImageSet& output, bool keep_left_rect, bool keep_right_rect) const;
+  bool prepareStreamBand(const StreamJob& job, int side, int band) const;
+  void matchStreamBand(const StreamJob& job, int band) const;
+
   image_proc::Processor mono_processor_;
+  image_proc::Processor right_processor_; // separate scratch so both sides can run at once
   
-  mutable cv::Mat_<int16_t> disparity16_; // scratch buffer for 16-bit signed disparity image
 #if CV_MAJOR_VERSION == 3
   mutable cv::Ptr<cv::StereoBM> block_matcher_; // contains scratch buffers for block matching
   mutable cv::Ptr<cv::StereoSGBM> sg_block_matcher_;
@@ -176,12 +377,25 @@ private:
   mutable cv::StereoSGBM sg_block_matcher_;
 #endif
   StereoType current_stereo_algorithm_;
-  // scratch buffers for speckle filtering
-  mutable cv::Mat_<uint32_t> labels_;
-  mutable cv::Mat_<uint32_t> wavefront_;
-  mutable cv::Mat_<uint8_t> region_types_;
-  // scratch buffer for dense point cloud
-  mutable cv::Mat_<cv::Vec3f> dense_points_;
+  MatcherBackendPtr cuda_matcher_;
+  bool compact_points2_;
+  bool quantize_points2_;
+  bool parallel_;
+  bool parallel_speckle_filter_;
+  bool fixed_point_disparity_;
+  cv::Rect matching_roi_;
+  bool incremental_;
+  double incremental_threshold_;
+  int pyramid_levels_;
+  bool streaming_;
+  // state of incremental matching: the images the cached disparities were
+  // computed from, and the matcher parameters they were computed with
+  mutable cv::Mat previous_left_, previous_right_;
+  mutable cv::Mat_<int16_t> incremental_disparity16_;
+  mutable std::vector<double> incremental_state_;
+  // scratch of the disparity and point cloud stages, which share none
+  mutable DisparityScratch disparity_scratch_;
+  mutable PointsScratch points_scratch_;
 };
 
 
@@ -193,6 +407,124 @@ inline int StereoProcessor::getInterpolation() const
 inline void StereoProcessor::setInterpolation(int interp)
 {
   mono_processor_.interpolation_ = interp;
+  right_processor_.interpolation_ = interp;
+}
+
+inline bool StereoProcessor::getFusedRectification() const
+{
+  return mono_processor_.fused_;
+}
+
+inline void StereoProcessor::setFusedRectification(bool fused)
+{
+  mono_processor_.fused_ = fused;
+  right_processor_.fused_ = fused;
+}
+
+inline bool StereoProcessor::getCompactPoints2() const
+{
+  return compact_points2_;
+}
+
+inline void StereoProcessor::setCompactPoints2(bool compact)
+{
+  compact_points2_ = compact;
+}
+
+inline bool StereoProcessor::getQuantizePoints2() const
+{
+  return quantize_points2_;
+}
+
+inline void StereoProcessor::setQuantizePoints2(bool quantize)
+{
+  quantize_points2_ = quantize;
+}
+
+inline bool StereoProcessor::getParallel() const
+{
+  return parallel_;
+}
+
+inline void StereoProcessor::setParallel(bool parallel)
+{
+  parallel_ = parallel;
+}
+
+inline bool StereoProcessor::getParallelSpeckleFilter() const
+{
+  return parallel_speckle_filter_;
+}
+
+inline void StereoProcessor::setParallelSpeckleFilter(bool parallel)
+{
+  parallel_speckle_filter_ = parallel;
+}
+
+inline bool StereoProcessor::getFixedPointDisparity() const
+{
+  return fixed_point_disparity_;
+}
+
+inline void StereoProcessor::setFixedPointDisparity(bool fixed_point)
+{
+  fixed_point_disparity_ = fixed_point;
+}
+
+inline cv::Rect StereoProcessor::getMatchingRoi() const
+{
+  return matching_roi_;
+}
+
+inline void StereoProcessor::setMatchingRoi(const cv::Rect& roi)
+{
+  matching_roi_ = roi;
+}
+
+inline bool StereoProcessor::getIncremental() const
+{
+  return incremental_;
+}
+
+inline void StereoProcessor::setIncremental(bool incremental)
+{
+  incremental_ = incremental;
+  if (!incremental) {
+    // Release the cache, and start from a full match when enabled again
+    previous_left_.release();
+    previous_right_.release();
+    incremental_disparity16_.release();
+  }
+}
+
+inline double StereoProcessor::getIncrementalThreshold() const
+{
+  return incremental_threshold_;
+}
+
+inline void StereoProcessor::setIncrementalThreshold(double mean_abs_diff)
+{
+  incremental_threshold_ = mean_abs_diff;
+}
+
+inline int StereoProcessor::getPyramidLevels() const
+{
+  return pyramid_levels_;
+}
+
+inline void StereoProcessor::setPyramidLevels(int levels)
+{
+  pyramid_levels_ = std::max(levels, 0);
+}
+
+inline bool StereoProcessor::getStreaming() const
+{
+  return streaming_;
+}
+
+inline void StereoProcessor::setStreaming(bool streaming)
+{
+  streaming_ = streaming;
 }
 
 // For once, a macro is used just to avoid errors
@@ -0,0 +1,138 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "stereo_image_proc/matcher_backend.h"
+#include <opencv2/opencv_modules.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <ros/console.h>
+#include <algorithm>
+
+#ifdef HAVE_OPENCV_CUDASTEREO
+#include <opencv2/cudastereo.hpp>
+#endif
+
+namespace stereo_image_proc {
+
+#ifdef HAVE_OPENCV_CUDASTEREO
+
+/**
+ * Block matching on the GPU with cv::cuda::StereoBM. Device buffers and the
+ * stream persist across frames, so a frame costs two uploads, the match and
+ * one 8-bit download, without reallocation.
+ *
+ * The GPU matcher writes 0 both where it rejects a match and where the
+ * disparity really is 0, so its own texture check stays off. Low texture and
+ * the borders the window and search range cannot cover are found on the CPU
+ * instead, as cv::StereoBM defines them, while the GPU matches.
+ */
+class CudaBlockMatcher : public MatcherBackend
+{
+public:
+  virtual bool compute(const cv::Mat& left_rect, const cv::Mat& right_rect,
+                       const MatcherParameters& params, cv::Mat_<int16_t>& disparity16)
+  {
+    try
+    {
+      if (!matcher_)
+        matcher_ = cv::cuda::createStereoBM(params.disparity_range, params.correlation_window_size);
+      matcher_->setNumDisparities(params.disparity_range);
+      matcher_->setBlockSize(params.correlation_window_size);
+      matcher_->setTextureThreshold(0);
+      matcher_->setPreFilterCap(params.prefilter_cap);
+      if (params.min_disparity != 0)
+        ROS_WARN_ONCE("CUDA block matching always searches from disparity 0, ignoring min_disparity");
+
+      left_.upload(left_rect, stream_);
+      right_.upload(right_rect, stream_);
+      matcher_->compute(left_, right_, disparity_, stream_);
+      disparity_.download(disparity8_, stream_);
+      findInvalid(left_rect, params);
+      stream_.waitForCompletion();
+    }
+    catch (cv::Exception& e)
+    {
+      ROS_ERROR("CUDA block matching failed: %s", e.what());
+      return false;
+    }
+
+    // Integer disparities, 0 included, except where findInvalid rejected them
+    disparity8_.convertTo(disparity16, CV_16S, 16);
+    disparity16.setTo(cv::Scalar(16 * (params.min_disparity - 1)), invalid_);
+    return true;
+  }
+
+private:
+  // Marks in invalid_ the pixels cv::StereoBM would reject for low texture,
+  // the sum over the window of the capped x-Sobel response, and its borders
+  void findInvalid(const cv::Mat& left_rect, const MatcherParameters& params)
+  {
+    const int window = params.correlation_window_size;
+    cv::Sobel(left_rect, sobel_, CV_16S, 1, 0, 3);
+    sobel_ = cv::abs(sobel_);
+    sobel_ = cv::min(sobel_, params.prefilter_cap);
+    cv::boxFilter(sobel_, texture_, CV_32S, cv::Size(window, window), cv::Point(-1, -1), false);
+    invalid_ = texture_ < params.texture_threshold;
+
+    const int margin = window / 2;
+    const int left_margin = std::min(left_rect.cols, params.disparity_range - 1 + margin);
+    const int rows = left_rect.rows, cols = left_rect.cols;
+    invalid_.rowRange(0, std::min(margin, rows)).setTo(255);
+    invalid_.rowRange(std::max(rows - margin, 0), rows).setTo(255);
+    invalid_.colRange(0, left_margin).setTo(255);
+    invalid_.colRange(std::max(cols - margin, 0), cols).setTo(255);
+  }
+
+  cv::Ptr<cv::cuda::StereoBM> matcher_;
+  cv::cuda::GpuMat left_, right_, disparity_;
+  cv::cuda::Stream stream_;
+  cv::Mat disparity8_;
+  cv::Mat sobel_, texture_, invalid_; // CPU validity mask
+};
+
+MatcherBackendPtr createCudaBlockMatcher()
+{
+  if (cv::cuda::getCudaEnabledDeviceCount() == 0)
+    return MatcherBackendPtr();
+  return MatcherBackendPtr(new CudaBlockMatcher);
+}
+
+#else
+
+MatcherBackendPtr createCudaBlockMatcher()
+{
+  return MatcherBackendPtr();
+}
+
+#endif
+
+} //namespace stereo_image_proc
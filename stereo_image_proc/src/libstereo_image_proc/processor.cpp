@@ -34,47 +34,227 @@
 #include <ros/assert.h>
 #include "stereo_image_proc/processor.h"
 #include <sensor_msgs/image_encodings.h>
+#include <image_proc/point_cloud_quantization.h>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <cmath>
 #include <limits>
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
 
 namespace stereo_image_proc {
 
+// Stripes shorter than this cost more in overlap and thread handoff than they gain
+static const int MIN_STRIPE_ROWS = 64;
+// Extra context rows for the vertical SGBM paths entering each stripe
+static const int SGBM_MARGIN_ROWS = 32;
+// Size of the tiles incremental matching checks for changes
+static const int INCREMENTAL_TILE = 32;
+// Size of the tiles pyramid matching refines with their own search range
+static const int PYRAMID_TILE = 128;
+// Fixed-point disparity is 16 times the true value
+static const int DISPARITY_SCALE = 16;
+// Disparity rows produced per step of streaming
+static const int STREAM_BAND_ROWS = 64;
+
+// Runs monocular processing of the left (index 0) and right (index 1) camera
+class StereoProcessor::MonoBody : public cv::ParallelLoopBody
+{
+public:
+  MonoBody(const image_proc::Processor* processors[2], const sensor_msgs::ImageConstPtr* raws[2],
+           const image_geometry::PinholeCameraModel* models[2], image_proc::ImageSet* outputs[2],
+           const int flags[2], bool results[2])
+    : processors_(processors), raws_(raws), models_(models), outputs_(outputs), flags_(flags), results_(results)
+  {
+  }
+
+  virtual void operator()(const cv::Range& sides) const
+  {
+    for (int i = sides.start; i < sides.end; ++i)
+      results_[i] = processors_[i]->process(*raws_[i], *models_[i], *outputs_[i], flags_[i]);
+  }
+
+private:
+  const image_proc::Processor** processors_;
+  const sensor_msgs::ImageConstPtr** raws_;
+  const image_geometry::PinholeCameraModel** models_;
+  image_proc::ImageSet** outputs_;
+  const int* flags_;
+  bool* results_;
+};
+
+// Block matches one horizontal stripe (plus margin) per index
+class StereoProcessor::StripeBody : public cv::ParallelLoopBody
+{
+public:
+  StripeBody(std::vector<MatcherStripe>& stripes, const cv::Mat& left_rect, const cv::Mat& right_rect,
+             StereoType algorithm, int margin, cv::Mat_<int16_t>& disparity16)
+    : stripes_(stripes), left_rect_(left_rect), right_rect_(right_rect),
+      algorithm_(algorithm), margin_(margin), disparity16_(disparity16)
+  {
+  }
+
+  virtual void operator()(const cv::Range& range) const
+  {
+    const int rows = left_rect_.rows, nstripes = stripes_.size();
+    for (int i = range.start; i < range.end; ++i)
+    {
+      MatcherStripe& stripe = stripes_[i];
+      cv::Range out(rows * i / nstripes, rows * (i + 1) / nstripes);
+      cv::Range in(std::max(0, out.start - margin_), std::min(rows, out.end + margin_));
+      const cv::Mat left = left_rect_.rowRange(in), right = right_rect_.rowRange(in);
+      if (algorithm_ == BM)
+#if CV_MAJOR_VERSION == 3
+        stripe.block_matcher->compute(left, right, stripe.disparity16);
+      else
+        stripe.sg_block_matcher->compute(left, right, stripe.disparity16);
+#else
+        stripe.block_matcher(left, right, stripe.disparity16);
+      else
+        stripe.sg_block_matcher(left, right, stripe.disparity16);
+#endif
+      stripe.disparity16.rowRange(out.start - in.start, out.end - in.start)
+        .copyTo(disparity16_.rowRange(out));
+    }
+  }
+
+private:
+  std::vector<MatcherStripe>& stripes_;
+  const cv::Mat& left_rect_;
+  const cv::Mat& right_rect_;
+  StereoType algorithm_;
+  int margin_;
+  cv::Mat_<int16_t>& disparity16_;
+};
+
+// Everything one frame of streaming works on
+struct StereoProcessor::StreamJob
+{
+  const sensor_msgs::Image* raws[2];
+  const image_geometry::PinholeCameraModel* models[2];
+  cv::Size size; // of the rectified images
+  int bands;
+  int margin;
+  StereoType algorithm;
+  cv::Mat* rects[2]; // full rectified images to fill in, or NULL
+};
+
+// Rectified rows [start, end) of the disparity image produced by a band
+static cv::Range streamBandRows(int band, int rows)
+{
+  return cv::Range(band * STREAM_BAND_ROWS, std::min(rows, (band + 1) * STREAM_BAND_ROWS));
+}
+
+// Matches one band (index 0) while the next band of the left (1) and right
+// (2) images is rectified
+class StereoProcessor::StreamBody : public cv::ParallelLoopBody
+{
+public:
+  StreamBody(const StereoProcessor& processor, const StreamJob& job, int band, bool results[3])
+    : processor_(processor), job_(job), band_(band), results_(results)
+  {
+  }
+
+  virtual void operator()(const cv::Range& tasks) const
+  {
+    for (int i = tasks.start; i < tasks.end; ++i) {
+      if (i == 0) {
+        if (band_ >= 0)
+          processor_.matchStreamBand(job_, band_);
+      }
+      else if (band_ + 1 < job_.bands) {
+        results_[i] = processor_.prepareStreamBand(job_, i - 1, band_ + 1);
+      }
+    }
+  }
+
+private:
+  const StereoProcessor& processor_;
+  const StreamJob& job_;
+  int band_;
+  bool* results_;
+};
+
+int StereoProcessor::dependencies(int flags)
+{
+  // Direct prerequisites of each derived output
+  const int cloud_color = (flags & MONO_POINTS) ? LEFT_RECT : LEFT_RECT_COLOR;
+  const image_proc::FlagDependency graph[] = {
+    { POINT_CLOUD,  DISPARITY | cloud_color },
+    { POINT_CLOUD2, DISPARITY | cloud_color },
+    { DISPARITY,    LEFT_RECT | RIGHT_RECT },
+  };
+  return image_proc::resolveDependencies(flags, graph, sizeof(graph) / sizeof(graph[0]));
+}
+
 bool StereoProcessor::process(const sensor_msgs::ImageConstPtr& left_raw,
                               const sensor_msgs::ImageConstPtr& right_raw,
                               const image_geometry::StereoCameraModel& model,
                               StereoImageSet& output, int flags) const
 {
-  // Do monocular processing on left and right images
+  // Do monocular processing on left and right images, computing only what the
+  // requested outputs need
+  const int requested = flags;
+  flags = dependencies(flags);
   int left_flags = flags & LEFT_ALL;
-  int right_flags = flags & RIGHT_ALL;
-  if (flags & STEREO_ALL) {
-    // Need the rectified images for stereo processing
-    left_flags |= LEFT_RECT;
-    right_flags |= RIGHT_RECT;
-  }
-  if (flags & (POINT_CLOUD | POINT_CLOUD2)) {
-    flags |= DISPARITY;
-    // Need the color channels for the point cloud
-    left_flags |= LEFT_RECT_COLOR;
-  }
-  if (!mono_processor_.process(left_raw, model.left(), output.left, left_flags))
-    return false;
-  if (!mono_processor_.process(right_raw, model.right(), output.right, right_flags >> 4))
-    return false;
+  int right_flags = (flags & RIGHT_ALL) >> 4;
+
+  // Streaming rectifies the mono images itself, keeping them only if they are
+  // wanted for more than matching
+  const bool streaming = streaming_ && (flags & DISPARITY) && streamable();
+  const bool keep_left_rect =
+    (requested & LEFT_RECT) || ((requested & MONO_POINTS) && (requested & (POINT_CLOUD | POINT_CLOUD2)));
+  const bool keep_right_rect = requested & RIGHT_RECT;
+  if (streaming) {
+    left_flags &= ~image_proc::Processor::RECT;
+    right_flags &= ~image_proc::Processor::RECT;
+  }
+  if (parallel_) {
+    const image_proc::Processor* processors[2] = { &mono_processor_, &right_processor_ };
+    const sensor_msgs::ImageConstPtr* raws[2] = { &left_raw, &right_raw };
+    const image_geometry::PinholeCameraModel* models[2] = { &model.left(), &model.right() };
+    image_proc::ImageSet* outputs[2] = { &output.left, &output.right };
+    const int side_flags[2] = { left_flags, right_flags };
+    bool results[2] = { false, false };
+    cv::parallel_for_(cv::Range(0, 2), MonoBody(processors, raws, models, outputs, side_flags, results));
+    if (!results[0] || !results[1])
+      return false;
+  }
+  else {
+    if (!mono_processor_.process(left_raw, model.left(), output.left, left_flags))
+      return false;
+    if (!right_processor_.process(right_raw, model.right(), output.right, right_flags))
+      return false;
+  }
 
   // Do block matching to produce the disparity image
-  if (flags & DISPARITY) {
+  if (streaming) {
+    if (!processStreaming(left_raw, right_raw, model, output, keep_left_rect, keep_right_rect))
+      return false;
+  }
+  else if (flags & DISPARITY) {
     processDisparity(output.left.rect, output.right.rect, model, output.disparity);
   }
 
+  // Point clouds take their colors from the rectified color or mono image
+  const bool mono_points = flags & MONO_POINTS;
+  const cv::Mat& cloud_color = mono_points ? output.left.rect : output.left.rect_color;
+  const std::string& cloud_encoding =
+    mono_points ? sensor_msgs::image_encodings::MONO8 : output.left.color_encoding;
+
   // Project disparity image to 3d point cloud
   if (flags & POINT_CLOUD) {
-    processPoints(output.disparity, output.left.rect_color, output.left.color_encoding, model, output.points);
+    processPoints(output.disparity, cloud_color, cloud_encoding, model, output.points);
   }
 
   // Project disparity image to 3d point cloud
   if (flags & POINT_CLOUD2) {
-    processPoints2(output.disparity, output.left.rect_color, output.left.color_encoding, model, output.points2);
+    processPoints2(output.disparity, cloud_color, cloud_encoding, model, output.points2);
   }
 
   return true;
@@ -84,41 +264,102 @@ void StereoProcessor::processDisparity(const cv::Mat& left_rect, const cv::Mat&
                                        const image_geometry::StereoCameraModel& model,
                                        stereo_msgs::DisparityImage& disparity) const
 {
-  // Fixed-point disparity is 16 times the true value: d = d_fp / 16.0 = x_l - x_r.
   static const int DPP = 16; // disparities per pixel
-  static const double inv_dpp = 1.0 / DPP;
 
-  // Block matcher produces 16-bit signed (fixed point) disparity image
-  if (current_stereo_algorithm_ == BM)
-#if CV_MAJOR_VERSION == 3
-    block_matcher_->compute(left_rect, right_rect, disparity16_);
-  else
-    sg_block_matcher_->compute(left_rect, right_rect, disparity16_);
-#else
-    block_matcher_(left_rect, right_rect, disparity16_);
+  // Only match the region of interest, plus the context the matcher needs to
+  // produce exactly the disparities it would inside the region on the full frame
+  const cv::Rect full(0, 0, left_rect.cols, left_rect.rows);
+  cv::Rect roi = matching_roi_;
+  if (roi.width == 0)
+    roi.width = full.width - roi.x;
+  if (roi.height == 0)
+    roi.height = full.height - roi.y;
+  roi &= full;
+  if (roi.area() == 0)
+    roi = full;
+  const cv::Rect crop = (roi == full) ? full : matchingContext(roi) & full;
+  // With our own speckle filter the matchers must not filter, so speckles
+  // are found on the whole image rather than per stripe, tile or level
+  const int speckle_size = getSpeckleSize();
+  const bool filter_speckles = parallel_speckle_filter_ && speckle_size > 0 && getSpeckleRange() >= 0;
+  if (filter_speckles)
+    setMatcherSpeckleSize(0);
+  const cv::Mat_<int16_t>* result = &disparity_scratch_.disparity16;
+  if (incremental_)
+    result = &matchIncremental(left_rect(crop), right_rect(crop));
   else
-    sg_block_matcher_(left_rect, right_rect, disparity16_);
-#endif
+    match(left_rect(crop), right_rect(crop));
+  if (filter_speckles) {
+    setMatcherSpeckleSize(speckle_size);
+    // Incremental results are kept for the next frame and speckles removed
+    // from them stay removed, so filtering them in place is harmless
+    filterSpeckles(const_cast<cv::Mat_<int16_t>&>(*result));
+  }
 
-  // Fill in DisparityImage image data, converting to 32-bit float
+  if (crop != full) {
+    // Everything outside the region is marked invalid, as the matchers do
+    const cv::Mat_<int16_t> matched = *result;
+    disparity_scratch_.roi_disparity16.create(full.height, full.width);
+    disparity_scratch_.roi_disparity16.setTo((getMinDisparity() - 1) * DPP);
+    matched(roi - crop.tl()).copyTo(disparity_scratch_.roi_disparity16(roi));
+    result = &disparity_scratch_.roi_disparity16;
+  }
+
+  fillDisparityImage(*result, roi, model, disparity);
+}
+
+void StereoProcessor::fillDisparityImage(const cv::Mat_<int16_t>& disparity16, const cv::Rect& roi,
+                                         const image_geometry::StereoCameraModel& model,
+                                         stereo_msgs::DisparityImage& disparity) const
+{
+  // Fixed-point disparity is 16 times the true value: d = d_fp / 16.0 = x_l - x_r.
+  static const int DPP = 16; // disparities per pixel
+  static const double inv_dpp = 1.0 / DPP;
+
+  const cv::Rect full(0, 0, disparity16.cols, disparity16.rows);
   sensor_msgs::Image& dimage = disparity.image;
-  dimage.height = disparity16_.rows;
-  dimage.width = disparity16_.cols;
-  dimage.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
-  dimage.step = dimage.width * sizeof(float);
-  dimage.data.resize(dimage.step * dimage.height);
-  cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  // We convert from fixed-point to float disparity and also adjust for any x-offset between
-  // the principal points: d = d_fp*inv_dpp - (cx_l - cx_r)
-  disparity16_.convertTo(dmat, dmat.type(), inv_dpp, -(model.left().cx() - model.right().cx()));
-  ROS_ASSERT(dmat.data == &dimage.data[0]);
+  dimage.height = disparity16.rows;
+  dimage.width = disparity16.cols;
+  if (fixed_point_disparity_) {
+    // Publish the matcher output as is, only adjusting for any x-offset between the
+    // principal points, rounded to fixed point: d_fp' = d_fp - DPP*(cx_l - cx_r)
+    dimage.encoding = sensor_msgs::image_encodings::TYPE_16SC1;
+    dimage.step = dimage.width * sizeof(int16_t);
+    dimage.data.resize(dimage.step * dimage.height);
+    cv::Mat_<int16_t> dmat(dimage.height, dimage.width, (int16_t*)&dimage.data[0], dimage.step);
+    disparity16.convertTo(dmat, dmat.type(), 1.0, -cvRound(DPP * (model.left().cx() - model.right().cx())));
+    ROS_ASSERT(dmat.data == &dimage.data[0]);
+  }
+  else {
+    // Fill in DisparityImage image data, converting to 32-bit float
+    dimage.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+    dimage.step = dimage.width * sizeof(float);
+    dimage.data.resize(dimage.step * dimage.height);
+    cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
+    // We convert from fixed-point to float disparity and also adjust for any x-offset between
+    // the principal points: d = d_fp*inv_dpp - (cx_l - cx_r)
+    disparity16.convertTo(dmat, dmat.type(), inv_dpp, -(model.left().cx() - model.right().cx()));
+    ROS_ASSERT(dmat.data == &dimage.data[0]);
+  }
   /// @todo is_bigendian? :)
 
   // Stereo parameters
   disparity.f = model.right().fx();
   disparity.T = model.baseline();
 
-  /// @todo Window of (potentially) valid disparities
+  // Window of (potentially) valid disparities: the matcher leaves a border of
+  // half its window, and the first columns have no match inside the right image
+  int border = getCorrelationWindowSize() / 2;
+  int left = getDisparityRange() + getMinDisparity() + border - 1;
+  int wtf = (getMinDisparity() >= 0) ? border + getMinDisparity() : std::max(border, -getMinDisparity());
+  int right = full.width - 1 - wtf;
+  int top = border;
+  int bottom = full.height - 1 - border;
+  cv::Rect valid = cv::Rect(left, top, std::max(right - left, 0), std::max(bottom - top, 0)) & roi;
+  disparity.valid_window.x_offset = valid.x;
+  disparity.valid_window.y_offset = valid.y;
+  disparity.valid_window.width = valid.width;
+  disparity.valid_window.height = valid.height;
 
   // Disparity search range
   disparity.min_disparity = getMinDisparity();
@@ -126,88 +367,952 @@ void StereoProcessor::processDisparity(const cv::Mat& left_rect, const cv::Mat&
   disparity.delta_d = inv_dpp;
 }
 
-inline bool isValidPoint(const cv::Vec3f& pt)
+cv::Rect StereoProcessor::matchingContext(const cv::Rect& roi) const
 {
-  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
-  // and zero disparities (point mapped to infinity).
-  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
+  // Left-image columns are matched against right-image columns up to
+  // min_disparity + disparity_range - 1 pixels further left
+  int margin = contextMargin(current_stereo_algorithm_ == SGBM ? SGBM : BM);
+  int left = std::max(getMinDisparity() + getDisparityRange() - 1, 0) + margin;
+  int right = std::max(-getMinDisparity(), 0) + margin;
+  return cv::Rect(roi.x - left, roi.y - margin, roi.width + left + right, roi.height + 2 * margin);
 }
 
-void StereoProcessor::processPoints(const stereo_msgs::DisparityImage& disparity,
-                                    const cv::Mat& color, const std::string& encoding,
-                                    const image_geometry::StereoCameraModel& model,
-                                    sensor_msgs::PointCloud& points) const
+int StereoProcessor::contextMargin(StereoType algorithm) const
 {
-  // Calculate dense point cloud
-  const sensor_msgs::Image& dimage = disparity.image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model.projectDisparityImageTo3d(dmat, dense_points_, true);
+  // Enough context for the correlation and prefilter windows to see exactly
+  // what they would in the full image; SGBM gets extra pixels so its paths
+  // have some history before reaching the region itself
+  int margin = getCorrelationWindowSize() / 2 + 1;
+  if (algorithm == SGBM)
+    margin += SGBM_MARGIN_ROWS;
+  else
+    margin += getPreFilterSize() / 2;
+  return margin;
+}
 
-  // Fill in sparse point cloud message
-  points.points.resize(0);
-  points.channels.resize(3);
-  points.channels[0].name = "rgb";
-  points.channels[0].values.resize(0);
-  points.channels[1].name = "u";
-  points.channels[1].values.resize(0);
-  points.channels[2].name = "v";
-  points.channels[2].values.resize(0);
-  
-  for (int32_t u = 0; u < dense_points_.rows; ++u) {
-    for (int32_t v = 0; v < dense_points_.cols; ++v) {
-      if (isValidPoint(dense_points_(u,v))) {
-        // x,y,z
-        geometry_msgs::Point32 pt;
-        pt.x = dense_points_(u,v)[0];
-        pt.y = dense_points_(u,v)[1];
-        pt.z = dense_points_(u,v)[2];
-        points.points.push_back(pt);
-        // u,v
-        points.channels[1].values.push_back(u);
-        points.channels[2].values.push_back(v);
+void StereoProcessor::match(const cv::Mat& left_rect, const cv::Mat& right_rect) const
+{
+  if (pyramid_levels_ > 0)
+    matchPyramid(left_rect, right_rect);
+  else
+    matchDirect(left_rect, right_rect);
+}
+
+void StereoProcessor::matchPyramid(const cv::Mat& left_rect, const cv::Mat& right_rect) const
+{
+  DisparityScratch& scratch = disparity_scratch_;
+  const int min_disparity = getMinDisparity();
+  const int disparity_range = getDisparityRange();
+  const int factor = 1 << pyramid_levels_;
+
+  // Coarse level: area-decimated images searched over the scaled-down range
+  const cv::Size coarse_size(left_rect.cols / factor, left_rect.rows / factor);
+  const int coarse_min = cvFloor(double(min_disparity) / factor);
+  const int coarse_range = ((disparity_range + factor - 1) / factor + 15) / 16 * 16;
+  if (coarse_size.width <= coarse_range + getCorrelationWindowSize() ||
+      coarse_size.height <= getCorrelationWindowSize()) {
+    // Too small to be worth coarsening
+    matchDirect(left_rect, right_rect);
+    return;
+  }
+  cv::resize(left_rect, scratch.pyramid_left, coarse_size, 0.0, 0.0, cv::INTER_AREA);
+  cv::resize(right_rect, scratch.pyramid_right, coarse_size, 0.0, 0.0, cv::INTER_AREA);
+  setSearchRange(coarse_min, coarse_range);
+  matchDirect(scratch.pyramid_left, scratch.pyramid_right);
+  cv::swap(scratch.disparity16, scratch.coarse_disparity16);
+
+  // Fine level: each tile searches only around the disparities found for it
+  // at the coarse level, which are accurate to about one coarse pixel
+  const int invalid = (min_disparity - 1) * DISPARITY_SCALE;
+  const int max_disparity = min_disparity + disparity_range - 1;
+  const cv::Rect frame(0, 0, left_rect.cols, left_rect.rows);
+  const cv::Rect coarse_frame(0, 0, coarse_size.width, coarse_size.height);
+  scratch.pyramid_disparity16.create(left_rect.rows, left_rect.cols);
+  for (int y = 0; y < frame.height; y += PYRAMID_TILE) {
+    for (int x = 0; x < frame.width; x += PYRAMID_TILE) {
+      const cv::Rect tile = cv::Rect(x, y, PYRAMID_TILE, PYRAMID_TILE) & frame;
+      cv::Mat_<int16_t> output = scratch.pyramid_disparity16(tile);
+      const cv::Rect coarse_tile = cv::Rect(tile.x / factor, tile.y / factor,
+                                            (tile.width + factor - 1) / factor,
+                                            (tile.height + factor - 1) / factor) & coarse_frame;
+      int lo = std::numeric_limits<int>::max(), hi = std::numeric_limits<int>::min();
+      for (int v = coarse_tile.y; v < coarse_tile.y + coarse_tile.height; ++v) {
+        const int16_t* d = scratch.coarse_disparity16[v];
+        for (int u = coarse_tile.x; u < coarse_tile.x + coarse_tile.width; ++u) {
+          if (d[u] >= coarse_min * DISPARITY_SCALE) {
+            lo = std::min(lo, (int)d[u]);
+            hi = std::max(hi, (int)d[u]);
+          }
+        }
       }
+      if (lo > hi) {
+        // Nothing matched at the coarse level
+        output.setTo(invalid);
+        continue;
+      }
+
+      int tile_min = std::max(min_disparity, cvFloor(double(lo) * factor / DISPARITY_SCALE) - 2 * factor);
+      int tile_max = std::min(max_disparity, cvCeil(double(hi) * factor / DISPARITY_SCALE) + 2 * factor);
+      int tile_range = std::min(disparity_range, std::max(16, (tile_max - tile_min + 16) / 16 * 16));
+      tile_min = std::min(tile_min, min_disparity + disparity_range - tile_range);
+      setSearchRange(tile_min, tile_range);
+      const cv::Rect context = matchingContext(tile) & frame;
+      matchDirect(left_rect(context), right_rect(context));
+      scratch.disparity16(tile - context.tl()).copyTo(output);
+      // Pixels invalid for this tile's range must be invalid for the full range
+      output.setTo(invalid, output < tile_min * DISPARITY_SCALE);
     }
   }
+  setSearchRange(min_disparity, disparity_range);
+  cv::swap(scratch.disparity16, scratch.pyramid_disparity16);
+}
 
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  points.channels[0].values.reserve(points.points.size());
-  if (encoding == enc::MONO8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          uint8_t g = color.at<uint8_t>(u,v);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          points.channels[0].values.push_back(*(float*)(&rgb));
-        }
+void StereoProcessor::setSearchRange(int min_disparity, int disparity_range) const
+{
+#if CV_MAJOR_VERSION == 3
+  block_matcher_->setMinDisparity(min_disparity);
+  block_matcher_->setNumDisparities(disparity_range);
+  sg_block_matcher_->setMinDisparity(min_disparity);
+  sg_block_matcher_->setNumDisparities(disparity_range);
+#else
+  block_matcher_.state->minDisparity = min_disparity;
+  block_matcher_.state->numberOfDisparities = disparity_range;
+  sg_block_matcher_.minDisparity = min_disparity;
+  sg_block_matcher_.numberOfDisparities = disparity_range;
+#endif
+}
+
+void StereoProcessor::setMatcherSpeckleSize(int size) const
+{
+#if CV_MAJOR_VERSION == 3
+  block_matcher_->setSpeckleWindowSize(size);
+  sg_block_matcher_->setSpeckleWindowSize(size);
+#else
+  block_matcher_.state->speckleWindowSize = size;
+  sg_block_matcher_.speckleWindowSize = size;
+#endif
+}
+
+namespace {
+
+const uint32_t NO_REGION = std::numeric_limits<uint32_t>::max();
+
+// Root of a union-find tree, halving the path on the way
+inline uint32_t findRoot(uint32_t* parent, uint32_t i)
+{
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Root of a union-find tree without modifying it, safe for concurrent readers
+inline uint32_t findRootConst(const uint32_t* parent, uint32_t i)
+{
+  while (parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+inline void uniteRegions(uint32_t* parent, uint32_t* size, uint32_t a, uint32_t b)
+{
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a == b)
+    return;
+  if (size[a] < size[b])
+    std::swap(a, b);
+  parent[b] = a;
+  size[a] += size[b];
+}
+
+/**
+ * Speckle filtering as cv::filterSpeckles: 4-connected regions of valid
+ * disparities with neighbors differing by at most max_diff, of at most
+ * max_size pixels, become invalid. Each band of rows is labeled on its own,
+ * leaving every pixel pointing straight at its band's root; the bands are
+ * then merged serially along their borders, and finally every pixel looks
+ * up its region size without modifying the trees.
+ */
+class SpeckleBody : public cv::ParallelLoopBody
+{
+public:
+  SpeckleBody(cv::Mat_<int16_t>& disparity, int16_t invalid, int max_size, int max_diff,
+              cv::Mat_<uint32_t>& parent, cv::Mat_<uint32_t>& size, int nbands)
+    : disparity_(disparity), invalid_(invalid), max_size_(max_size), max_diff_(max_diff),
+      parent_(parent[0]), size_(size[0]), nbands_(nbands), labeling_(true)
+  {
+  }
+
+  cv::Range band(int i) const
+  {
+    return cv::Range(disparity_.rows * i / nbands_, disparity_.rows * (i + 1) / nbands_);
+  }
+
+  // Joins the regions touching across the top row of each band but the first
+  void merge()
+  {
+    const int cols = disparity_.cols;
+    for (int i = 1; i < nbands_; ++i) {
+      const int y = band(i).start;
+      const int16_t* d = disparity_[y];
+      const int16_t* up = disparity_[y - 1];
+      for (int x = 0; x < cols; ++x) {
+        if (d[x] != invalid_ && up[x] != invalid_ && std::abs(d[x] - up[x]) <= max_diff_)
+          uniteRegions(parent_, size_, y * cols + x, (y - 1) * cols + x);
       }
     }
+    labeling_ = false;
+  }
+
+  virtual void operator()(const cv::Range& bands) const
+  {
+    for (int i = bands.start; i < bands.end; ++i) {
+      if (labeling_)
+        label(band(i));
+      else
+        removeSpeckles(band(i));
+    }
   }
-  else if (encoding == enc::RGB8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& rgb = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          points.channels[0].values.push_back(*(float*)(&rgb_packed));
+
+private:
+  void label(const cv::Range& rows) const
+  {
+    const int cols = disparity_.cols;
+    for (int y = rows.start; y < rows.end; ++y) {
+      const int16_t* d = disparity_[y];
+      const int16_t* up = (y > rows.start) ? disparity_[y - 1] : NULL;
+      for (int x = 0; x < cols; ++x) {
+        const uint32_t i = y * cols + x;
+        if (d[x] == invalid_) {
+          parent_[i] = NO_REGION;
+          continue;
         }
+        parent_[i] = i;
+        size_[i] = 1;
+        if (x > 0 && d[x - 1] != invalid_ && std::abs(d[x] - d[x - 1]) <= max_diff_)
+          uniteRegions(parent_, size_, i, i - 1);
+        if (up && up[x] != invalid_ && std::abs(d[x] - up[x]) <= max_diff_)
+          uniteRegions(parent_, size_, i, i - cols);
+      }
+    }
+    // Flatten, so the merge only ever relinks band roots
+    for (uint32_t i = rows.start * cols; i < (uint32_t)(rows.end * cols); ++i) {
+      if (parent_[i] != NO_REGION)
+        parent_[i] = findRoot(parent_, i);
+    }
+  }
+
+  void removeSpeckles(const cv::Range& rows) const
+  {
+    const int cols = disparity_.cols;
+    for (int y = rows.start; y < rows.end; ++y) {
+      int16_t* d = disparity_[y];
+      const uint32_t* parent = parent_ + y * cols;
+      for (int x = 0; x < cols; ++x) {
+        if (parent[x] != NO_REGION && (int)size_[findRootConst(parent_, parent[x])] <= max_size_)
+          d[x] = invalid_;
+      }
+    }
+  }
+
+  cv::Mat_<int16_t>& disparity_;
+  int16_t invalid_;
+  int max_size_, max_diff_;
+  uint32_t* parent_;
+  uint32_t* size_;
+  int nbands_;
+  bool labeling_;
+};
+
+} // namespace
+
+void filterSpecklesBanded(cv::Mat_<int16_t>& disparity, int16_t invalid, int max_size, int max_diff,
+                          int nbands, cv::Mat_<uint32_t>& labels, cv::Mat_<uint32_t>& sizes)
+{
+  if (disparity.empty())
+    return;
+  labels.create(disparity.rows, disparity.cols);
+  sizes.create(disparity.rows, disparity.cols);
+  nbands = std::max(1, std::min(nbands, disparity.rows));
+  SpeckleBody body(disparity, invalid, max_size, max_diff, labels, sizes, nbands);
+  cv::parallel_for_(cv::Range(0, nbands), body);
+  body.merge();
+  cv::parallel_for_(cv::Range(0, nbands), body);
+}
+
+void StereoProcessor::filterSpeckles(cv::Mat_<int16_t>& disparity16) const
+{
+  // Same invalid value and range units as the matchers' own filtering, which
+  // only SGBM scales to fixed point
+  const int16_t invalid = (getMinDisparity() - 1) * DISPARITY_SCALE;
+  int max_diff = getSpeckleRange();
+  if (current_stereo_algorithm_ == SGBM)
+    max_diff *= DISPARITY_SCALE;
+
+  const int nbands = std::min(cv::getNumThreads(), disparity16.rows / MIN_STRIPE_ROWS);
+  filterSpecklesBanded(disparity16, invalid, getSpeckleSize(), max_diff, nbands,
+                       disparity_scratch_.labels, disparity_scratch_.speckle_sizes);
+}
+
+void StereoProcessor::matchDirect(const cv::Mat& left_rect, const cv::Mat& right_rect) const
+{
+  // Block matcher produces 16-bit signed (fixed point) disparity image
+  StereoType algorithm = current_stereo_algorithm_;
+  if (algorithm == CUDA_BM) {
+    MatcherParameters params;
+    params.min_disparity = getMinDisparity();
+    params.disparity_range = getDisparityRange();
+    params.correlation_window_size = getCorrelationWindowSize();
+    params.texture_threshold = getTextureThreshold();
+    params.prefilter_cap = getPreFilterCap();
+    params.uniqueness_ratio = getUniquenessRatio();
+    if (!cuda_matcher_ || !cuda_matcher_->compute(left_rect, right_rect, params, disparity_scratch_.disparity16)) {
+      ROS_WARN_ONCE("CUDA block matching unavailable, falling back to CPU block matching");
+      algorithm = BM;
+    }
+  }
+
+  int nstripes = parallel_ ? std::min(cv::getNumThreads(), left_rect.rows / MIN_STRIPE_ROWS) : 1;
+  if (algorithm == CUDA_BM) {
+    // Already computed
+  }
+  else if (nstripes > 1) {
+    disparity_scratch_.stripes.resize(nstripes);
+    matchStripes(left_rect, right_rect, algorithm);
+  }
+  else if (algorithm == BM)
+#if CV_MAJOR_VERSION == 3
+    block_matcher_->compute(left_rect, right_rect, disparity_scratch_.disparity16);
+  else
+    sg_block_matcher_->compute(left_rect, right_rect, disparity_scratch_.disparity16);
+#else
+    block_matcher_(left_rect, right_rect, disparity_scratch_.disparity16);
+  else
+    sg_block_matcher_(left_rect, right_rect, disparity_scratch_.disparity16);
+#endif
+}
+
+const cv::Mat_<int16_t>& StereoProcessor::matchIncremental(const cv::Mat& left_rect,
+                                                         const cv::Mat& right_rect) const
+{
+  std::vector<double> state = matcherState();
+  if (previous_left_.size() != left_rect.size() || previous_left_.type() != left_rect.type() ||
+      incremental_state_ != state) {
+    match(left_rect, right_rect);
+    disparity_scratch_.disparity16.copyTo(incremental_disparity16_);
+    left_rect.copyTo(previous_left_);
+    right_rect.copyTo(previous_right_);
+    incremental_state_.swap(state);
+    return incremental_disparity16_;
+  }
+
+  // Find the tiles of either image that changed, and take them as the new
+  // reference so that slow drifts still add up to a change eventually
+  const cv::Rect frame(0, 0, left_rect.cols, left_rect.rows);
+  const int tile_rows = (frame.height + INCREMENTAL_TILE - 1) / INCREMENTAL_TILE;
+  const int tile_cols = (frame.width + INCREMENTAL_TILE - 1) / INCREMENTAL_TILE;
+  cv::Mat_<uint8_t> changed(tile_rows, tile_cols, (uint8_t)0);
+  for (int ty = 0; ty < tile_rows; ++ty) {
+    for (int tx = 0; tx < tile_cols; ++tx) {
+      cv::Rect tile = cv::Rect(tx * INCREMENTAL_TILE, ty * INCREMENTAL_TILE,
+                               INCREMENTAL_TILE, INCREMENTAL_TILE) & frame;
+      double threshold = incremental_threshold_ * tile.area();
+      if (cv::norm(left_rect(tile), previous_left_(tile), cv::NORM_L1) > threshold) {
+        left_rect(tile).copyTo(previous_left_(tile));
+        changed(ty, tx) = 1;
+      }
+      if (cv::norm(right_rect(tile), previous_right_(tile), cv::NORM_L1) > threshold) {
+        right_rect(tile).copyTo(previous_right_(tile));
+        changed(ty, tx) = 1;
+      }
+    }
+  }
+
+  // A tile's disparities depend on every pixel its matching context covers.
+  // Rematch runs of dirty tiles along each tile row with a single call.
+  for (int ty = 0; ty < tile_rows; ++ty) {
+    int run_start = -1;
+    for (int tx = 0; tx <= tile_cols; ++tx) {
+      bool dirty = false;
+      if (tx < tile_cols) {
+        cv::Rect tile = cv::Rect(tx * INCREMENTAL_TILE, ty * INCREMENTAL_TILE,
+                                 INCREMENTAL_TILE, INCREMENTAL_TILE) & frame;
+        cv::Rect context = matchingContext(tile) & frame;
+        int y0 = context.y / INCREMENTAL_TILE, y1 = (context.y + context.height - 1) / INCREMENTAL_TILE;
+        int x0 = context.x / INCREMENTAL_TILE, x1 = (context.x + context.width - 1) / INCREMENTAL_TILE;
+        for (int y = y0; y <= y1 && !dirty; ++y)
+          for (int x = x0; x <= x1 && !dirty; ++x)
+            dirty = changed(y, x) != 0;
       }
+      if (dirty && run_start < 0) {
+        run_start = tx;
+      }
+      else if (!dirty && run_start >= 0) {
+        cv::Rect run = cv::Rect(run_start * INCREMENTAL_TILE, ty * INCREMENTAL_TILE,
+                                (tx - run_start) * INCREMENTAL_TILE, INCREMENTAL_TILE) & frame;
+        cv::Rect context = matchingContext(run) & frame;
+        match(left_rect(context), right_rect(context));
+        disparity_scratch_.disparity16(run - context.tl()).copyTo(incremental_disparity16_(run));
+        run_start = -1;
+      }
+    }
+  }
+  return incremental_disparity16_;
+}
+
+std::vector<double> StereoProcessor::matcherState() const
+{
+  std::vector<double> state;
+  state.push_back(current_stereo_algorithm_);
+  state.push_back(getPreFilterSize());
+  state.push_back(getPreFilterCap());
+  state.push_back(getCorrelationWindowSize());
+  state.push_back(getMinDisparity());
+  state.push_back(getDisparityRange());
+  state.push_back(getTextureThreshold());
+  state.push_back(getUniquenessRatio());
+  state.push_back(getSpeckleSize());
+  state.push_back(getSpeckleRange());
+  state.push_back(getSgbmMode());
+  state.push_back(getP1());
+  state.push_back(getP2());
+  state.push_back(getDisp12MaxDiff());
+  state.push_back(matching_roi_.x);
+  state.push_back(matching_roi_.y);
+  state.push_back(matching_roi_.width);
+  state.push_back(matching_roi_.height);
+  state.push_back(pyramid_levels_);
+  return state;
+}
+
+void StereoProcessor::matchStripes(const cv::Mat& left_rect, const cv::Mat& right_rect,
+                                   StereoType algorithm) const
+{
+  // Speckle regions cross stripe borders, so the stripes must not filter them
+  // themselves: remove them once the stripes are joined, as the matcher would
+  // on the whole image
+  std::vector<MatcherStripe>& stripes = disparity_scratch_.stripes;
+  const int speckle_size = getSpeckleSize();
+  const bool filter_speckles = speckle_size > 0 && (algorithm == SGBM || getSpeckleRange() >= 0);
+  if (filter_speckles)
+    setMatcherSpeckleSize(0);
+  for (size_t i = 0; i < stripes.size(); ++i)
+    copyMatcherParameters(stripes[i]);
+  if (filter_speckles)
+    setMatcherSpeckleSize(speckle_size);
+
+  int margin = contextMargin(algorithm);
+
+  cv::Mat_<int16_t>& disparity16 = disparity_scratch_.disparity16;
+  disparity16.create(left_rect.rows, left_rect.cols);
+  cv::parallel_for_(cv::Range(0, (int)stripes.size()),
+                    StripeBody(stripes, left_rect, right_rect, algorithm, margin, disparity16));
+  if (filter_speckles)
+    filterSpeckles(disparity16);
+}
+
+void StereoProcessor::copyMatcherParameters(MatcherStripe& stripe) const
+{
+#if CV_MAJOR_VERSION == 3
+  cv::StereoBM& bm = *stripe.block_matcher;
+  bm.setPreFilterType(block_matcher_->getPreFilterType());
+  bm.setPreFilterSize(block_matcher_->getPreFilterSize());
+  bm.setPreFilterCap(block_matcher_->getPreFilterCap());
+  bm.setBlockSize(block_matcher_->getBlockSize());
+  bm.setMinDisparity(block_matcher_->getMinDisparity());
+  bm.setNumDisparities(block_matcher_->getNumDisparities());
+  bm.setTextureThreshold(block_matcher_->getTextureThreshold());
+  bm.setUniquenessRatio(block_matcher_->getUniquenessRatio());
+  bm.setSpeckleWindowSize(block_matcher_->getSpeckleWindowSize());
+  bm.setSpeckleRange(block_matcher_->getSpeckleRange());
+  bm.setDisp12MaxDiff(block_matcher_->getDisp12MaxDiff());
+
+  cv::StereoSGBM& sgbm = *stripe.sg_block_matcher;
+  sgbm.setMinDisparity(sg_block_matcher_->getMinDisparity());
+  sgbm.setNumDisparities(sg_block_matcher_->getNumDisparities());
+  sgbm.setBlockSize(sg_block_matcher_->getBlockSize());
+  sgbm.setP1(sg_block_matcher_->getP1());
+  sgbm.setP2(sg_block_matcher_->getP2());
+  sgbm.setDisp12MaxDiff(sg_block_matcher_->getDisp12MaxDiff());
+  sgbm.setPreFilterCap(sg_block_matcher_->getPreFilterCap());
+  sgbm.setUniquenessRatio(sg_block_matcher_->getUniquenessRatio());
+  sgbm.setSpeckleWindowSize(sg_block_matcher_->getSpeckleWindowSize());
+  sgbm.setSpeckleRange(sg_block_matcher_->getSpeckleRange());
+  sgbm.setMode(sg_block_matcher_->getMode());
+#else
+  // Copy parameters only: the states also own scratch buffers that must not be shared
+  CvStereoBMState& bm = *stripe.block_matcher.state;
+  const CvStereoBMState& src = *block_matcher_.state;
+  bm.preFilterType = src.preFilterType;
+  bm.preFilterSize = src.preFilterSize;
+  bm.preFilterCap = src.preFilterCap;
+  bm.SADWindowSize = src.SADWindowSize;
+  bm.minDisparity = src.minDisparity;
+  bm.numberOfDisparities = src.numberOfDisparities;
+  bm.textureThreshold = src.textureThreshold;
+  bm.uniquenessRatio = src.uniquenessRatio;
+  bm.speckleWindowSize = src.speckleWindowSize;
+  bm.speckleRange = src.speckleRange;
+  bm.trySmallerWindows = src.trySmallerWindows;
+  bm.disp12MaxDiff = src.disp12MaxDiff;
+
+  cv::StereoSGBM& sgbm = stripe.sg_block_matcher;
+  sgbm.minDisparity = sg_block_matcher_.minDisparity;
+  sgbm.numberOfDisparities = sg_block_matcher_.numberOfDisparities;
+  sgbm.SADWindowSize = sg_block_matcher_.SADWindowSize;
+  sgbm.preFilterCap = sg_block_matcher_.preFilterCap;
+  sgbm.uniquenessRatio = sg_block_matcher_.uniquenessRatio;
+  sgbm.P1 = sg_block_matcher_.P1;
+  sgbm.P2 = sg_block_matcher_.P2;
+  sgbm.speckleWindowSize = sg_block_matcher_.speckleWindowSize;
+  sgbm.speckleRange = sg_block_matcher_.speckleRange;
+  sgbm.disp12MaxDiff = sg_block_matcher_.disp12MaxDiff;
+  sgbm.fullDP = sg_block_matcher_.fullDP;
+#endif
+}
+
+bool StereoProcessor::streamable() const
+{
+  return !incremental_ && pyramid_levels_ == 0 && matching_roi_ == cv::Rect() &&
+    current_stereo_algorithm_ != CUDA_BM;
+}
+
+bool StereoProcessor::processStreaming(const sensor_msgs::ImageConstPtr& left_raw,
+                                       const sensor_msgs::ImageConstPtr& right_raw,
+                                       const image_geometry::StereoCameraModel& model,
+                                       StereoImageSet& output, bool keep_left_rect, bool keep_right_rect) const
+{
+  StreamJob job;
+  job.raws[0] = left_raw.get();
+  job.raws[1] = right_raw.get();
+  job.models[0] = &model.left();
+  job.models[1] = &model.right();
+  job.size = mono_processor_.rectifiedSize(model.left());
+  if (job.size.area() == 0 || right_processor_.rectifiedSize(model.right()) != job.size) {
+    ROS_ERROR("[stereo_image_proc] Left and right rectified images differ in size");
+    return false;
+  }
+  job.bands = (job.size.height + STREAM_BAND_ROWS - 1) / STREAM_BAND_ROWS;
+  job.algorithm = current_stereo_algorithm_;
+  job.margin = contextMargin(job.algorithm);
+  job.rects[0] = keep_left_rect ? &output.left.rect : NULL;
+  job.rects[1] = keep_right_rect ? &output.right.rect : NULL;
+  for (int side = 0; side < 2; ++side) {
+    if (job.rects[side])
+      job.rects[side]->create(job.size, CV_8UC1);
+  }
+  disparity_scratch_.disparity16.create(job.size.height, job.size.width);
+
+  // Step -1 only rectifies the first band; every later step matches one band
+  // while rectifying the next
+  for (int band = -1; band < job.bands; ++band) {
+    bool results[3] = { true, true, true };
+    StreamBody body(*this, job, band, results);
+    if (parallel_)
+      cv::parallel_for_(cv::Range(0, 3), body);
+    else
+      body(cv::Range(0, 3));
+    if (!results[1] || !results[2])
+      return false;
+  }
+
+  fillDisparityImage(disparity_scratch_.disparity16, cv::Rect(0, 0, job.size.width, job.size.height), model,
+                     output.disparity);
+  return true;
+}
+
+bool StereoProcessor::prepareStreamBand(const StreamJob& job, int side, int band) const
+{
+  DisparityScratch& scratch = disparity_scratch_;
+  // Rectified rows the band's disparities depend on
+  const cv::Range out = streamBandRows(band, job.size.height);
+  const cv::Range in(std::max(0, out.start - job.margin), std::min(job.size.height, out.end + job.margin));
+
+  StreamWindow& window = scratch.stream_windows[side][band % 2];
+  const StreamWindow& previous = scratch.stream_windows[side][(band + 1) % 2];
+  if (window.buffer.rows < in.size() || window.buffer.cols != job.size.width)
+    window.buffer.create(STREAM_BAND_ROWS + 2 * job.margin, job.size.width, CV_8UC1);
+  window.rows = in;
+  cv::Mat rect = window.buffer.rowRange(0, in.size());
+
+  // The previous band overlaps this one by twice the margin; copy those rows
+  // rather than rectifying them again
+  int start = in.start;
+  if (band > 0 && previous.rows.start <= in.start && previous.rows.end > in.start) {
+    start = std::min(previous.rows.end, in.end);
+    previous.buffer.rowRange(in.start - previous.rows.start, start - previous.rows.start)
+      .copyTo(rect.rowRange(0, start - in.start));
+  }
+  if (start == in.end)
+    return true;
+  const image_proc::Processor& processor = side ? right_processor_ : mono_processor_;
+  cv::Mat rows = rect.rowRange(start - in.start, in.size());
+  return processor.rectifyRows(*job.raws[side], *job.models[side], cv::Range(start, in.end),
+                               rows, scratch.stream_scratch[side]);
+}
+
+void StereoProcessor::matchStreamBand(const StreamJob& job, int band) const
+{
+  DisparityScratch& scratch = disparity_scratch_;
+  const StreamWindow& left_window = scratch.stream_windows[0][band % 2];
+  const StreamWindow& right_window = scratch.stream_windows[1][band % 2];
+  const cv::Range in = left_window.rows;
+  const cv::Range out = streamBandRows(band, job.size.height);
+  const cv::Range inner(out.start - in.start, out.end - in.start);
+  const cv::Mat left = left_window.buffer.rowRange(0, in.size());
+  const cv::Mat right = right_window.buffer.rowRange(0, in.size());
+
+  if (job.algorithm == BM)
+#if CV_MAJOR_VERSION == 3
+    block_matcher_->compute(left, right, scratch.stream_disparity16);
+  else
+    sg_block_matcher_->compute(left, right, scratch.stream_disparity16);
+#else
+    block_matcher_(left, right, scratch.stream_disparity16);
+  else
+    sg_block_matcher_(left, right, scratch.stream_disparity16);
+#endif
+  scratch.stream_disparity16.rowRange(inner).copyTo(scratch.disparity16.rowRange(out));
+
+  for (int side = 0; side < 2; ++side) {
+    if (job.rects[side]) {
+      const cv::Mat& rect = side ? right : left;
+      rect.rowRange(inner).copyTo(job.rects[side]->rowRange(out));
     }
   }
-  else if (encoding == enc::BGR8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& bgr = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          points.channels[0].values.push_back(*(float*)(&rgb_packed));
+}
+
+inline bool isValidPoint(const cv::Vec3f& pt)
+{
+  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
+  // and zero disparities (point mapped to infinity).
+  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
+}
+
+namespace {
+
+enum ColorFormat { COLOR_NONE, COLOR_MONO8, COLOR_RGB8, COLOR_BGR8 };
+
+// Packs one row of rectified color as 0x00RRGGBB, the PointCloud2 "rgb" layout
+void packColorRow(const cv::Mat& color, ColorFormat format, int y, int cols, int32_t* rgb)
+{
+  if (color.empty())
+    format = COLOR_NONE;
+  const uint8_t* in = (format == COLOR_NONE) ? NULL : color.ptr<uint8_t>(y);
+  for (int x = 0; x < cols; ++x) {
+    switch (format) {
+      case COLOR_MONO8:
+        rgb[x] = (in[x] << 16) | (in[x] << 8) | in[x];
+        break;
+      case COLOR_RGB8:
+        rgb[x] = (in[3*x] << 16) | (in[3*x + 1] << 8) | in[3*x + 2];
+        break;
+      case COLOR_BGR8:
+        rgb[x] = (in[3*x + 2] << 16) | (in[3*x + 1] << 8) | in[3*x];
+        break;
+      default:
+        rgb[x] = 0;
+    }
+  }
+}
+
+static const int POINTS2_STEP = 16; // x, y, z, rgb
+static const int QUANTIZED_POINTS2_STEP = 10; // x_mm, y_mm, z_mm, rgb
+
+#if defined(__SSE2__)
+inline __m128 loadDisparity4(const float* d)
+{
+  return _mm_loadu_ps(d);
+}
+
+inline __m128 loadDisparity4(const int16_t* d)
+{
+  __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(d));
+  // Sign-extend to 32 bits by unpacking into the high halves and shifting down
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16));
+}
+#endif
+
+/**
+ * Reprojects float or fixed-point (scaled by scale) disparities through Q straight into interleaved x, y, z, rgb
+ * points, matching cv::reprojectImageTo3D with handleMissingValues: pixels at
+ * the minimum disparity are missing, and W == 0 maps to infinity, so both are
+ * written as NaN (or skipped in compact mode). With quantize set, points are
+ * written in the image_proc::QuantizedPoints layout instead, exactly as
+ * quantizePoints would convert the float cloud.
+ */
+template <typename T>
+class ProjectPoints2Body : public cv::ParallelLoopBody
+{
+public:
+  ProjectPoints2Body(const cv::Mat_<T>& disparity, float scale, const cv::Mat& color, ColorFormat format,
+                     const cv::Matx44d& Q, float missing_disparity, bool quantize, uint8_t* data, size_t row_step)
+    : disparity_(disparity), scale_(scale), color_(color), format_(format), missing_(missing_disparity),
+      quantize_(quantize), point_step_(quantize ? QUANTIZED_POINTS2_STEP : POINTS2_STEP),
+      data_(data), row_step_(row_step)
+  {
+    for (int r = 0; r < 4; ++r)
+      for (int c = 0; c < 4; ++c)
+        q_[r][c] = Q(r,c);
+  }
+
+  // Organized output: every row writes its own slice of the cloud
+  virtual void operator()(const cv::Range& rows) const
+  {
+    std::vector<int32_t> rgb(disparity_.cols);
+    for (int y = rows.start; y < rows.end; ++y)
+      projectRow(y, &rgb[0], data_ + y * row_step_, false);
+  }
+
+  // Compact output: rows are appended one after the other; returns the point count
+  size_t projectCompact() const
+  {
+    std::vector<int32_t> rgb(disparity_.cols);
+    uint8_t* out = data_;
+    for (int y = 0; y < disparity_.rows; ++y)
+      out = projectRow(y, &rgb[0], out, true);
+    return (out - data_) / point_step_;
+  }
+
+private:
+  // Writes one x, y, z, rgb point in the output layout
+  uint8_t* storePoint(const float point[4], uint8_t* out) const
+  {
+    if (!quantize_) {
+      memcpy(out, point, POINTS2_STEP);
+      return out + POINTS2_STEP;
+    }
+    image_proc::quantizeXyz(point, out);
+    memcpy(out + 3 * sizeof(int16_t), &point[3], sizeof(float));
+    return out + QUANTIZED_POINTS2_STEP;
+  }
+
+  uint8_t* projectRow(int y, int32_t* rgb, uint8_t* out, bool compact) const
+  {
+    const T* d = disparity_[y];
+    const int cols = disparity_.cols;
+    packColorRow(color_, format_, y, cols, rgb);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    // Q * (x, y, d, 1), with the terms constant along the row folded together
+    const float row_x = q_[0][1] * y + q_[0][3];
+    const float row_y = q_[1][1] * y + q_[1][3];
+    const float row_z = q_[2][1] * y + q_[2][3];
+    const float row_w = q_[3][1] * y + q_[3][3];
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128 q00 = _mm_set1_ps(q_[0][0]), q02 = _mm_set1_ps(q_[0][2]), rx = _mm_set1_ps(row_x);
+    const __m128 q10 = _mm_set1_ps(q_[1][0]), q12 = _mm_set1_ps(q_[1][2]), ry = _mm_set1_ps(row_y);
+    const __m128 q20 = _mm_set1_ps(q_[2][0]), q22 = _mm_set1_ps(q_[2][2]), rz = _mm_set1_ps(row_z);
+    const __m128 q30 = _mm_set1_ps(q_[3][0]), q32 = _mm_set1_ps(q_[3][2]), rw = _mm_set1_ps(row_w);
+    const __m128 scale = _mm_set1_ps(scale_);
+    const __m128 missing = _mm_set1_ps(missing_), eps = _mm_set1_ps(FLT_EPSILON);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 bad = _mm_set1_ps(nan), zero = _mm_setzero_ps(), four = _mm_set1_ps(4.0f);
+    __m128 xs = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    for (; x + 4 <= cols; x += 4, xs = _mm_add_ps(xs, four)) {
+      __m128 dv = _mm_mul_ps(loadDisparity4(d + x), scale);
+      __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(q30, xs), rw), _mm_mul_ps(q32, dv));
+      __m128 iw = _mm_div_ps(_mm_set1_ps(1.0f), w);
+      __m128 px = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(q00, xs), rx), _mm_mul_ps(q02, dv)), iw);
+      __m128 py = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(q10, xs), ry), _mm_mul_ps(q12, dv)), iw);
+      __m128 pz = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(q20, xs), rz), _mm_mul_ps(q22, dv)), iw);
+      __m128 valid = _mm_and_ps(_mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(dv, missing), abs_mask), eps),
+                                _mm_and_ps(_mm_cmpneq_ps(w, zero),
+                                           _mm_cmpneq_ps(_mm_and_ps(pz, abs_mask), inf)));
+      __m128 pc = _mm_loadu_ps(reinterpret_cast<const float*>(rgb + x));
+      px = _mm_or_ps(_mm_and_ps(valid, px), _mm_andnot_ps(valid, bad));
+      py = _mm_or_ps(_mm_and_ps(valid, py), _mm_andnot_ps(valid, bad));
+      pz = _mm_or_ps(_mm_and_ps(valid, pz), _mm_andnot_ps(valid, bad));
+      pc = _mm_or_ps(_mm_and_ps(valid, pc), _mm_andnot_ps(valid, bad));
+      // Rows become whole points: (x, y, z, rgb) for each of the four pixels
+      _MM_TRANSPOSE4_PS(px, py, pz, pc);
+      int mask = compact ? _mm_movemask_ps(valid) : 0xf;
+      if (quantize_) {
+        float p[4][4];
+        _mm_storeu_ps(p[0], px);
+        _mm_storeu_ps(p[1], py);
+        _mm_storeu_ps(p[2], pz);
+        _mm_storeu_ps(p[3], pc);
+        for (int i = 0; i < 4; ++i) {
+          if (mask & (1 << i))
+            out = storePoint(p[i], out);
         }
+        continue;
+      }
+      if (mask & 1) { _mm_storeu_ps(reinterpret_cast<float*>(out), px); out += POINTS2_STEP; }
+      if (mask & 2) { _mm_storeu_ps(reinterpret_cast<float*>(out), py); out += POINTS2_STEP; }
+      if (mask & 4) { _mm_storeu_ps(reinterpret_cast<float*>(out), pz); out += POINTS2_STEP; }
+      if (mask & 8) { _mm_storeu_ps(reinterpret_cast<float*>(out), pc); out += POINTS2_STEP; }
+    }
+#endif
+    for (; x < cols; ++x) {
+      float dx = d[x] * scale_;
+      float w = q_[3][0] * x + row_w + q_[3][2] * dx;
+      float iw = 1.0f / w;
+      float point[4];
+      point[0] = (q_[0][0] * x + row_x + q_[0][2] * dx) * iw;
+      point[1] = (q_[1][0] * x + row_y + q_[1][2] * dx) * iw;
+      point[2] = (q_[2][0] * x + row_z + q_[2][2] * dx) * iw;
+      memcpy(&point[3], &rgb[x], sizeof(float));
+      bool valid = std::fabs(dx - missing_) > FLT_EPSILON && w != 0.0f && !std::isinf(point[2]);
+      if (!valid) {
+        if (compact)
+          continue;
+        point[0] = point[1] = point[2] = point[3] = nan;
       }
+      out = storePoint(point, out);
     }
+    return out;
+  }
+
+  const cv::Mat_<T>& disparity_;
+  float scale_;
+  const cv::Mat& color_;
+  ColorFormat format_;
+  float q_[4][4];
+  float missing_;
+  bool quantize_;
+  int point_step_;
+  uint8_t* data_;
+  size_t row_step_;
+};
+
+template <typename T>
+void projectPoints2(const ProjectPoints2Body<T>& body, bool compact, sensor_msgs::PointCloud2& points)
+{
+  if (compact) {
+    // Point positions depend on all previous rows, so this is one serial pass
+    points.height = 1;
+    points.width = body.projectCompact();
+    points.row_step = points.point_step * points.width;
+    points.data.resize (points.row_step);
+    points.is_dense = true;
   }
   else {
+    cv::parallel_for_(cv::Range(0, points.height), body);
+  }
+}
+
+} // namespace
+
+namespace {
+
+// Counts the valid points of each row, the first pass of processPoints
+class CountPointsBody : public cv::ParallelLoopBody
+{
+public:
+  CountPointsBody(const cv::Mat_<cv::Vec3f>& points, std::vector<size_t>& counts)
+    : points_(points), counts_(counts)
+  {
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    for (int y = rows.start; y < rows.end; ++y) {
+      const cv::Vec3f* row = points_[y];
+      size_t count = 0;
+      for (int x = 0; x < points_.cols; ++x)
+        count += isValidPoint(row[x]);
+      counts_[y] = count;
+    }
+  }
+
+private:
+  const cv::Mat_<cv::Vec3f>& points_;
+  std::vector<size_t>& counts_;
+};
+
+// Writes the valid points of each row from its precomputed offset on
+class FillPointsBody : public cv::ParallelLoopBody
+{
+public:
+  FillPointsBody(const cv::Mat_<cv::Vec3f>& points, const std::vector<size_t>& offsets,
+                 const cv::Mat& color, ColorFormat format, sensor_msgs::PointCloud& cloud)
+    : points_(points), offsets_(offsets), color_(color), format_(format), cloud_(cloud)
+  {
+  }
+
+  virtual void operator()(const cv::Range& rows) const
+  {
+    std::vector<int32_t> rgb(format_ == COLOR_NONE ? 0 : points_.cols);
+    for (int y = rows.start; y < rows.end; ++y) {
+      if (format_ != COLOR_NONE)
+        packColorRow(color_, format_, y, points_.cols, &rgb[0]);
+      const cv::Vec3f* row = points_[y];
+      size_t i = offsets_[y];
+      for (int x = 0; x < points_.cols; ++x) {
+        if (!isValidPoint(row[x]))
+          continue;
+        geometry_msgs::Point32& pt = cloud_.points[i];
+        pt.x = row[x][0];
+        pt.y = row[x][1];
+        pt.z = row[x][2];
+        // u,v
+        cloud_.channels[1].values[i] = y;
+        cloud_.channels[2].values[i] = x;
+        if (format_ != COLOR_NONE)
+          std::memcpy(&cloud_.channels[0].values[i], &rgb[x], sizeof(float));
+        ++i;
+      }
+    }
+  }
+
+private:
+  const cv::Mat_<cv::Vec3f>& points_;
+  const std::vector<size_t>& offsets_;
+  const cv::Mat& color_;
+  ColorFormat format_;
+  sensor_msgs::PointCloud& cloud_;
+};
+
+} // namespace
+
+void StereoProcessor::processPoints(const stereo_msgs::DisparityImage& disparity,
+                                    const cv::Mat& color, const std::string& encoding,
+                                    const image_geometry::StereoCameraModel& model,
+                                    sensor_msgs::PointCloud& points) const
+{
+  // Calculate dense point cloud
+  cv::Mat_<cv::Vec3f>& dense_points = points_scratch_.dense_points;
+  const cv::Mat_<float> dmat = floatDisparity(disparity, points_scratch_.float_disparity);
+  model.projectDisparityImageTo3d(dmat, dense_points, true);
+
+  namespace enc = sensor_msgs::image_encodings;
+  ColorFormat format = COLOR_NONE;
+  if (encoding == enc::MONO8)
+    format = COLOR_MONO8;
+  else if (encoding == enc::RGB8)
+    format = COLOR_RGB8;
+  else if (encoding == enc::BGR8)
+    format = COLOR_BGR8;
+  else
     ROS_WARN("Could not fill color channel of the point cloud, unrecognized encoding '%s'", encoding.c_str());
+
+  // Size the sparse cloud up front from per-row counts, so the rows can then
+  // be filled in parallel instead of growing the message point by point
+  const int rows = dense_points.rows;
+  std::vector<size_t> offsets(rows + 1, 0);
+  cv::parallel_for_(cv::Range(0, rows), CountPointsBody(dense_points, offsets));
+  size_t total = 0;
+  for (int y = 0; y <= rows; ++y) {
+    size_t count = offsets[y];
+    offsets[y] = total;
+    total += count;
   }
+
+  // Fill in sparse point cloud message
+  points.points.resize(total);
+  points.channels.resize(3);
+  points.channels[0].name = "rgb";
+  points.channels[0].values.resize(format == COLOR_NONE ? 0 : total);
+  points.channels[1].name = "u";
+  points.channels[1].values.resize(total);
+  points.channels[2].name = "v";
+  points.channels[2].values.resize(total);
+  cv::parallel_for_(cv::Range(0, rows), FillPointsBody(dense_points, offsets, color, format, points));
 }
 
 void StereoProcessor::processPoints2(const stereo_msgs::DisparityImage& disparity,
@@ -215,14 +1320,26 @@ void StereoProcessor::processPoints2(const stereo_msgs::DisparityImage& disparit
                                      const image_geometry::StereoCameraModel& model,
                                      sensor_msgs::PointCloud2& points) const
 {
-  // Calculate dense point cloud
   const sensor_msgs::Image& dimage = disparity.image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model.projectDisparityImageTo3d(dmat, dense_points_, true);
+  namespace enc = sensor_msgs::image_encodings;
+  bool fixed_point = (dimage.encoding == enc::TYPE_16SC1);
+  const cv::Mat dmat(dimage.height, dimage.width, fixed_point ? CV_16SC1 : CV_32FC1,
+                     const_cast<uint8_t*>(dimage.data.empty() ? NULL : &dimage.data[0]), dimage.step);
 
-  // Fill in sparse point cloud message
-  points.height = dense_points_.rows;
-  points.width  = dense_points_.cols;
+  ColorFormat format = COLOR_NONE;
+  if (encoding == enc::MONO8)
+    format = COLOR_MONO8;
+  else if (encoding == enc::RGB8)
+    format = COLOR_RGB8;
+  else if (encoding == enc::BGR8)
+    format = COLOR_BGR8;
+  else
+    ROS_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, unrecognized encoding '%s'",
+                      encoding.c_str());
+
+  // Fill in point cloud message
+  points.height = dmat.rows;
+  points.width  = dmat.cols;
   points.fields.resize (4);
   points.fields[0].name = "x";
   points.fields[0].offset = 0;
@@ -240,77 +1357,40 @@ void StereoProcessor::processPoints2(const stereo_msgs::DisparityImage& disparit
   points.fields[3].offset = 12;
   points.fields[3].count = 1;
   points.fields[3].datatype = sensor_msgs::PointField::FLOAT32;
-  //points.is_bigendian = false; ???
-  points.point_step = 16;
+  if (quantize_points2_) {
+    // image_proc::QuantizedPoints layout, projected straight from the
+    // disparities rather than converted from a float cloud
+    for (int i = 0; i < 3; ++i) {
+      points.fields[i].name = image_proc::QuantizedPoints::FIELD_NAMES[i];
+      points.fields[i].offset = i * sizeof(int16_t);
+      points.fields[i].datatype = sensor_msgs::PointField::INT16;
+    }
+    points.fields[3].offset = 3 * sizeof(int16_t);
+  }
+  points.is_bigendian = false;
+  points.point_step = quantize_points2_ ? QUANTIZED_POINTS2_STEP : POINTS2_STEP;
   points.row_step = points.point_step * points.width;
   points.data.resize (points.row_step * points.height);
   points.is_dense = false; // there may be invalid points
- 
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  int i = 0;
-  for (int32_t u = 0; u < dense_points_.rows; ++u) {
-    for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-      if (isValidPoint(dense_points_(u,v))) {
-        // x,y,z,rgba
-        memcpy (&points.data[i * points.point_step + 0], &dense_points_(u,v)[0], sizeof (float));
-        memcpy (&points.data[i * points.point_step + 4], &dense_points_(u,v)[1], sizeof (float));
-        memcpy (&points.data[i * points.point_step + 8], &dense_points_(u,v)[2], sizeof (float));
-      }
-      else {
-        memcpy (&points.data[i * points.point_step + 0], &bad_point, sizeof (float));
-        memcpy (&points.data[i * points.point_step + 4], &bad_point, sizeof (float));
-        memcpy (&points.data[i * points.point_step + 8], &bad_point, sizeof (float));
-      }
-    }
-  }
+  if (dmat.empty())
+    return;
 
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  i = 0;
-  if (encoding == enc::MONO8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          uint8_t g = color.at<uint8_t>(u,v);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          memcpy (&points.data[i * points.point_step + 12], &rgb, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::RGB8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& rgb = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          memcpy (&points.data[i * points.point_step + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::BGR8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& bgr = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          memcpy (&points.data[i * points.point_step + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
+  // reprojectImageTo3D treats the smallest disparity in the image as missing
+  double min_disparity;
+  cv::minMaxIdx(dmat, &min_disparity);
+
+  if (fixed_point) {
+    const cv::Mat_<int16_t> d16 = dmat;
+    projectPoints2(ProjectPoints2Body<int16_t>(d16, disparity.delta_d, color, format, model.reprojectionMatrix(),
+                                               min_disparity * disparity.delta_d, quantize_points2_,
+                                               &points.data[0], points.row_step),
+                   compact_points2_, points);
   }
   else {
-    ROS_WARN("Could not fill color channel of the point cloud, unrecognized encoding '%s'", encoding.c_str());
+    const cv::Mat_<float> d32 = dmat;
+    projectPoints2(ProjectPoints2Body<float>(d32, 1.0f, color, format, model.reprojectionMatrix(),
+                                             min_disparity, quantize_points2_, &points.data[0], points.row_step),
+                   compact_points2_, points);
   }
 }
 
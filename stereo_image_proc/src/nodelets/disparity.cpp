@@ -56,6 +56,10 @@
 #include <dynamic_reconfigure/server.h>
 
 #include <stereo_image_proc/processor.h>
+#include <image_proc/ordered_executor.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/latest_dispatcher.h>
+#include <image_proc/shm_ring.h>
 
 namespace stereo_image_proc {
 
@@ -79,16 +83,33 @@ class DisparityNodelet : public nodelet::Nodelet
   // Publications
   boost::mutex connect_mutex_;
   ros::Publisher pub_disparity_;
+  image_proc::ShmPublisher<DisparityImage> pub_disparity_shm_; // disparity/shm, for other processes
 
   // Dynamic reconfigure
   boost::recursive_mutex config_mutex_;
   typedef stereo_image_proc::DisparityConfig Config;
   typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
-  
-  // Processing state (note: only safe because we're single-threaded!)
-  image_geometry::StereoCameraModel model_;
-  stereo_image_proc::StereoProcessor block_matcher_; // contains scratch buffers for block matching
+  Config config_;
+  unsigned int config_generation_; // bumped on every reconfiguration
+  bool parallel_;
+  bool fixed_point_;
+  bool parallel_speckle_filter_;
+
+  // Processing state, one per frame in flight
+  struct State
+  {
+    State() : config_generation(0) {}
+
+    image_geometry::StereoCameraModel model;
+    stereo_image_proc::StereoProcessor block_matcher; // contains scratch buffers for block matching
+    unsigned int config_generation; // of the configuration block_matcher has
+  };
+  typedef image_proc::OrderedExecutor<State> Executor;
+  boost::shared_ptr<Executor> executor_;
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  // NULL unless ~latest_only is set; declared last so it stops first
+  boost::shared_ptr<image_proc::LatestDispatcher> latest_;
 
   virtual void onInit();
 
@@ -97,7 +118,19 @@ class DisparityNodelet : public nodelet::Nodelet
   void imageCb(const ImageConstPtr& l_image_msg, const CameraInfoConstPtr& l_info_msg,
                const ImageConstPtr& r_image_msg, const CameraInfoConstPtr& r_info_msg);
 
+  Executor::Publish process(State& state,
+                            const ImageConstPtr& l_image_msg, const CameraInfoConstPtr& l_info_msg,
+                            const ImageConstPtr& r_image_msg, const CameraInfoConstPtr& r_info_msg);
+
+  void publishDisparity(const DisparityImageConstPtr& disp_msg);
+
   void configCb(Config &config, uint32_t level);
+
+  void configure(StereoProcessor& block_matcher) const;
+
+public:
+  DisparityNodelet() : config_generation_(0), parallel_(false), fixed_point_(false),
+                       parallel_speckle_filter_(false) {}
 };
 
 void DisparityNodelet::onInit()
@@ -113,6 +146,22 @@ void DisparityNodelet::onInit()
   private_nh.param("queue_size", queue_size, 5);
   bool approx;
   private_nh.param("approximate_sync", approx, false);
+  // Split block matching into horizontal stripes across threads
+  private_nh.param("parallel", parallel_, false);
+  // Publish 16SC1 fixed-point disparity (d = value * delta_d) instead of 32FC1
+  private_nh.param("fixed_point_disparity", fixed_point_, false);
+  // Remove speckles over the whole disparity image across threads, instead of
+  // inside the matcher
+  private_nh.param("parallel_speckle_filter", parallel_speckle_filter_, false);
+  // Match this many frame pairs concurrently; 0 matches in the synchronizer
+  // callback. Each has its own matcher, so incremental mode compares frames
+  // against whichever frame that matcher saw last.
+  int num_worker_threads;
+  private_nh.param("num_worker_threads", num_worker_threads, 0);
+  executor_.reset(new Executor(std::max(num_worker_threads, 0)));
+  stats_ = image_proc::Instrumentation::stage(private_nh, "disparity");
+  // With ~latest_only, match only the newest synchronized set
+  latest_ = image_proc::LatestDispatcher::create(private_nh, stats_);
   if (approx)
   {
     approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
@@ -128,6 +177,9 @@ void DisparityNodelet::onInit()
                                      sub_r_image_, sub_r_info_) );
     exact_sync_->registerCallback(boost::bind(&DisparityNodelet::imageCb,
                                               this, _1, _2, _3, _4));
+    // Only the exact policy reports the sets it gives up on
+    if (stats_)
+      exact_sync_->registerDropCallback(boost::bind(&image_proc::StageStats::drop, stats_.get()));
   }
 
   // Set up dynamic reconfiguration
@@ -141,13 +193,14 @@ void DisparityNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_disparity_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_disparity_ = nh.advertise<DisparityImage>("disparity", 1, connect_cb, connect_cb);
+  pub_disparity_shm_.advertise(nh, "disparity", 1, connect_cb);
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void DisparityNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_disparity_.getNumSubscribers() == 0)
+  if (pub_disparity_.getNumSubscribers() == 0 && pub_disparity_shm_.getNumSubscribers() == 0)
   {
     sub_l_image_.unsubscribe();
     sub_l_info_ .unsubscribe();
@@ -172,43 +225,71 @@ void DisparityNodelet::imageCb(const ImageConstPtr& l_image_msg,
                                const ImageConstPtr& r_image_msg,
                                const CameraInfoConstPtr& r_info_msg)
 {
+  Executor::Task task = boost::bind(&DisparityNodelet::process, this, _1,
+                                    l_image_msg, l_info_msg, r_image_msg, r_info_msg);
+  if (latest_)
+    latest_->submit(l_image_msg->header.stamp, boost::bind(&Executor::submit, executor_.get(), task));
+  else
+    executor_->submit(task);
+}
+
+DisparityNodelet::Executor::Publish DisparityNodelet::process(State& state,
+                                                              const ImageConstPtr& l_image_msg,
+                                                              const CameraInfoConstPtr& l_info_msg,
+                                                              const ImageConstPtr& r_image_msg,
+                                                              const CameraInfoConstPtr& r_info_msg)
+{
+  image_proc::StageTimer timer(stats_.get(), l_image_msg->header.stamp);
+  {
+    boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
+    if (state.config_generation != config_generation_) {
+      configure(state.block_matcher);
+      state.config_generation = config_generation_;
+    }
+  }
+  StereoProcessor& block_matcher = state.block_matcher;
+  const image_geometry::StereoCameraModel& model = state.model;
+
   // Update the camera model
-  model_.fromCameraInfo(l_info_msg, r_info_msg);
+  state.model.fromCameraInfo(l_info_msg, r_info_msg);
 
   // Allocate new disparity image message
   DisparityImagePtr disp_msg = boost::make_shared<DisparityImage>();
   disp_msg->header         = l_info_msg->header;
   disp_msg->image.header   = l_info_msg->header;
 
-  // Compute window of (potentially) valid disparities
-  int border   = block_matcher_.getCorrelationWindowSize() / 2;
-  int left   = block_matcher_.getDisparityRange() + block_matcher_.getMinDisparity() + border - 1;
-  int wtf = (block_matcher_.getMinDisparity() >= 0) ? border + block_matcher_.getMinDisparity() : std::max(border, -block_matcher_.getMinDisparity());
-  int right  = disp_msg->image.width - 1 - wtf;
-  int top    = border;
-  int bottom = disp_msg->image.height - 1 - border;
-  disp_msg->valid_window.x_offset = left;
-  disp_msg->valid_window.y_offset = top;
-  disp_msg->valid_window.width    = right - left;
-  disp_msg->valid_window.height   = bottom - top;
-
   // Create cv::Mat views onto all buffers
   const cv::Mat_<uint8_t> l_image = cv_bridge::toCvShare(l_image_msg, sensor_msgs::image_encodings::MONO8)->image;
   const cv::Mat_<uint8_t> r_image = cv_bridge::toCvShare(r_image_msg, sensor_msgs::image_encodings::MONO8)->image;
 
   // Perform block matching to find the disparities
-  block_matcher_.processDisparity(l_image, r_image, model_, *disp_msg);
+  block_matcher.processDisparity(l_image, r_image, model, *disp_msg);
 
   // Adjust for any x-offset between the principal points: d' = d - (cx_l - cx_r)
-  double cx_l = model_.left().cx();
-  double cx_r = model_.right().cx();
+  double cx_l = model.left().cx();
+  double cx_r = model.right().cx();
   if (cx_l != cx_r) {
-    cv::Mat_<float> disp_image(disp_msg->image.height, disp_msg->image.width,
-                              reinterpret_cast<float*>(&disp_msg->image.data[0]),
-                              disp_msg->image.step);
-    cv::subtract(disp_image, cv::Scalar(cx_l - cx_r), disp_image);
+    if (disp_msg->image.encoding == sensor_msgs::image_encodings::TYPE_16SC1) {
+      cv::Mat_<int16_t> disp_image(disp_msg->image.height, disp_msg->image.width,
+                                   reinterpret_cast<int16_t*>(&disp_msg->image.data[0]),
+                                   disp_msg->image.step);
+      cv::subtract(disp_image, cv::Scalar(cvRound((cx_l - cx_r) / disp_msg->delta_d)), disp_image);
+    }
+    else {
+      cv::Mat_<float> disp_image(disp_msg->image.height, disp_msg->image.width,
+                                reinterpret_cast<float*>(&disp_msg->image.data[0]),
+                                disp_msg->image.step);
+      cv::subtract(disp_image, cv::Scalar(cx_l - cx_r), disp_image);
+    }
   }
 
+  timer.setBytes(disp_msg->image.data.size());
+  return boost::bind(&DisparityNodelet::publishDisparity, this, DisparityImageConstPtr(disp_msg));
+}
+
+void DisparityNodelet::publishDisparity(const DisparityImageConstPtr& disp_msg)
+{
+  pub_disparity_shm_.publish(*disp_msg);
   pub_disparity_.publish(disp_msg);
 }
 
@@ -218,28 +299,49 @@ void DisparityNodelet::configCb(Config &config, uint32_t level)
   config.prefilter_size |= 0x1; // must be odd
   config.correlation_window_size |= 0x1; // must be odd
   config.disparity_range = (config.disparity_range / 16) * 16; // must be multiple of 16
-  
+
+  // The reconfigure server holds config_mutex_ here. Matchers pick up the
+  // new settings before their next frame.
+  config_ = config;
+  ++config_generation_;
+}
+
+void DisparityNodelet::configure(StereoProcessor& block_matcher) const
+{
+  block_matcher.setParallel(parallel_);
+  block_matcher.setFixedPointDisparity(fixed_point_);
+  block_matcher.setParallelSpeckleFilter(parallel_speckle_filter_);
+
   // check stereo method
-  // Note: With single-threaded NodeHandle, configCb and imageCb can't be called
-  // concurrently, so this is thread-safe.
-  block_matcher_.setPreFilterCap(config.prefilter_cap);
-  block_matcher_.setCorrelationWindowSize(config.correlation_window_size);
-  block_matcher_.setMinDisparity(config.min_disparity);
-  block_matcher_.setDisparityRange(config.disparity_range);
-  block_matcher_.setUniquenessRatio(config.uniqueness_ratio);
-  block_matcher_.setSpeckleSize(config.speckle_size);
-  block_matcher_.setSpeckleRange(config.speckle_range);
+  const Config& config = config_;
+  block_matcher.setPreFilterCap(config.prefilter_cap);
+  block_matcher.setCorrelationWindowSize(config.correlation_window_size);
+  block_matcher.setMinDisparity(config.min_disparity);
+  block_matcher.setDisparityRange(config.disparity_range);
+  block_matcher.setUniquenessRatio(config.uniqueness_ratio);
+  block_matcher.setSpeckleSize(config.speckle_size);
+  block_matcher.setSpeckleRange(config.speckle_range);
+  block_matcher.setMatchingRoi(cv::Rect(config.roi_x_offset, config.roi_y_offset,
+                                         config.roi_width, config.roi_height));
+  block_matcher.setIncremental(config.incremental);
+  block_matcher.setIncrementalThreshold(config.incremental_threshold);
+  block_matcher.setPyramidLevels(config.pyramid_levels);
   if (config.stereo_algorithm == stereo_image_proc::Disparity_StereoBM) { // StereoBM
-    block_matcher_.setStereoType(StereoProcessor::BM);
-    block_matcher_.setPreFilterSize(config.prefilter_size);
-    block_matcher_.setTextureThreshold(config.texture_threshold);
+    block_matcher.setStereoType(StereoProcessor::BM);
+    block_matcher.setPreFilterSize(config.prefilter_size);
+    block_matcher.setTextureThreshold(config.texture_threshold);
   }
   else if (config.stereo_algorithm == stereo_image_proc::Disparity_StereoSGBM) { // StereoSGBM
-    block_matcher_.setStereoType(StereoProcessor::SGBM);
-    block_matcher_.setSgbmMode(config.fullDP);
-    block_matcher_.setP1(config.P1);
-    block_matcher_.setP2(config.P2);
-    block_matcher_.setDisp12MaxDiff(config.disp12MaxDiff);
+    block_matcher.setStereoType(StereoProcessor::SGBM);
+    block_matcher.setSgbmMode(config.fullDP);
+    block_matcher.setP1(config.P1);
+    block_matcher.setP2(config.P2);
+    block_matcher.setDisp12MaxDiff(config.disp12MaxDiff);
+  }
+  else if (config.stereo_algorithm == stereo_image_proc::Disparity_StereoBM_CUDA) { // StereoBM on the GPU
+    block_matcher.setStereoType(StereoProcessor::CUDA_BM);
+    block_matcher.setPreFilterSize(config.prefilter_size);
+    block_matcher.setTextureThreshold(config.texture_threshold);
   }
 }
 
@@ -45,11 +45,14 @@
 #include <message_filters/sync_policies/exact_time.h>
 #include <message_filters/sync_policies/approximate_time.h>
 #include <image_geometry/stereo_camera_model.h>
+#include <stereo_image_proc/processor.h>
+#include <image_proc/instrumentation.h>
+#include <image_proc/latest_dispatcher.h>
+#include <image_proc/shm_ring.h>
 
 #include <stereo_msgs/DisparityImage.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/image_encodings.h>
-#include <sensor_msgs/point_cloud2_iterator.h>
 
 namespace stereo_image_proc {
 
@@ -75,15 +78,25 @@ class PointCloud2Nodelet : public nodelet::Nodelet
   // Publications
   boost::mutex connect_mutex_;
   ros::Publisher pub_points2_;
+  image_proc::ShmPublisher<PointCloud2> pub_points2_shm_; // points2/shm, for other processes
+  bool mono_points_;
 
   // Processing state (note: only safe because we're single-threaded!)
   image_geometry::StereoCameraModel model_;
-  cv::Mat_<cv::Vec3f> points_mat_; // scratch buffer
+  StereoProcessor processor_; // only projects points, its matchers stay unused
+  image_proc::StageStatsPtr stats_; // NULL unless ~instrumentation is set
+  // NULL unless ~latest_only is set; declared last so it stops first
+  boost::shared_ptr<image_proc::LatestDispatcher> latest_;
   
   virtual void onInit();
 
   void connectCb();
 
+  void syncCb(const ImageConstPtr& l_image_msg,
+              const CameraInfoConstPtr& l_info_msg,
+              const CameraInfoConstPtr& r_info_msg,
+              const DisparityImageConstPtr& disp_msg);
+
   void imageCb(const ImageConstPtr& l_image_msg,
                const CameraInfoConstPtr& l_info_msg,
                const CameraInfoConstPtr& r_info_msg,
@@ -102,12 +115,26 @@ void PointCloud2Nodelet::onInit()
   private_nh.param("queue_size", queue_size, 5);
   bool approx;
   private_nh.param("approximate_sync", approx, false);
+  // Color points from left/image_rect, so the color pipeline can stay idle
+  private_nh.param("mono_points", mono_points_, false);
+  // Publish only the valid points, as a dense 1 x N cloud
+  bool compact;
+  private_nh.param("compact", compact, false);
+  processor_.setCompactPoints2(compact);
+  // Publish int16 millimetre x_mm, y_mm, z_mm instead of float32 x, y, z meters,
+  // see image_proc::QuantizedPoints
+  bool quantize_points;
+  private_nh.param("quantize_points", quantize_points, false);
+  processor_.setQuantizePoints2(quantize_points);
+  stats_ = image_proc::Instrumentation::stage(private_nh, "point_cloud2");
+  // With ~latest_only, project only the newest synchronized set
+  latest_ = image_proc::LatestDispatcher::create(private_nh, stats_);
   if (approx)
   {
     approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
                                                  sub_l_image_, sub_l_info_,
                                                  sub_r_info_, sub_disparity_) );
-    approximate_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::imageCb,
+    approximate_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::syncCb,
                                                     this, _1, _2, _3, _4));
   }
   else
@@ -115,8 +142,10 @@ void PointCloud2Nodelet::onInit()
     exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
                                      sub_l_image_, sub_l_info_,
                                      sub_r_info_, sub_disparity_) );
-    exact_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::imageCb,
+    exact_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::syncCb,
                                               this, _1, _2, _3, _4));
+    if (stats_)
+      exact_sync_->registerDropCallback(boost::bind(&image_proc::StageStats::drop, stats_.get()));
   }
 
   // Monitor whether anyone is subscribed to the output
@@ -124,13 +153,14 @@ void PointCloud2Nodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_points2_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_points2_  = nh.advertise<PointCloud2>("points2",  1, connect_cb, connect_cb);
+  pub_points2_shm_.advertise(nh, "points2", 1, connect_cb);
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloud2Nodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_points2_.getNumSubscribers() == 0)
+  if (pub_points2_.getNumSubscribers() == 0 && pub_points2_shm_.getNumSubscribers() == 0)
   {
     sub_l_image_  .unsubscribe();
     sub_l_info_   .unsubscribe();
@@ -142,18 +172,23 @@ void PointCloud2Nodelet::connectCb()
     ros::NodeHandle &nh = getNodeHandle();
     // Queue size 1 should be OK; the one that matters is the synchronizer queue size.
     image_transport::TransportHints hints("raw", ros::TransportHints(), getPrivateNodeHandle());
-    sub_l_image_  .subscribe(*it_, "left/image_rect_color", 1, hints);
+    sub_l_image_  .subscribe(*it_, mono_points_ ? "left/image_rect" : "left/image_rect_color", 1, hints);
     sub_l_info_   .subscribe(nh,   "left/camera_info", 1);
     sub_r_info_   .subscribe(nh,   "right/camera_info", 1);
     sub_disparity_.subscribe(nh,   "disparity", 1);
   }
 }
 
-inline bool isValidPoint(const cv::Vec3f& pt)
+void PointCloud2Nodelet::syncCb(const ImageConstPtr& l_image_msg,
+                                const CameraInfoConstPtr& l_info_msg,
+                                const CameraInfoConstPtr& r_info_msg,
+                                const DisparityImageConstPtr& disp_msg)
 {
-  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
-  // and zero disparities (point mapped to infinity).
-  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
+  if (latest_)
+    latest_->submit(disp_msg->header.stamp, boost::bind(&PointCloud2Nodelet::imageCb, this,
+                                                        l_image_msg, l_info_msg, r_info_msg, disp_msg));
+  else
+    imageCb(l_image_msg, l_info_msg, r_info_msg, disp_msg);
 }
 
 void PointCloud2Nodelet::imageCb(const ImageConstPtr& l_image_msg,
@@ -161,107 +196,26 @@ void PointCloud2Nodelet::imageCb(const ImageConstPtr& l_image_msg,
                                  const CameraInfoConstPtr& r_info_msg,
                                  const DisparityImageConstPtr& disp_msg)
 {
+  image_proc::StageTimer timer(stats_.get(), disp_msg->header.stamp);
+
   // Update the camera model
   model_.fromCameraInfo(l_info_msg, r_info_msg);
 
-  // Calculate point cloud
-  const Image& dimage = disp_msg->image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model_.projectDisparityImageTo3d(dmat, points_mat_, true);
-  cv::Mat_<cv::Vec3f> mat = points_mat_;
+  // Wrap the color image if processPoints2 can use it, it warns otherwise
+  namespace enc = sensor_msgs::image_encodings;
+  const std::string& encoding = l_image_msg->encoding;
+  cv::Mat color;
+  if (encoding == enc::MONO8 || encoding == enc::RGB8 || encoding == enc::BGR8)
+    color = cv::Mat(l_image_msg->height, l_image_msg->width, encoding == enc::MONO8 ? CV_8UC1 : CV_8UC3,
+                    const_cast<uint8_t*>(&l_image_msg->data[0]), l_image_msg->step);
 
-  // Fill in new PointCloud2 message (2D image-like layout)
+  // Project disparities and fill in the PointCloud2 message in one pass
   PointCloud2Ptr points_msg = boost::make_shared<PointCloud2>();
   points_msg->header = disp_msg->header;
-  points_msg->height = mat.rows;
-  points_msg->width  = mat.cols;
-  points_msg->is_bigendian = false;
-  points_msg->is_dense = false; // there may be invalid points
-
-  sensor_msgs::PointCloud2Modifier pcd_modifier(*points_msg);
-  pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
-
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*points_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*points_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*points_msg, "z");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_r(*points_msg, "r");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_g(*points_msg, "g");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_b(*points_msg, "b");
-
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  for (int v = 0; v < mat.rows; ++v)
-  {
-    for (int u = 0; u < mat.cols; ++u, ++iter_x, ++iter_y, ++iter_z)
-    {
-      if (isValidPoint(mat(v,u)))
-      {
-        // x,y,z
-        *iter_x = mat(v, u)[0];
-        *iter_y = mat(v, u)[1];
-        *iter_z = mat(v, u)[2];
-      }
-      else
-      {
-        *iter_x = *iter_y = *iter_z = bad_point;
-      }
-    }
-  }
-
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  const std::string& encoding = l_image_msg->encoding;
-  if (encoding == enc::MONO8)
-  {
-    const cv::Mat_<uint8_t> color(l_image_msg->height, l_image_msg->width,
-                                  (uint8_t*)&l_image_msg->data[0],
-                                  l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
-    {
-      for (int u = 0; u < mat.cols; ++u, ++iter_r, ++iter_g, ++iter_b)
-      {
-        uint8_t g = color(v,u);
-        *iter_r = *iter_g = *iter_b = g;
-      }
-    }
-  }
-  else if (encoding == enc::RGB8)
-  {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
-    {
-      for (int u = 0; u < mat.cols; ++u, ++iter_r, ++iter_g, ++iter_b)
-      {
-        const cv::Vec3b& rgb = color(v,u);
-        *iter_r = rgb[0];
-        *iter_g = rgb[1];
-        *iter_b = rgb[2];
-      }
-    }
-  }
-  else if (encoding == enc::BGR8)
-  {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
-    {
-      for (int u = 0; u < mat.cols; ++u, ++iter_r, ++iter_g, ++iter_b)
-      {
-        const cv::Vec3b& bgr = color(v,u);
-        *iter_r = bgr[2];
-        *iter_g = bgr[1];
-        *iter_b = bgr[0];
-      }
-    }
-  }
-  else
-  {
-    NODELET_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, "
-                          "unsupported encoding '%s'", encoding.c_str());
-  }
+  processor_.processPoints2(*disp_msg, color, encoding, model_, *points_msg);
 
+  timer.setBytes(points_msg->data.size());
+  pub_points2_shm_.publish(*points_msg);
   pub_points2_.publish(points_msg);
 }
 
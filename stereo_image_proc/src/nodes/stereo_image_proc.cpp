@@ -37,7 +37,7 @@
 #include <image_proc/advertisement_checker.h>
 
 void loadMonocularNodelets(nodelet::Loader& manager, const std::string& side,
-                           const XmlRpc::XmlRpcValue& rectify_params,
+                           const XmlRpc::XmlRpcValue& rectify_params, bool fused,
                            const nodelet::V_string& my_argv)
 {
   nodelet::M_string remappings;
@@ -59,8 +59,9 @@ void loadMonocularNodelets(nodelet::Loader& manager, const std::string& side,
   std::string debayer_name = ros::this_node::getName() + "_debayer_" + side;
   manager.load(debayer_name, "image_proc/debayer", remappings, my_argv);
 
-  // Rectify nodelet: image_mono -> image_rect
+  // Rectify nodelet: image_mono (image_raw if fused) -> image_rect
   remappings.clear();
+  remappings["image_raw"]   = image_raw_topic;
   remappings["image_mono"]  = image_mono_topic;
   remappings["camera_info"] = camera_info_topic;
   remappings["image_rect"]  = image_rect_topic;
@@ -69,14 +70,18 @@ void loadMonocularNodelets(nodelet::Loader& manager, const std::string& side,
     ros::param::set(rectify_mono_name, rectify_params);
   manager.load(rectify_mono_name, "image_proc/rectify", remappings, my_argv);
 
-  // Rectify nodelet: image_color -> image_rect_color
+  // Rectify nodelet: image_color (image_raw if fused) -> image_rect_color
   remappings.clear();
+  remappings["image_raw"]   = image_raw_topic;
   remappings["image_mono"]  = image_color_topic;
   remappings["camera_info"] = camera_info_topic;
   remappings["image_rect"]  = image_rect_color_topic;
   std::string rectify_color_name = ros::this_node::getName() + "_rectify_color_" + side;
-  if (rectify_params.valid())
-    ros::param::set(rectify_color_name, rectify_params);
+  XmlRpc::XmlRpcValue color_params = rectify_params;
+  if (fused)
+    color_params["fused_color"] = true;
+  if (color_params.valid())
+    ros::param::set(rectify_color_name, color_params);
   manager.load(rectify_color_name, "image_proc/rectify", remappings, my_argv);
 }
 
@@ -110,9 +115,14 @@ int main(int argc, char **argv)
   nodelet::M_string remappings;
   nodelet::V_string my_argv;
 
-  // Load equivalents of image_proc for left and right cameras
-  loadMonocularNodelets(manager, "left",  shared_params, my_argv);
-  loadMonocularNodelets(manager, "right", shared_params, my_argv);
+  // Load equivalents of image_proc for left and right cameras, optionally
+  // rectifying straight from image_raw
+  XmlRpc::XmlRpcValue rectify_params = shared_params;
+  bool fused = false;
+  if (private_nh.getParam("fused", fused))
+    rectify_params["fused"] = fused;
+  loadMonocularNodelets(manager, "left",  rectify_params, fused, my_argv);
+  loadMonocularNodelets(manager, "right", rectify_params, fused, my_argv);
 
   // Stereo nodelets also need to know the synchronization policy
   bool approx_sync;
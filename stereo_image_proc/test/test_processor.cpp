@@ -0,0 +1,559 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+* 
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+* 
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+* 
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+* 
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <stereo_image_proc/processor.h>
+#include <image_proc/point_cloud_quantization.h>
+#include <gtest/gtest.h>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <cmath>
+#include <cstring>
+
+using stereo_image_proc::StereoProcessor;
+
+namespace {
+
+// Rows of the band borders once a disparity image of ROWS rows is split into
+// NBANDS bands, as filterSpecklesBanded does
+const int ROWS = 96, COLS = 80, NBANDS = 4;
+const int16_t INVALID = -16;
+const int MAX_SIZE = 40;
+const int MAX_DIFF = 16;
+
+int bandBorder(int i)
+{
+  return ROWS * i / NBANDS;
+}
+
+int countDifferent(const cv::Mat& a, const cv::Mat& b)
+{
+  cv::Mat different;
+  cv::compare(a, b, different, cv::CMP_NE);
+  return cv::countNonZero(different);
+}
+
+class SpeckleFilterTest : public testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    // Background: one large region sloping slowly enough to stay connected
+    disparity_.create(ROWS, COLS);
+    for (int y = 0; y < ROWS; ++y)
+      for (int x = 0; x < COLS; ++x)
+        disparity_(y, x) = 320 + x / 4;
+
+    // Small speckle straddling the first band border: removed, though each
+    // band only sees part of it
+    fill(cv::Rect(10, bandBorder(1) - 2, 3, 4), 640);
+    // Thin line crossing every border: each band holds fewer than MAX_SIZE of
+    // its pixels, but the whole region is larger and has to be kept
+    fill(cv::Rect(30, 4, 1, ROWS - 8), 800);
+    // U shape whose arms only meet in the band below: two speckles within the
+    // upper band, but one region large enough to keep across both
+    fill(cv::Rect(40, bandBorder(2) - 16, 5, 20), 960);
+    disparity_(cv::Rect(41, bandBorder(2) - 16, 3, 19)).setTo(INVALID);
+    // Speckle on the last border whose neighbors differ by just more than the
+    // range, and one just within it, so part of the background
+    disparity_(cv::Rect(60, bandBorder(3) - 1, 2, 2)).setTo(320 + 60 / 4 + MAX_DIFF + 1);
+    disparity_(cv::Rect(70, bandBorder(3) - 1, 2, 2)).setTo(320 + 70 / 4 + MAX_DIFF);
+    // Isolated single pixels on the first and last rows
+    fill(cv::Rect(5, 0, 1, 1), 1200);
+    fill(cv::Rect(5, ROWS - 1, 1, 1), 1200);
+  }
+
+  // Sets the rectangle to value, surrounded by a one pixel invalid frame
+  void fill(const cv::Rect& rect, int16_t value)
+  {
+    const cv::Rect frame(0, 0, COLS, ROWS);
+    cv::Rect outer(rect.x - 1, rect.y - 1, rect.width + 2, rect.height + 2);
+    disparity_(outer & frame).setTo(INVALID);
+    disparity_(rect).setTo(value);
+  }
+
+  cv::Mat_<int16_t> expected(int max_size, int max_diff) const
+  {
+    cv::Mat_<int16_t> result = disparity_.clone();
+    cv::filterSpeckles(result, INVALID, max_size, max_diff);
+    return result;
+  }
+
+  cv::Mat_<int16_t> banded(int max_size, int max_diff, int nbands) const
+  {
+    cv::Mat_<int16_t> result = disparity_.clone();
+    cv::Mat_<uint32_t> labels, sizes;
+    stereo_image_proc::filterSpecklesBanded(result, INVALID, max_size, max_diff, nbands, labels, sizes);
+    return result;
+  }
+
+  cv::Mat_<int16_t> disparity_;
+};
+
+TEST_F(SpeckleFilterTest, matchesFilterSpecklesAcrossBandBorders)
+{
+  cv::Mat_<int16_t> reference = expected(MAX_SIZE, MAX_DIFF);
+  // The fixture only makes sense if it has speckles to remove and keeps the line
+  ASSERT_GT(countDifferent(reference, disparity_), 0);
+  ASSERT_EQ(800, reference(ROWS / 2, 30));
+  ASSERT_EQ(960, reference(bandBorder(2) - 16, 40));
+  ASSERT_EQ(INVALID, reference(bandBorder(1), 10));
+  ASSERT_EQ(INVALID, reference(bandBorder(3), 60));
+  ASSERT_NE(INVALID, reference(bandBorder(3), 70));
+
+  const int nbands[] = { 1, 2, NBANDS, 7, ROWS, 2 * ROWS };
+  for (size_t i = 0; i < sizeof(nbands) / sizeof(nbands[0]); ++i)
+    EXPECT_EQ(0, countDifferent(reference, banded(MAX_SIZE, MAX_DIFF, nbands[i]))) << nbands[i] << " bands";
+}
+
+TEST_F(SpeckleFilterTest, matchesFilterSpecklesOnRandomRegions)
+{
+  // Few disparity levels and many invalid pixels, for many small regions
+  // touching every border
+  cv::RNG rng(42);
+  for (int y = 0; y < ROWS; ++y)
+    for (int x = 0; x < COLS; ++x)
+      disparity_(y, x) = rng.uniform(0, 5) == 0 ? INVALID : (int16_t)(rng.uniform(20, 24) * 16);
+
+  for (int max_size = 0; max_size <= 64; max_size += 16) {
+    cv::Mat_<int16_t> reference = expected(max_size, MAX_DIFF);
+    EXPECT_EQ(0, countDifferent(reference, banded(max_size, MAX_DIFF, NBANDS))) << "max_size " << max_size;
+    EXPECT_EQ(0, countDifferent(reference, banded(max_size, MAX_DIFF, 13))) << "max_size " << max_size;
+  }
+}
+
+TEST_F(SpeckleFilterTest, leavesEmptyImages)
+{
+  cv::Mat_<int16_t> empty;
+  cv::Mat_<uint32_t> labels, sizes;
+  stereo_image_proc::filterSpecklesBanded(empty, INVALID, MAX_SIZE, MAX_DIFF, NBANDS, labels, sizes);
+  EXPECT_TRUE(empty.empty());
+}
+
+sensor_msgs::CameraInfo cameraInfo(int width, int height, double f, double cx, double cy, double tx)
+{
+  sensor_msgs::CameraInfo info;
+  info.width = width;
+  info.height = height;
+  info.distortion_model = "plumb_bob";
+  info.D.assign(5, 0.0);
+  double K[9] = { f, 0, cx, 0, f, cy, 0, 0, 1 };
+  double R[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+  double P[12] = { f, 0, cx, tx, 0, f, cy, 0, 0, 0, 1, 0 };
+  std::copy(K, K + 9, info.K.begin());
+  std::copy(R, R + 9, info.R.begin());
+  std::copy(P, P + 12, info.P.begin());
+  return info;
+}
+
+class ProcessPointsTest : public testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    const double f = 100.0, baseline = 0.1;
+    model_.fromCameraInfo(cameraInfo(COLS, ROWS, f, COLS / 2.0, ROWS / 2.0, 0.0),
+                          cameraInfo(COLS, ROWS, f, COLS / 2.0, ROWS / 2.0, -f * baseline));
+
+    // Random disparities with missing ones (the image minimum) and zero ones
+    // (at infinity) scattered, and whole rows without a valid point at the
+    // top, the bottom and on the borders of any row split
+    cv::RNG rng(7);
+    disparity_ = cv::Mat_<float>(ROWS, COLS);
+    for (int y = 0; y < ROWS; ++y) {
+      for (int x = 0; x < COLS; ++x) {
+        int kind = rng.uniform(0, 8);
+        disparity_(y, x) = kind == 0 ? -1.0f : kind == 1 ? 0.0f : rng.uniform(1.0f, 64.0f);
+      }
+    }
+    const int empty_rows[] = { 0, 1, bandBorder(1) - 1, bandBorder(1), bandBorder(2), ROWS - 1 };
+    for (size_t i = 0; i < sizeof(empty_rows) / sizeof(empty_rows[0]); ++i)
+      disparity_.row(empty_rows[i]).setTo(-1.0f);
+
+    color_ = cv::Mat(ROWS, COLS, CV_8UC3);
+    rng.fill(color_, cv::RNG::UNIFORM, 0, 256);
+  }
+
+  stereo_msgs::DisparityImage disparityImage() const
+  {
+    stereo_msgs::DisparityImage msg;
+    msg.image.height = ROWS;
+    msg.image.width = COLS;
+    msg.image.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+    msg.image.step = COLS * sizeof(float);
+    msg.image.data.resize(msg.image.step * ROWS);
+    cv::Mat_<float> view(ROWS, COLS, (float*)&msg.image.data[0], msg.image.step);
+    disparity_.copyTo(view);
+    msg.delta_d = 1.0f / 16;
+    return msg;
+  }
+
+  // The serial fill processPoints used before filling rows in parallel
+  sensor_msgs::PointCloud serialPoints(const std::string& encoding) const
+  {
+    cv::Mat_<cv::Vec3f> dense;
+    model_.projectDisparityImageTo3d(disparity_, dense, true);
+
+    sensor_msgs::PointCloud points;
+    points.channels.resize(3);
+    for (int u = 0; u < dense.rows; ++u) {
+      for (int v = 0; v < dense.cols; ++v) {
+        const cv::Vec3f& p = dense(u, v);
+        if (p[2] == image_geometry::StereoCameraModel::MISSING_Z || std::isinf(p[2]))
+          continue;
+        geometry_msgs::Point32 pt;
+        pt.x = p[0];
+        pt.y = p[1];
+        pt.z = p[2];
+        points.points.push_back(pt);
+        points.channels[1].values.push_back(u);
+        points.channels[2].values.push_back(v);
+        const cv::Vec3b& c = color_.at<cv::Vec3b>(u, v);
+        int32_t rgb = 0;
+        if (encoding == sensor_msgs::image_encodings::RGB8)
+          rgb = (c[0] << 16) | (c[1] << 8) | c[2];
+        else if (encoding == sensor_msgs::image_encodings::BGR8)
+          rgb = (c[2] << 16) | (c[1] << 8) | c[0];
+        float packed;
+        std::memcpy(&packed, &rgb, sizeof(packed));
+        points.channels[0].values.push_back(packed);
+      }
+    }
+    return points;
+  }
+
+  void expectPointsEqual(const sensor_msgs::PointCloud& expected, const sensor_msgs::PointCloud& actual,
+                         bool color)
+  {
+    ASSERT_EQ(expected.points.size(), actual.points.size());
+    ASSERT_EQ(3u, actual.channels.size());
+    ASSERT_EQ(color ? expected.points.size() : 0u, actual.channels[0].values.size());
+    for (size_t i = 0; i < expected.points.size(); ++i) {
+      EXPECT_EQ(expected.points[i].x, actual.points[i].x) << "point " << i;
+      EXPECT_EQ(expected.points[i].y, actual.points[i].y) << "point " << i;
+      EXPECT_EQ(expected.points[i].z, actual.points[i].z) << "point " << i;
+      EXPECT_EQ(expected.channels[1].values[i], actual.channels[1].values[i]) << "point " << i;
+      EXPECT_EQ(expected.channels[2].values[i], actual.channels[2].values[i]) << "point " << i;
+      if (color)
+        EXPECT_EQ(0, std::memcmp(&expected.channels[0].values[i], &actual.channels[0].values[i], sizeof(float)))
+          << "point " << i;
+    }
+  }
+
+  image_geometry::StereoCameraModel model_;
+  cv::Mat_<float> disparity_;
+  cv::Mat color_;
+};
+
+TEST_F(ProcessPointsTest, matchesSerialFill)
+{
+  StereoProcessor processor;
+  const std::string encodings[] = { sensor_msgs::image_encodings::RGB8, sensor_msgs::image_encodings::BGR8 };
+  for (int i = 0; i < 2; ++i) {
+    sensor_msgs::PointCloud points;
+    processor.processPoints(disparityImage(), color_, encodings[i], model_, points);
+    SCOPED_TRACE(encodings[i]);
+    expectPointsEqual(serialPoints(encodings[i]), points, true);
+  }
+}
+
+TEST_F(ProcessPointsTest, skipsColorOfUnknownEncodings)
+{
+  StereoProcessor processor;
+  sensor_msgs::PointCloud points;
+  processor.processPoints(disparityImage(), color_, sensor_msgs::image_encodings::TYPE_32FC1, model_, points);
+  expectPointsEqual(serialPoints(sensor_msgs::image_encodings::RGB8), points, false);
+}
+
+TEST_F(ProcessPointsTest, reusesScratchAcrossClouds)
+{
+  // A smaller second cloud must not keep points of the first
+  StereoProcessor processor;
+  sensor_msgs::PointCloud points;
+  processor.processPoints(disparityImage(), color_, sensor_msgs::image_encodings::RGB8, model_, points);
+  disparity_.rowRange(ROWS / 2, ROWS).setTo(-1.0f);
+  processor.processPoints(disparityImage(), color_, sensor_msgs::image_encodings::RGB8, model_, points);
+  expectPointsEqual(serialPoints(sensor_msgs::image_encodings::RGB8), points, true);
+}
+
+// Not a multiple of 4, so the scalar tail of each SSE row is covered too
+const int POINTS_ROWS = 24, POINTS_COLS = 83;
+const int MIN_DISPARITY = -4;
+const int16_t INVALID_FIXED = (MIN_DISPARITY - 1) * 16;
+
+class ProcessPoints2Test : public testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    const double f = 100.0, baseline = 0.1;
+    model_.fromCameraInfo(cameraInfo(POINTS_COLS, POINTS_ROWS, f, POINTS_COLS / 2.0, POINTS_ROWS / 2.0, 0.0),
+                          cameraInfo(POINTS_COLS, POINTS_ROWS, f, POINTS_COLS / 2.0, POINTS_ROWS / 2.0,
+                                     -f * baseline));
+
+    // Fixed-point disparities with the matchers' invalid value, zero (W == 0),
+    // negative ones, and the smallest valid ones around min_disparity
+    cv::RNG rng(11);
+    fixed_ = cv::Mat_<int16_t>(POINTS_ROWS, POINTS_COLS);
+    for (int y = 0; y < POINTS_ROWS; ++y) {
+      for (int x = 0; x < POINTS_COLS; ++x) {
+        switch (rng.uniform(0, 8)) {
+          case 0: fixed_(y, x) = INVALID_FIXED; break;
+          case 1: fixed_(y, x) = 0; break;
+          case 2: fixed_(y, x) = MIN_DISPARITY * 16; break;
+          case 3: fixed_(y, x) = MIN_DISPARITY * 16 + 1; break;
+          default: fixed_(y, x) = rng.uniform(MIN_DISPARITY * 16, 60 * 16);
+        }
+      }
+    }
+    color_ = cv::Mat(POINTS_ROWS, POINTS_COLS, CV_8UC1);
+    rng.fill(color_, cv::RNG::UNIFORM, 0, 256);
+  }
+
+  cv::Mat_<float> floatDisparity() const
+  {
+    cv::Mat_<float> disparity;
+    fixed_.convertTo(disparity, CV_32F, 1.0 / 16);
+    return disparity;
+  }
+
+  stereo_msgs::DisparityImage disparityImage(const cv::Mat& disparity, const std::string& encoding) const
+  {
+    stereo_msgs::DisparityImage msg;
+    msg.image.height = disparity.rows;
+    msg.image.width = disparity.cols;
+    msg.image.encoding = encoding;
+    msg.image.step = disparity.cols * disparity.elemSize();
+    msg.image.data.resize(msg.image.step * disparity.rows);
+    cv::Mat view(disparity.rows, disparity.cols, disparity.type(), &msg.image.data[0], msg.image.step);
+    disparity.copyTo(view);
+    msg.delta_d = 1.0f / 16;
+    msg.min_disparity = MIN_DISPARITY;
+    return msg;
+  }
+
+  sensor_msgs::PointCloud2 points2(const stereo_msgs::DisparityImage& disparity, bool compact,
+                                   bool quantize = false) const
+  {
+    StereoProcessor processor;
+    processor.setCompactPoints2(compact);
+    processor.setQuantizePoints2(quantize);
+    sensor_msgs::PointCloud2 points;
+    processor.processPoints2(disparity, color_, sensor_msgs::image_encodings::MONO8, model_, points);
+    return points;
+  }
+
+  // Compares the cloud against cv::reprojectImageTo3D of the float disparities,
+  // whose missing points (and those at infinity) must be NaN, or left out of
+  // compact clouds
+  void expectMatchesReprojection(const cv::Mat_<float>& disparity, const sensor_msgs::PointCloud2& points,
+                                 bool compact) const
+  {
+    cv::Mat_<cv::Vec3f> expected;
+    cv::reprojectImageTo3D(disparity, expected, cv::Mat(model_.reprojectionMatrix()), true);
+
+    ASSERT_EQ(16u, points.point_step);
+    size_t valid = 0, invalid = 0;
+    for (int y = 0; y < expected.rows; ++y) {
+      for (int x = 0; x < expected.cols; ++x) {
+        const cv::Vec3f& e = expected(y, x);
+        const bool is_valid = e[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(e[2]);
+        if (!is_valid)
+          ++invalid;
+        if (compact && !is_valid)
+          continue;
+        const size_t index = compact ? valid : y * expected.cols + x;
+        ASSERT_LE((index + 1) * points.point_step, points.data.size());
+        float p[4];
+        std::memcpy(p, &points.data[index * points.point_step], sizeof(p));
+        if (!is_valid) {
+          for (int i = 0; i < 4; ++i)
+            EXPECT_TRUE(std::isnan(p[i])) << "(" << x << ", " << y << ") d = " << disparity(y, x);
+          continue;
+        }
+        ++valid;
+        for (int i = 0; i < 3; ++i)
+          EXPECT_NEAR(e[i], p[i], 1e-4 * std::max(1.0f, std::fabs(e[i])))
+            << "(" << x << ", " << y << ") d = " << disparity(y, x);
+        const uint8_t g = color_.at<uint8_t>(y, x);
+        const int32_t rgb = (g << 16) | (g << 8) | g;
+        EXPECT_EQ(0, std::memcmp(&rgb, &p[3], sizeof(rgb))) << "(" << x << ", " << y << ")";
+      }
+    }
+    // The fixture only makes sense with both kinds of points
+    EXPECT_GT(valid, 0u);
+    EXPECT_GT(invalid, 0u);
+    if (compact) {
+      EXPECT_EQ(1u, points.height);
+      EXPECT_EQ(valid, points.width);
+      EXPECT_TRUE(points.is_dense);
+    }
+    else {
+      EXPECT_EQ((uint32_t)expected.rows, points.height);
+      EXPECT_EQ((uint32_t)expected.cols, points.width);
+    }
+  }
+
+  image_geometry::StereoCameraModel model_;
+  cv::Mat_<int16_t> fixed_;
+  cv::Mat color_;
+};
+
+TEST_F(ProcessPoints2Test, matchesReprojectionOfFloatDisparities)
+{
+  const cv::Mat_<float> disparity = floatDisparity();
+  const stereo_msgs::DisparityImage msg = disparityImage(disparity, sensor_msgs::image_encodings::TYPE_32FC1);
+  expectMatchesReprojection(disparity, points2(msg, false), false);
+  expectMatchesReprojection(disparity, points2(msg, true), true);
+}
+
+TEST_F(ProcessPoints2Test, matchesReprojectionOfFixedPointDisparities)
+{
+  const stereo_msgs::DisparityImage msg = disparityImage(fixed_, sensor_msgs::image_encodings::TYPE_16SC1);
+  expectMatchesReprojection(floatDisparity(), points2(msg, false), false);
+  expectMatchesReprojection(floatDisparity(), points2(msg, true), true);
+}
+
+TEST_F(ProcessPoints2Test, treatsImageMinimumAsMissing)
+{
+  // Without invalid pixels, reprojectImageTo3D takes the points at the
+  // smallest valid disparity as missing, and so must processPoints2
+  fixed_.setTo(MIN_DISPARITY * 16, fixed_ == INVALID_FIXED);
+  const cv::Mat_<float> disparity = floatDisparity();
+  expectMatchesReprojection(disparity, points2(disparityImage(disparity, sensor_msgs::image_encodings::TYPE_32FC1),
+                                               false), false);
+  expectMatchesReprojection(disparity, points2(disparityImage(fixed_, sensor_msgs::image_encodings::TYPE_16SC1),
+                                               false), false);
+}
+
+// Tall enough for four parallel stripes of MIN_STRIPE_ROWS
+const int STRIPES_ROWS = 256, STRIPES_COLS = 192;
+const int BACKGROUND_DISPARITY = 16, BAR_DISPARITY = 32;
+const cv::Rect BAR(100, 4, 20, STRIPES_ROWS - 8);
+
+class ParallelStripesTest : public testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    const double f = 100.0, baseline = 0.1;
+    model_.fromCameraInfo(cameraInfo(STRIPES_COLS, STRIPES_ROWS, f, STRIPES_COLS / 2.0, STRIPES_ROWS / 2.0, 0.0),
+                          cameraInfo(STRIPES_COLS, STRIPES_ROWS, f, STRIPES_COLS / 2.0, STRIPES_ROWS / 2.0,
+                                     -f * baseline));
+
+    // Random texture on a fronto-parallel background, with a nearer vertical
+    // bar crossing every stripe border
+    cv::RNG rng(5);
+    left_ = cv::Mat(STRIPES_ROWS, STRIPES_COLS, CV_8UC1);
+    right_ = cv::Mat(STRIPES_ROWS, STRIPES_COLS, CV_8UC1);
+    rng.fill(left_, cv::RNG::UNIFORM, 0, 256);
+    rng.fill(right_, cv::RNG::UNIFORM, 0, 256);
+    for (int y = 0; y < STRIPES_ROWS; ++y) {
+      for (int x = 0; x < STRIPES_COLS; ++x) {
+        const bool bar = BAR.contains(cv::Point(x + BAR_DISPARITY, y));
+        const int source = x + (bar ? BAR_DISPARITY : BACKGROUND_DISPARITY);
+        if (source < STRIPES_COLS)
+          right_.at<uint8_t>(y, x) = left_.at<uint8_t>(y, source);
+      }
+    }
+  }
+
+  cv::Mat disparity(bool parallel) const
+  {
+    StereoProcessor processor;
+    processor.setCorrelationWindowSize(9);
+    processor.setMinDisparity(0);
+    processor.setDisparityRange(64);
+    // Larger than the part of the bar any one stripe sees, but smaller than
+    // the whole bar
+    processor.setSpeckleSize(2000);
+    processor.setSpeckleRange(32);
+    processor.setParallel(parallel);
+    stereo_msgs::DisparityImage msg;
+    processor.processDisparity(left_, right_, model_, msg);
+    return cv::Mat(msg.image.height, msg.image.width, CV_32FC1, &msg.image.data[0], msg.image.step).clone();
+  }
+
+  image_geometry::StereoCameraModel model_;
+  cv::Mat left_, right_;
+};
+
+TEST_F(ParallelStripesTest, filtersSpecklesOnJoinedStripes)
+{
+  const int threads = cv::getNumThreads();
+  cv::setNumThreads(4);
+  const cv::Mat serial = disparity(false);
+  const cv::Mat parallel = disparity(true);
+  cv::setNumThreads(threads);
+
+  // The fixture only makes sense if the matcher keeps the bar
+  ASSERT_NEAR(BAR_DISPARITY, serial.at<float>(STRIPES_ROWS / 2, BAR.x + BAR.width / 2), 1.0);
+  EXPECT_EQ(0, countDifferent(serial, parallel));
+}
+
+TEST_F(ProcessPoints2Test, quantizesLikeQuantizePoints)
+{
+  // A point 160 m away too, out of range: it keeps its color but not its
+  // coordinates
+  fixed_(0, 0) = 1;
+  const stereo_msgs::DisparityImage msgs[] = {
+    disparityImage(floatDisparity(), sensor_msgs::image_encodings::TYPE_32FC1),
+    disparityImage(fixed_, sensor_msgs::image_encodings::TYPE_16SC1),
+  };
+  for (int i = 0; i < 2; ++i) {
+    for (int compact = 0; compact < 2; ++compact) {
+      SCOPED_TRACE(msgs[i].image.encoding + (compact ? " compact" : ""));
+      sensor_msgs::PointCloud2 expected = points2(msgs[i], compact);
+      ASSERT_TRUE(image_proc::quantizePoints(expected));
+      const sensor_msgs::PointCloud2 actual = points2(msgs[i], compact, true);
+      ASSERT_EQ(expected.fields.size(), actual.fields.size());
+      for (size_t f = 0; f < expected.fields.size(); ++f) {
+        EXPECT_EQ(expected.fields[f].name, actual.fields[f].name);
+        EXPECT_EQ(expected.fields[f].offset, actual.fields[f].offset);
+        EXPECT_EQ(expected.fields[f].datatype, actual.fields[f].datatype);
+      }
+      EXPECT_EQ(expected.point_step, actual.point_step);
+      EXPECT_EQ(expected.width, actual.width);
+      EXPECT_EQ(expected.height, actual.height);
+      EXPECT_EQ(expected.row_step, actual.row_step);
+      ASSERT_EQ(expected.data.size(), actual.data.size());
+      EXPECT_EQ(0, std::memcmp(&expected.data[0], &actual.data[0], expected.data.size()));
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}